@@ -0,0 +1,545 @@
+#include "MockGmailService.h"
+
+#include "httplib.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Fills `out` if the file exists. Returns false only if it exists but does not parse.
+bool loadJsonFile(const std::string& path, json& out) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return true;
+    }
+    try {
+        out = json::parse(file);
+    } catch (const json::parse_error&) {
+        return false;
+    }
+    return true;
+}
+
+std::string toLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+bool containsInsensitive(const std::string& haystack, const std::string& needle) {
+    return toLower(haystack).find(toLower(needle)) != std::string::npos;
+}
+
+bool hasLabel(const json& message, const std::string& label_id) {
+    if (!message.contains("labelIds") || !message["labelIds"].is_array()) {
+        return false;
+    }
+    for (const auto& id : message["labelIds"]) {
+        if (id.is_string() && id.get<std::string>() == label_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Small subset of Gmail search syntax: is:unread, is:read, is:starred, from:, to:,
+// subject:, label:, in:inbox and free-text words matched against subject/snippet/body.
+// Terms are ANDed.
+bool matchesQuery(const json& message, const std::string& query) {
+    std::istringstream terms(query);
+    std::string term;
+    while (terms >> term) {
+        const size_t colon = term.find(':');
+        const std::string key = colon == std::string::npos ? "" : toLower(term.substr(0, colon));
+        const std::string value = colon == std::string::npos ? term : term.substr(colon + 1);
+
+        if (key == "is") {
+            const std::string v = toLower(value);
+            if (v == "unread" && !hasLabel(message, "UNREAD")) return false;
+            if (v == "read" && hasLabel(message, "UNREAD")) return false;
+            if (v == "starred" && !hasLabel(message, "STARRED")) return false;
+            if (v == "important" && !hasLabel(message, "IMPORTANT")) return false;
+        } else if (key == "from" || key == "to" || key == "subject") {
+            if (!containsInsensitive(message.value(key, ""), value)) return false;
+        } else if (key == "label" || key == "in") {
+            std::string label = value;
+            std::transform(label.begin(), label.end(), label.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+            if (!hasLabel(message, label)) return false;
+        } else {
+            if (!containsInsensitive(message.value("subject", ""), value) &&
+                !containsInsensitive(message.value("snippet", ""), value) &&
+                !containsInsensitive(message.value("body", ""), value)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void replyJson(httplib::Response& res, const json& body, int status = 200) {
+    res.status = status;
+    res.set_content(body.dump(), "application/json");
+}
+
+// FastAPI error shape, so the tool loop sees the same bodies as with the real service
+void replyError(httplib::Response& res, int status, const std::string& detail) {
+    replyJson(res, json{{"detail", detail}}, status);
+}
+
+json parseBody(const httplib::Request& req) {
+    if (req.body.empty()) {
+        return json::object();
+    }
+    return json::parse(req.body, nullptr, /*allow_exceptions=*/false);
+}
+
+// Standard base64, or base64url without padding as in Gmail's raw format
+std::string base64Encode(const std::string& in, bool url) {
+    static const char* kStd = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const char* kUrl = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char* alphabet = url ? kUrl : kStd;
+    std::string out;
+    out.reserve((in.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3) {
+        const uint32_t v = (static_cast<unsigned char>(in[i]) << 16) |
+                           (static_cast<unsigned char>(in[i + 1]) << 8) |
+                           static_cast<unsigned char>(in[i + 2]);
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += alphabet[(v >> 6) & 63];
+        out += alphabet[v & 63];
+    }
+    if (i < in.size()) {
+        uint32_t v = static_cast<unsigned char>(in[i]) << 16;
+        if (i + 1 < in.size()) v |= static_cast<unsigned char>(in[i + 1]) << 8;
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        if (i + 1 < in.size()) out += alphabet[(v >> 6) & 63];
+        if (!url) out.append(i + 1 < in.size() ? "=" : "==");
+    }
+    return out;
+}
+
+// Base64 wrapped at 76 characters, as mail clients send it
+std::string base64Wrapped(const std::string& in) {
+    const std::string encoded = base64Encode(in, /*url=*/false);
+    std::string out;
+    for (size_t i = 0; i < encoded.size(); i += 76) {
+        out.append(encoded, i, 76);
+        out += "\r\n";
+    }
+    return out;
+}
+
+// Quoted-printable with soft line breaks; non-ASCII bytes, '=' and line ends are escaped
+std::string quotedPrintableEncode(const std::string& in) {
+    static const char* kHex = "0123456789ABCDEF";
+    std::string out;
+    size_t line = 0;
+    for (unsigned char c : in) {
+        std::string token;
+        if ((c >= 33 && c <= 126 && c != '=') || c == ' ') {
+            token = static_cast<char>(c);
+        } else {
+            token = {'=', kHex[c >> 4], kHex[c & 15]};
+        }
+        if (line + token.size() > 75) {
+            out += "=\r\n";
+            line = 0;
+        }
+        out += token;
+        line += token.size();
+    }
+    return out;
+}
+
+// The fixture message as RFC 822: multipart/alternative with the body as quoted-printable
+// text/plain and base64 text/html, so format=raw exercises the client's MIME decoding
+std::string rawMessage(const json& message) {
+    const std::string boundary = "mock-" + message.value("id", "") + "-alt";
+    const std::string body = message.value("body", "");
+    std::string html = "<html><body><p>";
+    for (char c : body) {
+        if (c == '<') html += "&lt;";
+        else if (c == '>') html += "&gt;";
+        else if (c == '&') html += "&amp;";
+        else if (c == '\n') html += "<br>";
+        else html += c;
+    }
+    html += "</p></body></html>";
+
+    std::string raw;
+    raw += "From: " + message.value("from", "") + "\r\n";
+    raw += "To: " + message.value("to", "") + "\r\n";
+    raw += "Subject: " + message.value("subject", "") + "\r\n";
+    raw += "Date: " + message.value("date", "") + "\r\n";
+    raw += "MIME-Version: 1.0\r\n";
+    raw += "Content-Type: multipart/alternative; boundary=\"" + boundary + "\"\r\n\r\n";
+    raw += "--" + boundary + "\r\n";
+    raw += "Content-Type: text/plain; charset=\"UTF-8\"\r\n";
+    raw += "Content-Transfer-Encoding: quoted-printable\r\n\r\n";
+    raw += quotedPrintableEncode(body) + "\r\n";
+    raw += "--" + boundary + "\r\n";
+    raw += "Content-Type: text/html; charset=\"UTF-8\"\r\n";
+    raw += "Content-Transfer-Encoding: base64\r\n\r\n";
+    raw += base64Wrapped(html);
+    raw += "--" + boundary + "--\r\n";
+    return raw;
+}
+
+} // namespace
+
+MockGmailService::MockGmailService() = default;
+
+MockGmailService::~MockGmailService() {
+    stop();
+}
+
+bool MockGmailService::loadFixtures(const std::string& fixtures_dir) {
+    const std::string dir = fixtures_dir.empty() || fixtures_dir.back() == '/' ? fixtures_dir : fixtures_dir + "/";
+
+    json messages = json::array();
+    if (!loadJsonFile(dir + "messages.json", messages) || !messages.is_array()) return false;
+    json labels = json::array();
+    if (!loadJsonFile(dir + "labels.json", labels) || !labels.is_array()) return false;
+    json history = json::object();
+    if (!loadJsonFile(dir + "history.json", history) || !history.is_object()) return false;
+    json profile = json::object();
+    if (!loadJsonFile(dir + "profile.json", profile) || !profile.is_object()) return false;
+
+    fixture_messages_ = std::move(messages);
+    fixture_labels_ = std::move(labels);
+    fixture_history_ = std::move(history);
+    fixture_profile_ = std::move(profile);
+    resetState();
+    return true;
+}
+
+void MockGmailService::resetState() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    messages_ = fixture_messages_;
+    labels_ = fixture_labels_;
+    next_id_ = 1;
+}
+
+void MockGmailService::simulateLatency() {
+    request_count_.fetch_add(1, std::memory_order_relaxed);
+    if (latency_ms_ > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms_));
+    }
+}
+
+void MockGmailService::registerRoutes() {
+    httplib::Server& srv = *server_;
+
+    srv.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+        replyJson(res, json{{"status", "healthy"}, {"service", "Mock Gmail API Microservice"}});
+    });
+
+    srv.Get("/profile", [this](const httplib::Request&, httplib::Response& res) {
+        simulateLatency();
+        replyJson(res, fixture_profile_);
+    });
+
+    srv.Get("/history", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        json history = fixture_history_;
+        if (req.has_param("start_history_id")) {
+            history["history_id"] = req.get_param_value("start_history_id");
+        }
+        if (!history.contains("history_records")) history["history_records"] = json::array();
+        if (!history.contains("next_page_token")) history["next_page_token"] = nullptr;
+        replyJson(res, history);
+    });
+
+    // Labels
+    srv.Get("/labels", [this](const httplib::Request&, httplib::Response& res) {
+        simulateLatency();
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        replyJson(res, json{{"labels", labels_}});
+    });
+
+    srv.Get("/labels/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (const auto& label : labels_) {
+            if (label.value("id", "") == id) {
+                replyJson(res, label);
+                return;
+            }
+        }
+        replyError(res, 404, "Label " + id + " not found");
+    });
+
+    srv.Post("/labels", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const json body = parseBody(req);
+        if (!body.is_object() || !body.contains("name") || !body["name"].is_string()) {
+            replyError(res, 422, "Field 'name' is required");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        json label = {
+            {"id", "Label_mock_" + std::to_string(next_id_++)},
+            {"name", body["name"]},
+            {"labelListVisibility", body.value("label_list_visibility", "labelShow")},
+            {"messageListVisibility", body.value("message_list_visibility", "show")},
+            {"type", "user"},
+        };
+        labels_.push_back(label);
+        replyJson(res, label);
+    });
+
+    srv.Put("/labels/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        const json body = parseBody(req);
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (auto& label : labels_) {
+            if (label.value("id", "") != id) continue;
+            if (body.is_object()) {
+                if (body.contains("name") && body["name"].is_string()) label["name"] = body["name"];
+                if (body.contains("label_list_visibility") && body["label_list_visibility"].is_string()) {
+                    label["labelListVisibility"] = body["label_list_visibility"];
+                }
+                if (body.contains("message_list_visibility") && body["message_list_visibility"].is_string()) {
+                    label["messageListVisibility"] = body["message_list_visibility"];
+                }
+            }
+            replyJson(res, label);
+            return;
+        }
+        replyError(res, 404, "Label " + id + " not found");
+    });
+
+    srv.Delete("/labels/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (auto it = labels_.begin(); it != labels_.end(); ++it) {
+            if (it->value("id", "") == id) {
+                labels_.erase(it);
+                replyJson(res, json{{"success", true}, {"message", "Label " + id + " deleted successfully"}});
+                return;
+            }
+        }
+        replyError(res, 400, "Label " + id + " not found");
+    });
+
+    // Messages
+    srv.Get("/messages", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string query = req.has_param("query") ? req.get_param_value("query") : "";
+        // LlamaInference sends numbers as "%f" strings, so parse leniently
+        long max_results = -1;
+        if (req.has_param("max_results")) {
+            try {
+                max_results = static_cast<long>(std::stod(req.get_param_value("max_results")));
+            } catch (const std::exception&) {
+                replyError(res, 422, "max_results must be an integer");
+                return;
+            }
+        }
+
+        const bool ids_only = req.has_param("ids_only") && req.get_param_value("ids_only") == "true";
+
+        json out = json::array();
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (const auto& message : messages_) {
+            if (max_results >= 0 && static_cast<long>(out.size()) >= max_results) break;
+            if (!matchesQuery(message, query)) continue;
+            if (ids_only) {
+                out.push_back(json{{"id", message.value("id", "")}, {"threadId", message.value("threadId", message.value("id", ""))}});
+                continue;
+            }
+            // Same metadata-only projection as GmailManager.list_messages
+            out.push_back(json{
+                {"id", message.value("id", "")},
+                {"threadId", message.value("threadId", message.value("id", ""))},
+                {"from", message.value("from", "N/A")},
+                {"subject", message.value("subject", "N/A")},
+                {"snippet", message.value("snippet", "")},
+            });
+        }
+        replyJson(res, json{{"messages", out}});
+    });
+
+    srv.Get("/messages/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (const auto& message : messages_) {
+            if (message.value("id", "") != id) continue;
+            if (req.has_param("format") && req.get_param_value("format") == "raw") {
+                replyJson(res, json{
+                    {"id", id},
+                    {"threadId", message.value("threadId", id)},
+                    {"labelIds", message.value("labelIds", json::array())},
+                    {"snippet", message.value("snippet", "")},
+                    {"raw", base64Encode(rawMessage(message), /*url=*/true)},
+                });
+                return;
+            }
+            replyJson(res, json{
+                {"id", id},
+                {"threadId", message.value("threadId", id)},
+                {"from", message.value("from", "[No Sender]")},
+                {"subject", message.value("subject", "[No Subject]")},
+                {"snippet", message.value("snippet", "")},
+                {"body", message.value("body", "")},
+            });
+            return;
+        }
+        replyError(res, 404, "Requested entity was not found.");
+    });
+
+    // Same projection as GmailManager.get_messages
+    srv.Post("/messages/batch", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const json body = parseBody(req);
+        if (!body.is_object() || !body.contains("message_ids") || !body["message_ids"].is_array() ||
+            body["message_ids"].empty()) {
+            replyError(res, 422, "message_ids must not be empty");
+            return;
+        }
+        static const std::vector<std::string> kFields = {"id", "threadId", "from", "to", "date",
+                                                         "subject", "snippet", "labelIds", "body"};
+        std::vector<std::string> fields;
+        for (const auto& field : body.value("fields", json::array())) {
+            if (field.is_string() && std::find(kFields.begin(), kFields.end(), field.get<std::string>()) != kFields.end()) {
+                fields.push_back(field.get<std::string>());
+            }
+        }
+        if (fields.empty()) {
+            fields = {"id", "from", "date", "subject", "body"};
+        }
+        const long max_body_chars = body.contains("max_body_chars") && body["max_body_chars"].is_number()
+                                        ? body["max_body_chars"].get<long>() : 2000;
+
+        json out = json::array();
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (const auto& id : body["message_ids"]) {
+            const std::string wanted = id.is_string() ? id.get<std::string>() : "";
+            const auto it = std::find_if(messages_.begin(), messages_.end(),
+                                         [&](const json& m) { return m.value("id", "") == wanted; });
+            if (it == messages_.end()) {
+                out.push_back(json{{"id", wanted}, {"error", "Requested entity was not found."}});
+                continue;
+            }
+            json item = json::object();
+            for (const auto& field : fields) {
+                if (field == "threadId") {
+                    item[field] = it->value("threadId", wanted);
+                } else if (field == "labelIds") {
+                    item[field] = it->value("labelIds", json::array());
+                } else if (field == "body") {
+                    std::string text = it->value("body", "");
+                    if (max_body_chars >= 0 && static_cast<long>(text.size()) > max_body_chars) {
+                        text = text.substr(0, max_body_chars) + "...";
+                    }
+                    item[field] = text;
+                } else {
+                    item[field] = it->value(field, "");
+                }
+            }
+            out.push_back(item);
+        }
+        replyJson(res, json{{"messages", out}});
+    });
+
+    srv.Post("/messages", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const json body = parseBody(req);
+        if (!body.is_object() || !body.contains("to") || !body.contains("subject") || !body.contains("body")) {
+            replyError(res, 422, "Fields 'to', 'subject' and 'body' are required");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        replyJson(res, json{{"message_id", "sent_mock_" + std::to_string(next_id_++)}, {"status", "sent"}});
+    });
+
+    srv.Post("/messages/:id/labels", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        const json body = parseBody(req);
+        if (!body.is_object()) {
+            replyError(res, 422, "Body must be an object");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (auto& message : messages_) {
+            if (message.value("id", "") != id) continue;
+            if (!message.contains("labelIds") || !message["labelIds"].is_array()) {
+                message["labelIds"] = json::array();
+            }
+            json& label_ids = message["labelIds"];
+            for (const auto& remove : body.value("remove_label_ids", json::array())) {
+                for (auto it = label_ids.begin(); it != label_ids.end(); ++it) {
+                    if (*it == remove) { label_ids.erase(it); break; }
+                }
+            }
+            for (const auto& add : body.value("add_label_ids", json::array())) {
+                if (!hasLabel(message, add.get<std::string>())) label_ids.push_back(add);
+            }
+            replyJson(res, json{{"id", id}, {"threadId", message.value("threadId", id)}, {"labelIds", label_ids}});
+            return;
+        }
+        replyError(res, 404, "Message with ID " + id + " not found.");
+    });
+
+    srv.Delete("/messages/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        simulateLatency();
+        const std::string id = req.path_params.at("id");
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        for (auto it = messages_.begin(); it != messages_.end(); ++it) {
+            if (it->value("id", "") == id) {
+                messages_.erase(it);
+                replyJson(res, json{{"success", true}, {"message_id", id}, {"status", "trashed"}});
+                return;
+            }
+        }
+        replyError(res, 404, "Message with ID " + id + " not found or already trashed.");
+    });
+}
+
+bool MockGmailService::start() {
+    if (server_) {
+        return true;
+    }
+    server_ = std::make_unique<httplib::Server>();
+    registerRoutes();
+
+    port_ = server_->bind_to_any_port("127.0.0.1");
+    if (port_ <= 0) {
+        server_.reset();
+        return false;
+    }
+    thread_ = std::make_unique<std::thread>([this]() { server_->listen_after_bind(); });
+    server_->wait_until_ready();
+    return true;
+}
+
+void MockGmailService::stop() {
+    if (server_) {
+        server_->stop();
+    }
+    if (thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+    thread_.reset();
+    server_.reset();
+    port_ = 0;
+}
+
+std::string MockGmailService::address() const {
+    return "http://127.0.0.1:" + std::to_string(port_);
+}
@@ -0,0 +1,70 @@
+#ifndef MOCK_GMAIL_SERVICE_H
+#define MOCK_GMAIL_SERVICE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "nlohmann/json.hpp"
+
+namespace httplib { class Server; }
+
+// In-process stand-in for gmail-microservice/gmail_service.py used by the benchmark.
+// Serves the same routes and response shapes from JSON fixtures, with an artificial
+// per-request latency, so runs are reproducible without a Google account or network.
+//
+// Fixture directory layout (all files optional, missing ones are served empty):
+//   messages.json  [{"id", "threadId", "from", "subject", "snippet", "body", "labelIds": [...]}, ...]
+//   labels.json    [{"id", "name", "type", ...}, ...]
+//   history.json   {"history_id": "...", "history_records": [...]}
+//   profile.json   {"emailAddress": "...", "messagesTotal": N, "historyId": "..."}
+//
+// Mutating routes (send, trash, label CRUD, message labels) operate on an in-memory copy, so every
+// start() begins from the fixtures again.
+class MockGmailService {
+public:
+    MockGmailService();
+    ~MockGmailService();
+
+    // Load fixtures from `fixtures_dir`. Returns false if a present file fails to parse.
+    bool loadFixtures(const std::string& fixtures_dir);
+
+    // Latency added to every response, emulating the Gmail API round trip
+    void setLatencyMs(int latency_ms) { latency_ms_ = latency_ms; }
+
+    // Bind to an ephemeral port on 127.0.0.1 and serve on a background thread
+    bool start();
+    void stop();
+
+    // Base URL for LlamaInference's gmail_service_addr, e.g. "http://127.0.0.1:41234"
+    std::string address() const;
+
+    uint64_t requestCount() const { return request_count_.load(std::memory_order_relaxed); }
+    void resetState(); // Restore the mailbox to the loaded fixtures
+
+private:
+    void registerRoutes();
+    void simulateLatency();
+
+    std::unique_ptr<httplib::Server> server_;
+    std::unique_ptr<std::thread> thread_;
+    int port_ = 0;
+    int latency_ms_ = 0;
+    std::atomic<uint64_t> request_count_{0};
+
+    // Fixtures as loaded, and the live copy the routes read and mutate
+    nlohmann::json fixture_messages_ = nlohmann::json::array();
+    nlohmann::json fixture_labels_ = nlohmann::json::array();
+    nlohmann::json fixture_history_ = nlohmann::json::object();
+    nlohmann::json fixture_profile_ = nlohmann::json::object();
+
+    std::mutex state_mutex_;
+    nlohmann::json messages_;
+    nlohmann::json labels_;
+    uint64_t next_id_ = 1;
+};
+
+#endif // MOCK_GMAIL_SERVICE_H
@@ -0,0 +1,556 @@
+// Non-interactive benchmark: drives LlamaInference over scripted conversations against
+// an in-process mock of the Gmail microservice and prints one JSON report.
+#include "LlamaInference.h"
+#include "Logger.h"
+#include "MemoryStore.h"
+#include "PerfMetrics.h"
+#include "SystemPrompt.h"
+#include "SessionReplay.h"
+#include "MockGmailService.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Counts every heap allocation of the process per thread, so the report can show what
+// parsing tool calls and responses allocates (ToolCallMetrics::parse_allocations).
+// new[] and the nothrow forms go through these as well.
+void* operator new(std::size_t size) {
+    countThreadAllocation();
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+void print_bench_help(const char* app_name) {
+    std::cout << "Usage: " << app_name << " -m <model_path> [options]\n\n"
+              << "Runs every conversation in the conversations file through the chat/tool loop against a mock\n"
+              << "Gmail service and writes a JSON report (TTFT, tokens/s, prefill tokens per turn, tool\n"
+              << "iterations per task, peak RSS).\n\n"
+              << "Options:\n"
+              << "  -h, --help                    Show this help message and exit.\n"
+              << "  -c, --context-size <int>      Context size. (Default: 4096)\n"
+              << "  -ngl, --gpu-layers <int>      Layers to offload to GPU. (Default: 99)\n"
+              << "  -t, --threads <int>           Generation threads. (Default: hardware concurrency)\n"
+              << "  -tb, --threads-batch <int>    Prompt processing threads. (Default: hardware concurrency)\n"
+              << "  -b, --batch-size <int>        Logical batch size (n_batch). 0 = context size. (Default: 0)\n"
+              << "  -ctk, --cache-type-k <type>   KV cache type for K: f16, q8_0, q4_0, ... (Default: f16)\n"
+              << "  -ctv, --cache-type-v <type>   KV cache type for V; quantized types enable flash attention. (Default: f16)\n"
+              << "  -fa, --flash-attn             Use flash attention.\n"
+              << "  -nkvo, --no-kv-offload        Keep the KV cache in system memory when layers are offloaded to the GPU.\n"
+              << "  --no-tool-prefetch            Do not start Gmail requests before the model has finished a tool call.\n"
+              << "  --native-mime                 Fetch messages in raw format and decode MIME parts here instead of in\n"
+              << "                                the Gmail service.\n"
+              << "  --project-tool-results        Give the model only id, from, subject, date and snippet of listed\n"
+              << "                                messages.\n"
+              << "  --compact                     Summarize older turns once the history fills 60% of the prompt budget,\n"
+              << "                                instead of dropping tokens when the context overflows.\n"
+              << "  --compact-at <float>          Share of the prompt budget that triggers a summary (Default: 0.6).\n"
+              << "  --compact-keep <int>          Latest user turns kept verbatim when summarizing (Default: 2).\n"
+              << "  --memory                      Remember tool results and answers across tasks and recall the ones\n"
+              << "                                relevant to each message; use --repeat to measure it. (Default: off)\n"
+              << "  --memory-file <path>          Keep the memory in this file. (Default: in memory only)\n"
+              << "  --memory-top-k <int>          Entries recalled per message at most. (Default: 3)\n"
+              << "  --memory-tokens <int>         Tokens the recalled entries may take. (Default: 384)\n"
+              << "  --cascade-model <path>        Small model that decides the tool calls; the main model writes the\n"
+              << "                                replies and the calls the small one is unsure of. (Default: off)\n"
+              << "  --cascade-ngl <int>           Layers of the small model to offload to the GPU. (Default: 0)\n"
+              << "  --cascade-confidence <float>  Confidence below which the main model decides a step. (Default: 0.6)\n"
+              << "  -mrc, --max-response-chars <int> Maximum characters per response. (Default: 2048)\n"
+              << "  --conversations <path>        Scripted conversations. (Default: bench/conversations.json)\n"
+              << "  --fixtures <dir>              Mock mailbox fixtures. (Default: bench/fixtures)\n"
+              << "  --mock-latency-ms <int>       Latency added to every mock Gmail response. (Default: 0)\n"
+              << "  --repeat <int>                Run the whole conversation set this many times. (Default: 1)\n"
+              << "  --label <text>                Free-form tag stored in the report, e.g. a commit id.\n"
+              << "  -o, --out <path>              Write the report here instead of stdout.\n"
+              << "  --seed <int>                  Sampler seed. (Default: random, or the recorded seed with --replay)\n"
+              << "  -lf, --log-file <path>        JSON-lines diagnostics. (Default: off)\n\n"
+              << "Replay mode:\n"
+              << "  --replay <session.jsonl>      Re-run a session recorded with `chat --record-session` instead of the\n"
+              << "                                scripted conversations. Tool calls are answered from the recording and\n"
+              << "                                must match it; -m, -c, -b and the KV cache options default to the\n"
+              << "                                recorded values.\n"
+              << "  --max-slowdown-pct <float>    Also fail if mean TTFT or decode throughput regresses by more than this.\n\n"
+              << "Exit status is 2 when a replay diverges or regresses, 1 on errors.\n"
+              << std::endl;
+}
+
+struct Conversation {
+    std::string name;
+    std::vector<std::string> turns;
+};
+
+bool loadConversations(const std::string& path, std::vector<Conversation>& out) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not open conversations file: " << path << std::endl;
+        return false;
+    }
+    try {
+        const json doc = json::parse(file);
+        for (const auto& c : doc.at("conversations")) {
+            Conversation conv;
+            conv.name = c.value("name", "conversation_" + std::to_string(out.size()));
+            for (const auto& turn : c.at("turns")) {
+                conv.turns.push_back(turn.get<std::string>());
+            }
+            out.push_back(std::move(conv));
+        }
+    } catch (const json::exception& e) {
+        std::cerr << "Invalid conversations file " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+    return !out.empty();
+}
+
+// Nearest-rank percentile of an unsorted sample (p in [0, 100])
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    const size_t rank = static_cast<size_t>(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+double mean(const std::vector<double>& values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    double total = 0.0;
+    for (double v : values) total += v;
+    return total / values.size();
+}
+
+json distribution(const std::vector<double>& values) {
+    return json{
+        {"mean", mean(values)},
+        {"p50", percentile(values, 50)},
+        {"p90", percentile(values, 90)},
+        {"max", percentile(values, 100)},
+    };
+}
+
+// Peak resident set size of this process in bytes (ru_maxrss is KiB on Linux, bytes on macOS)
+long long peakRssBytes() {
+    struct rusage usage {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return static_cast<long long>(usage.ru_maxrss);
+#else
+    return static_cast<long long>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+bool writeReport(const json& report, const std::string& out_path) {
+    if (out_path.empty()) {
+        std::cout << report.dump(2) << std::endl;
+        return true;
+    }
+    std::ofstream out(out_path);
+    if (!out.is_open()) {
+        std::cerr << "Could not open output file: " << out_path << std::endl;
+        return false;
+    }
+    out << report.dump(2) << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string model_path;
+    int n_ctx = 0;   // 0 = 4096, or the recorded value with --replay
+    int ngl = 99;
+    int n_threads = -1;
+    int n_threads_batch = -1;
+    int n_batch = -1; // -1 = context size, or the recorded value with --replay
+    int max_response_chars = 2048;
+    KvCacheConfig kv_cache;
+    bool tool_prefetch = true;
+    bool native_mime = false;
+    bool project_tool_results = false;
+    CompactionConfig compaction;
+    bool memory_enabled = false;
+    MemoryStoreOptions memory_options;
+    memory_options.path.clear(); // A benchmark run does not add to the user's memory
+    MemoryConfig memory_config;
+    CascadeConfig cascade;
+    bool kv_cache_given = false; // Any of -ctk/-ctv/-fa/-nkvo; otherwise --replay uses the recorded cache
+    int mock_latency_ms = 0;
+    int repeat = 1;
+    std::string conversations_path = "bench/conversations.json";
+    std::string fixtures_dir = "bench/fixtures";
+    std::string label;
+    std::string out_path;
+    std::string log_file_path;
+    long long seed = -1;
+    std::string replay_path;
+    double max_slowdown_pct = -1.0; // < 0 = only tool-call divergence fails a replay
+
+    for (int i = 1; i < argc; i++) {
+        try {
+            if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+                print_bench_help(argv[0]);
+                return 0;
+            } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--model") == 0) && i + 1 < argc) {
+                model_path = argv[++i];
+            } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--context-size") == 0) && i + 1 < argc) {
+                n_ctx = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-ngl") == 0 || strcmp(argv[i], "--gpu-layers") == 0) && i + 1 < argc) {
+                ngl = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+                n_threads = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-tb") == 0 || strcmp(argv[i], "--threads-batch") == 0) && i + 1 < argc) {
+                n_threads_batch = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0) && i + 1 < argc) {
+                n_batch = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-ctk") == 0 || strcmp(argv[i], "--cache-type-k") == 0) && i + 1 < argc) {
+                kv_cache_given = true;
+                if (!parseKvCacheType(argv[++i], kv_cache.type_k)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if ((strcmp(argv[i], "-ctv") == 0 || strcmp(argv[i], "--cache-type-v") == 0) && i + 1 < argc) {
+                kv_cache_given = true;
+                if (!parseKvCacheType(argv[++i], kv_cache.type_v)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-fa") == 0 || strcmp(argv[i], "--flash-attn") == 0) {
+                kv_cache.flash_attn = true;
+                kv_cache_given = true;
+            } else if (strcmp(argv[i], "-nkvo") == 0 || strcmp(argv[i], "--no-kv-offload") == 0) {
+                kv_cache.offload_kqv = false;
+                kv_cache_given = true;
+            } else if (strcmp(argv[i], "--no-tool-prefetch") == 0) {
+                tool_prefetch = false;
+            } else if (strcmp(argv[i], "--native-mime") == 0) {
+                native_mime = true;
+            } else if (strcmp(argv[i], "--project-tool-results") == 0) {
+                project_tool_results = true;
+            } else if (strcmp(argv[i], "--compact") == 0) {
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-at") == 0 && i + 1 < argc) {
+                compaction.trigger_ratio = std::stof(argv[++i]);
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-keep") == 0 && i + 1 < argc) {
+                compaction.keep_recent_turns = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory") == 0) {
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-file") == 0 && i + 1 < argc) {
+                memory_options.path = argv[++i];
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-top-k") == 0 && i + 1 < argc) {
+                memory_config.top_k = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory-tokens") == 0 && i + 1 < argc) {
+                memory_config.token_budget = std::max(64, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--cascade-model") == 0 && i + 1 < argc) {
+                cascade.model_path = argv[++i];
+            } else if (strcmp(argv[i], "--cascade-ngl") == 0 && i + 1 < argc) {
+                cascade.n_gpu_layers = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cascade-confidence") == 0 && i + 1 < argc) {
+                cascade.min_confidence = std::stof(argv[++i]);
+            } else if ((strcmp(argv[i], "-mrc") == 0 || strcmp(argv[i], "--max-response-chars") == 0) && i + 1 < argc) {
+                max_response_chars = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--conversations") == 0 && i + 1 < argc) {
+                conversations_path = argv[++i];
+            } else if (strcmp(argv[i], "--fixtures") == 0 && i + 1 < argc) {
+                fixtures_dir = argv[++i];
+            } else if (strcmp(argv[i], "--mock-latency-ms") == 0 && i + 1 < argc) {
+                mock_latency_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+                repeat = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+                label = argv[++i];
+            } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--out") == 0) && i + 1 < argc) {
+                out_path = argv[++i];
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                seed = std::stoll(argv[++i]);
+            } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+                replay_path = argv[++i];
+            } else if (strcmp(argv[i], "--max-slowdown-pct") == 0 && i + 1 < argc) {
+                max_slowdown_pct = std::stod(argv[++i]);
+            } else if ((strcmp(argv[i], "-lf") == 0 || strcmp(argv[i], "--log-file") == 0) && i + 1 < argc) {
+                log_file_path = argv[++i];
+            } else {
+                std::cerr << "Unknown or incomplete argument: " << argv[i] << std::endl;
+                print_bench_help(argv[0]);
+                return 1;
+            }
+        } catch (std::exception& e) {
+            std::cerr << "Error parsing arguments: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    RecordedSession session;
+    if (!replay_path.empty()) {
+        std::string error;
+        if (!session.load(replay_path, error)) {
+            std::cerr << "Failed to load session recording: " << error << std::endl;
+            return 1;
+        }
+        // Unless overridden, replay with the recorded model and context geometry
+        if (model_path.empty()) model_path = session.config.value("model", "");
+        if (n_ctx <= 0) n_ctx = session.config.value("n_ctx", 0);
+        if (n_batch < 0) n_batch = session.config.value("n_batch", 0);
+        if (!kv_cache_given && session.config.contains("kv_cache")) {
+            const json& kv = session.config["kv_cache"];
+            parseKvCacheType(kv.value("type_k", "f16"), kv_cache.type_k);
+            parseKvCacheType(kv.value("type_v", "f16"), kv_cache.type_v);
+            kv_cache.flash_attn = kv.value("flash_attn", false);
+            kv_cache.offload_kqv = kv.value("offload_kqv", true);
+        }
+    }
+    if (n_ctx <= 0) n_ctx = 4096;
+    if (n_batch < 0) n_batch = 0;
+
+    if (model_path.empty()) {
+        std::cerr << "Model path (-m) is required." << std::endl;
+        print_bench_help(argv[0]);
+        return 1;
+    }
+
+    if (!log_file_path.empty() && !Logger::instance().open(log_file_path)) {
+        std::cerr << "Failed to open log file: " << log_file_path << std::endl;
+    }
+
+    const unsigned int hardware_concurrency_val = std::thread::hardware_concurrency();
+    if (n_threads == -1) {
+        n_threads = hardware_concurrency_val > 0 ? hardware_concurrency_val : 4;
+    }
+    if (n_threads_batch == -1) {
+        n_threads_batch = hardware_concurrency_val > 0 ? hardware_concurrency_val : 4;
+    }
+
+    if (!replay_path.empty()) {
+        // Tool traffic is served from the recording, so no Gmail service is needed
+        LlamaInference llama(model_path, ngl, n_ctx, "http://127.0.0.1:0", n_threads, n_threads_batch);
+        llama.setMaxResponseChars(session.config.value("max_response_chars", max_response_chars));
+        llama.setBatchSize(n_batch);
+        llama.setKvCacheConfig(kv_cache);
+        llama.setMetricsFile("");
+        if (!llama.initialize()) {
+            std::cerr << "Failed to initialize LlamaInference." << std::endl;
+            Logger::instance().close();
+            return 1;
+        }
+
+        if (seed >= 0) {
+            // Explicit seed overrides the recorded one (e.g. to check sensitivity to sampling)
+            session.config["seed"] = static_cast<uint32_t>(seed);
+        }
+        SessionReplayer replayer(llama, session);
+        bool identical = true;
+        json replay = replayer.run(identical);
+
+        bool regressed = false;
+        if (max_slowdown_pct >= 0.0) {
+            const json& delta = replay["summary"]["delta_pct"];
+            regressed = delta.value("ttft_ms", 0.0) > max_slowdown_pct ||
+                        delta.value("decode_tokens_per_s", 0.0) < -max_slowdown_pct;
+        }
+        replay["summary"]["regressed"] = regressed;
+
+        const json report = {
+            {"label", label},
+            {"config", llama.describeConfig()},
+            {"replay", std::move(replay)},
+            {"peak_rss_bytes", peakRssBytes()},
+        };
+        const bool written = writeReport(report, out_path);
+        Logger::instance().close();
+        if (!written) return 1;
+        return identical && !regressed ? 0 : 2;
+    }
+
+    std::vector<Conversation> conversations;
+    if (!loadConversations(conversations_path, conversations)) {
+        return 1;
+    }
+
+    MockGmailService mock;
+    if (!mock.loadFixtures(fixtures_dir)) {
+        std::cerr << "Failed to load fixtures from " << fixtures_dir << std::endl;
+        return 1;
+    }
+    mock.setLatencyMs(mock_latency_ms);
+    if (!mock.start()) {
+        std::cerr << "Failed to start the mock Gmail service" << std::endl;
+        return 1;
+    }
+
+    LlamaInference llama(model_path, ngl, n_ctx, mock.address(), n_threads, n_threads_batch);
+    llama.setSystemPrompt(defaultSystemPrompt());
+    llama.setMaxResponseChars(max_response_chars);
+    llama.setBatchSize(n_batch);
+    llama.setKvCacheConfig(kv_cache);
+    llama.setToolPrefetch(tool_prefetch);
+    llama.setNativeMime(native_mime);
+    llama.setProjectToolResults(project_tool_results);
+    llama.setCompactionConfig(compaction);
+    llama.setCascadeConfig(cascade);
+    MemoryStore memory_store(memory_options);
+    if (memory_enabled) {
+        memory_store.open();
+        llama.setMemoryStore(&memory_store, memory_config);
+    }
+    if (seed >= 0) {
+        llama.setSeed(static_cast<uint32_t>(seed));
+    }
+    llama.setMetricsFile(""); // The report below carries the per-turn metrics
+
+    const auto load_start = PerfClock::now();
+    if (!llama.initialize()) {
+        std::cerr << "Failed to initialize LlamaInference." << std::endl;
+        mock.stop();
+        Logger::instance().close();
+        return 1;
+    }
+    const double load_ms = elapsedMs(load_start);
+    const long long rss_after_load = peakRssBytes();
+
+    std::vector<double> ttft_ms;
+    std::vector<double> decode_tps;
+    std::vector<double> prefill_tps;
+    std::vector<double> prefill_tokens;
+    std::vector<double> tool_calls_per_task;
+    int tool_calls_prefetched = 0;
+    std::vector<double> tool_parse_us;
+    std::vector<double> tool_parse_allocations;
+    std::vector<double> memory_ms;
+    std::vector<double> memory_lookup_ms;
+    std::vector<double> memory_entries;
+    std::vector<double> route_confidence;
+    json cascade_routes = {{"tool", 0}, {"answer", 0}, {"escalated", 0}};
+    json runs = json::array();
+    const auto bench_start = PerfClock::now();
+
+    for (int r = 0; r < repeat; r++) {
+        for (const auto& conv : conversations) {
+            // Every task starts from the same mailbox and an empty conversation; with
+            // --memory, what earlier tasks remembered carries over
+            mock.resetState();
+            llama.resetChat();
+
+            json turns = json::array();
+            int task_tool_calls = 0;
+            for (const auto& user_message : conv.turns) {
+                std::string output;
+                const std::string reply = llama.chat(user_message, false, output, []() {});
+                const TurnMetrics metrics = llama.getLastTurnMetrics();
+
+                ttft_ms.push_back(metrics.ttftMs());
+                if (metrics.decodeMs() > 0.0) {
+                    decode_tps.push_back(metrics.generatedTokens() * 1000.0 / metrics.decodeMs());
+                }
+                if (metrics.prefillMs() > 0.0) {
+                    prefill_tps.push_back(metrics.prefillTokens() * 1000.0 / metrics.prefillMs());
+                }
+                prefill_tokens.push_back(metrics.prefillTokens());
+                if (memory_enabled) {
+                    memory_ms.push_back(metrics.memory_ms);
+                    memory_lookup_ms.push_back(metrics.memory_lookup_ms);
+                    memory_entries.push_back(metrics.memory_entries);
+                }
+                task_tool_calls += metrics.toolCalls();
+                for (const auto& iteration : metrics.iterations) {
+                    if (iteration.routed) {
+                        cascade_routes[iteration.route.decision] = cascade_routes.value(iteration.route.decision, 0) + 1;
+                        route_confidence.push_back(iteration.route.confidence);
+                    }
+                    if (!iteration.has_tool_call) continue;
+                    tool_calls_prefetched += iteration.tool.prefetched;
+                    tool_parse_us.push_back(iteration.tool.parse_us);
+                    tool_parse_allocations.push_back(static_cast<double>(iteration.tool.parse_allocations));
+                }
+
+                json turn = metrics.toJson();
+                turn["user"] = user_message;
+                turn["response_chars"] = reply.size();
+                turns.push_back(std::move(turn));
+            }
+            tool_calls_per_task.push_back(task_tool_calls);
+            runs.push_back(json{
+                {"repeat", r},
+                {"conversation", conv.name},
+                {"tool_calls", task_tool_calls},
+                {"turns", std::move(turns)},
+            });
+            std::cerr << "[bench] " << conv.name << " (" << (r + 1) << "/" << repeat << ") done" << std::endl;
+        }
+    }
+
+    const double bench_ms = elapsedMs(bench_start);
+    mock.stop();
+
+    const json engine_config = llama.describeConfig();
+    json report = {
+        {"label", label},
+        {"config", {
+            {"engine", engine_config},
+            {"mock_latency_ms", mock_latency_ms},
+            {"repeat", repeat},
+            {"conversations", conversations_path},
+            {"fixtures", fixtures_dir},
+        }},
+        {"summary", {
+            {"turns", ttft_ms.size()},
+            {"tasks", tool_calls_per_task.size()},
+            {"load_ms", load_ms},
+            {"wall_ms", bench_ms},
+            {"ttft_ms", distribution(ttft_ms)},
+            {"decode_tokens_per_s", distribution(decode_tps)},
+            {"prefill_tokens_per_s", distribution(prefill_tps)},
+            {"prefill_tokens_per_turn", distribution(prefill_tokens)},
+            {"tool_iterations_per_task", distribution(tool_calls_per_task)},
+            {"tool_calls_prefetched", tool_calls_prefetched},
+            // Per tool call: parsing the call out of the reply plus projecting the response
+            {"tool_parse_us", distribution(tool_parse_us)},
+            {"tool_parse_allocations", distribution(tool_parse_allocations)},
+            // Per turn with --memory: recall in total (embeddings included), the lookup alone
+            // and the entries put back into the conversation
+            {"memory_ms", distribution(memory_ms)},
+            {"memory_lookup_ms", distribution(memory_lookup_ms)},
+            {"memory_entries", distribution(memory_entries)},
+            // Per tool-loop step with --cascade-model: who decided it, and how sure the small model was
+            {"cascade_routes", std::move(cascade_routes)},
+            {"cascade_route_confidence", distribution(route_confidence)},
+            {"mock_requests", mock.requestCount()},
+            {"peak_rss_bytes_after_load", rss_after_load},
+            {"peak_rss_bytes", peakRssBytes()},
+            // With decode_tokens_per_s, the speed/memory trade-off of --cache-type-k/-v and --flash-attn
+            {"kv_cache_bytes", engine_config["kv_cache"].value("bytes", static_cast<uint64_t>(0))},
+        }},
+        {"runs", std::move(runs)},
+    };
+
+    const bool written = writeReport(report, out_path);
+    Logger::instance().close();
+    return written ? 0 : 1;
+}
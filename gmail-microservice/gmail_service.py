@@ -33,7 +33,25 @@ class LabelUpdate(BaseModel):
     label_list_visibility: Optional[str] = None
     message_list_visibility: Optional[str] = None
 
+class MessageLabelsModify(BaseModel):
+    add_label_ids: List[str] = []
+    remove_label_ids: List[str] = []
+
+class MessageBatchGet(BaseModel):
+    message_ids: List[str]
+    fields: Optional[List[str]] = None
+    max_body_chars: Optional[int] = 2000
+
 class GmailManager:
+    # Gmail accepts up to 100 calls per batch request, but recommends at most 50 to stay
+    # clear of the per-user rate limit
+    BATCH_SIZE = 50
+
+    # Fields get_messages can return; 'body' needs the full message, the rest only metadata
+    MESSAGE_FIELDS = ['id', 'threadId', 'from', 'to', 'date', 'subject', 'snippet', 'labelIds', 'internalDate', 'body']
+    DEFAULT_MESSAGE_FIELDS = ['id', 'from', 'date', 'subject', 'body']
+    HEADER_FIELDS = {'from': 'From', 'to': 'To', 'date': 'Date', 'subject': 'Subject'}
+
     def __init__(self, credentials_path='runtime-deps/credentials.json', token_path='runtime-deps/token.json'):
         """
         Initialize Gmail API service with OAuth 2.0 authentication
@@ -93,13 +111,15 @@ class GmailManager:
 
     """ HISTORY """
 
-    def get_history(self, start_history_id=None, max_results=100):
+    def get_history(self, start_history_id=None, max_results=100, page_token=None):
         """
         Get the history of changes to the user's mailbox.
         
         :param start_history_id: Starting point for fetching history (optional)
         :param max_results: Maximum number of history records to return
-        :return: List of history records
+        :param page_token: Continue a previous call that returned next_page_token (optional)
+        :return: List of history records, plus latest_history_id, the point to continue
+                 from once every page has been read
         """
         try:
             # If no start_history_id is provided, get the current one
@@ -115,11 +135,14 @@ class GmailManager:
                 'maxResults': max_results,
                 'historyTypes': ['messageAdded', 'messageDeleted', 'labelAdded', 'labelRemoved']
             }
+            if page_token:
+                params['pageToken'] = page_token
             
             history = self.service.users().history().list(**params).execute()
             
             return {
                 'history_id': start_history_id,
+                'latest_history_id': history.get('historyId', start_history_id),
                 'history_records': history.get('history', []),
                 'next_page_token': history.get('nextPageToken', None)
             }
@@ -128,6 +151,7 @@ class GmailManager:
             print(f"An error occurred: {e}")
             if e.resp.status == 404:
                 print("History ID not found. The ID might be too old.")
+                return {'error': str(e), 'status': 404}
             return {'error': str(e)}
 
     """ LABELS """
@@ -237,6 +261,14 @@ class GmailManager:
 
     """ MESSAGES """
 
+    @staticmethod
+    def _decode_part_data(data: str) -> bytes:
+        """
+        Decode a base64url body from the Gmail API. urlsafe_b64decode takes the URL-safe
+        alphabet as it is; only the padding Gmail leaves off has to be restored.
+        """
+        return base64.urlsafe_b64decode(data + '=' * (-len(data) % 4))
+
     def _extract_and_decode_body(self, payload: Dict[str, Any]) -> str:
         """
         Extracts and decodes the message body from the payload.
@@ -254,8 +286,7 @@ class GmailManager:
         
         if body_content:
             try:
-                # Replace URL-safe characters and add padding if necessary
-                decoded_bytes = base64.urlsafe_b64decode(body_content.replace('-', '+').replace('_', '/') + "===")
+                decoded_bytes = self._decode_part_data(body_content)
                 return decoded_bytes.decode('utf-8')
             except Exception as e:
                 print(f"Error decoding body part: {e}")
@@ -269,7 +300,7 @@ class GmailManager:
                 if 'text/plain' in part_mime_type:
                     if 'data' in part.get('body', {}):
                         try:
-                            decoded_bytes = base64.urlsafe_b64decode(part['body']['data'].replace('-', '+').replace('_', '/') + "===")
+                            decoded_bytes = self._decode_part_data(part['body']['data'])
                             plain_text_body = decoded_bytes.decode('utf-8')
                             break # Prefer plain text immediately
                         except Exception as e:
@@ -278,7 +309,7 @@ class GmailManager:
                 elif 'text/html' in part_mime_type:
                      if 'data' in part.get('body', {}):
                         try:
-                            decoded_bytes = base64.urlsafe_b64decode(part['body']['data'].replace('-', '+').replace('_', '/') + "===")
+                            decoded_bytes = self._decode_part_data(part['body']['data'])
                             html_body = decoded_bytes.decode('utf-8')
                         except Exception as e:
                             print(f"Error decoding text/html part: {e}")
@@ -297,12 +328,93 @@ class GmailManager:
         
         return "[No readable body content found]"
 
-    def list_messages(self, query: str = '', max_results: Optional[int] = None):
+    def _batch_get_messages(self, message_ids: List[str], **get_params) -> Dict[str, Any]:
+        """
+        Fetch many messages with batch requests: one HTTP round trip per BATCH_SIZE messages
+        instead of one per message.
+
+        :param message_ids: Message IDs to fetch (without duplicates)
+        :param get_params: Parameters of messages().get(), e.g. format and metadataHeaders
+        :return: Dict of message ID to message resource, or to {'error': ...} if that fetch failed
+        """
+        results = {}
+
+        def on_response(request_id, response, exception):
+            if exception is not None:
+                print(f"An error occurred while fetching message {request_id}: {exception}")
+                results[request_id] = {'error': str(exception)}
+            else:
+                results[request_id] = response
+
+        for start in range(0, len(message_ids), self.BATCH_SIZE):
+            batch = self.service.new_batch_http_request(callback=on_response)
+            for msg_id in message_ids[start:start + self.BATCH_SIZE]:
+                batch.add(self.service.users().messages().get(userId='me', id=msg_id, **get_params),
+                          request_id=msg_id)
+            batch.execute()
+        return results
+
+    def get_messages(self, message_ids: List[str], fields: Optional[List[str]] = None,
+                     max_body_chars: Optional[int] = 2000):
+        """
+        Fetch many messages at once, returning only the requested fields of each.
+        Only asks Gmail for full messages when 'body' is requested, and only for the
+        requested headers otherwise.
+
+        :param message_ids: IDs of the messages to fetch
+        :param fields: Subset of MESSAGE_FIELDS (default DEFAULT_MESSAGE_FIELDS)
+        :param max_body_chars: Truncate bodies to this many characters (None for no limit)
+        :return: List of projected messages in the order of message_ids; a message that
+                 could not be fetched has 'id' and 'error' instead
+        """
+        fields = [f for f in (fields or self.DEFAULT_MESSAGE_FIELDS) if f in self.MESSAGE_FIELDS]
+        if not fields:
+            fields = self.DEFAULT_MESSAGE_FIELDS
+        unique_ids = list(dict.fromkeys(message_ids))
+
+        if 'body' in fields:
+            get_params = {'format': 'full'}
+        else:
+            get_params = {
+                'format': 'metadata',
+                'metadataHeaders': [self.HEADER_FIELDS[f] for f in fields if f in self.HEADER_FIELDS],
+            }
+        try:
+            fetched = self._batch_get_messages(unique_ids, **get_params)
+        except HttpError as e:
+            print(f"An error occurred while fetching messages: {e}")
+            fetched = {msg_id: {'error': str(e)} for msg_id in unique_ids}
+
+        projected = []
+        for msg_id in message_ids:
+            message = fetched.get(msg_id, {'error': 'Not fetched'})
+            if 'error' in message:
+                projected.append({'id': msg_id, 'error': message['error']})
+                continue
+            payload = message.get('payload', {})
+            headers = {h['name'].lower(): h['value'] for h in payload.get('headers', [])}
+            item = {}
+            for field in fields:
+                if field in self.HEADER_FIELDS:
+                    item[field] = headers.get(field, '')
+                elif field == 'body':
+                    body = self._extract_and_decode_body(payload)
+                    if max_body_chars is not None and len(body) > max_body_chars:
+                        body = body[:max_body_chars] + '...'
+                    item['body'] = body
+                else:
+                    item[field] = message.get(field)
+            projected.append(item)
+        return projected
+
+    def list_messages(self, query: str = '', max_results: Optional[int] = None, ids_only: bool = False):
         """
         List messages from Gmail inbox, handling pagination and fetching metadata (sender, subject, snippet).
         
         :param query: Optional search query to filter messages
         :param max_results: Optional maximum number of messages to retrieve.
+        :param ids_only: Skip the per-message metadata fetch and return only id/threadId.
+                         Listing thousands of messages this way costs one API call per page.
         :return: List of message objects, each containing id, threadId, from, subject, and snippet.
         """
         try:
@@ -341,53 +453,66 @@ class GmailManager:
                 page_token = results.get('nextPageToken')
                 if not page_token or len(listed_messages_ids) >= actual_max_results:
                     break
+
+            if ids_only:
+                return [{'id': m['id'], 'threadId': m['threadId']} for m in listed_messages_ids]
             
-            # Now fetch metadata for the collected IDs
+            # Now fetch metadata for the collected IDs, BATCH_SIZE messages per API round trip
+            fetched = self._batch_get_messages(
+                list(dict.fromkeys(m['id'] for m in listed_messages_ids)),
+                format='metadata',
+                metadataHeaders=['From', 'Subject'] # Snippet comes by default with metadata
+            )
             detailed_messages = []
             for msg_id_obj in listed_messages_ids:
-                try:
-                    msg_id = msg_id_obj['id']
-                    msg_data = self.service.users().messages().get(
-                        userId='me', 
-                        id=msg_id, 
-                        format='metadata', 
-                        metadataHeaders=['From', 'Subject'] # Snippet comes by default with metadata
-                    ).execute()
-                    
-                    headers = msg_data.get('payload', {}).get('headers', [])
-                    sender = next((h['value'] for h in headers if h['name'].lower() == 'from'), 'N/A')
-                    subject = next((h['value'] for h in headers if h['name'].lower() == 'subject'), 'N/A')
-                    snippet = msg_data.get('snippet', '')
-                    
+                msg_id = msg_id_obj['id']
+                msg_data = fetched.get(msg_id, {'error': 'Not fetched'})
+                if 'error' in msg_data:
                     detailed_messages.append({
                         'id': msg_id,
                         'threadId': msg_id_obj['threadId'],
-                        'from': sender,
-                        'subject': subject,
-                        'snippet': snippet
+                        'error': f"Failed to fetch metadata: {msg_data['error']}"
                     })
-                except HttpError as e_get:
-                    print(f"An error occurred while fetching metadata for message ID {msg_id}: {e_get}")
-                    # Optionally add a placeholder or skip this message
-                    detailed_messages.append({
-                        'id': msg_id,
-                        'threadId': msg_id_obj['threadId'],
-                        'error': f'Failed to fetch metadata: {str(e_get)}'
-                    })
-            
+                    continue
+
+                headers = msg_data.get('payload', {}).get('headers', [])
+                sender = next((h['value'] for h in headers if h['name'].lower() == 'from'), 'N/A')
+                subject = next((h['value'] for h in headers if h['name'].lower() == 'subject'), 'N/A')
+                detailed_messages.append({
+                    'id': msg_id,
+                    'threadId': msg_id_obj['threadId'],
+                    'from': sender,
+                    'subject': subject,
+                    'snippet': msg_data.get('snippet', '')
+                })
+
             return detailed_messages
         except HttpError as e_list:
             print(f"An error occurred while listing messages: {e_list}")
             return []
 
-    def get_message_content(self, message_id: str):
+    def get_message_content(self, message_id: str, format: str = 'full'):
         """
         Get the full content of a specific message, parse and decode the body.
         
         :param message_id: The ID of the message to retrieve.
-        :return: Parsed message content including sender, subject, and decoded body.
+        :param format: 'full' decodes the body here; 'raw' returns the RFC 822 message as
+                       Gmail's base64url string, undecoded, for the client to parse
+        :return: Parsed message content including sender, subject, and decoded body,
+                 or id, threadId, labelIds, snippet and raw
         """
         try:
+            if format == 'raw':
+                message = self.service.users().messages().get(userId='me', id=message_id, format='raw').execute()
+                # raw goes last so a client can parse the small fields without scanning past it
+                return {
+                    'id': message.get('id'),
+                    'threadId': message.get('threadId'),
+                    'labelIds': message.get('labelIds', []),
+                    'snippet': message.get('snippet'),
+                    'raw': message.get('raw', '')
+                }
+
             message = self.service.users().messages().get(userId='me', id=message_id, format='full').execute()
             
             payload = message.get('payload', {})
@@ -441,6 +566,25 @@ class GmailManager:
             print(f"An error occurred: {e}")
             return {'error': str(e)}
 
+    def modify_message_labels(self, message_id, add_label_ids=None, remove_label_ids=None):
+        """
+        Add and/or remove labels on a message.
+        
+        :param message_id: ID of the message to modify
+        :param add_label_ids: Label IDs to add
+        :param remove_label_ids: Label IDs to remove
+        :return: Modified message resource (id, threadId, labelIds) or error
+        """
+        try:
+            body = {
+                'addLabelIds': add_label_ids or [],
+                'removeLabelIds': remove_label_ids or []
+            }
+            return self.service.users().messages().modify(userId='me', id=message_id, body=body).execute()
+        except HttpError as e:
+            print(f"An error occurred while modifying labels of message {message_id}: {e}")
+            return {'error': str(e), 'message_id': message_id}
+
     def trash_message(self, message_id):
         """
         Move a message to trash.
@@ -527,7 +671,8 @@ def delete_label(label_id: str = Path(..., description="ID of the label to delet
 @app.get("/messages", tags=["Messages"])
 def list_messages_endpoint(
     query: str = Query("", description="Optional search query to filter messages"),
-    max_results: Optional[int] = Query(None, description="Optional maximum number of messages to retrieve.")
+    max_results: Optional[int] = Query(None, description="Optional maximum number of messages to retrieve."),
+    ids_only: bool = Query(False, description="Return only id/threadId, skipping the per-message metadata fetch.")
 ):
     """
     List messages from Gmail inbox.
@@ -535,18 +680,36 @@ def list_messages_endpoint(
     """
     # manager = GmailManager() # Use the global instance
     # Pass max_results to the manager method
-    messages = gmail_manager.list_messages(query=query, max_results=max_results) 
+    messages = gmail_manager.list_messages(query=query, max_results=max_results, ids_only=ids_only)
     if gmail_manager.service is None: # Check if service initialization failed
         raise HTTPException(status_code=500, detail="Failed to connect to Gmail service.")
     return {"messages": messages}
 
+@app.post("/messages/batch", tags=["Messages"])
+def get_messages_endpoint(request: MessageBatchGet):
+    """
+    Get many messages in one call, with only the requested fields of each.
+    Fields: id, threadId, from, to, date, subject, snippet, labelIds, internalDate, body.
+    """
+    if not request.message_ids:
+        raise HTTPException(status_code=422, detail="message_ids must not be empty")
+    messages = gmail_manager.get_messages(
+        message_ids=request.message_ids,
+        fields=request.fields,
+        max_body_chars=request.max_body_chars
+    )
+    return {"messages": messages}
+
 @app.get("/messages/{message_id}", tags=["Messages"])
-def get_message_content_endpoint(message_id: str = Path(..., description="The ID of the message to retrieve.")):
+def get_message_content_endpoint(
+    message_id: str = Path(..., description="The ID of the message to retrieve."),
+    format: str = Query("full", description="'full' returns the decoded body; 'raw' the undecoded RFC 822 message")
+):
     """
     Get the full content of a specific message by its ID.
     """
     # manager = GmailManager() # Use the global instance
-    message_content = gmail_manager.get_message_content(message_id=message_id)
+    message_content = gmail_manager.get_message_content(message_id=message_id, format=format)
     if gmail_manager.service is None: # Check if service initialization failed
         raise HTTPException(status_code=500, detail="Failed to connect to Gmail service.")
     if 'error' in message_content:
@@ -567,6 +730,23 @@ def send_message(message: EmailMessage):
         raise HTTPException(status_code=500, detail="Failed to send message")
     return {"message_id": message_id, "status": "sent"}
 
+@app.post("/messages/{message_id}/labels", tags=["Messages"])
+def modify_message_labels_endpoint(
+    message_id: str = Path(..., description="ID of the message to modify"),
+    labels: MessageLabelsModify = Body(...)
+):
+    """Add and/or remove labels on a message"""
+    result = gmail_manager.modify_message_labels(
+        message_id=message_id,
+        add_label_ids=labels.add_label_ids,
+        remove_label_ids=labels.remove_label_ids
+    )
+    if 'error' in result:
+        if "<HttpError 404" in result['error']:
+            raise HTTPException(status_code=404, detail=f"Message with ID {message_id} not found.")
+        raise HTTPException(status_code=500, detail=result['error'])
+    return {"id": result.get('id'), "threadId": result.get('threadId'), "labelIds": result.get('labelIds', [])}
+
 @app.delete("/messages/{message_id}", tags=["Messages"])
 def trash_message_endpoint(message_id: str = Path(..., description="ID of the message to move to trash")):
     """
@@ -603,15 +783,18 @@ def trash_message_endpoint(message_id: str = Path(..., description="ID of the me
 @app.get("/history", tags=["History"])
 def get_history(
     start_history_id: Optional[str] = Query(None, description="Starting point for fetching history"),
-    max_results: int = Query(100, description="Maximum number of history records to return")
+    max_results: int = Query(100, description="Maximum number of history records to return"),
+    page_token: Optional[str] = Query(None, description="next_page_token of the previous call")
 ):
     """Get the history of changes to the user's mailbox"""
     history_data = gmail_manager.get_history(
         start_history_id=start_history_id,
-        max_results=max_results
+        max_results=max_results,
+        page_token=page_token
     )
     if 'error' in history_data:
-        raise HTTPException(status_code=500, detail=history_data['error'])
+        # 404: start_history_id is too old; the caller has to list the mailbox again
+        raise HTTPException(status_code=history_data.get('status', 500), detail=history_data['error'])
     return history_data
 
 if __name__ == "__main__":
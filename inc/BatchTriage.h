@@ -0,0 +1,61 @@
+#ifndef BATCH_TRIAGE_H
+#define BATCH_TRIAGE_H
+
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+class LlamaInference;
+
+struct BatchTriageOptions {
+    std::string query = "in:inbox";       // Gmail search selecting the messages to triage
+    std::string since_history_id;         // If set, triage messages added since this history ID instead
+    int max_messages = 1000;
+    std::vector<std::string> categories = {"Work", "Personal", "Finance", "Travel", "Newsletters", "Notifications", "Spam"};
+    std::string label_prefix = "Triage/"; // Gmail label applied for category C is label_prefix + C
+    bool dry_run = false;                 // Classify only; do not create or apply labels
+    int fetch_threads = 4;
+    int prefetch = 64;                    // Messages fetched ahead of inference
+    bool generate = false;                // Generate the category name instead of scoring categories from logits
+    int parallel = 8;                     // Messages classified together when generating (LlamaInference::completeBatch)
+    int body_chars = 1200;                // Budget for the compacted body in each prompt
+    std::string report_path = "triage_report.jsonl"; // One JSON line per message (empty disables)
+};
+
+// Non-interactive inbox triage: list message IDs, then stream them through a pipeline
+//
+//   fetch (fetch_threads) -> compact -> classify (caller's thread) -> label (one thread)
+//
+// connected by bounded queues, so Gmail round trips overlap with inference. Every
+// classification prompt starts with the same system prompt (instructions and category
+// list), which stays in the KV cache; only the message itself is prefilled. By default
+// the category is read off the logits after that prefill (LlamaInference::classify) and
+// the report carries the probability of every category. With `generate`, the model
+// writes the category name instead, and messages already waiting in the queue are
+// classified together as forks of the shared prefix.
+class BatchTriage {
+public:
+    BatchTriage(LlamaInference& engine, const std::string& gmail_service_addr, BatchTriageOptions options);
+
+    // Runs the whole batch and returns a summary (counts per category, timings, errors)
+    nlohmann::json run();
+
+private:
+    struct Item;
+    struct Result;
+
+    bool listMessageIds(std::vector<std::string>& ids, std::string& error);
+    // Looks up (and unless dry_run, creates) the label of every category
+    bool resolveLabels(std::string& error);
+    std::string classificationSystemPrompt() const;
+    std::string compactBody(const std::string& body) const;
+    std::string parseCategory(const std::string& raw) const;
+
+    LlamaInference& engine_;
+    std::string gmail_service_addr_;
+    BatchTriageOptions options_;
+    std::vector<std::string> label_ids_; // Parallel to options_.categories ("" in dry runs)
+};
+
+#endif // BATCH_TRIAGE_H
@@ -0,0 +1,146 @@
+#ifndef ENGINE_METRICS_H
+#define ENGINE_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lock-free building blocks for the Prometheus endpoint. Recording is a handful of
+// relaxed atomic operations; all aggregation (cumulative buckets, ratios, text
+// formatting) happens in render() when the endpoint is scraped.
+
+class MetricCounter {
+public:
+    void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class MetricGauge {
+public:
+    void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Accumulates a double without locks (std::atomic<double>::fetch_add is C++20)
+class MetricSum {
+public:
+    void add(double v) {
+        double current = value_.load(std::memory_order_relaxed);
+        while (!value_.compare_exchange_weak(current, current + v, std::memory_order_relaxed)) {
+        }
+    }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<double> value_{0.0};
+};
+
+// Fixed-bucket histogram. Buckets store per-bucket (not cumulative) counts so
+// observe() touches exactly one bucket; render() accumulates them.
+class MetricHistogram {
+public:
+    explicit MetricHistogram(std::vector<double> upper_bounds);
+
+    void observe(double v);
+
+    // Appends the _bucket/_sum/_count lines. `labels` is either empty or `key="value",`
+    void render(std::string& out, const std::string& name, const std::string& labels) const;
+
+private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_; // bounds_.size() + 1 (the +Inf bucket)
+    MetricSum sum_;
+    MetricCounter count_;
+};
+
+// Counters for every metric exported at /metrics. One process-wide instance; the
+// inference engine, tool loop and servers record into it.
+class EngineMetrics {
+public:
+    static EngineMetrics& instance();
+
+    // Generation
+    MetricHistogram decode_latency_seconds;   // Per generated token, llama_decode only
+    MetricHistogram prefill_tokens_per_second; // Per prefill pass
+    MetricHistogram ttft_seconds;
+    MetricCounter prefill_tokens_total;
+    MetricSum prefill_seconds_total;
+    MetricCounter generated_tokens_total;
+    MetricSum decode_seconds_total;
+    MetricCounter prompt_tokens_total;        // Tokens in formatted prompts
+    MetricCounter prompt_tokens_reused_total; // ...of which were served from the KV cache
+    MetricCounter context_shifts_total;
+    MetricCounter history_compactions_total;  // Older turns replaced by a summary
+    MetricCounter turns_total;
+
+    // Long-term memory (MemoryStore)
+    MetricHistogram memory_lookup_seconds;     // Per lookup, search only
+    MetricCounter memory_recalled_entries_total;
+
+    // Idle-time background work (IdleScheduler)
+    MetricCounter idle_jobs_total;             // Jobs run to completion
+    MetricCounter idle_jobs_preempted_total;   // Runs interrupted by a foreground call
+    MetricSum idle_job_seconds_total;
+    MetricHistogram idle_preemption_seconds;   // Foreground wait for a preempted job to give the engine up
+
+    // Model cascade: who decided each tool-loop step (the small model's call, or the main model)
+    MetricCounter cascade_tool_calls_total;    // Small model's tool call used as is
+    MetricCounter cascade_answers_total;       // Small model chose to answer; the main model wrote the reply
+    MetricCounter cascade_escalations_total;   // Small model not confident enough; the main model decided
+
+    // KV cache occupancy
+    MetricGauge kv_cache_tokens;
+    MetricGauge kv_cache_capacity;             // n_ctx
+
+    // Tool prefetching (ToolPrefetcher)
+    MetricCounter tool_prefetches_total;       // Requests started speculatively
+    MetricCounter tool_prefetch_hits_total;    // Tool calls answered by one of them
+
+    // Tools, labelled by tool_name
+    void recordToolCall(const std::string& tool_name, double seconds, bool error);
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string render() const;
+
+private:
+    EngineMetrics();
+
+    struct ToolStats {
+        MetricCounter calls;
+        MetricCounter errors;
+        MetricHistogram latency_seconds;
+        ToolStats();
+    };
+
+    // Tool names are a small, mostly fixed set; the lock only guards the map shape and
+    // is taken once per tool call, never per token.
+    mutable std::mutex tools_mutex_;
+    std::map<std::string, std::unique_ptr<ToolStats>> tools_;
+};
+
+namespace httplib { class Server; }
+
+// Optional embedded HTTP endpoint serving EngineMetrics::render() at GET /metrics
+class MetricsServer {
+public:
+    MetricsServer();
+    ~MetricsServer();
+
+    // Bind and start serving on a background thread. Returns false if the port cannot be bound.
+    bool start(const std::string& host, int port);
+    void stop();
+
+private:
+    std::unique_ptr<httplib::Server> server_;
+    std::unique_ptr<std::thread> thread_;
+};
+
+#endif // ENGINE_METRICS_H
@@ -0,0 +1,101 @@
+#ifndef ENGINE_SERVER_H
+#define ENGINE_SERVER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "LlamaInference.h"
+#include "PerfMetrics.h"
+
+namespace httplib { class Server; }
+
+// Hosts one loaded LlamaInference for several frontends (TUI, scripts, the Python
+// service), so the model is loaded once and stays warm. JSON over localhost HTTP or
+// an AF_UNIX socket:
+//
+//   GET    /health                     model and engine configuration, idle-time jobs
+//   POST   /sessions                   {"session_id"} of a new, empty conversation
+//   DELETE /sessions/{id}
+//   POST   /chat        {"message", "session_id"?, "stream"?}    tool-calling chat turn;
+//                       with "stream": true the reply arrives as server-sent events
+//                       ("data: {"delta": ...}" per piece, then "event: done")
+//   POST   /complete    {"message", "system"?, "max_chars"?}     one-shot completion
+//   POST   /classify    {"text", "labels", "system"?, "answer_prefix"?}  label probabilities
+//   POST   /embeddings  {"input": "..." | ["...", ...]}
+//   POST   /reload      {"model"?, "n_ctx"?, "n_gpu_layers"?}     switch model or context; served
+//                       by the current engine until the new one is ready
+//   GET    /metrics                    Prometheus text (EngineMetrics)
+//
+// The engine runs one request at a time. Requests queue in arrival order, and a chat
+// request first swaps its session's history into the engine; the shared system
+// prompt stays in the KV cache across sessions. A request that finds the queue full
+// gets 503 with Retry-After instead of tying up a connection thread, and the thread
+// pool keeps spare threads so /health, /metrics, /sessions and /reload always answer.
+// Errors use {"detail": "..."}.
+class EngineServer {
+public:
+    explicit EngineServer(LlamaInference& engine);
+    ~EngineServer();
+
+    // Least recently used sessions are dropped beyond this many. A session with a chat
+    // request queued or running is never dropped.
+    void setMaxSessions(size_t max_sessions) { max_sessions_ = max_sessions; }
+
+    // Engine requests waiting behind the running one beyond this many are refused with 503.
+    // Call before serve(): the thread pool is sized from it.
+    void setMaxQueuedRequests(size_t max_queued) { max_queued_ = max_queued; }
+
+    // Bind to host:port, or to a Unix socket path (an existing socket file is replaced).
+    // Returns false if binding fails.
+    bool bind(const std::string& host, int port);
+    bool bindUnix(const std::string& socket_path);
+
+    // Serve on the calling thread until stop()
+    void serve();
+    void stop();
+
+private:
+    struct Session {
+        std::vector<ChatMessage> history;
+        PerfClock::time_point last_used;
+        int pins = 0; // Chat requests holding or waiting for the engine on this session
+    };
+    struct EngineLease; // A place in the engine queue, then the engine for one request
+    struct SessionPin;  // Keeps a session from being dropped while a request uses it
+
+    void registerRoutes();
+    std::string createSession();
+    std::string createSessionLocked(); // Requires sessions_mutex_
+    // Make `session_id` the engine's current conversation. Returns false if it does not exist.
+    bool activateSession(const std::string& session_id);
+    void saveSession(const std::string& session_id);
+
+    LlamaInference& engine_;
+    std::unique_ptr<httplib::Server> server_;
+    std::string socket_path_;
+
+    // Engine scheduling: tickets are served in the order they were drawn. Tickets of
+    // requests that went away before their turn are skipped.
+    std::mutex schedule_mutex_;
+    std::condition_variable schedule_cv_;
+    uint64_t next_ticket_ = 0;
+    uint64_t now_serving_ = 0;
+    std::set<uint64_t> abandoned_tickets_;
+    size_t max_queued_ = 8;
+
+    // Parked conversations. active_session_ is the one loaded in the engine
+    // (only touched while holding an EngineLease).
+    std::mutex sessions_mutex_;
+    std::map<std::string, Session> sessions_;
+    size_t max_sessions_ = 64;
+    uint64_t session_counter_ = 0;
+    std::string active_session_;
+};
+
+#endif // ENGINE_SERVER_H
@@ -0,0 +1,36 @@
+#ifndef FUNCTION_REF_H
+#define FUNCTION_REF_H
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature>
+class FunctionRef;
+
+// Non-owning reference to a callable, for callbacks that are only invoked during the call
+// they are passed to (per-token streaming, UI redraws). Unlike std::function it never
+// copies the callable or allocates: it is a pointer to the callable plus a pointer to a
+// function that invokes it. The callable must outlive the FunctionRef, so use it for
+// parameters only, never for members.
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+public:
+    template <typename F,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, FunctionRef> &&
+                                          std::is_invocable_r_v<R, F&, Args...>>>
+    FunctionRef(F&& callable) noexcept
+        : callable_(const_cast<void*>(static_cast<const void*>(std::addressof(callable)))),
+          invoke_([](void* callable, Args... args) -> R {
+              return (*static_cast<std::add_pointer_t<std::remove_reference_t<F>>>(callable))(
+                  std::forward<Args>(args)...);
+          }) {}
+
+    R operator()(Args... args) const { return invoke_(callable_, std::forward<Args>(args)...); }
+
+private:
+    void* callable_;
+    R (*invoke_)(void*, Args...);
+};
+
+#endif // FUNCTION_REF_H
@@ -0,0 +1,24 @@
+#ifndef GMAIL_CLIENT_H
+#define GMAIL_CLIENT_H
+
+#include <string>
+
+#include "nlohmann/json_fwd.hpp"
+
+// HTTP client for gmail-microservice/gmail_service.py. GET parameters go into the query
+// string, other methods send them as a JSON body. Never throws: failures come back as an
+// {"error": ...} JSON envelope, which is what the model sees as the tool result.
+class GmailClient {
+public:
+    explicit GmailClient(const std::string& base_url);
+
+    // Performs one request and returns the response body ("{}" if empty) or the error envelope
+    std::string request(const std::string& http_method, const std::string& endpoint, const nlohmann::json& params) const;
+
+    const std::string& baseUrl() const { return base_url_; }
+
+private:
+    std::string base_url_;
+};
+
+#endif // GMAIL_CLIENT_H
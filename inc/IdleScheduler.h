@@ -0,0 +1,110 @@
+#ifndef IDLE_SCHEDULER_H
+#define IDLE_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nlohmann/json_fwd.hpp"
+
+// Low-priority work for the time the engine would otherwise sit idle between prompts
+// (summaries, embeddings, KV cache warm-up), run one job at a time on a worker thread.
+//
+// Jobs call the engine like any other caller. Foreground calls bracket themselves with
+// foregroundBegin()/foregroundEnd(): that preempts the running job and holds new ones back
+// until nothing has happened in the foreground for idle_delay_ms. LlamaInference polls
+// shouldYield() from llama.cpp's abort callback and between decode steps, so a preempted
+// job gives the context up within one decode step; the job itself sees `preempted` set and
+// is requeued unless it reports that it finished anyway. `preempted` is only set when the
+// job was actually told to yield: a job that had to wait for the engine instead waits
+// for the next idle period before it starts, and then runs undisturbed.
+class IdleScheduler {
+public:
+    // One run of a job on the worker. Returns true when the job is done; false puts it back
+    // in the queue, to continue (or start over) in the next idle period.
+    using Job = std::function<bool(const std::atomic<bool>& preempted)>;
+
+    explicit IdleScheduler(int idle_delay_ms = 1000);
+    ~IdleScheduler();
+
+    IdleScheduler(const IdleScheduler&) = delete;
+    IdleScheduler& operator=(const IdleScheduler&) = delete;
+
+    void start();
+    // Preempts the running job, waits for it and drops the queue
+    void stop();
+    bool running() const;
+    void setIdleDelay(int idle_delay_ms);
+
+    // Queue `job`; higher priorities run first, equal ones in submission order. A queued job
+    // of the same name is replaced (a running one finishes or is preempted first).
+    void submit(const std::string& name, int priority, Job job);
+
+    // A foreground call starts / ends. Calls nest and may overlap across threads.
+    void foregroundBegin();
+    void foregroundEnd();
+
+    // Whether the calling thread is the worker; its engine calls are not foreground calls
+    bool onWorkerThread() const;
+    // The worker takes / releases the engine (LlamaInference holds its call lock in between).
+    // workerEnter() returns false if a foreground call came in while the worker waited for
+    // the lock; the worker then releases it, waits in waitForIdle() and tries again.
+    bool workerEnter();
+    void workerLeave();
+    void waitForIdle();
+    bool workerInEngine() const { return worker_in_engine_.load(std::memory_order_acquire); }
+    // True while a job holds the engine and a foreground call (or stop()) wants it back;
+    // marks the running job preempted. Lock-free; polled from inside llama_decode.
+    bool shouldYield() const {
+        const bool yield = worker_in_engine_.load(std::memory_order_acquire) &&
+                           (foreground_.load(std::memory_order_acquire) > 0 || stopping_.load(std::memory_order_acquire));
+        if (yield) {
+            preempted_.store(true, std::memory_order_release);
+        }
+        return yield;
+    }
+
+    // Queue, running job and counters (runs, completed, preempted, seconds in jobs)
+    nlohmann::json stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Queued {
+        std::string name;
+        int priority = 0;
+        uint64_t seq = 0; // Submission order among equal priorities
+        Job job;
+    };
+
+    void run();
+    // Caller holds mutex_
+    bool idleLocked() const;
+
+    mutable std::mutex mutex_; // Guards everything below except the atomics
+    std::condition_variable wake_;
+    std::chrono::milliseconds idle_delay_;
+    std::vector<Queued> queue_;
+    uint64_t next_seq_ = 0;
+    std::string running_name_;
+    Clock::time_point last_activity_ = Clock::now();
+    bool stop_ = true;
+    uint64_t runs_ = 0;
+    uint64_t completed_ = 0;
+    uint64_t preemptions_ = 0;
+    double busy_seconds_ = 0.0;
+    std::thread worker_;
+
+    std::atomic<int> foreground_{0};
+    std::atomic<bool> worker_in_engine_{false};
+    std::atomic<bool> stopping_{false};
+    mutable std::atomic<bool> preempted_{false}; // The running job was told to yield
+};
+
+#endif // IDLE_SCHEDULER_H
@@ -0,0 +1,56 @@
+#ifndef JSON_PROJECTION_H
+#define JSON_PROJECTION_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+// Streaming (SAX) readers for the JSON that passes through the tool loop. They keep only
+// the values they are asked for and never build a DOM of the whole document, so a message
+// list with bodies costs one lexer pass plus the few strings that are kept.
+
+// Finds the {"tool_name": ..., "parameters": {...}} object of a tool call in `text`, which
+// is exactly that object. Only "parameters" is materialized. Returns false for anything
+// that is not valid JSON or not an object with a string "tool_name".
+bool projectToolCall(std::string_view text, std::string& tool_name, nlohmann::json& params);
+
+// Message fields a projection keeps; combine with |
+enum MessageField : unsigned {
+    kMessageId       = 1u << 0,
+    kMessageThreadId = 1u << 1,
+    kMessageFrom     = 1u << 2,
+    kMessageSubject  = 1u << 3,
+    kMessageSnippet  = 1u << 4,
+    kMessageDate     = 1u << 5,
+    kMessageLabelIds = 1u << 6,
+    kMessageError    = 1u << 7,  // Per-message "error" of a failed fetch
+};
+
+// What a listing needs in the conversation
+constexpr unsigned kMessageSummaryFields = kMessageId | kMessageFrom | kMessageSubject | kMessageSnippet |
+                                           kMessageDate | kMessageError;
+
+struct MessageSummary {
+    unsigned present = 0;  // MessageField bits of the fields the message had (and were kept)
+    std::string id;
+    std::string thread_id;
+    std::string from;
+    std::string subject;
+    std::string snippet;
+    std::string date;
+    std::vector<std::string> label_ids;
+    std::string error;
+};
+
+// Reads the messages of a listing ({"messages": [...]} as from GET /messages and
+// POST /messages/batch, or a bare array), keeping the `fields` of each and skipping
+// everything else, bodies included. Returns false if `text` is not valid JSON or not a
+// listing; an error envelope is not a listing.
+bool projectMessages(std::string_view text, unsigned fields, std::vector<MessageSummary>& messages);
+
+// Serializes summaries as {"messages": [...]}, with the fields each message had
+std::string messagesToJson(const std::vector<MessageSummary>& messages);
+
+#endif // JSON_PROJECTION_H
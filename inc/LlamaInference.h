@@ -1,87 +1,387 @@
 #ifndef LLAMA_INFERENCE_H
 #define LLAMA_INFERENCE_H
 
-#include "llama.h"
+#include "FunctionRef.h"
+#include "PerfMetrics.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <functional>
-#include <fstream>
 
-// Added includes
-#include "httplib.h"
-#include "nlohmann/json.hpp"
+#include "nlohmann/json_fwd.hpp"
+
+class IdleScheduler;
+class LlamaEngine;
+class MailboxSync;
+class MemoryStore;
+class SessionRecorder;
+
+// One message of a chat history, owned (unlike llama_chat_message)
+struct ChatMessage {
+    std::string role;    // "user", "assistant", "system" or "tool"
+    std::string content;
+};
+
+// How llama.cpp places threads and memory on NUMA systems (ggml_numa_strategy)
+enum class NumaStrategy {
+    Disabled,
+    Distribute, // Spread execution evenly over all nodes
+    Isolate,    // Only spawn threads on CPUs of the node execution started on
+    Numactl,    // Use the CPU map provided by numactl
+    Mirror,
+};
+
+// "disabled", "distribute", "isolate", "numactl" or "mirror". Returns false for anything else.
+bool parseNumaStrategy(const std::string& name, NumaStrategy& strategy);
+
+// Element type of the KV cache (a subset of ggml_type). Per element, q8_0 takes about half
+// the memory of f16 and q4_0 about a quarter, which also cuts the memory traffic of every
+// decode step at long contexts.
+enum class KvCacheType { F32, F16, BF16, Q8_0, Q5_1, Q5_0, Q4_1, Q4_0, IQ4_NL };
+
+// "f32", "f16", "bf16", "q8_0", "q5_1", "q5_0", "q4_1", "q4_0" or "iq4_nl". Returns false for anything else.
+bool parseKvCacheType(const std::string& name, KvCacheType& type);
+const char* kvCacheTypeName(KvCacheType type);
+
+// KV cache layout and attention kernel, applied by initialize()
+struct KvCacheConfig {
+    KvCacheType type_k = KvCacheType::F16;
+    KvCacheType type_v = KvCacheType::F16; // A quantized V cache requires flash attention; initialize() enables it
+    bool flash_attn = false;
+    bool offload_kqv = true; // Keep the KV cache and the attention on the GPU for offloaded layers
+};
+
+// Rolling summarization of the conversation (see LlamaInference::compactHistory). Instead of
+// letting the prompt overflow and dropping tokens after the system prompt, older turns are
+// replaced by a summary the model writes, so prefill stays bounded in long sessions.
+struct CompactionConfig {
+    bool enabled = false;
+    float trigger_ratio = 0.6f;   // Compact once the history fills this share of the prompt budget (3/4 of n_ctx)
+    int keep_recent_turns = 2;    // Latest user turns, with their tool calls and replies, kept verbatim
+    int summary_max_chars = 1500;
+};
+
+// Retrieval from long-term memory before each chat turn (see LlamaInference::setMemoryStore)
+struct MemoryConfig {
+    int top_k = 3;                // Entries recalled per turn at most
+    int token_budget = 384;       // Tokens the recalled entries may take together, header included
+    float min_similarity = 0.75f; // Embedding matches below this need a keyword match as well
+};
+
+// Background work between prompts (see LlamaInference::startIdleWork)
+struct IdleConfig {
+    int delay_ms = 1000;        // Quiet time after the last call before a job starts
+    bool compact = true;        // Compact the history after a turn (when compaction is enabled)
+    bool warm_cache = true;     // Prefill the conversation after a turn or importHistory()
+    bool index_memory = true;   // Embed new memory entries (with a memory store)
+    bool summarize_mail = true; // Summarize mail the mailbox sync brings in (with a mailbox sync)
+};
+
+// Two-model cascade (see LlamaInference::setCascadeConfig): a small model decides the tool
+// calls of chat(), constrained by a grammar to the tool catalogue, and the main model only
+// writes the replies, so the steps that merely emit tool-call JSON run at the small model's speed
+struct CascadeConfig {
+    std::string model_path;      // Small model; empty = no cascade
+    int n_gpu_layers = 0;
+    int context_size = 0;        // 0 = the main model's
+    float min_confidence = 0.6f; // Below this the main model decides the step instead
+    int max_tokens = 256;        // Longest tool call the small model may write
+
+    bool enabled() const { return !model_path.empty(); }
+};
+
+// Thread count and optional CPU pinning for one of llama.cpp's two thread pools
+struct ThreadConfig {
+    int n_threads = 0;
+    std::vector<int> cpus; // Pin one thread per listed CPU (strict affinity); empty = OS scheduling
+};
+
+// One sampler chain. Applied in this order: top-k (a cheap pre-filter that shrinks the
+// ~150k-token vocabulary of e.g. Qwen3 before the other samplers run), repetition penalty,
+// top-p, min-p, temperature, then a random pick. temperature <= 0 is greedy (argmax);
+// without a penalty that skips the other samplers altogether.
+struct SamplerProfile {
+    float temperature = 0.8f;
+    int top_k = 40;               // 0 = off
+    float top_p = 0.95f;          // 1 = off
+    float min_p = 0.05f;          // 0 = off
+    float repeat_penalty = 1.0f;  // 1 = off. The history is per chain, so completeBatch() forks share it.
+    int repeat_last_n = 64;       // Tokens the penalty looks back over (-1 = context size)
+
+    nlohmann::json toJson() const;
+    static SamplerProfile fromJson(const nlohmann::json& j); // Missing fields keep their defaults
+};
+
+// Sampling per phase of a reply. Every generation starts with `reply`; once the reply
+// turns out to be a tool call (its first character after any <think> block is '{'),
+// the rest is sampled with `tool_call`, by default greedy, so tool JSON is deterministic
+// and cheap to sample.
+struct SamplerConfig {
+    SamplerProfile reply;
+    SamplerProfile tool_call = greedyProfile();
+
+    static SamplerProfile greedyProfile() {
+        SamplerProfile p;
+        p.temperature = 0.0f;
+        return p;
+    }
+    nlohmann::json toJson() const;
+    static SamplerConfig fromJson(const nlohmann::json& j);
+};
 
+// Public API of maimail_core: a local llama.cpp model with the Gmail tool loop. This
+// header deliberately includes neither llama.h nor httplib nor the full nlohmann/json;
+// the implementation lives in LlamaEngine. Calls are serialized internally; the metrics
+// getters, describeConfig() and reconfigure() can be used from another thread while a
+// call is running (EngineServer additionally queues requests in arrival order).
 class LlamaInference {
 public:
+    // Performs one tool HTTP request and returns the response body (or an {"error": ...} envelope)
+    using ToolTransport = std::function<std::string(const std::string& http_method,
+                                                    const std::string& endpoint,
+                                                    const nlohmann::json& params)>;
+
+    // Receives the fraction (0..1) of model weights loaded so far; return false to abort the load
+    using LoadProgressCallback = std::function<bool(float progress)>;
+
+    // setSeed() value that picks a random seed (LLAMA_DEFAULT_SEED)
+    static constexpr uint32_t kRandomSeed = 0xFFFFFFFF;
+
     // Constructor with configuration options
-    LlamaInference(const std::string& model_path, 
-                   int n_gpu_layers, 
-                   int context_size, 
+    LlamaInference(const std::string& model_path,
+                   int n_gpu_layers,
+                   int context_size,
                    const std::string& gmail_service_addr,
-                   int num_threads_generate = 4, 
+                   int num_threads_generate = 4,
                    int num_threads_batch = 4);
-    
+
     // Destructor to clean up resources
     ~LlamaInference();
-    
-    // Initialize the model, context, and sampler
+
+    LlamaInference(const LlamaInference&) = delete;
+    LlamaInference& operator=(const LlamaInference&) = delete;
+
+    // Initialize the model, context, and sampler. Blocks for the whole model load (and the
+    // warm-up decode); run it on a background thread to keep a UI responsive, with
+    // setLoadProgressCallback() for feedback. Returns false on failure or abort.
     bool initialize();
-    
+
     // Set system prompt to guide the model's behavior
     void setSystemPrompt(const std::string& system_prompt);
-    
+
     // Generate a response for a given prompt, with optional streaming
-    std::string generate(const std::string& prompt, bool stream_output, std::string& output_string, std::function<void()> redraw_ui);
-    
-    // Generate with a custom callback for each token
+    std::string generate(const std::string& prompt, bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui);
+
+    // Generate with a callback for each piece of text as it is sampled. Pieces are complete
+    // UTF-8 (bytes of a character split across tokens are held back until it is whole) and
+    // the view is only valid during the callback. Nothing is allocated per token.
     std::string generateWithCallback(
-        const std::string& prompt, 
-        std::function<void(const std::string&)> token_callback
+        const std::string& prompt,
+        FunctionRef<void(std::string_view)> token_callback
     );
-    
+
+    // One-shot completion outside the chat history: formats {system, user} with the chat
+    // template and generates at most max_chars. Consecutive calls with the same system
+    // prompt reuse its KV cache entries, so only the user message is prefilled.
+    std::string completeOnce(const std::string& system_prompt, const std::string& user_message, int max_chars);
+
+    // completeOnce() for many user messages under one system prompt. The shared prompt
+    // prefix is prefilled once into sequence 0 and forked into up to setParallelSequences()
+    // sequences, which prefill only their own tokens and then decode together, one token
+    // per fork per llama_decode. Each fork samples with its own chain, seeded from the seed
+    // and the message's index. Prompts too long to fork are completed one at a time after
+    // the rest. Outputs are in input order.
+    std::vector<std::string> completeBatch(const std::string& system_prompt,
+                                           const std::vector<std::string>& user_messages,
+                                           int max_chars);
+
+    // Score a fixed set of candidate answers to {system, user} straight from the logits,
+    // without sampling: each label's log-probability (summed over its tokens, so multi-token
+    // labels work) as the start of the reply, normalized into a distribution over the labels.
+    // One prefill per call, plus one short decode per multi-token label; the system prompt's
+    // cache entries are reused like completeOnce(). Labels are scored exactly as given (mind
+    // leading spaces). `answer_prefix` is appended after the generation prompt, e.g. an
+    // empty reasoning block for thinking models. Returns probabilities parallel to `labels`,
+    // empty on failure.
+    std::vector<double> classify(const std::string& system_prompt, const std::string& user_message,
+                                 const std::vector<std::string>& labels, const std::string& answer_prefix = "");
+
+    // Number of tokens `text` encodes to (special tokens parsed), 0 before initialize().
+    // Does not wait for a running call.
+    int countTokens(const std::string& text) const;
+
     // Chat functionality with message history, with optional streaming
-    std::string chat(const std::string& user_message, bool stream_output, std::string& output_string, std::function<void()> redraw_ui);
-    
+    std::string chat(const std::string& user_message, bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui);
+
     // Reset the chat history (keeps system prompt)
     void resetChat();
-    
+
+    // The chat history after the system prompt, for parking a conversation and resuming it
+    // later with importHistory(). Several conversations can share one loaded model this way;
+    // the KV cache keeps the common system-prompt prefix when switching between them.
+    std::vector<ChatMessage> exportHistory() const;
+    void importHistory(const std::vector<ChatMessage>& history);
+
+    // Rolling summarization. With config.enabled, chat() compacts before a turn once the
+    // history has crossed the trigger; front ends call compactHistory() while the user is
+    // idle (startIdleWork() does) so that work is usually done before the next message arrives.
+    void setCompactionConfig(const CompactionConfig& config);
+    // Replace the turns before the last keep_recent_turns (and any earlier summary) with one
+    // summary message written by the model, then prefill the compacted conversation so the
+    // next turn only prefills its own message. Only when compaction is enabled and the
+    // history crossed the trigger, unless `force`. Returns true if the history changed.
+    bool compactHistory(bool force = false);
+
+    // Remember tool results and answered questions in `store`, and before each chat() turn
+    // recall the entries most relevant to the user message that are no longer in the
+    // conversation, as one system message within config.token_budget. nullptr to stop. Not owned.
+    void setMemoryStore(MemoryStore* store, const MemoryConfig& config = MemoryConfig());
+    // Embed up to `max_entries` memory entries that have no embedding for this model yet and
+    // return how many were embedded. chat() embeds a few before its lookup; front ends call
+    // this while the user is idle (startIdleWork() does) so that lookup only has to embed the query.
+    int indexMemory(int max_entries = 16);
+
+    // Mean-pooled, L2-normalized embedding of each text (empty vector for a text that
+    // fails). Uses a second context on the same model weights, created on first use.
+    std::vector<std::vector<float>> embed(const std::vector<std::string>& texts);
+
+    // Use the time between prompts. Once started, a worker thread runs low-priority jobs
+    // whenever no call has been made for config.delay_ms: after each chat() turn it compacts
+    // the history, embeds new memory entries and prefills the conversation into the KV cache,
+    // and it summarizes mail as the mailbox sync brings it in. Any call on this object
+    // preempts the running job, which gives the context up within one decode step (a CPU
+    // decode is aborted mid-graph) and is resumed in the next idle period. Call after
+    // initialize() and the set*() calls; stopIdleWork() before the mailbox sync or memory
+    // store go away.
+    void startIdleWork(const IdleConfig& config = IdleConfig());
+    void stopIdleWork();
+    bool idleWorkRunning() const;
+    // The scheduler, for jobs of one's own (IdleScheduler.h). A job uses this object like
+    // any other caller and is preempted the same way.
+    IdleScheduler& idleScheduler();
+    // Write a one-line summary (category, topic, requested action) for up to `max_messages`
+    // mailbox sync messages that have none; list_new_messages answers carry them. Returns
+    // how many were written.
+    int summarizeNewMail(int max_messages = 4);
+    // Decode the formatted conversation into the KV cache now, so the next chat() only
+    // prefills its own message
+    void warmCache();
+
+    // Replace the model and/or context while the current engine keeps serving. The new
+    // engine is loaded on the calling thread (a context change alone reuses the loaded
+    // weights), the conversation is migrated between two calls (KV cache copied when the
+    // weights are shared, otherwise prefilled ahead of the swap) and the engines are swapped.
+    // Empty / 0 / -1 keep the current model path, context size and GPU layers. Both engines
+    // are resident during the switch. Returns false, keeping the current engine, if the new
+    // one fails to initialize.
+    bool reconfigure(const std::string& model_path, int context_size = 0, int n_gpu_layers = -1);
+
     // Set parameters
+    // Context size and GPU layers are applied by initialize(); afterwards use reconfigure()
     void setContextSize(int n_ctx);
     void setGpuLayers(int ngl);
     void setMaxResponseChars(int max_chars);
-    
+    // Logical batch size for prompt processing (0 = context size). Applied by initialize().
+    void setBatchSize(int n_batch);
+    // Sequences completeBatch() may fork off the shared prefix (0 = no forking). Applied by initialize().
+    void setParallelSequences(int n_parallel);
+    // Load a small model next to the main one, with the same threads, KV cache and load
+    // options. Each step of the tool loop first asks it for the next tool call, or for
+    // ANSWER when the results so far suffice; its call is taken when its confidence reaches
+    // config.min_confidence. Confidence only counts the tokens where the grammar left a
+    // choice, each scored among the tokens it allowed: the probability of the chosen tool
+    // or the geometric mean over the parameters, whichever is lower. Otherwise, and for
+    // every reply, the main model generates as it would without the cascade. Applied by initialize() and kept across reconfigure().
+    void setCascadeConfig(const CascadeConfig& config);
+    // KV cache types, flash attention and KV offload. Applied by initialize(); the resulting
+    // cache size is reported in describeConfig()["kv_cache"]["bytes"].
+    void setKvCacheConfig(const KvCacheConfig& config);
+    // Map the model file instead of reading it (default on). With mmap, weights are paged in
+    // on first use, so the first prompt pays for them unless warm-up is enabled.
+    void setUseMmap(bool use_mmap);
+    // Lock the model weights in RAM so they are never swapped out (default off)
+    void setUseMlock(bool use_mlock);
+    // NUMA placement; initialized once per process, by the first initialize() (default Disabled)
+    void setNumaStrategy(NumaStrategy strategy);
+    // Run one throwaway decode at the end of initialize() so weights are faulted in and the
+    // thread pools started before the first real prompt (default on)
+    void setWarmup(bool warmup);
+    // Called on the thread running initialize() while weights load (nullptr for none)
+    void setLoadProgressCallback(LoadProgressCallback callback);
+    // Threads for single-token decode and for prompt batches (prefill). Replaces the thread
+    // counts given to the constructor; takes effect immediately on an initialized engine.
+    void setThreadConfig(const ThreadConfig& generate, const ThreadConfig& batch);
+    // Decode `n_prefill` tokens as one batch, then `n_decode` tokens one at a time, and
+    // report both rates in tokens/s. Uses (and clears) sequence 0. For ThreadTuner.
+    bool measureThroughput(int n_prefill, int n_decode, double& prefill_tps, double& decode_tps);
+    // Sampler profiles; take effect immediately. The seed is set separately (setSeed).
+    void setSamplerConfig(const SamplerConfig& config);
+    SamplerConfig getSamplerConfig() const;
+    // Sampler seed. kRandomSeed (the default) picks a random seed; the one in use is
+    // reported by getSeed(). Can be changed after initialize().
+    void setSeed(uint32_t seed);
+    uint32_t getSeed() const;
+
+    // Route tool requests through `transport` instead of HTTP to the Gmail microservice
+    // (nullptr restores the default). Used by session replay.
+    void setToolTransport(ToolTransport transport);
+    // Start read-only tool requests while the model is still generating the call, and
+    // get_message_content for the first `follow_up_ids` results of list_messages. On by
+    // default; never active while a tool transport is set.
+    void setToolPrefetch(bool enabled, int follow_up_ids = 3);
+    // Fetch get_message_content in Gmail's raw format and decode the MIME parts natively
+    // (base64, quoted-printable, multipart) instead of in the Python service. Off by default.
+    void setNativeMime(bool enabled);
+    // Give the model only id, from, subject, date and snippet of each message listed by
+    // list_messages / list_new_messages (read with a SAX projection, without a DOM). Fewer
+    // prompt tokens per listing; labelIds and threadId are dropped. Off by default.
+    void setProjectToolResults(bool enabled);
+    // Answer the list_new_messages tool from a background mailbox sync (nullptr: over HTTP).
+    // Not owned; must outlive its use here.
+    void setMailboxSync(MailboxSync* mailbox);
+    // Record user messages, prompts, sampled tokens and tool traffic (nullptr to stop). Not owned.
+    void setSessionRecorder(SessionRecorder* recorder);
+    // Model path, seed, context/batch sizes, KV cache, threads, load options and timings and
+    // system prompt, for session_start records and reports. A snapshot taken whenever a
+    // setting changes, so reading it never waits for a running call.
+    nlohmann::json describeConfig() const;
+
+    // Performance telemetry
+    // Metrics of the most recently completed chat() turn (safe to call from another thread)
+    TurnMetrics getLastTurnMetrics() const;
+    // Metrics of the most recent generateWithCallback() pass
+    GenerationMetrics getLastGenerationMetrics() const;
+    // Append one JSON line per completed turn to this file (empty path disables)
+    bool setMetricsFile(const std::string& path);
+
 private:
-    // Configuration
-    std::string model_path_;
-    int n_gpu_layers_;
-    int context_size_;
-    int max_response_chars_ = 2048; // Default max response length
-    int num_threads_generate_;
-    int num_threads_batch_;
-    std::string system_prompt_;
-    std::string gmail_microservice_address_; // Will be set by constructor
-    std::ofstream debug_log_file_;
-    
-    // LLAMA resources
-    llama_model* model_ = nullptr;
-    llama_context* ctx_ = nullptr;
-    llama_sampler* sampler_ = nullptr;
-    const llama_vocab* vocab_ = nullptr;
-    int n_past_ = 0;
-    
-    // Chat history
-    std::vector<llama_chat_message> messages_;
-    std::vector<char> formatted_;
-    int prev_len_ = 0;
-    
-    // Initialize chat with system prompt
-    void initializeChat();
-    
-    // Helper to make HTTP POST/GET requests for tools
-    std::string make_tool_request(const std::string& method, const std::string& endpoint, const nlohmann::json& params);
-
-    // Clean up resources
-    void cleanup();
+    // Holds call_mutex_ for one call. Unless taken on the idle worker, it preempts the idle
+    // job first and counts as activity that postpones idle work.
+    class CallLock;
+
+    // The engine in use, for the calls that do not take call_mutex_
+    std::shared_ptr<LlamaEngine> current() const;
+
+    // Queue the idle jobs that follow a turn (after_turn) or a change of conversation
+    void submitIdleJobs(bool after_turn);
+    void submitWarmCache();
+    void submitMailSummaries();
+
+    // reconfigure() replaces engine_ holding both mutexes; readers hold either one. A
+    // replaced engine lives until the last shared_ptr to it is dropped.
+    mutable std::mutex engine_mutex_;
+    std::shared_ptr<LlamaEngine> engine_;
+    // Held for every call that uses the context or the conversation, so a swap always
+    // happens between calls
+    mutable std::mutex call_mutex_;
+    std::mutex reconfigure_mutex_; // One reconfigure() at a time
+
+    std::unique_ptr<IdleScheduler> idle_;
+    IdleConfig idle_config_;            // Set by startIdleWork() while the worker is stopped
+    MailboxSync* mailbox_ = nullptr;    // Not owned; notifies submitMailSummaries()
 };
 
 #endif // LLAMA_INFERENCE_H
@@ -0,0 +1,157 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Compile-time log levels. Any LOG_* statement below MAIMAIL_LOG_LEVEL compiles to dead
+// code: its arguments are still type-checked against the format but never evaluated.
+// Set from CMake (-DMAIMAIL_LOG_LEVEL=DEBUG).
+#define MAIMAIL_LOG_LEVEL_TRACE 0
+#define MAIMAIL_LOG_LEVEL_DEBUG 1
+#define MAIMAIL_LOG_LEVEL_INFO  2
+#define MAIMAIL_LOG_LEVEL_WARN  3
+#define MAIMAIL_LOG_LEVEL_ERROR 4
+#define MAIMAIL_LOG_LEVEL_OFF   5
+
+#ifndef MAIMAIL_LOG_LEVEL
+#define MAIMAIL_LOG_LEVEL MAIMAIL_LOG_LEVEL_DEBUG
+#endif
+
+enum class LogLevel : uint8_t {
+    Trace = MAIMAIL_LOG_LEVEL_TRACE,
+    Debug = MAIMAIL_LOG_LEVEL_DEBUG,
+    Info  = MAIMAIL_LOG_LEVEL_INFO,
+    Warn  = MAIMAIL_LOG_LEVEL_WARN,
+    Error = MAIMAIL_LOG_LEVEL_ERROR,
+};
+
+// Parses "trace", "debug", "info", "warn" or "error". Returns false for anything else.
+bool parseLogLevel(const std::string& name, LogLevel& level);
+
+// Process-wide asynchronous logger writing JSON lines.
+//
+// Producers format their message straight into a slot of a fixed-size, lock-free
+// ring buffer (bounded MPMC queue, one sequence number per slot) and return; they
+// never take a lock, allocate or touch the file. A single writer thread drains the
+// ring and writes through a large stdio buffer, flushing only when the ring runs
+// dry (or on warnings/errors). If the ring is full the record is dropped and
+// counted rather than blocking the caller.
+class Logger {
+public:
+    static Logger& instance();
+
+    // Open (append) the log file and start the writer thread. Calling open() again
+    // closes the previous file first.
+    bool open(const std::string& path);
+
+    // Drain everything still queued, stop the writer thread and close the file.
+    void close();
+
+    // Runtime threshold on top of the compile-time one.
+    void setLevel(LogLevel level) { level_.store(static_cast<uint8_t>(level), std::memory_order_relaxed); }
+
+    bool enabled(LogLevel level) const {
+        return running_.load(std::memory_order_acquire) &&
+               static_cast<uint8_t>(level) >= level_.load(std::memory_order_relaxed);
+    }
+
+    // printf-style. `component` must be a string literal (only the pointer is queued).
+    void log(LogLevel level, const char* component, const char* fmt, ...)
+#if defined(__GNUC__) || defined(__clang__)
+        __attribute__((format(printf, 4, 5)))
+#endif
+        ;
+
+    // Number of records dropped because the ring was full.
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+    ~Logger();
+
+private:
+    Logger() = default;
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    static constexpr size_t kRingSize = 4096; // Must be a power of two
+    static constexpr size_t kMaxMessage = 480; // Longer messages are truncated
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        int64_t timestamp_us;
+        uint32_t thread_id;
+        LogLevel level;
+        bool truncated;
+        uint16_t length;
+        const char* component;
+        char message[kMaxMessage];
+    };
+
+    void writerLoop();
+    bool drainOnce(); // Returns true if at least one record was written
+    void writeRecord(const Slot& slot);
+    bool reportDrops(uint64_t& reported_drops); // Returns true if a drop notice was written
+
+    std::unique_ptr<Slot[]> ring_;
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<size_t> dequeue_pos_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint8_t> level_{static_cast<uint8_t>(MAIMAIL_LOG_LEVEL)};
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stop_requested_{false};
+    std::atomic<bool> urgent_flush_{false};
+    std::thread writer_;
+    std::FILE* file_ = nullptr;
+    std::string line_; // Writer-thread scratch buffer, reused between records
+};
+
+#define MAIMAIL_LOG_AT(lvl, component, ...)                              \
+    do {                                                                 \
+        if (Logger::instance().enabled(lvl)) {                           \
+            Logger::instance().log(lvl, component, __VA_ARGS__);         \
+        }                                                                \
+    } while (0)
+
+#define MAIMAIL_LOG_OFF(lvl, component, ...)                             \
+    do {                                                                 \
+        if (false) {                                                     \
+            Logger::instance().log(lvl, component, __VA_ARGS__);         \
+        }                                                                \
+    } while (0)
+
+#if MAIMAIL_LOG_LEVEL <= MAIMAIL_LOG_LEVEL_TRACE
+#define LOG_TRACE(component, ...) MAIMAIL_LOG_AT(LogLevel::Trace, component, __VA_ARGS__)
+#else
+#define LOG_TRACE(component, ...) MAIMAIL_LOG_OFF(LogLevel::Trace, component, __VA_ARGS__)
+#endif
+
+#if MAIMAIL_LOG_LEVEL <= MAIMAIL_LOG_LEVEL_DEBUG
+#define LOG_DEBUG(component, ...) MAIMAIL_LOG_AT(LogLevel::Debug, component, __VA_ARGS__)
+#else
+#define LOG_DEBUG(component, ...) MAIMAIL_LOG_OFF(LogLevel::Debug, component, __VA_ARGS__)
+#endif
+
+#if MAIMAIL_LOG_LEVEL <= MAIMAIL_LOG_LEVEL_INFO
+#define LOG_INFO(component, ...) MAIMAIL_LOG_AT(LogLevel::Info, component, __VA_ARGS__)
+#else
+#define LOG_INFO(component, ...) MAIMAIL_LOG_OFF(LogLevel::Info, component, __VA_ARGS__)
+#endif
+
+#if MAIMAIL_LOG_LEVEL <= MAIMAIL_LOG_LEVEL_WARN
+#define LOG_WARN(component, ...) MAIMAIL_LOG_AT(LogLevel::Warn, component, __VA_ARGS__)
+#else
+#define LOG_WARN(component, ...) MAIMAIL_LOG_OFF(LogLevel::Warn, component, __VA_ARGS__)
+#endif
+
+#if MAIMAIL_LOG_LEVEL <= MAIMAIL_LOG_LEVEL_ERROR
+#define LOG_ERROR(component, ...) MAIMAIL_LOG_AT(LogLevel::Error, component, __VA_ARGS__)
+#else
+#define LOG_ERROR(component, ...) MAIMAIL_LOG_OFF(LogLevel::Error, component, __VA_ARGS__)
+#endif
+
+#endif // LOGGER_H
@@ -0,0 +1,137 @@
+#ifndef MAILBOX_SYNC_H
+#define MAILBOX_SYNC_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GmailClient.h"
+#include "nlohmann/json.hpp"
+
+struct MailboxSyncOptions {
+    int min_interval_ms = 15000;    // Poll interval right after a change
+    int max_interval_ms = 300000;   // The interval doubles up to this while nothing changes
+    int seed_messages = 200;        // Inbox messages listed when there is no usable history ID
+    int max_messages = 1000;        // Newest inbox messages kept; older ones are dropped
+    int snippet_chars = 240;
+    int answer_token_budget = 2000; // Snippet tokens in one list_new_messages answer
+    std::string snapshot_path = "maimail_mailbox.json"; // Empty keeps the mailbox in memory only
+};
+
+// Keeps a local model of the inbox up to date in the background, so "what's new" is
+// answered without a cold Gmail scan. The first sync lists the newest inbox messages; after
+// that one worker thread polls GET /history from the last history ID and applies the
+// deltas: added messages are fetched (metadata only, one POST /messages/batch per poll),
+// deleted and archived ones are dropped, label changes are applied. Snippets are cut and
+// their token counts computed as messages arrive, so an answer can be sized to a token
+// budget without tokenizing anything on the chat thread.
+//
+// The poll interval adapts: it drops to min_interval_ms after a change and doubles while
+// nothing changes. The worker runs at idle priority, so it only gets CPU time the decode
+// threads leave unused. The model is saved to snapshot_path after every change and loaded
+// on start, so a restart continues from the saved history ID instead of listing again.
+class MailboxSync {
+public:
+    // Tokens `text` encodes to in the chat model; 0 if the model is not loaded yet
+    using TokenCounter = std::function<int(const std::string& text)>;
+    // Called on the worker after a sync that changed the mailbox
+    using ChangeCallback = std::function<void()>;
+
+    MailboxSync(const std::string& gmail_service_addr, MailboxSyncOptions options);
+    ~MailboxSync();
+
+    MailboxSync(const MailboxSync&) = delete;
+    MailboxSync& operator=(const MailboxSync&) = delete;
+
+    // Set before start(). Messages that arrive while the counter returns 0 are counted later.
+    void setTokenCounter(TokenCounter counter);
+    // May be replaced at any time (nullptr for none)
+    void setChangeCallback(ChangeCallback callback);
+
+    // Loads the snapshot, if any, and starts the worker
+    void start();
+    void stop();
+
+    // Poll now instead of at the end of the interval, e.g. after a tool changed the mailbox
+    void syncNow();
+
+    // Whether a sync has completed since start(), i.e. newest() reflects the mailbox
+    bool ready() const;
+
+    // Newest inbox messages first, in the shape of GET /messages: {"messages": [{id, threadId,
+    // from, subject, date, snippet, labelIds}], ...}. Stops at `max_results` messages or when
+    // the snippets reach answer_token_budget tokens. `unread_only` keeps UNREAD messages.
+    // Messages summarized by setSummaries() carry a "summary" as well.
+    nlohmann::json newest(int max_results, bool unread_only) const;
+
+    // Messages without a summary yet, newest first, at most `max`: (message ID, sender,
+    // subject and snippet as text to summarize)
+    std::vector<std::pair<std::string, std::string>> pendingSummaries(size_t max) const;
+    // One-line summaries by message ID, kept with the messages and in the snapshot
+    void setSummaries(const std::vector<std::pair<std::string, std::string>>& summaries);
+
+    // Message count, history ID, last sync time and poll counters
+    nlohmann::json stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string id;
+        std::string thread_id;
+        std::string from;
+        std::string subject;
+        std::string date;
+        std::string snippet;
+        std::vector<std::string> label_ids;
+        int64_t internal_date = 0; // Milliseconds since the epoch, as Gmail orders messages
+        int tokens = -1;           // Of from, subject and snippet; -1 until counted
+        std::string summary;       // Written while the user is idle; empty until then
+    };
+
+    void run();
+    // Full listing of the inbox. Returns false on failure with `error` set.
+    bool seed(std::string& error);
+    // One GET /history pass from history_id_ (all pages). `expired` is set when Gmail no
+    // longer has that history ID and the mailbox has to be listed again.
+    bool poll(bool& changed, bool& expired, std::string& error);
+    // Metadata of `ids`, with snippets cut and tokens counted
+    bool fetchEntries(const std::vector<std::string>& ids, std::vector<Entry>& entries, std::string& error);
+    void countTokens(Entry& entry) const;
+    void recountMissing();
+    void trimLocked();
+
+    void loadSnapshot();
+    void saveSnapshot() const;
+
+    static nlohmann::json toJson(const Entry& entry);
+    static Entry fromJson(const nlohmann::json& j);
+
+    GmailClient client_;
+    MailboxSyncOptions options_;
+    TokenCounter count_tokens_;
+
+    std::mutex callback_mutex_; // Guards on_change_; held while it runs
+    ChangeCallback on_change_;
+    mutable std::mutex save_mutex_; // One saveSnapshot() at a time (sync worker and setSummaries())
+
+    mutable std::mutex mutex_; // Guards everything below; never held across a request
+    std::condition_variable wake_;
+    bool stop_ = false;
+    bool wake_requested_ = false;
+    bool ready_ = false;
+    std::string history_id_;
+    std::map<std::string, Entry> entries_; // By message ID
+    Clock::time_point last_sync_{};
+    uint64_t polls_ = 0;
+    uint64_t poll_errors_ = 0;
+    std::thread worker_;
+};
+
+#endif // MAILBOX_SYNC_H
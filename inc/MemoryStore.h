@@ -0,0 +1,126 @@
+#ifndef MEMORY_STORE_H
+#define MEMORY_STORE_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct MemoryStoreOptions {
+    std::string path = "maimail_memory.jsonl"; // Empty keeps the memory in this process only
+    size_t max_entries = 5000;                 // Oldest entries are forgotten beyond this
+};
+
+// One remembered piece of an earlier conversation
+struct MemoryEntry {
+    uint64_t id = 0;            // Never reused
+    int64_t time_ms = 0;        // Wall-clock time it was added (milliseconds since the epoch)
+    std::string kind;           // "turn" (a question and its answer) or "tool" (a tool result)
+    std::string key;            // A newer entry with the same non-empty key replaces this one
+    std::string text;
+    uint64_t source_hash = 0;   // memoryHash() of the chat message it was taken from
+    std::vector<float> embedding; // L2-normalized; empty until embedded with the current model
+};
+
+struct MemoryHit {
+    MemoryEntry entry;          // Without the embedding
+    double score = 0.0;         // Reciprocal-rank fusion of both rankings
+    double similarity = 0.0;    // Cosine similarity to the query; 0 if either is not embedded
+    double keyword_score = 0.0; // BM25
+};
+
+struct MemoryQuery {
+    std::string text;
+    std::vector<float> embedding;    // Of `text`; empty for a keyword-only lookup
+    size_t k = 3;
+    float min_similarity = 0.75f;    // Embedding matches below this only count with a keyword match
+    std::unordered_set<uint64_t> exclude_ids;
+    std::unordered_set<uint64_t> exclude_sources; // Entries taken from these messages (memoryHash)
+};
+
+// Stable 64-bit FNV-1a hash of a chat message, to recognize what is still in the context
+uint64_t memoryHash(const std::string& text);
+
+// Long-term memory of past turns and tool results, searched before each chat turn so the
+// model gets back what has left its context instead of calling the same tools again.
+//
+// Entries are indexed twice: an inverted keyword index scored with BM25, and embeddings
+// (from LlamaInference::embed(), filled in after the fact) compared by dot product. Both
+// rankings are fused by reciprocal rank. Everything is kept in memory, so a lookup over a
+// few thousand entries stays well under a millisecond; the query embedding is the caller's.
+//
+// The file is an append-only JSON-lines log of "entry" and "embedding" records, replayed
+// on open() (replacements and the entry limit apply again) and rewritten there when most
+// of it is dead. Embeddings are tagged with the embedding model; entries embedded by
+// another model are embedded again.
+class MemoryStore {
+public:
+    explicit MemoryStore(MemoryStoreOptions options = MemoryStoreOptions());
+    ~MemoryStore();
+
+    MemoryStore(const MemoryStore&) = delete;
+    MemoryStore& operator=(const MemoryStore&) = delete;
+
+    // Loads options.path, if it exists, and appends to it from then on. Returns false if
+    // the file cannot be written; the store still works in memory.
+    bool open();
+    void close();
+
+    // Identifies the embeddings setEmbedding() will be given (model path and size)
+    void setEmbeddingModel(const std::string& model);
+
+    // Adds an entry and returns its ID. An entry with the same non-empty key is replaced.
+    uint64_t add(const std::string& kind, const std::string& key, const std::string& text, uint64_t source_hash);
+
+    // Entries still to be embedded with the current model, newest first, at most `max`
+    std::vector<std::pair<uint64_t, std::string>> pendingEmbeddings(size_t max) const;
+    // `model` is the setEmbeddingModel() ID of the model that computed the embedding, which
+    // may have been replaced meanwhile; it is then embedded again
+    void setEmbedding(uint64_t id, const std::vector<float>& embedding, const std::string& model);
+
+    // Best `query.k` entries, best first. Entries without a keyword match need
+    // query.min_similarity to the query embedding.
+    std::vector<MemoryHit> search(const MemoryQuery& query) const;
+
+    size_t size() const;
+
+private:
+    struct Posting {
+        uint32_t slot;
+        uint32_t count;
+    };
+    struct Slot {
+        MemoryEntry entry;
+        std::string embedding_model; // Model entry.embedding came from
+        bool live = false;
+        uint32_t n_terms = 0;
+    };
+
+    // Caller holds mutex_
+    void insertLocked(MemoryEntry entry);
+    void forgetLocked(uint32_t slot);
+    // Drop dead slots and re-index the live ones
+    void rebuildLocked();
+    void appendRecord(const std::string& line);
+    void rewriteLog();
+
+    static std::vector<std::string> terms(const std::string& text);
+
+    MemoryStoreOptions options_;
+    mutable std::mutex mutex_;
+    std::ofstream log_;
+    std::string embedding_model_;
+    uint64_t next_id_ = 1;
+    std::vector<Slot> slots_;                          // In insertion order, including dead (replaced) entries
+    std::unordered_map<uint64_t, uint32_t> by_id_;     // Live entries
+    std::unordered_map<std::string, uint32_t> by_key_; // Live entries with a key
+    std::unordered_map<std::string, std::vector<Posting>> index_; // Term -> slots (dead ones skipped at search)
+    size_t live_ = 0;
+    uint64_t live_terms_ = 0;                          // For BM25's average entry length
+    size_t log_records_ = 0;
+};
+
+#endif // MEMORY_STORE_H
@@ -0,0 +1,69 @@
+#ifndef MIME_PARSER_H
+#define MIME_PARSER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Decodes base64 in either alphabet (standard "+/" or URL-safe "-_", as Gmail's raw format
+// uses), appending the bytes to `out`. Padding is optional and whitespace is skipped, so
+// line-wrapped MIME bodies decode as they are. Runs of 16 clean characters are decoded
+// with SSSE3 where the CPU has it (checked at run time), the rest with a lookup table.
+// Returns false on a character outside both alphabets, leaving `out` as it was.
+bool base64UrlDecode(std::string_view in, std::string& out);
+
+// Whether base64UrlDecode() may use SSSE3 when the CPU has it (the default). Turned off by
+// tests/mime_base64_test.cpp to check the SIMD blocks against the table decoder.
+void setBase64Simd(bool enabled);
+
+// Decodes quoted-printable text (RFC 2045), appending to `out`: =XX escapes and soft line
+// breaks. Malformed escapes are kept literally, as mail clients do.
+void quotedPrintableDecode(std::string_view in, std::string& out);
+
+// A leaf entity of a MIME message. The views point into the buffer given to MimeMessage.
+struct MimePart {
+    std::string_view headers;       // Raw header block
+    std::string_view body;          // Still transfer-encoded
+    std::string content_type;       // Lowercase type/subtype; text/plain if absent
+    std::string charset;            // Lowercase; empty if absent
+    std::string transfer_encoding;  // Lowercase; empty means 7bit
+    std::string filename;
+    bool attachment = false;        // Content-Disposition: attachment, or a filename was given
+};
+
+// RFC 822 / MIME message walked in place: headers and parts are views into `message`,
+// which must outlive this object. Only the part that is asked for is decoded, so
+// attachments and the HTML alternative of a newsletter cost a scan, not a decode.
+class MimeMessage {
+public:
+    explicit MimeMessage(std::string_view message);
+
+    // First header called `name` (case-insensitive), unfolded, with RFC 2047 encoded words
+    // decoded; empty if absent
+    std::string header(std::string_view name) const;
+
+    // Leaf parts in document order (multiparts are walked, up to a nesting limit)
+    const std::vector<MimePart>& parts() const { return parts_; }
+
+    // The first inline text/plain part, else the first inline text/html part, decoded to
+    // UTF-8. Empty if there is neither.
+    std::string bodyText() const;
+
+    // Transfer-decodes a part and converts Latin-1 and Windows-1252 charsets to UTF-8
+    static std::string decodeBody(const MimePart& part);
+
+private:
+    void walk(std::string_view headers, std::string_view body, int depth);
+
+    std::string_view headers_;
+    std::vector<MimePart> parts_;
+};
+
+// Turns a GET /messages/{id}?format=raw response ({"id", "threadId", "snippet", ..., "raw"})
+// into the get_message_content shape ({"id", "threadId", "from", "subject", "snippet", "body"},
+// plus "attachments" when there are any). The raw message is decoded straight from the
+// response buffer; only the small metadata around it goes through the JSON parser.
+// Returns false if the response has no usable "raw" field.
+bool rawMessageToContent(const std::string& response, std::string& content);
+
+#endif // MIME_PARSER_H
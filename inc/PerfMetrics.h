@@ -0,0 +1,111 @@
+#ifndef PERF_METRICS_H
+#define PERF_METRICS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json_fwd.hpp"
+
+using PerfClock = std::chrono::steady_clock;
+
+// Milliseconds elapsed between two steady_clock points (end defaults to now)
+inline double elapsedMs(PerfClock::time_point start, PerfClock::time_point end = PerfClock::now()) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Heap allocations made so far on the calling thread. Only binaries that replace operator
+// new to call countThreadAllocation() count them (bench does); elsewhere this stays 0.
+uint64_t threadAllocationCount();
+void countThreadAllocation();
+
+// One round trip to the Gmail microservice
+struct ToolCallMetrics {
+    std::string tool_name;
+    std::string http_method;
+    double http_ms = 0.0;          // Wall time of the GmailClient request
+    size_t response_bytes = 0;     // Bytes injected into the conversation as the "tool" message
+    bool error = false;            // Transport error or non-2xx status
+    bool prefetched = false;       // Served by ToolPrefetcher; http_ms is then the wait, if any
+    double parse_us = 0.0;         // Parsing the tool call out of the reply plus reading the response
+    uint64_t parse_allocations = 0; // Heap allocations of the same (see threadAllocationCount)
+};
+
+// One generateWithCallback() pass: prompt ingestion followed by token generation
+struct GenerationMetrics {
+    int prompt_tokens = 0;         // Tokens in the full formatted prompt
+    int reused_tokens = 0;         // Prompt tokens already in the KV cache (not decoded again)
+    int prefill_tokens = 0;        // Prompt tokens actually decoded
+    int generated_tokens = 0;      // Sampled tokens (excluding the end-of-generation token)
+    int context_shifts = 0;        // Times old tokens were evicted to make room
+    double tokenize_ms = 0.0;
+    double prefill_ms = 0.0;
+    double decode_ms = 0.0;        // Time spent in llama_decode for generated tokens
+    double sample_ms = 0.0;        // Sampler chain time (llama_perf_sampler)
+    double ttft_ms = 0.0;          // From entry to the first sampled token
+    double total_ms = 0.0;
+
+    // Raw llama_perf_context deltas over this pass, for cross-checking the wall-clock numbers
+    double perf_prompt_eval_ms = 0.0;
+    double perf_eval_ms = 0.0;
+    int perf_prompt_eval_tokens = 0;
+    int perf_eval_tokens = 0;
+
+    double prefillTokensPerSecond() const;
+    double decodeTokensPerSecond() const;
+    nlohmann::json toJson() const;
+};
+
+// The small model's pass of a model cascade (see LlamaInference::setCascadeConfig)
+struct RouteMetrics {
+    std::string decision;          // "tool" (its call was used), "answer" or "escalated" (the main model generated)
+    double confidence = 0.0;       // Probability of its choice (see LlamaInference::setCascadeConfig)
+    GenerationMetrics generation;
+};
+
+// One pass through the tool loop in chat(): a generation plus the tool call it requested, if any
+struct IterationMetrics {
+    int index = 0;
+    GenerationMetrics generation;  // The pass whose output was used
+    bool has_tool_call = false;
+    ToolCallMetrics tool;
+    bool routed = false;           // The cascade's small model decided first
+    RouteMetrics route;
+
+    nlohmann::json toJson() const;
+};
+
+// Everything that happened while answering one user message
+struct TurnMetrics {
+    uint64_t turn = 0;             // 1-based turn counter since the engine was created
+    int64_t timestamp_ms = 0;      // Wall-clock (system_clock) start of the turn
+    double total_ms = 0.0;
+    int n_ctx = 0;
+    int kv_tokens_after = 0;       // Tokens held in the KV cache once the turn finished
+    int memory_entries = 0;        // Memory entries recalled before the turn
+    int memory_tokens = 0;         // ...and the tokens of the message they were given in
+    double memory_ms = 0.0;        // Recall in total: embedding pending entries and the query, lookup
+    double memory_lookup_ms = 0.0; // MemoryStore::search() alone
+    std::vector<IterationMetrics> iterations;
+
+    bool empty() const { return iterations.empty(); }
+    double ttftMs() const;         // TTFT of the first iteration
+    int promptTokens() const;
+    int reusedTokens() const;
+    int prefillTokens() const;
+    int generatedTokens() const;
+    double prefillMs() const;
+    double decodeMs() const;
+    double sampleMs() const;
+    double toolMs() const;
+    size_t toolBytes() const;
+    int toolCalls() const;
+
+    nlohmann::json toJson() const;
+    // Compact one-line summary for the TUI status bar
+    std::string statusLine() const;
+};
+
+#endif // PERF_METRICS_H
@@ -0,0 +1,64 @@
+#ifndef SESSION_RECORDER_H
+#define SESSION_RECORDER_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "PerfMetrics.h"
+
+// Captures a chat session as JSON lines so it can be replayed later (see SessionReplay.h).
+// Every line is one event with a "type" and "t_ms" (milliseconds since open()):
+//
+//   session_start  {config: {model, seed, n_ctx, n_batch, system_prompt, ...}}
+//   reset          {}                                    conversation cleared
+//   user           {text}
+//   prompt         {text}                                formatted prompt of one tool-loop iteration
+//   generation     {tokens: [...], token_ms: [...], text} sampled tokens and their arrival times
+//   tool           {name, method, endpoint, params, response, ms}
+//   turn_end       {metrics}                             TurnMetrics::toJson()
+//   compaction     {messages, summary}                   the first `messages` of the conversation
+//                                                        were replaced by the summary message
+//   memory         {text}                                message of recalled memory entries,
+//                                                        added in front of the next user message
+//
+// The recorder is passive: LlamaInference calls it from chat() when one is attached.
+class SessionRecorder {
+public:
+    SessionRecorder() = default;
+    ~SessionRecorder();
+
+    bool open(const std::string& path);
+    // Keep events in memory instead of writing a file (used by the replayer to capture the re-run)
+    void captureInMemory();
+    void close();
+    bool isOpen() const;
+
+    // Events captured so far in memory mode; clears the buffer
+    std::vector<nlohmann::json> takeEvents();
+
+    void recordSessionStart(const nlohmann::json& config);
+    void recordReset();
+    void recordUserMessage(const std::string& text);
+    void recordPrompt(const std::string& prompt);
+    void recordGeneration(const std::vector<int32_t>& tokens, const std::vector<double>& token_ms, const std::string& text);
+    void recordToolCall(const std::string& tool_name, const std::string& http_method, const std::string& endpoint,
+                        const nlohmann::json& params, const std::string& response, double ms);
+    void recordTurnEnd(const TurnMetrics& metrics);
+    void recordCompaction(size_t replaced_messages, const std::string& summary);
+    void recordMemory(const std::string& text);
+
+private:
+    void write(const char* type, nlohmann::json event);
+
+    std::mutex mutex_;
+    std::ofstream file_;
+    bool in_memory_ = false;
+    std::vector<nlohmann::json> events_;
+    PerfClock::time_point start_;
+};
+
+#endif // SESSION_RECORDER_H
@@ -0,0 +1,65 @@
+#ifndef SESSION_REPLAY_H
+#define SESSION_REPLAY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+class LlamaInference;
+
+struct RecordedToolCall {
+    std::string name;
+    std::string method;
+    std::string endpoint;
+    nlohmann::json params;
+    std::string response;
+    double ms = 0.0;
+
+    // Same request as `other` (name, method, endpoint and parameters)
+    bool sameRequest(const RecordedToolCall& other) const;
+    nlohmann::json toJson() const; // Without the response body
+};
+
+// One chat() call as seen in a recording
+struct RecordedTurn {
+    bool reset_before = false;                     // resetChat() was called before this turn
+    nlohmann::json compaction_before;              // {messages, summary} if the history was compacted before it
+    std::string memory_before;                     // Message of recalled memory entries, if any
+    std::string user_message;
+    std::vector<std::string> prompts;              // One per tool-loop iteration
+    std::vector<std::vector<int32_t>> generations; // Sampled tokens per iteration
+    std::vector<RecordedToolCall> tool_calls;
+    nlohmann::json metrics;                        // TurnMetrics::toJson(), null if the turn never finished
+};
+
+// A session recording (SessionRecorder output) grouped by turn
+struct RecordedSession {
+    nlohmann::json config = nlohmann::json::object(); // session_start config
+    std::vector<RecordedTurn> turns;
+
+    // Parse a JSON-lines recording. Returns false and sets `error` on failure.
+    bool load(const std::string& path, std::string& error);
+    // Group already-parsed events (file or SessionRecorder::takeEvents())
+    void appendEvents(const std::vector<nlohmann::json>& events);
+};
+
+// Re-runs a recorded session against an initialized engine: same user messages, same
+// seed, and tool requests answered from the recording instead of the Gmail service.
+// Reports whether the tool calls (and sampled tokens) are identical and how the
+// per-turn performance compares with the recording.
+class SessionReplayer {
+public:
+    SessionReplayer(LlamaInference& engine, const RecordedSession& session);
+
+    // Runs every turn and returns the report. `identical` is set to false if any turn
+    // made different tool calls than the recording.
+    nlohmann::json run(bool& identical);
+
+private:
+    LlamaInference& engine_;
+    const RecordedSession& session_;
+};
+
+#endif // SESSION_REPLAY_H
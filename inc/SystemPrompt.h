@@ -0,0 +1,18 @@
+#ifndef SYSTEM_PROMPT_H
+#define SYSTEM_PROMPT_H
+
+#include <string>
+
+// Default system prompt for Qwen3-style tool calling, shared by every front end
+// (TUI, benchmark, ...). Lists the tools LlamaInference knows how to dispatch.
+std::string defaultSystemPrompt();
+
+// System prompt for rolling summarization (LlamaInference::compactHistory): condenses a
+// transcript of older turns into notes the assistant can continue the conversation from
+std::string compactionPrompt(int max_chars);
+
+// System prompt for the one-line summaries of newly arrived mail written while the user is
+// idle (LlamaInference::summarizeNewMail); the user message is one message's metadata
+std::string mailSummaryPrompt(int max_chars);
+
+#endif // SYSTEM_PROMPT_H
@@ -0,0 +1,65 @@
+#ifndef THREAD_TUNER_H
+#define THREAD_TUNER_H
+
+#include <string>
+#include <vector>
+
+#include "LlamaInference.h"
+#include "nlohmann/json.hpp"
+
+// CPU layout as seen by Linux sysfs. On hybrid CPUs (Intel P/E cores, ARM big.LITTLE)
+// "performance" holds the fast cores only; elsewhere it equals all cores.
+struct CpuTopology {
+    std::string cpu_model;
+    std::vector<int> logical;              // Every online CPU
+    std::vector<int> physical;             // One CPU (the first SMT sibling) per core
+    std::vector<int> performance;          // Logical CPUs of the performance cores
+    std::vector<int> performance_physical; // One CPU per performance core
+    bool hybrid = false;
+
+    // Falls back to hardware_concurrency() CPUs without SMT/hybrid information when
+    // sysfs is not available
+    static CpuTopology detect();
+};
+
+// Picks thread counts (and, with pinning, CPU sets) for decode and prefill separately:
+// decode is memory-bound and usually fastest on the physical performance cores alone,
+// while prefill is compute-bound and can profit from every core. Candidates are measured
+// on the loaded model with LlamaInference::measureThroughput(), and the winners are
+// cached per machine, model file, GPU offload and pinning mode, so only the first start
+// pays for the benchmark.
+//
+// Cache file: {"<key>": {"decode": {"threads", "cpus"}, "prefill": {...},
+//                        "decode_tps", "prefill_tps", "candidates": [...]}, ...}
+class ThreadTuner {
+public:
+    ThreadTuner(LlamaInference& engine, const std::string& model_path, int n_gpu_layers, bool pin);
+
+    // Apply the cached configuration, or benchmark (always, with `force`) and cache it.
+    // Returns false if nothing could be measured; the engine keeps its threads then.
+    bool tune(const std::string& cache_path, bool force);
+
+    // Whether the last tune() ran the benchmark, and the configuration it applied
+    bool benchmarked() const { return benchmarked_; }
+    const nlohmann::json& result() const { return result_; }
+
+private:
+    struct Candidate {
+        std::string name;
+        std::vector<int> cpus;
+    };
+
+    std::vector<Candidate> candidates() const;
+    std::string cacheKey() const;
+    void apply(const nlohmann::json& result);
+
+    LlamaInference& engine_;
+    std::string model_path_;
+    int n_gpu_layers_;
+    bool pin_;
+    CpuTopology topology_;
+    bool benchmarked_ = false;
+    nlohmann::json result_;
+};
+
+#endif // THREAD_TUNER_H
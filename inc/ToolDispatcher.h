@@ -0,0 +1,79 @@
+#ifndef TOOL_DISPATCHER_H
+#define TOOL_DISPATCHER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "GmailClient.h"
+#include "nlohmann/json.hpp"
+
+class MailboxSync;
+
+// A tool call mapped onto a Gmail microservice request
+struct ToolRequest {
+    std::string tool_name;
+    std::string http_method;
+    std::string endpoint;
+    nlohmann::json params = nlohmann::json::object(); // Query parameters (GET) or JSON body
+};
+
+// Turns model output into Gmail microservice requests and performs them. Independent of
+// the inference engine, so other frontends can reuse the tool protocol.
+class ToolDispatcher {
+public:
+    // Performs one tool request and returns the response body (or an {"error": ...} envelope)
+    using Transport = std::function<std::string(const std::string& http_method,
+                                                const std::string& endpoint,
+                                                const nlohmann::json& params)>;
+
+    explicit ToolDispatcher(const std::string& gmail_service_addr);
+
+    // Finds a {"tool_name": ..., "parameters": {...}} object in model output, after any
+    // <think> block. Returns false if the output is not a tool call.
+    static bool parseToolCall(const std::string& model_output, std::string& tool_name, nlohmann::json& params);
+
+    // Whether a reply generated so far is a tool call: its first character after an optional
+    // <think>...</think> block and whitespace is '{'. 1 = tool call (with `json_start` set to
+    // the '{' if given), 0 = plain reply, -1 = not decided yet.
+    static int replyKind(const std::string& text, size_t* json_start = nullptr);
+
+    // Every tool resolve() maps, e.g. to constrain a model's tool calls to the catalogue
+    static const std::vector<std::string>& toolNames();
+
+    // Tools that only read the mailbox, so repeating or prefetching them is harmless
+    static bool isReadOnly(const std::string& tool_name);
+
+    // Maps a tool call onto its endpoint and method. Returns false for unknown tools or
+    // missing path parameters, with `error` set to the message shown to the model.
+    static bool resolve(const std::string& tool_name, nlohmann::json params, ToolRequest& request, std::string& error);
+
+    // Sends the request through the transport if one is set, over HTTP otherwise.
+    // list_new_messages is answered from the mailbox sync once it is ready. With native
+    // MIME, get_message_content fetches the raw message and decodes it here.
+    std::string execute(const ToolRequest& request) const;
+
+    // Replace HTTP with `transport` (nullptr restores HTTP). Used by session replay.
+    void setTransport(Transport transport) { transport_ = std::move(transport); }
+
+    bool hasTransport() const { return static_cast<bool>(transport_); }
+
+    // Answer list_new_messages from `mailbox` (nullptr: always over HTTP), and wake it after
+    // tools that change the mailbox. Not owned.
+    void setMailboxSync(MailboxSync* mailbox) { mailbox_ = mailbox; }
+
+    // Fetch get_message_content as format=raw and walk the MIME structure in C++
+    // (MimeParser) instead of having the service decode every part
+    void setNativeMime(bool enabled) { native_mime_ = enabled; }
+    bool nativeMime() const { return native_mime_; }
+
+    const GmailClient& client() const { return client_; }
+
+private:
+    GmailClient client_;
+    Transport transport_;
+    MailboxSync* mailbox_ = nullptr;
+    bool native_mime_ = false;
+};
+
+#endif // TOOL_DISPATCHER_H
@@ -0,0 +1,86 @@
+#ifndef TOOL_PREFETCHER_H
+#define TOOL_PREFETCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "JsonProjection.h"
+#include "ToolDispatcher.h"
+#include "nlohmann/json.hpp"
+
+// Starts likely tool requests before the model has finished asking for them, so the Gmail
+// round trip overlaps with decoding instead of following it. Two kinds of guesses:
+//  - the tool call being generated: the tool name comes in the first few tokens, so as soon
+//    as the partial call names a tool without parameters (list_labels, get_profile) or has
+//    completed the ID of get_message_content / get_label, that request is started;
+//  - the previous tool result: after list_messages or list_new_messages, get_message_content
+//    for the first few listed messages.
+// Responses are parked for a short time, and fetch() serves an identical request from them
+// (waiting for it if it is still running). Only read-only tools are prefetched, and any
+// other tool call clears the parked responses, so none of them predates a change made
+// through the tools. Not thread-safe: one engine thread calls everything; the requests
+// themselves run on detached threads that own copies of what they need.
+class ToolPrefetcher {
+public:
+    struct Options {
+        bool enabled = true;
+        int follow_up_ids = 3;  // get_message_content prefetches after a listing
+        int ttl_ms = 30000;     // How long a parked response may be served
+        int max_in_flight = 4;  // Prefetches running at once; further guesses are dropped
+    };
+
+    explicit ToolPrefetcher(const ToolDispatcher& tools);
+    ToolPrefetcher(const ToolDispatcher& tools, const Options& options);
+
+    void setOptions(const Options& options);
+    const Options& options() const { return options_; }
+
+    // A new generation pass starts; observe() then receives its text piece by piece
+    void beginReply();
+    void observe(std::string_view piece);
+
+    // Performs `request`, or returns its parked response (`prefetched` = true). A tool that
+    // is not read-only clears the parked responses first.
+    std::string fetch(const ToolRequest& request, bool& prefetched);
+
+    // Queue get_message_content prefetches for the first messages of a listing the model
+    // has just been given (list_messages, list_new_messages)
+    void afterListing(const std::vector<MessageSummary>& messages);
+
+    // Forget all parked responses (running requests complete unobserved)
+    void clear();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Parked {
+        std::shared_future<std::string> response;
+        Clock::time_point started;
+    };
+
+    // Starts the partial call's request once it is unambiguous. Returns true when there is
+    // nothing more to learn from this reply.
+    bool startFromPartialCall(std::string_view call);
+    void start(const std::string& tool_name, const nlohmann::json& params);
+    void evictExpired();
+
+    const ToolDispatcher& tools_;
+    Options options_;
+    std::map<std::string, Parked> parked_; // By method, endpoint and parameters
+    std::shared_ptr<std::atomic<int>> in_flight_ = std::make_shared<std::atomic<int>>(0);
+
+    // The reply being generated, until it is known to be a plain answer or the prefetch
+    // decision for its tool call is made
+    std::string reply_;
+    int reply_kind_ = -1; // ToolDispatcher::replyKind()
+    size_t call_start_ = 0;
+    bool watching_ = false;
+};
+
+#endif // TOOL_PREFETCHER_H
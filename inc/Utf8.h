@@ -0,0 +1,14 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Length of the longest prefix of `text` that does not end inside a UTF-8 sequence
+size_t completeUtf8Length(std::string_view text);
+
+// Cut `s` to at most max_bytes at a UTF-8 character boundary
+void truncateUtf8(std::string& s, size_t max_bytes);
+
+#endif // UTF8_H
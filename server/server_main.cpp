@@ -0,0 +1,410 @@
+// Headless engine server: loads the model once and serves chat, classification and
+// embeddings to any number of local frontends (see EngineServer.h for the API).
+#include "LlamaInference.h"
+#include "EngineServer.h"
+#include "Logger.h"
+#include "SystemPrompt.h"
+#include "ThreadTuner.h"
+#include "MailboxSync.h"
+#include "MemoryStore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "nlohmann/json.hpp"
+
+namespace {
+
+EngineServer* g_server = nullptr;
+
+void handleSignal(int) {
+    if (g_server) {
+        g_server->stop();
+    }
+}
+
+void print_server_help(const char* app_name) {
+    std::cout << "Usage: " << app_name << " -m <model_path> [options]\n\n"
+              << "Serves one loaded model over localhost HTTP or a Unix socket: chat sessions (with\n"
+              << "server-sent-event streaming), one-shot completions, label classification and embeddings.\n\n"
+              << "Options:\n"
+              << "  -h, --help                    Show this help message and exit.\n"
+              << "  -c, --context-size <int>      Context size. (Default: 4096)\n"
+              << "  -ngl, --gpu-layers <int>      Layers to offload to GPU. (Default: 99)\n"
+              << "  -t, --threads <int>           Generation threads. (Default: hardware concurrency)\n"
+              << "  -tb, --threads-batch <int>    Prompt processing threads. (Default: hardware concurrency)\n"
+              << "  -b, --batch-size <int>        Logical batch size (n_batch). 0 = context size. (Default: 0)\n"
+              << "  -mrc, --max-response-chars <int> Maximum characters per response. (Default: 2048)\n"
+              << "  -ga, --gmail-addr <addr>      Address of the Gmail microservice. (Default: http://localhost:8000)\n"
+              << "  -spf, --system-prompt-file <path> System prompt for chat sessions. (Default: built-in prompt)\n"
+              << "  --host <addr>                 Address to listen on. (Default: 127.0.0.1)\n"
+              << "  --port <int>                  Port to listen on. (Default: 8090)\n"
+              << "  --unix <path>                 Listen on this Unix socket instead of TCP.\n"
+              << "  --max-sessions <int>          Chat sessions kept before the least recently used is dropped. (Default: 64)\n"
+              << "  --max-queue <int>             Engine requests waiting at once; more get 503. (Default: 8)\n"
+              << "  --temp <float>                Reply sampling temperature; 0 = greedy. (Default: 0.8)\n"
+              << "  --top-k <int>                 Top-k pre-filter; 0 = off. (Default: 40)\n"
+              << "  --top-p <float>               Top-p; 1 = off. (Default: 0.95)\n"
+              << "  --min-p <float>               Min-p; 0 = off. (Default: 0.05)\n"
+              << "  --repeat-penalty <float>      Repetition penalty; 1 = off. (Default: 1.0)\n"
+              << "  --repeat-last-n <int>         Tokens the repetition penalty looks back over. (Default: 64)\n"
+              << "  --tool-temp <float>           Temperature once a reply turns out to be a tool call; 0 = greedy. (Default: 0)\n"
+              << "  --seed <int>                  Sampler seed. (Default: random)\n"
+              << "  --auto-threads                Benchmark thread configurations on first run (cached). Overrides -t/-tb.\n"
+              << "  --retune-threads              Like --auto-threads, ignoring the cache.\n"
+              << "  --pin-threads                 With --auto-threads: pin threads to the selected CPUs.\n"
+              << "  --thread-cache <path>         Tuned thread configurations. (Default: maimail_threads.json)\n"
+              << "  -ctk, --cache-type-k <type>   KV cache type for K: f16, q8_0, q4_0, ... (Default: f16)\n"
+              << "  -ctv, --cache-type-v <type>   KV cache type for V; quantized types enable flash attention. (Default: f16)\n"
+              << "  -fa, --flash-attn             Use flash attention.\n"
+              << "  -nkvo, --no-kv-offload        Keep the KV cache in system memory when layers are offloaded to the GPU.\n"
+              << "  --no-tool-prefetch            Do not start Gmail requests before the model has finished a tool call.\n"
+              << "  --native-mime                 Fetch messages in raw format and decode MIME parts here instead of in\n"
+              << "                                the Gmail service.\n"
+              << "  --project-tool-results        Give the model only id, from, subject, date and snippet of listed\n"
+              << "                                messages.\n"
+              << "  --compact                     Summarize older turns once the history fills 60% of the prompt budget,\n"
+              << "                                instead of dropping tokens when the context overflows.\n"
+              << "  --compact-at <float>          Share of the prompt budget that triggers a summary (Default: 0.6).\n"
+              << "  --compact-keep <int>          Latest user turns kept verbatim when summarizing (Default: 2).\n"
+              << "  --memory                      Remember tool results and answers across sessions and recall the ones\n"
+              << "                                relevant to each message. (Default: off)\n"
+              << "  --memory-file <path>          Where the memory is kept. (Default: maimail_memory.jsonl)\n"
+              << "  --memory-top-k <int>          Entries recalled per message at most. (Default: 3)\n"
+              << "  --memory-tokens <int>         Tokens the recalled entries may take. (Default: 384)\n"
+              << "  --sync                        Keep a local copy of the inbox up to date in the background, so\n"
+              << "                                \"what's new\" is answered without asking Gmail. (Default: off)\n"
+              << "  --sync-interval <int>         Seconds between polls after a change; doubles while nothing\n"
+              << "                                changes, up to 5 minutes. (Default: 15)\n"
+              << "  --sync-snapshot <path>        Where the synced inbox is kept between runs. (Default: maimail_mailbox.json)\n"
+              << "  --no-idle-jobs                Do not use the time between prompts for background work (compaction,\n"
+              << "                                memory indexing, prefilling the conversation, summarizing new mail).\n"
+              << "  --idle-delay <int>            Milliseconds without a request before background work starts. (Default: 1000)\n"
+              << "  --no-mmap                     Read the model into memory instead of mapping it.\n"
+              << "  --mlock                       Lock the model in RAM so it is never swapped out.\n"
+              << "  --numa <strategy>             disabled, distribute, isolate, numactl or mirror. (Default: disabled)\n"
+              << "  --no-warmup                   Skip the warm-up decode before serving.\n"
+              << "  --cascade-model <path>        Small model that decides the tool calls; the main model writes the\n"
+              << "                                replies and the calls the small one is unsure of. (Default: off)\n"
+              << "  --cascade-ngl <int>           Layers of the small model to offload to the GPU. (Default: 0)\n"
+              << "  --cascade-confidence <float>  Confidence below which the main model decides a step. (Default: 0.6)\n"
+              << "  -mf, --metrics-file <path>    One JSON line of performance metrics per chat turn. (Default: off)\n"
+              << "  -lf, --log-file <path>        JSON-lines diagnostics. (Default: maimail_server.log)\n"
+              << "  -ll, --log-level <level>      trace, debug, info, warn or error. (Default: info)\n"
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string model_path;
+    int ngl = 99;
+    int n_ctx = 4096;
+    int n_threads = -1;
+    int n_threads_batch = -1;
+    int n_batch = 0;
+    int max_response_chars = -1;
+    std::string gmail_address = "http://localhost:8000";
+    std::string system_prompt_file_path;
+    std::string host = "127.0.0.1";
+    int port = 8090;
+    std::string unix_socket_path;
+    int max_sessions = 64;
+    int max_queue = 8;
+    long long seed = -1;
+    SamplerConfig sampler_config;
+    KvCacheConfig kv_cache;
+    bool tool_prefetch = true;
+    bool native_mime = false;
+    bool project_tool_results = false;
+    CompactionConfig compaction;
+    bool memory_enabled = false;
+    MemoryStoreOptions memory_options;
+    MemoryConfig memory_config;
+    bool mailbox_sync_enabled = false;
+    MailboxSyncOptions sync_options;
+    bool idle_jobs = true;
+    IdleConfig idle_config;
+    CascadeConfig cascade;
+    bool use_mmap = true;
+    bool use_mlock = false;
+    NumaStrategy numa = NumaStrategy::Disabled;
+    bool warmup = true;
+    bool auto_threads = false;
+    bool retune_threads = false;
+    bool pin_threads = false;
+    std::string thread_cache_path = "maimail_threads.json";
+    std::string metrics_file_path;
+    std::string log_file_path = "maimail_server.log";
+    std::string log_level_name = "info";
+
+    for (int i = 1; i < argc; i++) {
+        try {
+            if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+                print_server_help(argv[0]);
+                return 0;
+            } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--model") == 0) && i + 1 < argc) {
+                model_path = argv[++i];
+            } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--context-size") == 0) && i + 1 < argc) {
+                n_ctx = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-ngl") == 0 || strcmp(argv[i], "--gpu-layers") == 0) && i + 1 < argc) {
+                ngl = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+                n_threads = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-tb") == 0 || strcmp(argv[i], "--threads-batch") == 0) && i + 1 < argc) {
+                n_threads_batch = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0) && i + 1 < argc) {
+                n_batch = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-mrc") == 0 || strcmp(argv[i], "--max-response-chars") == 0) && i + 1 < argc) {
+                max_response_chars = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "-ga") == 0 || strcmp(argv[i], "--gmail-addr") == 0) && i + 1 < argc) {
+                gmail_address = argv[++i];
+            } else if ((strcmp(argv[i], "-spf") == 0 || strcmp(argv[i], "--system-prompt-file") == 0) && i + 1 < argc) {
+                system_prompt_file_path = argv[++i];
+            } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+                host = argv[++i];
+            } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+                port = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+                unix_socket_path = argv[++i];
+            } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+                max_sessions = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--max-queue") == 0 && i + 1 < argc) {
+                max_queue = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--temp") == 0 && i + 1 < argc) {
+                sampler_config.reply.temperature = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) {
+                sampler_config.reply.top_k = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--top-p") == 0 && i + 1 < argc) {
+                sampler_config.reply.top_p = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--min-p") == 0 && i + 1 < argc) {
+                sampler_config.reply.min_p = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat-penalty") == 0 && i + 1 < argc) {
+                sampler_config.reply.repeat_penalty = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat-last-n") == 0 && i + 1 < argc) {
+                sampler_config.reply.repeat_last_n = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--tool-temp") == 0 && i + 1 < argc) {
+                sampler_config.tool_call.temperature = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                seed = std::stoll(argv[++i]);
+            } else if (strcmp(argv[i], "--auto-threads") == 0) {
+                auto_threads = true;
+            } else if (strcmp(argv[i], "--retune-threads") == 0) {
+                auto_threads = true;
+                retune_threads = true;
+            } else if (strcmp(argv[i], "--pin-threads") == 0) {
+                pin_threads = true;
+            } else if (strcmp(argv[i], "--thread-cache") == 0 && i + 1 < argc) {
+                thread_cache_path = argv[++i];
+            } else if ((strcmp(argv[i], "-ctk") == 0 || strcmp(argv[i], "--cache-type-k") == 0) && i + 1 < argc) {
+                if (!parseKvCacheType(argv[++i], kv_cache.type_k)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if ((strcmp(argv[i], "-ctv") == 0 || strcmp(argv[i], "--cache-type-v") == 0) && i + 1 < argc) {
+                if (!parseKvCacheType(argv[++i], kv_cache.type_v)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-fa") == 0 || strcmp(argv[i], "--flash-attn") == 0) {
+                kv_cache.flash_attn = true;
+            } else if (strcmp(argv[i], "-nkvo") == 0 || strcmp(argv[i], "--no-kv-offload") == 0) {
+                kv_cache.offload_kqv = false;
+            } else if (strcmp(argv[i], "--no-tool-prefetch") == 0) {
+                tool_prefetch = false;
+            } else if (strcmp(argv[i], "--native-mime") == 0) {
+                native_mime = true;
+            } else if (strcmp(argv[i], "--project-tool-results") == 0) {
+                project_tool_results = true;
+            } else if (strcmp(argv[i], "--compact") == 0) {
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-at") == 0 && i + 1 < argc) {
+                compaction.trigger_ratio = std::stof(argv[++i]);
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-keep") == 0 && i + 1 < argc) {
+                compaction.keep_recent_turns = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory") == 0) {
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-file") == 0 && i + 1 < argc) {
+                memory_options.path = argv[++i];
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-top-k") == 0 && i + 1 < argc) {
+                memory_config.top_k = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory-tokens") == 0 && i + 1 < argc) {
+                memory_config.token_budget = std::max(64, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--sync") == 0) {
+                mailbox_sync_enabled = true;
+            } else if (strcmp(argv[i], "--sync-interval") == 0 && i + 1 < argc) {
+                sync_options.min_interval_ms = std::max(1, std::stoi(argv[++i])) * 1000;
+                sync_options.max_interval_ms = std::max(sync_options.max_interval_ms, sync_options.min_interval_ms);
+            } else if (strcmp(argv[i], "--sync-snapshot") == 0 && i + 1 < argc) {
+                sync_options.snapshot_path = argv[++i];
+            } else if (strcmp(argv[i], "--no-idle-jobs") == 0) {
+                idle_jobs = false;
+            } else if (strcmp(argv[i], "--idle-delay") == 0 && i + 1 < argc) {
+                idle_config.delay_ms = std::max(0, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--no-mmap") == 0) {
+                use_mmap = false;
+            } else if (strcmp(argv[i], "--mlock") == 0) {
+                use_mlock = true;
+            } else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+                if (!parseNumaStrategy(argv[++i], numa)) {
+                    std::cerr << "Unknown NUMA strategy: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--no-warmup") == 0) {
+                warmup = false;
+            } else if (strcmp(argv[i], "--cascade-model") == 0 && i + 1 < argc) {
+                cascade.model_path = argv[++i];
+            } else if (strcmp(argv[i], "--cascade-ngl") == 0 && i + 1 < argc) {
+                cascade.n_gpu_layers = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cascade-confidence") == 0 && i + 1 < argc) {
+                cascade.min_confidence = std::stof(argv[++i]);
+            } else if ((strcmp(argv[i], "-mf") == 0 || strcmp(argv[i], "--metrics-file") == 0) && i + 1 < argc) {
+                metrics_file_path = argv[++i];
+            } else if ((strcmp(argv[i], "-lf") == 0 || strcmp(argv[i], "--log-file") == 0) && i + 1 < argc) {
+                log_file_path = argv[++i];
+            } else if ((strcmp(argv[i], "-ll") == 0 || strcmp(argv[i], "--log-level") == 0) && i + 1 < argc) {
+                log_level_name = argv[++i];
+            } else {
+                std::cerr << "Unknown or incomplete argument: " << argv[i] << std::endl;
+                return 1;
+            }
+        } catch (std::exception& e) {
+            std::cerr << "Error parsing arguments: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    LogLevel level;
+    if (!parseLogLevel(log_level_name, level)) {
+        std::cerr << "Unknown log level: " << log_level_name << std::endl;
+        return 1;
+    }
+    Logger::instance().setLevel(level);
+    if (!Logger::instance().open(log_file_path)) {
+        std::cerr << "WARNING: Could not open " << log_file_path << std::endl;
+    }
+
+    if (model_path.empty()) {
+        std::cerr << "Model path (-m) is required." << std::endl;
+        print_server_help(argv[0]);
+        return 1;
+    }
+
+    std::string system_prompt;
+    if (!system_prompt_file_path.empty()) {
+        std::ifstream file(system_prompt_file_path);
+        if (!file.is_open()) {
+            std::cerr << "Cannot open system prompt file " << system_prompt_file_path << std::endl;
+            return 1;
+        }
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        system_prompt = buffer.str();
+    }
+    if (system_prompt.empty()) {
+        system_prompt = defaultSystemPrompt();
+    }
+
+    const unsigned int hw = std::thread::hardware_concurrency();
+    if (n_threads == -1) n_threads = hw > 0 ? hw : 4;
+    if (n_threads_batch == -1) n_threads_batch = hw > 0 ? hw : 4;
+
+    LlamaInference llama(model_path, ngl, n_ctx, gmail_address, n_threads, n_threads_batch);
+    llama.setSystemPrompt(system_prompt);
+    llama.setBatchSize(n_batch);
+    llama.setMetricsFile(metrics_file_path);
+    llama.setSamplerConfig(sampler_config);
+    if (max_response_chars > 0) {
+        llama.setMaxResponseChars(max_response_chars);
+    }
+    if (seed >= 0) {
+        llama.setSeed(static_cast<uint32_t>(seed));
+    }
+    llama.setKvCacheConfig(kv_cache);
+    llama.setToolPrefetch(tool_prefetch);
+    llama.setNativeMime(native_mime);
+    llama.setProjectToolResults(project_tool_results);
+    llama.setCompactionConfig(compaction);
+    llama.setUseMmap(use_mmap);
+    llama.setUseMlock(use_mlock);
+    llama.setNumaStrategy(numa);
+    llama.setWarmup(warmup);
+    llama.setCascadeConfig(cascade);
+
+    // Started before the model loads, so the first listing overlaps with it; messages that
+    // arrive meanwhile get their token counts on a later poll
+    std::atomic<bool> model_ready{false};
+    MailboxSync mailbox_sync(gmail_address, sync_options);
+    if (mailbox_sync_enabled) {
+        mailbox_sync.setTokenCounter([&llama, &model_ready](const std::string& text) {
+            return model_ready ? llama.countTokens(text) : 0;
+        });
+        llama.setMailboxSync(&mailbox_sync);
+        mailbox_sync.start();
+    }
+
+    // Shared by all sessions: what one frontend looked up, another does not have to
+    MemoryStore memory_store(memory_options);
+    if (memory_enabled) {
+        if (!memory_store.open()) {
+            std::cerr << "WARNING: Could not open " << memory_options.path << "; memory is kept for this run only" << std::endl;
+        }
+        llama.setMemoryStore(&memory_store, memory_config);
+    }
+
+    if (!llama.initialize()) {
+        std::cerr << "Failed to load model " << model_path << std::endl;
+        Logger::instance().close();
+        return 1;
+    }
+
+    model_ready = true;
+
+    const nlohmann::json config = llama.describeConfig();
+    const nlohmann::json& kv = config["kv_cache"];
+    std::cout << "KV cache: " << kv.value("bytes", static_cast<uint64_t>(0)) / (1024 * 1024) << " MiB for "
+              << config.value("n_ctx", 0) << " tokens (K " << kv.value("type_k", std::string()) << ", V "
+              << kv.value("type_v", std::string()) << (kv.value("flash_attn", false) ? ", flash attention" : "")
+              << ")" << std::endl;
+
+    if (auto_threads) {
+        std::cout << "Selecting thread configuration..." << std::endl;
+        ThreadTuner(llama, model_path, ngl, pin_threads).tune(thread_cache_path, retune_threads);
+    }
+
+    EngineServer server(llama);
+    server.setMaxSessions(max_sessions > 0 ? static_cast<size_t>(max_sessions) : 1);
+    server.setMaxQueuedRequests(max_queue > 0 ? static_cast<size_t>(max_queue) : 0);
+    const bool bound = unix_socket_path.empty() ? server.bind(host, port) : server.bindUnix(unix_socket_path);
+    if (!bound) {
+        std::cerr << "Could not listen on " << (unix_socket_path.empty() ? host + ":" + std::to_string(port) : unix_socket_path) << std::endl;
+        Logger::instance().close();
+        return 1;
+    }
+    std::cout << "maimail-server ready on "
+              << (unix_socket_path.empty() ? "http://" + host + ":" + std::to_string(port) : "unix:" + unix_socket_path)
+              << std::endl;
+
+    if (idle_jobs) {
+        llama.startIdleWork(idle_config);
+    }
+
+    g_server = &server;
+    std::signal(SIGINT, handleSignal);
+    std::signal(SIGTERM, handleSignal);
+    server.serve();
+    g_server = nullptr;
+    llama.stopIdleWork(); // Its jobs use the mailbox sync and memory store, which go first
+
+    LOG_INFO("main", "Server stopped.");
+    Logger::instance().close();
+    return 0;
+}
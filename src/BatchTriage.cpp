@@ -0,0 +1,461 @@
+#include "BatchTriage.h"
+#include "BoundedQueue.h"
+#include "LlamaInference.h"
+#include "Logger.h"
+#include "PerfMetrics.h"
+#include "Utf8.h"
+
+#include "httplib.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Generated text for a classification: the category name and nothing else
+const int kMaxClassificationChars = 48;
+
+std::unique_ptr<httplib::Client> makeClient(const std::string& addr) {
+    auto cli = std::make_unique<httplib::Client>(addr);
+    cli->set_connection_timeout(10);
+    cli->set_read_timeout(30);
+    cli->set_keep_alive(true); // One connection per stage thread, reused for every request
+    return cli;
+}
+
+// Parses a 2xx JSON response; otherwise returns null and describes the failure in `error`
+json parseResponse(const httplib::Result& res, std::string& error) {
+    if (!res) {
+        error = "HTTP request failed: " + httplib::to_string(res.error());
+        return nullptr;
+    }
+    if (res->status < 200 || res->status >= 300) {
+        error = "HTTP " + std::to_string(res->status) + ": " + res->body.substr(0, 200);
+        return nullptr;
+    }
+    json body = json::parse(res->body, nullptr, /*allow_exceptions=*/false);
+    if (body.is_discarded()) {
+        error = "Invalid JSON in response";
+        return nullptr;
+    }
+    return body;
+}
+
+json getJson(httplib::Client& cli, const std::string& path, const httplib::Params& params, std::string& error) {
+    return parseResponse(cli.Get(path, params, httplib::Headers{}), error);
+}
+
+json postJson(httplib::Client& cli, const std::string& path, const json& body, std::string& error) {
+    return parseResponse(cli.Post(path, body.dump(), "application/json"), error);
+}
+
+std::string toLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+} // namespace
+
+// A fetched and compacted message on its way to the classifier
+struct BatchTriage::Item {
+    std::string id;
+    std::string from;
+    std::string subject;
+    std::string text;
+    std::string error;
+    double fetch_ms = 0.0;
+};
+
+// A classified message on its way to the labeler
+struct BatchTriage::Result {
+    Item item;
+    std::string category;  // Empty if the output matched no category
+    std::string raw;       // Model output (free-form generation only)
+    std::vector<double> scores; // Probability per category (logit scoring only)
+    double classify_ms = 0.0;
+    int prefill_tokens = 0;
+    int reused_tokens = 0;
+};
+
+BatchTriage::BatchTriage(LlamaInference& engine, const std::string& gmail_service_addr, BatchTriageOptions options)
+    : engine_(engine), gmail_service_addr_(gmail_service_addr), options_(std::move(options)) {}
+
+bool BatchTriage::listMessageIds(std::vector<std::string>& ids, std::string& error) {
+    auto cli = makeClient(gmail_service_addr_);
+
+    if (!options_.since_history_id.empty()) {
+        // Only messages added since the given point, e.g. the historyId saved by the previous nightly run
+        const json history = getJson(*cli, "/history", {
+            {"start_history_id", options_.since_history_id},
+            {"max_results", "500"},
+        }, error);
+        if (history.is_null()) {
+            return false;
+        }
+        std::unordered_set<std::string> seen;
+        for (const auto& record : history.value("history_records", json::array())) {
+            for (const auto& added : record.value("messagesAdded", json::array())) {
+                const std::string id = added.value("message", json::object()).value("id", "");
+                if (!id.empty() && seen.insert(id).second && static_cast<int>(ids.size()) < options_.max_messages) {
+                    ids.push_back(id);
+                }
+            }
+        }
+        return true;
+    }
+
+    // ids_only skips the per-message metadata fetch; the fetch stage reads each message anyway
+    const json listing = getJson(*cli, "/messages", {
+        {"query", options_.query},
+        {"max_results", std::to_string(options_.max_messages)},
+        {"ids_only", "true"},
+    }, error);
+    if (listing.is_null()) {
+        return false;
+    }
+    for (const auto& message : listing.value("messages", json::array())) {
+        const std::string id = message.value("id", "");
+        if (!id.empty()) {
+            ids.push_back(id);
+        }
+    }
+    return true;
+}
+
+bool BatchTriage::resolveLabels(std::string& error) {
+    label_ids_.assign(options_.categories.size(), "");
+
+    auto cli = makeClient(gmail_service_addr_);
+    const json listing = getJson(*cli, "/labels", {}, error);
+    if (listing.is_null()) {
+        return false;
+    }
+    std::map<std::string, std::string> existing; // name -> id
+    for (const auto& label : listing.value("labels", json::array())) {
+        existing[label.value("name", "")] = label.value("id", "");
+    }
+
+    for (size_t i = 0; i < options_.categories.size(); i++) {
+        const std::string name = options_.label_prefix + options_.categories[i];
+        auto it = existing.find(name);
+        if (it != existing.end()) {
+            label_ids_[i] = it->second;
+            continue;
+        }
+        if (options_.dry_run) {
+            continue;
+        }
+        const json created = postJson(*cli, "/labels", json{{"name", name}}, error);
+        if (created.is_null() || !created.contains("id")) {
+            error = "create_label '" + name + "' failed: " + error;
+            return false;
+        }
+        label_ids_[i] = created["id"].get<std::string>();
+        LOG_INFO("BatchTriage::resolveLabels", "Created label %s (%s)", name.c_str(), label_ids_[i].c_str());
+    }
+    return true;
+}
+
+std::string BatchTriage::classificationSystemPrompt() const {
+    // Kept byte-identical for every message so its KV cache entries are reused
+    std::string prompt =
+        "You are an email triage assistant. Classify the email you are given into exactly one of these categories:\n";
+    for (const auto& category : options_.categories) {
+        prompt += "- " + category + "\n";
+    }
+    prompt += "Reply with the category name only, with no explanation and no punctuation.";
+    return prompt;
+}
+
+std::string BatchTriage::compactBody(const std::string& body) const {
+    // Drop quoted replies and collapse whitespace; the first part of a message carries the signal
+    std::string out;
+    out.reserve(std::min<size_t>(body.size(), options_.body_chars + 64));
+    std::istringstream lines(body);
+    std::string line;
+    while (std::getline(lines, line) && out.size() < static_cast<size_t>(options_.body_chars)) {
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '>') {
+            continue;
+        }
+        bool in_space = !out.empty();
+        if (!out.empty()) out += ' ';
+        for (size_t i = first; i < line.size(); i++) {
+            const bool space = line[i] == ' ' || line[i] == '\t' || line[i] == '\r';
+            if (space && in_space) continue;
+            out += space ? ' ' : line[i];
+            in_space = space;
+        }
+    }
+    truncateUtf8(out, options_.body_chars);
+    return out;
+}
+
+std::string BatchTriage::parseCategory(const std::string& raw) const {
+    // Ignore any reasoning block and compare case-insensitively
+    std::string answer = raw;
+    const size_t think_end = answer.rfind("</think>");
+    if (think_end != std::string::npos) {
+        answer = answer.substr(think_end + strlen("</think>"));
+    }
+    answer = toLower(answer);
+    const size_t start = answer.find_first_not_of(" \t\r\n\"'*-");
+    if (start == std::string::npos) {
+        return "";
+    }
+    answer = answer.substr(start);
+
+    // Prefer a category the answer starts with, then any category it mentions
+    for (const auto& category : options_.categories) {
+        if (answer.rfind(toLower(category), 0) == 0) return category;
+    }
+    for (const auto& category : options_.categories) {
+        if (answer.find(toLower(category)) != std::string::npos) return category;
+    }
+    return "";
+}
+
+json BatchTriage::run() {
+    const auto run_start = PerfClock::now();
+    json summary = {{"dry_run", options_.dry_run}};
+
+    std::vector<std::string> ids;
+    std::string error;
+    if (!listMessageIds(ids, error)) {
+        LOG_ERROR("BatchTriage::run", "Listing messages failed: %s", error.c_str());
+        summary["error"] = "listing messages failed: " + error;
+        return summary;
+    }
+    if (!resolveLabels(error)) {
+        LOG_ERROR("BatchTriage::run", "Resolving labels failed: %s", error.c_str());
+        summary["error"] = "resolving labels failed: " + error;
+        return summary;
+    }
+    LOG_INFO("BatchTriage::run", "Triage of %zu messages into %zu categories", ids.size(), options_.categories.size());
+
+    std::ofstream report;
+    if (!options_.report_path.empty()) {
+        report.open(options_.report_path, std::ios::trunc);
+        if (!report.is_open()) {
+            LOG_ERROR("BatchTriage::run", "Could not open report file: %s", options_.report_path.c_str());
+        }
+    }
+
+    BoundedQueue<Item> fetched(options_.prefetch);
+    BoundedQueue<Result> classified(options_.prefetch);
+
+    // Stage 1: fetch + compact. Threads claim IDs from a shared cursor.
+    std::atomic<size_t> next_id{0};
+    std::atomic<int> fetchers_running{std::max(1, options_.fetch_threads)};
+    std::vector<std::thread> fetchers;
+    for (int t = 0; t < std::max(1, options_.fetch_threads); t++) {
+        fetchers.emplace_back([&]() {
+            auto cli = makeClient(gmail_service_addr_);
+            for (size_t i = next_id.fetch_add(1); i < ids.size(); i = next_id.fetch_add(1)) {
+                Item item;
+                item.id = ids[i];
+                const auto t_fetch = PerfClock::now();
+                std::string fetch_error;
+                const json message = getJson(*cli, "/messages/" + item.id, {}, fetch_error);
+                item.fetch_ms = elapsedMs(t_fetch);
+                if (message.is_null()) {
+                    item.error = fetch_error;
+                } else {
+                    item.from = message.value("from", "");
+                    item.subject = message.value("subject", "");
+                    const std::string body = message.value("body", "");
+                    item.text = compactBody(body.empty() ? message.value("snippet", "") : body);
+                }
+                if (!fetched.push(std::move(item))) {
+                    break;
+                }
+            }
+            if (fetchers_running.fetch_sub(1) == 1) {
+                fetched.close(); // Last fetcher out
+            }
+        });
+    }
+
+    // Stage 3: apply labels and write the report
+    std::map<std::string, int> per_category;
+    int labelled = 0;
+    int failed = 0;
+    double label_ms_total = 0.0;
+    std::thread labeler([&]() {
+        auto cli = makeClient(gmail_service_addr_);
+        Result result;
+        while (classified.pop(result)) {
+            json line = {
+                {"id", result.item.id},
+                {"from", result.item.from},
+                {"subject", result.item.subject},
+                {"category", result.category},
+                {"raw", result.raw},
+                {"fetch_ms", result.item.fetch_ms},
+                {"classify_ms", result.classify_ms},
+                {"prefill_tokens", result.prefill_tokens},
+                {"reused_tokens", result.reused_tokens},
+            };
+            if (!result.scores.empty()) {
+                json scores = json::object();
+                for (size_t c = 0; c < result.scores.size(); c++) {
+                    scores[options_.categories[c]] = result.scores[c];
+                }
+                line["scores"] = scores;
+            }
+            std::string label_error = result.item.error;
+            if (label_error.empty() && !result.category.empty()) {
+                per_category[result.category]++;
+                const auto it = std::find(options_.categories.begin(), options_.categories.end(), result.category);
+                const std::string& label_id = label_ids_[it - options_.categories.begin()];
+                if (!options_.dry_run && !label_id.empty()) {
+                    const auto t_label = PerfClock::now();
+                    const json modified = postJson(*cli, "/messages/" + result.item.id + "/labels",
+                                                   json{{"add_label_ids", {label_id}}}, label_error);
+                    label_ms_total += elapsedMs(t_label);
+                    if (!modified.is_null()) {
+                        labelled++;
+                        line["label_id"] = label_id;
+                    }
+                }
+            } else if (label_error.empty()) {
+                per_category["(unclassified)"]++;
+            }
+            if (!label_error.empty()) {
+                failed++;
+                line["error"] = label_error;
+            }
+            if (report.is_open()) {
+                report << line.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+            }
+        }
+    });
+
+    // Stage 2: classify on this thread (the engine is single-threaded)
+    const std::string system_prompt = classificationSystemPrompt();
+    int classified_count = 0;
+    double classify_ms_total = 0.0;
+    double wait_ms_total = 0.0; // Time the model sat idle waiting for a fetch
+    int prefill_total = 0;
+    int reused_total = 0;
+    int groups = 0;
+    const size_t max_group = static_cast<size_t>(std::max(1, options_.parallel));
+    // Thinking models (Qwen3 style) answer "/no_think" with an empty reasoning block; the
+    // category is scored after it
+    const std::string answer_prefix = engine_.countTokens("</think>") == 1 ? "<think>\n\n</think>\n\n" : "";
+    std::vector<Item> group;
+    for (;;) {
+        // Block for one message, then take whatever else is already queued
+        group.clear();
+        Item item;
+        const auto t_wait = PerfClock::now();
+        if (!fetched.pop(item)) {
+            break;
+        }
+        wait_ms_total += elapsedMs(t_wait);
+        group.push_back(std::move(item));
+        while (group.size() < max_group && fetched.tryPop(item)) {
+            group.push_back(std::move(item));
+        }
+
+        std::vector<std::string> user_messages;
+        std::vector<size_t> to_classify; // Indices into group
+        for (size_t i = 0; i < group.size(); i++) {
+            if (group[i].error.empty()) {
+                user_messages.push_back("From: " + group[i].from + "\nSubject: " + group[i].subject + "\n\n" +
+                                        group[i].text + "\n/no_think");
+                to_classify.push_back(i);
+            }
+        }
+        std::vector<Result> results(group.size());
+        if (options_.generate && !user_messages.empty()) {
+            const auto t_classify = PerfClock::now();
+            const std::vector<std::string> raw = engine_.completeBatch(system_prompt, user_messages, kMaxClassificationChars);
+            const double group_ms = elapsedMs(t_classify);
+            const GenerationMetrics generation = engine_.getLastGenerationMetrics();
+            classify_ms_total += group_ms;
+            prefill_total += generation.prefill_tokens;
+            reused_total += generation.reused_tokens;
+            groups++;
+            // Per-message time and token counts are the group's, shared evenly
+            const int n = static_cast<int>(to_classify.size());
+            for (size_t k = 0; k < to_classify.size(); k++) {
+                Result& result = results[to_classify[k]];
+                result.raw = raw[k];
+                result.category = parseCategory(result.raw);
+                result.classify_ms = group_ms / n;
+                result.prefill_tokens = generation.prefill_tokens / n;
+                result.reused_tokens = generation.reused_tokens / n;
+            }
+        } else {
+            // One prefill per message and no sampling: the category is the most likely label
+            for (size_t k = 0; k < to_classify.size(); k++) {
+                Result& result = results[to_classify[k]];
+                const auto t_classify = PerfClock::now();
+                result.scores = engine_.classify(system_prompt, user_messages[k], options_.categories, answer_prefix);
+                result.classify_ms = elapsedMs(t_classify);
+                if (!result.scores.empty()) {
+                    const auto best = std::max_element(result.scores.begin(), result.scores.end());
+                    if (*best > 0.0) {
+                        result.category = options_.categories[best - result.scores.begin()];
+                    }
+                }
+                const GenerationMetrics generation = engine_.getLastGenerationMetrics();
+                result.prefill_tokens = generation.prefill_tokens;
+                result.reused_tokens = generation.reused_tokens;
+                classify_ms_total += result.classify_ms;
+                prefill_total += result.prefill_tokens;
+                reused_total += result.reused_tokens;
+            }
+            if (!to_classify.empty()) {
+                groups++;
+            }
+        }
+
+        for (size_t i = 0; i < group.size(); i++) {
+            if (group[i].error.empty()) {
+                classified_count++;
+                if (classified_count % 100 == 0) {
+                    LOG_INFO("BatchTriage::run", "Classified %d/%zu messages", classified_count, ids.size());
+                }
+            }
+            results[i].item = std::move(group[i]);
+            classified.push(std::move(results[i]));
+        }
+    }
+
+    for (auto& fetcher : fetchers) {
+        fetcher.join();
+    }
+    classified.close();
+    labeler.join();
+
+    const double total_ms = elapsedMs(run_start);
+    summary["messages"] = ids.size();
+    summary["classified"] = classified_count;
+    summary["labelled"] = labelled;
+    summary["errors"] = failed;
+    summary["per_category"] = per_category;
+    summary["total_ms"] = total_ms;
+    summary["messages_per_s"] = total_ms > 0.0 ? ids.size() * 1000.0 / total_ms : 0.0;
+    summary["classify_ms_mean"] = classified_count > 0 ? classify_ms_total / classified_count : 0.0;
+    summary["classify_groups"] = groups;
+    summary["inference_idle_ms"] = wait_ms_total;
+    summary["label_ms_total"] = label_ms_total;
+    summary["prefill_tokens_total"] = prefill_total;
+    summary["reused_tokens_total"] = reused_total;
+    if (!options_.report_path.empty()) {
+        summary["report"] = options_.report_path;
+    }
+    LOG_INFO("BatchTriage::run", "Done: %s", summary.dump().c_str());
+    return summary;
+}
@@ -0,0 +1,228 @@
+#include "EngineMetrics.h"
+#include "Logger.h"
+
+#include <cstdio>
+
+#include "httplib.h"
+
+namespace { // Anonymous namespace for helpers
+
+std::string formatValue(double v) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+void appendHeader(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void appendSample(std::string& out, const std::string& name, const std::string& labels, double value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += formatValue(value);
+    out += '\n';
+}
+
+std::string escapeLabelValue(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') escaped += '\\';
+        if (c == '\n') { escaped += "\\n"; continue; }
+        escaped += c;
+    }
+    return escaped;
+}
+
+} // end anonymous namespace
+
+MetricHistogram::MetricHistogram(std::vector<double> upper_bounds)
+    : bounds_(std::move(upper_bounds)),
+      buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void MetricHistogram::observe(double v) {
+    size_t i = 0;
+    while (i < bounds_.size() && v > bounds_[i]) {
+        ++i; // At most a dozen buckets; a linear scan beats a binary search here
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    sum_.add(v);
+    count_.inc();
+}
+
+void MetricHistogram::render(std::string& out, const std::string& name, const std::string& labels) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        std::string le = i < bounds_.size() ? formatValue(bounds_[i]) : "+Inf";
+        appendSample(out, name + "_bucket", labels + "le=\"" + le + "\"", static_cast<double>(cumulative));
+    }
+    std::string plain_labels = labels.empty() ? labels : labels.substr(0, labels.size() - 1); // Drop trailing comma
+    appendSample(out, name + "_sum", plain_labels, sum_.value());
+    appendSample(out, name + "_count", plain_labels, static_cast<double>(count_.value()));
+}
+
+EngineMetrics::ToolStats::ToolStats()
+    : latency_seconds({0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0}) {}
+
+EngineMetrics::EngineMetrics()
+    : decode_latency_seconds({0.005, 0.01, 0.02, 0.035, 0.05, 0.075, 0.1, 0.15, 0.25, 0.5, 1.0, 2.5}),
+      prefill_tokens_per_second({10, 25, 50, 100, 200, 400, 800, 1600, 3200, 6400}),
+      ttft_seconds({0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0}),
+      memory_lookup_seconds({0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.1}),
+      idle_preemption_seconds({0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0}) {}
+
+EngineMetrics& EngineMetrics::instance() {
+    static EngineMetrics metrics;
+    return metrics;
+}
+
+void EngineMetrics::recordToolCall(const std::string& tool_name, double seconds, bool error) {
+    ToolStats* stats = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        auto& slot = tools_[tool_name];
+        if (!slot) {
+            slot.reset(new ToolStats());
+        }
+        stats = slot.get(); // Entries are never removed, so the pointer stays valid
+    }
+    stats->calls.inc();
+    if (error) {
+        stats->errors.inc();
+    }
+    stats->latency_seconds.observe(seconds);
+}
+
+std::string EngineMetrics::render() const {
+    std::string out;
+    out.reserve(8192);
+
+    appendHeader(out, "maimail_decode_latency_seconds", "histogram", "Time spent in llama_decode per generated token.");
+    decode_latency_seconds.render(out, "maimail_decode_latency_seconds", "");
+
+    appendHeader(out, "maimail_prefill_tokens_per_second", "histogram", "Prompt ingestion throughput per prefill pass.");
+    prefill_tokens_per_second.render(out, "maimail_prefill_tokens_per_second", "");
+
+    appendHeader(out, "maimail_time_to_first_token_seconds", "histogram", "Time from prompt submission to the first sampled token.");
+    ttft_seconds.render(out, "maimail_time_to_first_token_seconds", "");
+
+    appendHeader(out, "maimail_prefill_tokens_total", "counter", "Prompt tokens decoded.");
+    appendSample(out, "maimail_prefill_tokens_total", "", static_cast<double>(prefill_tokens_total.value()));
+    appendHeader(out, "maimail_prefill_seconds_total", "counter", "Time spent decoding prompt tokens.");
+    appendSample(out, "maimail_prefill_seconds_total", "", prefill_seconds_total.value());
+    appendHeader(out, "maimail_generated_tokens_total", "counter", "Tokens sampled.");
+    appendSample(out, "maimail_generated_tokens_total", "", static_cast<double>(generated_tokens_total.value()));
+    appendHeader(out, "maimail_decode_seconds_total", "counter", "Time spent decoding generated tokens.");
+    appendSample(out, "maimail_decode_seconds_total", "", decode_seconds_total.value());
+
+    const uint64_t prompt_tokens = prompt_tokens_total.value();
+    const uint64_t reused_tokens = prompt_tokens_reused_total.value();
+    appendHeader(out, "maimail_prompt_tokens_total", "counter", "Tokens in formatted prompts, including those reused from the KV cache.");
+    appendSample(out, "maimail_prompt_tokens_total", "", static_cast<double>(prompt_tokens));
+    appendHeader(out, "maimail_prompt_tokens_reused_total", "counter", "Prompt tokens served from the KV cache instead of being decoded.");
+    appendSample(out, "maimail_prompt_tokens_reused_total", "", static_cast<double>(reused_tokens));
+    appendHeader(out, "maimail_kv_cache_hit_ratio", "gauge", "Fraction of all prompt tokens reused from the KV cache.");
+    appendSample(out, "maimail_kv_cache_hit_ratio", "", prompt_tokens ? static_cast<double>(reused_tokens) / prompt_tokens : 0.0);
+
+    const int64_t kv_tokens = kv_cache_tokens.value();
+    const int64_t kv_capacity = kv_cache_capacity.value();
+    appendHeader(out, "maimail_kv_cache_tokens", "gauge", "Tokens currently held in the KV cache.");
+    appendSample(out, "maimail_kv_cache_tokens", "", static_cast<double>(kv_tokens));
+    appendHeader(out, "maimail_kv_cache_capacity_tokens", "gauge", "Context size (n_ctx).");
+    appendSample(out, "maimail_kv_cache_capacity_tokens", "", static_cast<double>(kv_capacity));
+    appendHeader(out, "maimail_kv_cache_occupancy_ratio", "gauge", "KV cache tokens divided by n_ctx.");
+    appendSample(out, "maimail_kv_cache_occupancy_ratio", "", kv_capacity ? static_cast<double>(kv_tokens) / kv_capacity : 0.0);
+
+    appendHeader(out, "maimail_context_shifts_total", "counter", "Times old tokens were evicted to fit the context.");
+    appendSample(out, "maimail_context_shifts_total", "", static_cast<double>(context_shifts_total.value()));
+    appendHeader(out, "maimail_history_compactions_total", "counter", "Times older turns were replaced by a summary.");
+    appendSample(out, "maimail_history_compactions_total", "", static_cast<double>(history_compactions_total.value()));
+    appendHeader(out, "maimail_memory_lookup_seconds", "histogram", "Time to search the long-term memory, per turn.");
+    memory_lookup_seconds.render(out, "maimail_memory_lookup_seconds", "");
+    appendHeader(out, "maimail_memory_recalled_entries_total", "counter", "Memory entries put back into the conversation.");
+    appendSample(out, "maimail_memory_recalled_entries_total", "", static_cast<double>(memory_recalled_entries_total.value()));
+    appendHeader(out, "maimail_idle_jobs_total", "counter", "Idle-time background jobs run to completion.");
+    appendSample(out, "maimail_idle_jobs_total", "", static_cast<double>(idle_jobs_total.value()));
+    appendHeader(out, "maimail_idle_jobs_preempted_total", "counter", "Idle-time job runs interrupted by a foreground call.");
+    appendSample(out, "maimail_idle_jobs_preempted_total", "", static_cast<double>(idle_jobs_preempted_total.value()));
+    appendHeader(out, "maimail_idle_job_seconds_total", "counter", "Time spent in idle-time background jobs.");
+    appendSample(out, "maimail_idle_job_seconds_total", "", idle_job_seconds_total.value());
+    appendHeader(out, "maimail_idle_preemption_seconds", "histogram", "Time a foreground call waited for a preempted idle job to release the engine.");
+    idle_preemption_seconds.render(out, "maimail_idle_preemption_seconds", "");
+    appendHeader(out, "maimail_cascade_routes_total", "counter", "Tool-loop steps of the model cascade, by what decided them.");
+    appendSample(out, "maimail_cascade_routes_total", "decision=\"tool\"", static_cast<double>(cascade_tool_calls_total.value()));
+    appendSample(out, "maimail_cascade_routes_total", "decision=\"answer\"", static_cast<double>(cascade_answers_total.value()));
+    appendSample(out, "maimail_cascade_routes_total", "decision=\"escalated\"", static_cast<double>(cascade_escalations_total.value()));
+    appendHeader(out, "maimail_turns_total", "counter", "Completed chat turns.");
+    appendSample(out, "maimail_turns_total", "", static_cast<double>(turns_total.value()));
+    appendHeader(out, "maimail_tool_prefetches_total", "counter", "Tool requests started before the model finished asking for them.");
+    appendSample(out, "maimail_tool_prefetches_total", "", static_cast<double>(tool_prefetches_total.value()));
+    appendHeader(out, "maimail_tool_prefetch_hits_total", "counter", "Tool calls answered by a prefetched response.");
+    appendSample(out, "maimail_tool_prefetch_hits_total", "", static_cast<double>(tool_prefetch_hits_total.value()));
+
+    std::lock_guard<std::mutex> lock(tools_mutex_);
+    appendHeader(out, "maimail_tool_calls_total", "counter", "Tool calls sent to the Gmail microservice.");
+    for (const auto& [name, stats] : tools_) {
+        appendSample(out, "maimail_tool_calls_total", "tool_name=\"" + escapeLabelValue(name) + "\"", static_cast<double>(stats->calls.value()));
+    }
+    appendHeader(out, "maimail_tool_errors_total", "counter", "Tool calls that failed (transport error or non-2xx status).");
+    for (const auto& [name, stats] : tools_) {
+        appendSample(out, "maimail_tool_errors_total", "tool_name=\"" + escapeLabelValue(name) + "\"", static_cast<double>(stats->errors.value()));
+    }
+    appendHeader(out, "maimail_tool_latency_seconds", "histogram", "Round-trip time of tool calls.");
+    for (const auto& [name, stats] : tools_) {
+        stats->latency_seconds.render(out, "maimail_tool_latency_seconds", "tool_name=\"" + escapeLabelValue(name) + "\",");
+    }
+    return out;
+}
+
+MetricsServer::MetricsServer() = default;
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start(const std::string& host, int port) {
+    stop();
+    server_.reset(new httplib::Server());
+    server_->Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+        res.set_content(EngineMetrics::instance().render(), "text/plain; version=0.0.4; charset=utf-8");
+    });
+    if (!server_->bind_to_port(host, port)) {
+        LOG_ERROR("MetricsServer::start", "Could not bind metrics endpoint to %s:%d", host.c_str(), port);
+        server_.reset();
+        return false;
+    }
+    thread_.reset(new std::thread([this]() { server_->listen_after_bind(); }));
+    LOG_INFO("MetricsServer::start", "Serving Prometheus metrics at http://%s:%d/metrics", host.c_str(), port);
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (server_) {
+        server_->stop();
+    }
+    if (thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+    thread_.reset();
+    server_.reset();
+}
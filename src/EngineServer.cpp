@@ -0,0 +1,462 @@
+#include "EngineServer.h"
+#include "EngineMetrics.h"
+#include "IdleScheduler.h"
+#include "Logger.h"
+
+#include "httplib.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+
+void sendError(httplib::Response& res, int status, const std::string& detail) {
+    res.status = status;
+    res.set_content(json{{"detail", detail}}.dump(), "application/json");
+}
+
+void sendJson(httplib::Response& res, const json& body) {
+    res.set_content(body.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+}
+
+// The engine queue is full: the client retries later instead of holding a connection
+void sendBusy(httplib::Response& res) {
+    res.set_header("Retry-After", "1");
+    sendError(res, 503, "The engine is busy; too many requests are queued");
+}
+
+// Parses the request body as a JSON object; sends 400 and returns false otherwise
+bool parseBody(const httplib::Request& req, httplib::Response& res, json& body) {
+    body = json::parse(req.body, nullptr, /*allow_exceptions=*/false);
+    if (body.is_discarded() || !body.is_object()) {
+        sendError(res, 400, "Request body must be a JSON object");
+        return false;
+    }
+    return true;
+}
+
+std::string sseEvent(const char* event, const json& data) {
+    std::string out;
+    if (event) {
+        out += "event: ";
+        out += event;
+        out += "\n";
+    }
+    out += "data: " + data.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+    return out;
+}
+
+// The last assistant message of a conversation (the reply without tool-call rounds)
+std::string lastReply(const std::vector<ChatMessage>& history) {
+    for (auto it = history.rbegin(); it != history.rend(); ++it) {
+        if (it->role == "assistant") return it->content;
+    }
+    return "";
+}
+
+} // namespace
+
+struct EngineServer::EngineLease {
+    // Draws a ticket without waiting; false if max_queued_ requests already wait
+    explicit EngineLease(EngineServer& server) : server_(server) {
+        std::lock_guard<std::mutex> lock(server_.schedule_mutex_);
+        if (server_.next_ticket_ - server_.now_serving_ > server_.max_queued_) {
+            return;
+        }
+        ticket_ = server_.next_ticket_++;
+        drawn_ = true;
+    }
+    // Releases the engine, or gives up the place in the queue if the turn never came
+    ~EngineLease() {
+        if (!drawn_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(server_.schedule_mutex_);
+        if (ticket_ != server_.now_serving_) {
+            server_.abandoned_tickets_.insert(ticket_);
+            return;
+        }
+        server_.now_serving_++;
+        while (server_.abandoned_tickets_.erase(server_.now_serving_) > 0) {
+            server_.now_serving_++;
+        }
+        server_.schedule_cv_.notify_all();
+    }
+    EngineLease(const EngineLease&) = delete;
+    EngineLease& operator=(const EngineLease&) = delete;
+
+    explicit operator bool() const { return drawn_; }
+
+    // Blocks until this request has the engine
+    void wait() {
+        std::unique_lock<std::mutex> lock(server_.schedule_mutex_);
+        server_.schedule_cv_.wait(lock, [&]() { return server_.now_serving_ == ticket_; });
+    }
+
+private:
+    EngineServer& server_;
+    uint64_t ticket_ = 0;
+    bool drawn_ = false;
+};
+
+struct EngineServer::SessionPin {
+    // Pins `session_id`, or a new session if it is empty; false if the session does not exist
+    SessionPin(EngineServer& server, const std::string& session_id) : server_(server) {
+        std::lock_guard<std::mutex> lock(server_.sessions_mutex_);
+        if (session_id.empty()) {
+            id_ = server_.createSessionLocked();
+        } else if (server_.sessions_.count(session_id) > 0) {
+            id_ = session_id;
+        } else {
+            return;
+        }
+        server_.sessions_[id_].pins++;
+    }
+    ~SessionPin() {
+        if (id_.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(server_.sessions_mutex_);
+        auto it = server_.sessions_.find(id_);
+        if (it != server_.sessions_.end()) { // Gone if it was deleted meanwhile
+            it->second.pins--;
+        }
+    }
+    SessionPin(const SessionPin&) = delete;
+    SessionPin& operator=(const SessionPin&) = delete;
+
+    explicit operator bool() const { return !id_.empty(); }
+    const std::string& id() const { return id_; }
+
+private:
+    EngineServer& server_;
+    std::string id_;
+};
+
+EngineServer::EngineServer(LlamaInference& engine) : engine_(engine), server_(new httplib::Server()) {
+    registerRoutes();
+}
+
+EngineServer::~EngineServer() {
+    stop();
+    if (!socket_path_.empty()) {
+        unlink(socket_path_.c_str());
+    }
+}
+
+bool EngineServer::bind(const std::string& host, int port) {
+    if (!server_->bind_to_port(host, port)) {
+        LOG_ERROR("EngineServer::bind", "Could not bind to %s:%d", host.c_str(), port);
+        return false;
+    }
+    LOG_INFO("EngineServer::bind", "Listening on http://%s:%d", host.c_str(), port);
+    return true;
+}
+
+bool EngineServer::bindUnix(const std::string& socket_path) {
+    // A stale socket from a previous run would make bind() fail; anything else is left alone
+    struct stat st;
+    if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path.c_str());
+    }
+    server_->set_address_family(AF_UNIX);
+    if (!server_->bind_to_port(socket_path, 80)) {
+        LOG_ERROR("EngineServer::bindUnix", "Could not bind to Unix socket %s", socket_path.c_str());
+        return false;
+    }
+    socket_path_ = socket_path;
+    LOG_INFO("EngineServer::bindUnix", "Listening on unix:%s", socket_path.c_str());
+    return true;
+}
+
+void EngineServer::serve() {
+    // Every queued request keeps a connection thread while it waits for the engine;
+    // the spare threads serve requests that never wait for it
+    constexpr size_t kSpareThreads = 4;
+    const size_t threads = max_queued_ + 1 + kSpareThreads;
+    server_->new_task_queue = [threads]() { return new httplib::ThreadPool(threads); };
+    server_->listen_after_bind();
+}
+
+void EngineServer::stop() {
+    if (server_) {
+        server_->stop();
+    }
+}
+
+std::string EngineServer::createSession() {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    return createSessionLocked();
+}
+
+std::string EngineServer::createSessionLocked() {
+    static std::mt19937_64 rng{std::random_device{}()};
+    char id[40];
+    snprintf(id, sizeof(id), "s%llu-%016llx", static_cast<unsigned long long>(++session_counter_),
+             static_cast<unsigned long long>(rng()));
+    sessions_[id].last_used = PerfClock::now();
+
+    // Pinned sessions stay, even if that leaves more than max_sessions_ until a later call
+    while (sessions_.size() > max_sessions_) {
+        auto oldest = sessions_.end();
+        for (auto it = sessions_.begin(); it != sessions_.end(); ++it) {
+            if (it->second.pins > 0 || it->first == id) continue;
+            if (oldest == sessions_.end() || it->second.last_used < oldest->second.last_used) oldest = it;
+        }
+        if (oldest == sessions_.end()) break;
+        LOG_DEBUG("EngineServer::createSession", "Dropping least recently used session %s", oldest->first.c_str());
+        sessions_.erase(oldest);
+    }
+    return id;
+}
+
+bool EngineServer::activateSession(const std::string& session_id) {
+    std::vector<ChatMessage> history;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        auto it = sessions_.find(session_id);
+        if (it == sessions_.end()) {
+            return false;
+        }
+        it->second.last_used = PerfClock::now();
+        if (session_id == active_session_) {
+            return true;
+        }
+        history = it->second.history;
+    }
+    engine_.importHistory(history);
+    active_session_ = session_id;
+    return true;
+}
+
+void EngineServer::saveSession(const std::string& session_id) {
+    std::vector<ChatMessage> history = engine_.exportHistory();
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    auto it = sessions_.find(session_id);
+    if (it != sessions_.end()) {
+        it->second.history = std::move(history);
+    }
+}
+
+void EngineServer::registerRoutes() {
+    server_->Get("/health", [this](const httplib::Request&, httplib::Response& res) {
+        json config = engine_.describeConfig();
+        config.erase("system_prompt");
+        sendJson(res, json{{"status", "ok"}, {"engine", config}, {"idle", engine_.idleScheduler().stats()}});
+    });
+
+    server_->Post("/reload", [this](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        if (!parseBody(req, res, body)) return;
+        // Deliberately not leased: requests keep running on the current engine while the
+        // new one loads, and reconfigure() swaps them between two calls
+        if (!engine_.reconfigure(body.value("model", ""), body.value("n_ctx", 0), body.value("n_gpu_layers", -1))) {
+            sendError(res, 500, "The new engine failed to load; the current one is still serving");
+            return;
+        }
+        json config = engine_.describeConfig();
+        config.erase("system_prompt");
+        sendJson(res, json{{"status", "ok"}, {"engine", config}});
+    });
+
+    server_->Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+        res.set_content(EngineMetrics::instance().render(), "text/plain; version=0.0.4; charset=utf-8");
+    });
+
+    server_->Post("/sessions", [this](const httplib::Request&, httplib::Response& res) {
+        sendJson(res, json{{"session_id", createSession()}});
+    });
+
+    server_->Delete("/sessions/:id", [this](const httplib::Request& req, httplib::Response& res) {
+        const std::string id = req.path_params.at("id");
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        if (sessions_.erase(id) == 0) {
+            sendError(res, 404, "Unknown session");
+            return;
+        }
+        sendJson(res, json{{"session_id", id}, {"deleted", true}});
+    });
+
+    server_->Post("/chat", [this](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        if (!parseBody(req, res, body)) return;
+        if (!body.contains("message") || !body["message"].is_string()) {
+            sendError(res, 400, "'message' (string) is required");
+            return;
+        }
+        if (body.contains("session_id") && !body["session_id"].is_string()) {
+            sendError(res, 400, "'session_id' must be a string");
+            return;
+        }
+        if (body.contains("stream") && !body["stream"].is_boolean()) {
+            sendError(res, 400, "'stream' must be a boolean");
+            return;
+        }
+        const std::string message = body["message"].get<std::string>();
+        // Shared so a streamed reply can carry both into its content provider
+        auto lease = std::make_shared<EngineLease>(*this);
+        if (!*lease) {
+            sendBusy(res);
+            return;
+        }
+        auto pin = std::make_shared<SessionPin>(*this, body.value("session_id", ""));
+        if (!*pin) {
+            sendError(res, 404, "Unknown session");
+            return;
+        }
+        const std::string session_id = pin->id();
+
+        if (!body.value("stream", false)) {
+            lease->wait();
+            if (!activateSession(session_id)) {
+                sendError(res, 404, "Unknown session");
+                return;
+            }
+            std::string output;
+            engine_.chat(message, false, output, []() {});
+            saveSession(session_id);
+            const std::vector<ChatMessage> history = engine_.exportHistory();
+            sendJson(res, json{
+                {"session_id", session_id},
+                {"reply", lastReply(history)},
+                {"output", output},
+                {"metrics", engine_.getLastTurnMetrics().toJson()},
+            });
+            return;
+        }
+
+        // Streaming: the turn runs inside the content provider, writing each new piece
+        // of output as an event as soon as the engine produces it
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider("text/event-stream",
+            [this, message, session_id, lease, pin](size_t /* offset */, httplib::DataSink& sink) {
+                lease->wait();
+                if (!activateSession(session_id)) {
+                    const std::string event = sseEvent("error", json{{"detail", "Unknown session"}});
+                    sink.write(event.data(), event.size());
+                    sink.done();
+                    return true;
+                }
+                const std::string start = sseEvent("session", json{{"session_id", session_id}});
+                sink.write(start.data(), start.size());
+
+                std::string output;
+                size_t sent = 0;
+                bool connected = true;
+                // The engine only streams whole UTF-8 characters, so every delta is valid on its own
+                auto flush = [&]() {
+                    if (!connected || output.size() <= sent) return;
+                    const std::string event = sseEvent(nullptr, json{{"delta", output.substr(sent)}});
+                    connected = sink.write(event.data(), event.size());
+                    sent = output.size();
+                };
+                // The turn still completes if the client goes away, so the session stays consistent
+                engine_.chat(message, true, output, flush);
+                flush();
+                saveSession(session_id);
+
+                if (connected) {
+                    const std::vector<ChatMessage> history = engine_.exportHistory();
+                    const std::string done = sseEvent("done", json{
+                        {"session_id", session_id},
+                        {"reply", lastReply(history)},
+                        {"metrics", engine_.getLastTurnMetrics().toJson()},
+                    });
+                    sink.write(done.data(), done.size());
+                }
+                sink.done();
+                return true;
+            });
+    });
+
+    server_->Post("/complete", [this](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        if (!parseBody(req, res, body)) return;
+        if (!body.contains("message") || !body["message"].is_string()) {
+            sendError(res, 400, "'message' (string) is required");
+            return;
+        }
+        EngineLease lease(*this);
+        if (!lease) {
+            sendBusy(res);
+            return;
+        }
+        lease.wait();
+        const std::string text = engine_.completeOnce(body.value("system", ""), body["message"].get<std::string>(),
+                                                      body.value("max_chars", 0));
+        sendJson(res, json{{"text", text}, {"metrics", engine_.getLastGenerationMetrics().toJson()}});
+    });
+
+    server_->Post("/classify", [this](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        if (!parseBody(req, res, body)) return;
+        if (!body.contains("text") || !body["text"].is_string() || !body.contains("labels") || !body["labels"].is_array()) {
+            sendError(res, 400, "'text' (string) and 'labels' (array of strings) are required");
+            return;
+        }
+        std::vector<std::string> labels;
+        for (const auto& label : body["labels"]) {
+            if (!label.is_string()) {
+                sendError(res, 400, "'labels' must contain strings only");
+                return;
+            }
+            labels.push_back(label.get<std::string>());
+        }
+        if (labels.empty()) {
+            sendError(res, 400, "'labels' must not be empty");
+            return;
+        }
+        std::vector<double> probabilities;
+        {
+            EngineLease lease(*this);
+            if (!lease) {
+                sendBusy(res);
+                return;
+            }
+            lease.wait();
+            probabilities = engine_.classify(body.value("system", ""), body["text"].get<std::string>(), labels,
+                                             body.value("answer_prefix", ""));
+        }
+        if (probabilities.empty()) {
+            sendError(res, 500, "Classification failed");
+            return;
+        }
+        const size_t best = std::max_element(probabilities.begin(), probabilities.end()) - probabilities.begin();
+        sendJson(res, json{{"label", labels[best]}, {"labels", labels}, {"probabilities", probabilities}});
+    });
+
+    server_->Post("/embeddings", [this](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        if (!parseBody(req, res, body)) return;
+        std::vector<std::string> inputs;
+        const json input = body.value("input", json());
+        if (input.is_string()) {
+            inputs.push_back(input.get<std::string>());
+        } else if (input.is_array() && std::all_of(input.begin(), input.end(), [](const json& v) { return v.is_string(); })) {
+            inputs = input.get<std::vector<std::string>>();
+        } else {
+            sendError(res, 400, "'input' must be a string or an array of strings");
+            return;
+        }
+        std::vector<std::vector<float>> embeddings;
+        {
+            EngineLease lease(*this);
+            if (!lease) {
+                sendBusy(res);
+                return;
+            }
+            lease.wait();
+            embeddings = engine_.embed(inputs);
+        }
+        const size_t dim = embeddings.empty() ? 0 : embeddings.front().size();
+        sendJson(res, json{{"embeddings", embeddings}, {"dim", dim}});
+    });
+}
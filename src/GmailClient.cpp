@@ -0,0 +1,137 @@
+#include "GmailClient.h"
+#include "Logger.h"
+
+#include <iomanip> // Required for std::setw, std::hex
+#include <sstream> // Required for std::ostringstream
+
+#include "httplib.h"
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+
+// URL encode a query-string key or value
+std::string url_encode(const std::string& value) {
+    std::ostringstream escaped;
+    escaped.fill('0');
+    escaped << std::hex;
+
+    for (char c : value) {
+        // Keep alphanumeric and other safe characters like - _ . ! ~ * ' ( )
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '!' || c == '~' ||
+            c == '*' || c == '\'' || c == '(' || c == ')') {
+            escaped << c;
+        } else if (c == ' ') { // Special case for space
+            escaped << '+';
+        }
+        else {
+            // Any other characters are percent-encoded
+            escaped << '%' << std::setw(2) << std::uppercase << static_cast<int>(static_cast<unsigned char>(c));
+        }
+    }
+    return escaped.str();
+}
+
+} // namespace
+
+GmailClient::GmailClient(const std::string& base_url) : base_url_(base_url) {}
+
+std::string GmailClient::request(const std::string& http_method, const std::string& endpoint, const json& params) const {
+    httplib::Client cli(base_url_.c_str());
+    cli.set_connection_timeout(10); // 10 seconds
+    cli.set_read_timeout(30);       // 30 seconds
+
+    httplib::Result res;
+    std::string params_str = params.empty() ? "" : params.dump();
+    std::string request_path = endpoint;
+
+    // Convert http_method to uppercase for reliable comparison
+    std::string method_upper = http_method;
+    for (char &c : method_upper) {
+        c = toupper(c);
+    }
+
+    if (method_upper == "POST") {
+        if (!params_str.empty()) {
+            res = cli.Post(endpoint.c_str(), params_str, "application/json");
+        } else { // POST with no body
+            res = cli.Post(endpoint.c_str());
+        }
+    } else if (method_upper == "GET") {
+        // For GET, parameters are typically URL-encoded.
+        if (!params.empty()) {
+            std::string query_string = "?";
+            bool first_param = true;
+            for (auto& [key, val] : params.items()) {
+                if (!first_param) {
+                    query_string += "&";
+                }
+                // Basic URL encoding for key and value might be needed here if they can contain special characters.
+                // httplib itself doesn't directly expose a general purpose URL encoder for query params.
+                // For simplicity, assuming keys are safe and values are simple strings/numbers.
+                // Proper URL encoding: httplib::detail::encode_url can be studied or use a library if complex values are expected.
+                query_string += url_encode(key); // Use url_encode for key
+                query_string += "=";
+                if (val.is_string()) {
+                    query_string += url_encode(val.get<std::string>()); // URL encode string value
+                } else if (val.is_number_integer()) {
+                    query_string += std::to_string(val.get<long long>()); // "20", which int query parameters accept
+                } else if (val.is_number()) {
+                    query_string += url_encode(std::to_string(val.get<double>())); // Encode number as string
+                } else if (val.is_boolean()) {
+                    query_string += val.get<bool>() ? "true" : "false"; // Booleans are typically fine
+                } else if (val.is_null()) {
+                    // How to handle null? Skip or empty string? Skipping for now.
+                    // query_string += "";
+                }
+                // Add other type handlers if necessary
+                first_param = false;
+            }
+            request_path += query_string;
+            LOG_DEBUG("GmailClient::request", "Constructed GET request path with query: %s", request_path.c_str());
+        }
+        res = cli.Get(request_path.c_str());
+    } else if (method_upper == "DELETE") {
+        // For DELETE, if there are params, they might be in query string or body.
+        // httplib's Delete takes body. If params are for query, adjust path.
+        // Gmail API for delete_label and trash_message uses ID in path, no body.
+        // Our current tool_params.erase for these cases handles it.
+        // If a DELETE tool needed a body, params_str would be used.
+        res = cli.Delete(endpoint.c_str(), params_str, "application/json");
+    } else if (method_upper == "PUT") { // Added PUT method
+        if (!params_str.empty()) {
+            res = cli.Put(endpoint.c_str(), params_str, "application/json");
+        } else { // PUT with no body (less common but possible)
+            res = cli.Put(endpoint.c_str());
+        }
+    }
+    // Add other methods like PUT if needed
+    else {
+        json error_response;
+        error_response["error"] = "Unsupported HTTP method for tool request: " + http_method;
+        return error_response.dump();
+    }
+
+    if (res) {
+        if (res->status >= 200 && res->status < 300) {
+            return res->body.empty() ? "{}" : res->body; // Return empty JSON if body is empty
+        } else {
+            json error_response;
+            error_response["error"] = "Tool request failed";
+            error_response["status_code"] = res->status;
+            error_response["reason"] = res->reason;
+            error_response["body"] = res->body;
+            LOG_ERROR("GmailClient::request", "Tool request error: %s", error_response.dump().c_str());
+            return error_response.dump();
+        }
+    } else {
+        auto err = res.error();
+        json error_response;
+        error_response["error"] = "Tool request HTTP library error";
+        error_response["httplib_error_code"] = static_cast<int>(err); // httplib::Error is an enum
+        error_response["httplib_error_message"] = httplib::to_string(err);
+        LOG_ERROR("GmailClient::request", "Tool request httplib error: %s", error_response.dump().c_str());
+        return error_response.dump();
+    }
+}
@@ -0,0 +1,187 @@
+#include "IdleScheduler.h"
+#include "EngineMetrics.h"
+#include "Logger.h"
+
+#include <algorithm>
+
+#include "nlohmann/json.hpp"
+
+namespace {
+
+// Scheduler whose worker the current thread is, if any
+thread_local const IdleScheduler* t_worker_of = nullptr;
+
+} // namespace
+
+IdleScheduler::IdleScheduler(int idle_delay_ms) : idle_delay_(std::max(0, idle_delay_ms)) {}
+
+IdleScheduler::~IdleScheduler() {
+    stop();
+}
+
+void IdleScheduler::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (worker_.joinable()) {
+        return;
+    }
+    stop_ = false;
+    stopping_ = false;
+    last_activity_ = Clock::now();
+    worker_ = std::thread(&IdleScheduler::run, this);
+}
+
+void IdleScheduler::stop() {
+    std::thread worker;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        stopping_ = true;
+        preempted_ = true;
+        queue_.clear();
+        worker.swap(worker_);
+    }
+    wake_.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    stopping_ = false;
+}
+
+bool IdleScheduler::running() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !stop_;
+}
+
+void IdleScheduler::setIdleDelay(int idle_delay_ms) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_delay_ = std::chrono::milliseconds(std::max(0, idle_delay_ms));
+    }
+    wake_.notify_all();
+}
+
+void IdleScheduler::submit(const std::string& name, int priority, Job job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+            return;
+        }
+        queue_.erase(std::remove_if(queue_.begin(), queue_.end(), [&](const Queued& q) { return q.name == name; }),
+                     queue_.end());
+        queue_.push_back(Queued{name, priority, next_seq_++, std::move(job)});
+    }
+    wake_.notify_all();
+}
+
+void IdleScheduler::foregroundBegin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    foreground_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void IdleScheduler::foregroundEnd() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        foreground_.fetch_sub(1, std::memory_order_acq_rel);
+        last_activity_ = Clock::now();
+    }
+    wake_.notify_all();
+}
+
+bool IdleScheduler::onWorkerThread() const {
+    return t_worker_of == this;
+}
+
+bool IdleScheduler::idleLocked() const {
+    return foreground_.load(std::memory_order_acquire) == 0 && Clock::now() >= last_activity_ + idle_delay_;
+}
+
+bool IdleScheduler::workerEnter() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // While stopping, the job enters and yields at its first check
+    if (!stop_ && !idleLocked()) {
+        return false;
+    }
+    worker_in_engine_.store(true, std::memory_order_release);
+    return true;
+}
+
+void IdleScheduler::waitForIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_ && !idleLocked()) {
+        if (foreground_.load(std::memory_order_acquire) > 0) {
+            wake_.wait(lock);
+        } else {
+            wake_.wait_until(lock, last_activity_ + idle_delay_);
+        }
+    }
+}
+
+void IdleScheduler::workerLeave() {
+    worker_in_engine_.store(false, std::memory_order_release);
+}
+
+void IdleScheduler::run() {
+    t_worker_of = this;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        if (queue_.empty() || foreground_.load(std::memory_order_acquire) > 0) {
+            wake_.wait(lock);
+            continue;
+        }
+        const auto idle_until = last_activity_ + idle_delay_;
+        if (Clock::now() < idle_until) {
+            wake_.wait_until(lock, idle_until);
+            continue;
+        }
+
+        auto next = std::min_element(queue_.begin(), queue_.end(), [](const Queued& a, const Queued& b) {
+            return a.priority != b.priority ? a.priority > b.priority : a.seq < b.seq;
+        });
+        Queued job = std::move(*next);
+        queue_.erase(next);
+        running_name_ = job.name;
+        preempted_ = false;
+        runs_++;
+        lock.unlock();
+
+        const auto t_start = Clock::now();
+        const bool done = job.job(preempted_);
+        const double seconds = std::chrono::duration<double>(Clock::now() - t_start).count();
+
+        lock.lock();
+        running_name_.clear();
+        busy_seconds_ += seconds;
+        EngineMetrics::instance().idle_job_seconds_total.add(seconds);
+        if (preempted_.load(std::memory_order_acquire) && !stop_) {
+            preemptions_++;
+            EngineMetrics::instance().idle_jobs_preempted_total.inc();
+            LOG_DEBUG("IdleScheduler::run", "Idle job '%s' preempted after %.0f ms", job.name.c_str(), seconds * 1000.0);
+        }
+        if (done) {
+            completed_++;
+            EngineMetrics::instance().idle_jobs_total.inc();
+            LOG_DEBUG("IdleScheduler::run", "Idle job '%s' done in %.0f ms", job.name.c_str(), seconds * 1000.0);
+        } else if (!stop_ && std::none_of(queue_.begin(), queue_.end(), [&](const Queued& q) { return q.name == job.name; })) {
+            // Not finished: back in the queue, behind nothing newer of the same name
+            queue_.push_back(std::move(job));
+        }
+    }
+    t_worker_of = nullptr;
+}
+
+nlohmann::json IdleScheduler::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    nlohmann::json queued = nlohmann::json::array();
+    for (const auto& q : queue_) {
+        queued.push_back(q.name);
+    }
+    return nlohmann::json{
+        {"running", !stop_},
+        {"job", running_name_},
+        {"queued", std::move(queued)},
+        {"runs", runs_},
+        {"completed", completed_},
+        {"preempted", preemptions_},
+        {"busy_seconds", busy_seconds_},
+    };
+}
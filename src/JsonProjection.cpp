@@ -0,0 +1,278 @@
+#include "JsonProjection.h"
+
+using json = nlohmann::json;
+
+namespace {
+
+// Base for the handlers below: every event is accepted and ignored, and a syntax error
+// ends the parse (sax_parse then returns false instead of throwing)
+struct IgnoringSax {
+    bool null() { return true; }
+    bool boolean(bool) { return true; }
+    bool number_integer(json::number_integer_t) { return true; }
+    bool number_unsigned(json::number_unsigned_t) { return true; }
+    bool number_float(json::number_float_t, const json::string_t&) { return true; }
+    bool string(json::string_t&) { return true; }
+    bool binary(json::binary_t&) { return true; }
+    bool start_object(std::size_t) { return true; }
+    bool key(json::string_t&) { return true; }
+    bool end_object() { return true; }
+    bool start_array(std::size_t) { return true; }
+    bool end_array() { return true; }
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) { return false; }
+};
+
+// Keeps "tool_name" and builds "parameters" of the root object; everything else is skipped
+class ToolCallSax : public IgnoringSax {
+public:
+    ToolCallSax(std::string& tool_name, json& params) : tool_name_(tool_name), params_(params) {}
+
+    bool null() { return value(nullptr); }
+    bool boolean(bool b) { return value(b); }
+    bool number_integer(json::number_integer_t n) { return value(n); }
+    bool number_unsigned(json::number_unsigned_t n) { return value(n); }
+    bool number_float(json::number_float_t n, const json::string_t&) { return value(n); }
+
+    bool string(json::string_t& s) {
+        if (depth_ == 1 && key_ == Key::ToolName) {
+            tool_name_ = s;
+            has_tool_name_ = true;
+            return true;
+        }
+        return value(s);
+    }
+
+    bool start_object(std::size_t) {
+        depth_++;
+        if (depth_ == 1) {
+            root_is_object_ = true;
+        } else if (depth_ == 2 && key_ == Key::Parameters) {
+            params_ = json::object(); // Repeated keys: the last one wins, as with json::parse
+            stack_.assign(1, &params_);
+        } else if (!stack_.empty()) {
+            stack_.push_back(insert(json::object()));
+        }
+        return true;
+    }
+
+    bool end_object() {
+        pop();
+        return true;
+    }
+
+    bool start_array(std::size_t) {
+        depth_++;
+        if (!stack_.empty()) {
+            stack_.push_back(insert(json::array()));
+        }
+        return true;
+    }
+
+    bool end_array() {
+        pop();
+        return true;
+    }
+
+    bool key(json::string_t& k) {
+        if (depth_ == 1) {
+            key_ = k == "tool_name" ? Key::ToolName : k == "parameters" ? Key::Parameters : Key::Other;
+        } else if (!stack_.empty()) {
+            object_key_ = k;
+        }
+        return true;
+    }
+
+    bool complete() const { return root_is_object_ && has_tool_name_; }
+
+private:
+    enum class Key { Other, ToolName, Parameters };
+
+    template <typename T>
+    bool value(T&& v) {
+        if (!stack_.empty()) {
+            insert(json(std::forward<T>(v)));
+        }
+        return true;
+    }
+
+    // Adds `v` to the container being built and returns it
+    json* insert(json&& v) {
+        json& parent = *stack_.back();
+        if (parent.is_object()) {
+            json& slot = parent[object_key_];
+            slot = std::move(v);
+            return &slot;
+        }
+        parent.push_back(std::move(v));
+        return &parent.back();
+    }
+
+    void pop() {
+        if (!stack_.empty()) {
+            stack_.pop_back();
+        }
+        depth_--;
+    }
+
+    std::string& tool_name_;
+    json& params_;
+    int depth_ = 0;
+    Key key_ = Key::Other;          // Current key of the root object
+    bool root_is_object_ = false;
+    bool has_tool_name_ = false;
+    std::vector<json*> stack_;      // Containers under construction inside "parameters"
+    std::string object_key_;
+};
+
+unsigned fieldOf(const std::string& key) {
+    if (key == "id") return kMessageId;
+    if (key == "threadId") return kMessageThreadId;
+    if (key == "from") return kMessageFrom;
+    if (key == "subject") return kMessageSubject;
+    if (key == "snippet") return kMessageSnippet;
+    if (key == "date") return kMessageDate;
+    if (key == "labelIds") return kMessageLabelIds;
+    if (key == "error") return kMessageError;
+    return 0;
+}
+
+// Walks {"messages": [{...}, ...]} or [{...}, ...] and copies the wanted string fields of
+// each message. Strings that are not kept are only seen in the lexer's buffer.
+class MessagesSax : public IgnoringSax {
+public:
+    MessagesSax(unsigned fields, std::vector<MessageSummary>& messages) : fields_(fields), messages_(messages) {}
+
+    bool string(json::string_t& s) {
+        if (!inMessages()) {
+            return true;
+        }
+        if (depth_ == messages_depth_ + 1 && field_ != 0 && field_ != kMessageLabelIds) {
+            MessageSummary& message = messages_.back();
+            target(message, field_) = s;
+            message.present |= field_;
+        } else if (in_labels_ && depth_ == messages_depth_ + 2) {
+            messages_.back().label_ids.push_back(s);
+        }
+        return true;
+    }
+
+    bool start_object(std::size_t) {
+        depth_++;
+        if (depth_ == 1) {
+            root_is_object_ = true;
+        } else if (inMessages() && depth_ == messages_depth_ + 1) {
+            messages_.emplace_back();
+        }
+        field_ = 0;
+        return true;
+    }
+
+    bool end_object() {
+        depth_--;
+        field_ = 0;
+        return true;
+    }
+
+    bool start_array(std::size_t) {
+        depth_++;
+        if ((depth_ == 1) || (depth_ == 2 && root_is_object_ && root_key_is_messages_)) {
+            if (messages_depth_ > 0) {
+                return false; // A second "messages" array
+            }
+            messages_depth_ = depth_;
+        } else if (inMessages() && depth_ == messages_depth_ + 2 && field_ == kMessageLabelIds) {
+            in_labels_ = true;
+            messages_.back().label_ids.clear();
+            messages_.back().present |= kMessageLabelIds;
+        }
+        return true;
+    }
+
+    bool end_array() {
+        if (in_labels_ && depth_ == messages_depth_ + 2) {
+            in_labels_ = false;
+        } else if (inMessages() && depth_ == messages_depth_) {
+            messages_done_ = true;
+        }
+        depth_--;
+        field_ = 0;
+        return true;
+    }
+
+    bool key(json::string_t& k) {
+        if (depth_ == 1 && root_is_object_) {
+            root_key_is_messages_ = k == "messages";
+        } else if (inMessages() && depth_ == messages_depth_ + 1) {
+            field_ = fieldOf(k) & fields_;
+        }
+        return true;
+    }
+
+    bool found() const { return messages_depth_ > 0; }
+
+private:
+    bool inMessages() const { return messages_depth_ > 0 && !messages_done_; }
+
+    static std::string& target(MessageSummary& m, unsigned field) {
+        switch (field) {
+            case kMessageId: return m.id;
+            case kMessageThreadId: return m.thread_id;
+            case kMessageFrom: return m.from;
+            case kMessageSubject: return m.subject;
+            case kMessageSnippet: return m.snippet;
+            case kMessageDate: return m.date;
+            default: return m.error;
+        }
+    }
+
+    const unsigned fields_;
+    std::vector<MessageSummary>& messages_;
+    int depth_ = 0;
+    int messages_depth_ = 0;        // Depth inside the messages array; 0 until it is found
+    bool root_is_object_ = false;
+    bool root_key_is_messages_ = false;
+    bool messages_done_ = false;
+    bool in_labels_ = false;
+    unsigned field_ = 0;            // Kept field the current key of a message names, if any
+};
+
+} // namespace
+
+bool projectToolCall(std::string_view text, std::string& tool_name, json& params) {
+    std::string name;
+    json parameters = json::object();
+    ToolCallSax sax(name, parameters);
+    if (!json::sax_parse(text.begin(), text.end(), &sax) || !sax.complete()) {
+        return false;
+    }
+    tool_name = std::move(name);
+    params = parameters.is_object() ? std::move(parameters) : json::object();
+    return true;
+}
+
+bool projectMessages(std::string_view text, unsigned fields, std::vector<MessageSummary>& messages) {
+    messages.clear();
+    MessagesSax sax(fields, messages);
+    if (!json::sax_parse(text.begin(), text.end(), &sax) || !sax.found()) {
+        messages.clear();
+        return false;
+    }
+    return true;
+}
+
+std::string messagesToJson(const std::vector<MessageSummary>& messages) {
+    json out = json::array();
+    for (const auto& m : messages) {
+        json j = json::object();
+        if (m.present & kMessageId) j["id"] = m.id;
+        if (m.present & kMessageThreadId) j["threadId"] = m.thread_id;
+        if (m.present & kMessageFrom) j["from"] = m.from;
+        if (m.present & kMessageSubject) j["subject"] = m.subject;
+        if (m.present & kMessageDate) j["date"] = m.date;
+        if (m.present & kMessageSnippet) j["snippet"] = m.snippet;
+        if (m.present & kMessageLabelIds) j["labelIds"] = m.label_ids;
+        if (m.present & kMessageError) j["error"] = m.error;
+        out.push_back(std::move(j));
+    }
+    return json{{"messages", std::move(out)}}.dump(-1, ' ', false, json::error_handler_t::replace);
+}
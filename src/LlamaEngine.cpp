@@ -0,0 +1,2644 @@
+#include "LlamaEngine.h"
+#include "Logger.h"
+#include "EngineMetrics.h"
+#include "JsonProjection.h"
+#include "MailboxSync.h"
+#include "MemoryStore.h"
+#include "SystemPrompt.h"
+#include "SessionRecorder.h"
+#include "TokenStreamer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <random>
+
+#include "ggml-cpu.h"
+#include "nlohmann/json.hpp"
+
+// Using alias for json
+using json = nlohmann::json;
+
+namespace {
+
+ggml_numa_strategy toGgmlNuma(NumaStrategy strategy) {
+    switch (strategy) {
+        case NumaStrategy::Distribute: return GGML_NUMA_STRATEGY_DISTRIBUTE;
+        case NumaStrategy::Isolate:    return GGML_NUMA_STRATEGY_ISOLATE;
+        case NumaStrategy::Numactl:    return GGML_NUMA_STRATEGY_NUMACTL;
+        case NumaStrategy::Mirror:     return GGML_NUMA_STRATEGY_MIRROR;
+        case NumaStrategy::Disabled:   break;
+    }
+    return GGML_NUMA_STRATEGY_DISABLED;
+}
+
+// A pool with one thread per listed CPU, each pinned to its CPU (strict_cpu), or an
+// unpinned pool when `cpus` is empty
+ggml_threadpool* newThreadpool(int n_threads, const std::vector<int>& cpus) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+            params.cpumask[cpu] = true;
+        }
+    }
+    params.strict_cpu = !cpus.empty();
+    return ggml_threadpool_new(&params);
+}
+
+llama_sampler* buildSamplerChain(const SamplerProfile& profile, uint32_t seed) {
+    // Perf counters are enabled so sampling time shows up in the telemetry
+    llama_sampler_chain_params params = llama_sampler_chain_default_params();
+    params.no_perf = false;
+    llama_sampler* chain = llama_sampler_chain_init(params);
+
+    const bool penalize = profile.repeat_penalty != 1.0f && profile.repeat_last_n != 0;
+    if (profile.temperature <= 0.0f && !penalize) {
+        // Argmax is a single pass; a top-k partial sort in front would only add work
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return chain;
+    }
+    if (profile.top_k > 0) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(profile.top_k));
+    }
+    if (penalize) {
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(profile.repeat_last_n, profile.repeat_penalty, 0.0f, 0.0f));
+    }
+    if (profile.temperature <= 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return chain;
+    }
+    if (profile.top_p < 1.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(profile.top_p, 1));
+    }
+    if (profile.min_p > 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(profile.min_p, 1));
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(profile.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+    return chain;
+}
+
+ggml_type toGgmlType(KvCacheType type) {
+    switch (type) {
+        case KvCacheType::F32:    return GGML_TYPE_F32;
+        case KvCacheType::BF16:   return GGML_TYPE_BF16;
+        case KvCacheType::Q8_0:   return GGML_TYPE_Q8_0;
+        case KvCacheType::Q5_1:   return GGML_TYPE_Q5_1;
+        case KvCacheType::Q5_0:   return GGML_TYPE_Q5_0;
+        case KvCacheType::Q4_1:   return GGML_TYPE_Q4_1;
+        case KvCacheType::Q4_0:   return GGML_TYPE_Q4_0;
+        case KvCacheType::IQ4_NL: return GGML_TYPE_IQ4_NL;
+        case KvCacheType::F16:    break;
+    }
+    return GGML_TYPE_F16;
+}
+
+// Elements of one layer's K (or V) entry for one token: head size times KV heads. The head
+// size is read from the GGUF metadata where the model sets it, n_embd / n_head otherwise.
+int64_t kvRowElements(const llama_model* model, const char* length_key) {
+    int64_t head_size = 0;
+    char arch[64];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) > 0) {
+        const std::string key = std::string(arch) + ".attention." + length_key;
+        char value[32];
+        if (llama_model_meta_val_str(model, key.c_str(), value, sizeof(value)) > 0) {
+            head_size = std::atoll(value);
+        }
+    }
+    if (head_size <= 0) {
+        head_size = llama_model_n_embd(model) / std::max(1, llama_model_n_head(model));
+    }
+    return head_size * llama_model_n_head_kv(model);
+}
+
+// Size of the unified KV cache llama.cpp allocates for n_ctx cells
+size_t kvCacheBytes(const llama_model* model, uint32_t n_ctx, ggml_type type_k, ggml_type type_v) {
+    const size_t per_cell = ggml_row_size(type_k, kvRowElements(model, "key_length")) +
+                            ggml_row_size(type_v, kvRowElements(model, "value_length"));
+    return per_cell * n_ctx * static_cast<size_t>(llama_model_n_layer(model));
+}
+
+const char* numaName(NumaStrategy strategy) {
+    switch (strategy) {
+        case NumaStrategy::Distribute: return "distribute";
+        case NumaStrategy::Isolate:    return "isolate";
+        case NumaStrategy::Numactl:    return "numactl";
+        case NumaStrategy::Mirror:     return "mirror";
+        case NumaStrategy::Disabled:   break;
+    }
+    return "disabled";
+}
+
+// First line of the message that replaces compacted turns; also how a later compaction
+// recognizes the previous summary so it is folded into the new one
+constexpr char kSummaryPrefix[] = "Summary of the earlier conversation:\n";
+
+// Transcript budget per message when compacting: tool results are mostly JSON the summary
+// only needs a few fields of
+constexpr size_t kCompactToolChars = 1500;
+constexpr size_t kCompactMessageChars = 3000;
+
+// Appends at most max_bytes of `text`, cut at a UTF-8 character boundary
+void appendClipped(std::string& out, const char* text, size_t max_bytes) {
+    size_t len = strlen(text);
+    if (len > max_bytes) {
+        len = max_bytes;
+        while (len > 0 && (static_cast<unsigned char>(text[len]) & 0xC0) == 0x80) {
+            len--;
+        }
+        out.append(text, len);
+        out += " [...]";
+        return;
+    }
+    out.append(text, len);
+}
+
+// Removes a leading reasoning block (up to the last </think>) and surrounding whitespace
+std::string stripReasoning(std::string text) {
+    const size_t think_end = text.rfind("</think>");
+    if (think_end != std::string::npos) {
+        text.erase(0, think_end + strlen("</think>"));
+    }
+    const size_t start = text.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) {
+        return "";
+    }
+    const size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(start, end - start + 1);
+}
+
+// First line of the message recalled memory entries are given in. Each entry follows on
+// its own line as "[#<id>, <date>, <kind>] <text>", which is also how a later lookup sees
+// which entries the conversation already holds.
+constexpr char kMemoryPrefix[] = "Notes from earlier conversations (they may be out of date):";
+
+// What a memory entry keeps of a user message, a reply and a tool result
+constexpr size_t kMemoryUserChars = 500;
+constexpr size_t kMemoryReplyChars = 1500;
+constexpr size_t kMemoryToolChars = 2000;
+// Entries chat() embeds before its lookup at most; the rest wait for indexMemory()
+constexpr int kMemoryIndexPerTurn = 4;
+
+// Length of the one-line summaries summarizeNewMail() writes
+constexpr int kMailSummaryChars = 200;
+
+// The question the cascade's small model is asked after the conversation, and the reply
+// that leaves the step to the main model
+constexpr char kRouteAnswer[] = "ANSWER";
+// Highest-logit tokens the route grammar checks first; it only sees the rest of the
+// vocabulary when it rejects all of them
+constexpr size_t kRouteTopCandidates = 16;
+constexpr char kRoutePrompt[] =
+    "Decide the next step. If a tool is needed, reply with only the tool call JSON. If the tool results "
+    "above already hold what the reply needs, or no tool is needed, reply with only the word ANSWER. /no_think";
+
+// GBNF the small model is held to: an optional empty reasoning block, then either one call
+// of a tool in the catalogue, in the system prompt's format, or the answer marker
+std::string routeGrammar() {
+    std::string grammar = std::string("root   ::= think? ( call | \"") + kRouteAnswer + "\" )\n";
+    grammar += R"GBNF(think  ::= "<think>" [ \t\n]* "</think>" [ \t\n]*
+call   ::= "{\"tool_name\": \"" name "\", \"parameters\": " object "}"
+object ::= "{" ws ( member ( "," ws member )* )? "}"
+member ::= string ":" ws value
+value  ::= object ws | array ws | string | number | ( "true" | "false" | "null" ) ws
+array  ::= "[" ws ( value ( "," ws value )* )? "]"
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" ( ["\\/bfnrt] | "u" [0-9a-fA-F]{4} ) )* "\"" ws
+number ::= "-"? ( [0-9] | [1-9] [0-9]{0,15} ) ( "." [0-9]+ )? ( [eE] [-+]? [0-9]{1,15} )? ws
+ws     ::= | " " | "\n" [ \t]{0,20}
+name   ::=)GBNF";
+    const std::vector<std::string>& names = ToolDispatcher::toolNames();
+    for (size_t i = 0; i < names.size(); i++) {
+        grammar += (i == 0 ? " \"" : " | \"") + names[i] + "\"";
+    }
+    grammar += "\n";
+    return grammar;
+}
+
+// "2026-10-18 14:05" in local time
+std::string formatLocalTime(int64_t time_ms) {
+    const time_t seconds = static_cast<time_t>(time_ms / 1000);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char buf[32];
+    const size_t len = std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &local);
+    return std::string(buf, len);
+}
+
+} // namespace
+
+LlamaEngine::LlamaEngine(const std::string& model_path,
+                         int n_gpu_layers,
+                         int context_size,
+                         const std::string& gmail_service_addr,
+                         int num_threads_generate,
+                         int num_threads_batch)
+    : model_path_(model_path),
+      n_gpu_layers_(n_gpu_layers),
+      context_size_(context_size),
+      num_threads_generate_(num_threads_generate),
+      num_threads_batch_(num_threads_batch),
+      max_response_chars_(context_size), // Default max_response_chars to context_size
+      tools_(gmail_service_addr) {
+    // Logging goes through the process-wide Logger; the owner of main() opens the file.
+    LOG_INFO("LlamaEngine", "--- LlamaEngine Initialized ---");
+    publishConfig();
+}
+
+LlamaEngine::LlamaEngine(const LlamaEngine& base, const std::string& model_path, int context_size, int n_gpu_layers)
+    : model_path_(model_path),
+      n_gpu_layers_(n_gpu_layers),
+      context_size_(context_size),
+      max_response_chars_(base.max_response_chars_),
+      num_threads_generate_(base.num_threads_generate_),
+      num_threads_batch_(base.num_threads_batch_),
+      cpus_generate_(base.cpus_generate_),
+      cpus_batch_(base.cpus_batch_),
+      n_batch_(base.n_batch_),
+      n_parallel_(base.n_parallel_),
+      seed_(base.seed_),
+      sampler_config_(base.sampler_config_),
+      kv_cache_(base.kv_cache_),
+      use_mmap_(base.use_mmap_),
+      use_mlock_(base.use_mlock_),
+      numa_(base.numa_),
+      warmup_(base.warmup_),
+      load_progress_(base.load_progress_),
+      system_prompt_(base.system_prompt_),
+      tools_(base.tools_),
+      prefetcher_(tools_, base.prefetcher_.options()),
+      project_tool_results_(base.project_tool_results_),
+      compaction_(base.compaction_),
+      memory_(base.memory_),
+      memory_config_(base.memory_config_),
+      mailbox_(base.mailbox_),
+      abort_callback_(base.abort_callback_),
+      abort_callback_data_(base.abort_callback_data_),
+      cascade_(base.cascade_),
+      router_(base.router_),
+      recorder_(base.recorder_) {
+    if (base.model_owner_ && model_path == base.model_path_ && n_gpu_layers == base.n_gpu_layers_) {
+        model_owner_ = base.model_owner_;
+        model_ = model_owner_.get();
+    }
+    replacing_ = true;
+    LOG_INFO("LlamaEngine", "--- LlamaEngine Initialized (reconfigured from %s, n_ctx %d) ---",
+             base.model_path_.c_str(), base.context_size_);
+    publishConfig();
+}
+
+LlamaEngine::~LlamaEngine() {
+    cleanup();
+    LOG_INFO("LlamaEngine", "--- LlamaEngine Cleanup ---");
+}
+
+bool LlamaEngine::initialize() {
+    LOG_DEBUG("LlamaEngine::initialize", "Method entered. Model path: %s", model_path_.c_str());
+
+    // Only print errors
+    llama_log_set([](enum ggml_log_level level, const char* text, void* /* user_data */) {
+        if (level >= GGML_LOG_LEVEL_ERROR) {
+            fprintf(stderr, "%s", text);
+        }
+    }, nullptr);
+
+    // Load dynamic backends and set up NUMA. Both are process-wide and must happen once,
+    // whichever engine initializes first.
+    static std::once_flag backend_once;
+    std::call_once(backend_once, [this] {
+        ggml_backend_load_all();
+        if (numa_ != NumaStrategy::Disabled) {
+            llama_numa_init(toGgmlNuma(numa_));
+            LOG_INFO("LlamaEngine::initialize", "NUMA strategy: %s", numaName(numa_));
+        }
+    });
+
+    // Initialize the model, unless the weights are shared with the engine this one replaces
+    if (model_) {
+        load_ms_ = 0.0;
+        LOG_INFO("LlamaEngine::initialize", "Reusing the loaded weights of %s", model_path_.c_str());
+    } else {
+        llama_model_params model_params = llama_model_default_params();
+        model_params.n_gpu_layers = n_gpu_layers_;
+        model_params.use_mmap = use_mmap_;
+        model_params.use_mlock = use_mlock_;
+        if (load_progress_) {
+            model_params.progress_callback = [](float progress, void* user_data) {
+                return static_cast<LlamaEngine*>(user_data)->load_progress_(progress);
+            };
+            model_params.progress_callback_data = this;
+        }
+        const auto t_load = PerfClock::now();
+        model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
+        if (!model_) {
+            LOG_ERROR("LlamaEngine::initialize", "Unable to load model (or the load was aborted). Path: %s", model_path_.c_str());
+            return false;
+        }
+        model_owner_.reset(model_, llama_model_free);
+        load_ms_ = elapsedMs(t_load);
+        LOG_INFO("LlamaEngine::initialize", "Model loaded in %.0f ms (mmap=%d, mlock=%d)", load_ms_, use_mmap_, use_mlock_);
+    }
+
+    vocab_ = llama_model_get_vocab(model_);
+
+    // Initialize the context
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = context_size_;
+    ctx_params.n_batch = n_batch_ > 0 ? std::min(n_batch_, context_size_) : context_size_; // Configurable via setBatchSize, e.g. 512
+    ctx_params.n_seq_max = 1 + std::max(0, n_parallel_); // Sequence 0 plus completeBatch() forks
+    ctx_params.n_threads = num_threads_generate_ > 0 ? num_threads_generate_ : 0; // 0 for llama.cpp default (often physical cores)
+    ctx_params.n_threads_batch = num_threads_batch_ > 0 ? num_threads_batch_ : 0; // 0 for llama.cpp default
+    ctx_params.type_k = toGgmlType(kv_cache_.type_k);
+    ctx_params.type_v = toGgmlType(kv_cache_.type_v);
+    ctx_params.offload_kqv = kv_cache_.offload_kqv;
+    ctx_params.flash_attn = kv_cache_.flash_attn;
+    ctx_params.abort_callback = abort_callback_;
+    ctx_params.abort_callback_data = abort_callback_data_;
+    if (ctx_params.type_v != GGML_TYPE_F16 && ctx_params.type_v != GGML_TYPE_F32 && !ctx_params.flash_attn) {
+        // llama.cpp refuses a quantized V cache without flash attention
+        LOG_WARN("LlamaEngine::initialize", "V cache type %s requires flash attention; enabling it.", kvCacheTypeName(kv_cache_.type_v));
+        ctx_params.flash_attn = true;
+        kv_cache_.flash_attn = true;
+    }
+    ctx_ = llama_init_from_model(model_, ctx_params);
+    if (!ctx_) {
+        LOG_ERROR("LlamaEngine::initialize", "Failed to create the llama_context.");
+        cleanup();
+        return false;
+    }
+    kv_cache_bytes_ = kvCacheBytes(model_, llama_n_ctx(ctx_), ctx_params.type_k, ctx_params.type_v);
+    LOG_INFO("LlamaEngine::initialize", "KV cache: %.1f MiB for %u cells (K %s, V %s, flash_attn=%d, offload_kqv=%d)",
+             kv_cache_bytes_ / (1024.0 * 1024.0), llama_n_ctx(ctx_), kvCacheTypeName(kv_cache_.type_k),
+             kvCacheTypeName(kv_cache_.type_v), kv_cache_.flash_attn, kv_cache_.offload_kqv);
+    if (!cpus_generate_.empty() || !cpus_batch_.empty()) {
+        applyThreads();
+    }
+
+    if (warmup_) {
+        warmup();
+    }
+
+    // Initialize the sampler
+    initSampler();
+
+    // Prepare chat history buffer
+    formatted_.resize(context_size_);
+
+    // Initialize chat if system prompt is set
+    if (!system_prompt_.empty()) {
+        initializeChat();
+    }
+
+    // Entries embedded by another model (or at another size) are embedded again. A
+    // replacement engine loads while the old one still embeds into the shared store, so
+    // it only takes the store over in migrateFrom().
+    if (memory_ && !replacing_) {
+        memory_->setEmbeddingModel(embeddingModelId());
+    }
+
+    // The cascade's small model, unless inherited from the engine this one replaces. Without
+    // it every step is the main model's, as if no cascade was configured.
+    if (cascade_.enabled() && !router_ && !initRouter()) {
+        LOG_WARN("LlamaEngine::initialize", "Cascade model %s failed to load; continuing without the cascade.",
+                 cascade_.model_path.c_str());
+    }
+
+    published_vocab_.store(vocab_, std::memory_order_release); // Not before: a failed load frees the model
+    LOG_INFO("LlamaEngine::initialize", "Initialization successful.");
+    publishConfig(); // Seed, context and KV cache sizes are known now
+    return true;
+}
+
+void LlamaEngine::initSampler() {
+    if (sampler_) {
+        llama_sampler_free(sampler_);
+        sampler_ = nullptr;
+    }
+    if (tool_sampler_) {
+        llama_sampler_free(tool_sampler_);
+        tool_sampler_ = nullptr;
+    }
+    // A random seed is drawn here, not by llama.cpp: a greedy chain has no RNG to report it,
+    // and both chains (either may sample) must share it for a session to be reproducible
+    resolved_seed_ = seed_;
+    if (resolved_seed_ == LLAMA_DEFAULT_SEED) {
+        std::random_device rd;
+        do {
+            resolved_seed_ = rd();
+        } while (resolved_seed_ == LLAMA_DEFAULT_SEED);
+    }
+    sampler_ = buildSamplerChain(sampler_config_.reply, resolved_seed_);
+    tool_sampler_ = buildSamplerChain(sampler_config_.tool_call, resolved_seed_);
+    LOG_DEBUG("LlamaEngine::initSampler", "Sampler chains created (%d and %d samplers). Seed: %u",
+              llama_sampler_chain_n(sampler_), llama_sampler_chain_n(tool_sampler_), resolved_seed_);
+}
+
+llama_perf_sampler_data LlamaEngine::samplerPerf() const {
+    llama_perf_sampler_data total = llama_perf_sampler(sampler_);
+    if (tool_sampler_) {
+        const llama_perf_sampler_data tool = llama_perf_sampler(tool_sampler_);
+        total.t_sample_ms += tool.t_sample_ms;
+        total.n_sample += tool.n_sample;
+    }
+    return total;
+}
+
+void LlamaEngine::setSystemPrompt(const std::string& system_prompt) {
+    LOG_DEBUG("LlamaEngine::setSystemPrompt", "Method entered.");
+    system_prompt_ = system_prompt;
+
+    // Reset and initialize with the new system prompt if we're already initialized
+    if (model_ && ctx_) {
+        LOG_DEBUG("LlamaEngine::setSystemPrompt", "Model and context exist, re-initializing chat.");
+        resetChat();
+        initializeChat();
+    } else {
+        LOG_DEBUG("LlamaEngine::setSystemPrompt", "Model/context not yet loaded. Prompt set, chat will be initialized later.");
+    }
+    publishConfig();
+}
+
+void LlamaEngine::initializeChat() {
+    LOG_DEBUG("LlamaEngine::initializeChat", "Method entered.");
+
+    if (system_prompt_.empty()) {
+        LOG_DEBUG("LlamaEngine::initializeChat", "System prompt is empty, skipping.");
+        return;
+    }
+
+    // Clear any existing messages first
+    for (auto& msg : messages_) {
+        free(const_cast<char*>(msg.content));
+    }
+    messages_.clear();
+    prev_len_ = 0;
+
+    // Add system message to the beginning of the chat
+    messages_.push_back({"system", strdup(system_prompt_.c_str())});
+
+    // Format the system message
+    const char* tmpl = llama_model_chat_template(model_, /* name */ nullptr);
+    prev_len_ = llama_chat_apply_template(tmpl, messages_.data(), messages_.size(), false, nullptr, 0);
+
+    if (prev_len_ < 0) {
+        LOG_ERROR("LlamaEngine::initializeChat", "llama_chat_apply_template failed for system prompt. Error code: %d", prev_len_);
+        prev_len_ = 0;
+        n_keep_ = 0;
+    } else {
+        // The formatted system prompt is the fixed prefix of every prompt; pin it in the KV cache
+        std::vector<char> system_buf(prev_len_ + 1);
+        llama_chat_apply_template(tmpl, messages_.data(), messages_.size(), false, system_buf.data(), system_buf.size());
+        n_keep_ = static_cast<int>(tokenize(std::string(system_buf.data(), prev_len_), false).size());
+        LOG_DEBUG("LlamaEngine::initializeChat", "System prompt applied. prev_len_ = %d, n_keep_ = %d tokens", prev_len_, n_keep_);
+    }
+}
+
+std::string LlamaEngine::generate(const std::string& prompt, bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui) {
+    // This is an older method, ensure it logs if ever called directly.
+    LOG_DEBUG("LlamaEngine::generate", "Method entered (older version). Prompt: %.50s...", prompt.c_str());
+    return generateWithCallback(prompt, [stream_output, &output_string, redraw_ui](std::string_view piece) {
+        if (stream_output) {
+            output_string += piece;
+            redraw_ui();
+        }
+    });
+}
+
+std::string LlamaEngine::formatOneShot(const std::string& system_prompt, const std::string& user_message) const {
+    const char* tmpl = llama_model_chat_template(model_, /* name */ nullptr);
+    const llama_chat_message msgs[2] = {
+        {"system", system_prompt.c_str()},
+        {"user", user_message.c_str()},
+    };
+    const int len = llama_chat_apply_template(tmpl, msgs, 2, true, nullptr, 0);
+    if (len < 0) {
+        LOG_ERROR("LlamaEngine::formatOneShot", "llama_chat_apply_template failed. Error code: %d", len);
+        return "";
+    }
+    std::vector<char> buf(len + 1);
+    llama_chat_apply_template(tmpl, msgs, 2, true, buf.data(), buf.size());
+    return std::string(buf.data(), len);
+}
+
+std::string LlamaEngine::completeOnce(const std::string& system_prompt, const std::string& user_message, int max_chars) {
+    if (!model_ || !ctx_ || !sampler_) {
+        LOG_ERROR("LlamaEngine::completeOnce", "Called with uninitialized Llama resources!");
+        return "";
+    }
+    const std::string prompt = formatOneShot(system_prompt, user_message);
+    if (prompt.empty()) {
+        return "";
+    }
+
+    const int saved_max_chars = max_response_chars_;
+    if (max_chars > 0) {
+        max_response_chars_ = max_chars;
+    }
+    std::string out = generateWithCallback(prompt, [](std::string_view) {});
+    max_response_chars_ = saved_max_chars;
+    return out;
+}
+
+std::vector<std::string> LlamaEngine::completeBatch(const std::string& system_prompt,
+                                                       const std::vector<std::string>& user_messages,
+                                                       int max_chars) {
+    std::vector<std::string> outputs(user_messages.size());
+    if (user_messages.empty()) {
+        return outputs;
+    }
+    if (!model_ || !ctx_ || !sampler_) {
+        LOG_ERROR("LlamaEngine::completeBatch", "Called with uninitialized Llama resources!");
+        return outputs;
+    }
+    const int max_forks = static_cast<int>(llama_n_seq_max(ctx_)) - 1;
+    if (max_forks < 1 || user_messages.size() == 1) {
+        // No spare sequences: fall back to one completion at a time (still reuses the prefix)
+        for (size_t i = 0; i < user_messages.size() && !yieldRequested(); i++) {
+            outputs[i] = completeOnce(system_prompt, user_messages[i], max_chars);
+        }
+        return outputs;
+    }
+    const size_t max_chars_per_fork = max_chars > 0 ? static_cast<size_t>(max_chars) : static_cast<size_t>(max_response_chars_);
+    // KV cells a fork may generate into. Every token has at least one byte of text, so a
+    // fork stopped at max_chars_per_fork tokens never needs more cells than this.
+    const size_t max_tokens_per_fork = max_chars_per_fork;
+
+    GenerationMetrics metrics;
+    const auto t_start = PerfClock::now();
+    const llama_perf_context_data perf_before = llama_perf_context(ctx_);
+    const llama_perf_sampler_data sampler_before = samplerPerf();
+
+    // Tokenize every prompt; the shared prefix is their longest common token prefix
+    // (system prompt plus the start of the user turn), kept short enough that every
+    // fork still has at least one token of its own to produce logits from.
+    std::vector<std::vector<llama_token>> prompts(user_messages.size());
+    size_t prefix_len = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < user_messages.size(); i++) {
+        prompts[i] = tokenize(formatOneShot(system_prompt, user_messages[i]), false);
+        if (prompts[i].empty()) {
+            return outputs;
+        }
+        metrics.prompt_tokens += static_cast<int>(prompts[i].size());
+        size_t common = 0;
+        if (i == 0) {
+            common = prompts[0].size() - 1;
+        } else {
+            while (common < prefix_len && common < prompts[i].size() - 1 && prompts[i][common] == prompts[0][common]) {
+                common++;
+            }
+        }
+        prefix_len = std::min(prefix_len, common);
+    }
+    metrics.tokenize_ms = elapsedMs(t_start);
+    const std::vector<llama_token> prefix(prompts[0].begin(), prompts[0].begin() + prefix_len);
+
+    // Sequence 0 holds the prefix, reusing whatever part of it is already cached
+    const size_t n_reuse = reuseCachedPrefix(prefix, false);
+    const auto t_prefill = PerfClock::now();
+    if (!prefillTokens(prefix, n_reuse)) {
+        return outputs;
+    }
+    metrics.prefill_tokens = static_cast<int>(prefix.size() - n_reuse);
+    metrics.prefill_ms = elapsedMs(t_prefill);
+
+    // Forks run in groups of at most max_forks sequences. A group must fit the KV cache:
+    // the prefix once, plus every fork's own prompt tokens and generation budget.
+    const int n_ctx = static_cast<int>(llama_n_ctx(ctx_));
+    const int n_batch = static_cast<int>(llama_n_batch(ctx_));
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    std::vector<size_t> oversized; // Completed one at a time once every group is done
+    double fork_sample_ms = 0.0;   // In the forks' own sampler chains
+    size_t next = 0;
+    while (next < prompts.size()) {
+        std::vector<size_t> group;
+        size_t budget = prefix.size();
+        while (next < prompts.size() && static_cast<int>(group.size()) < max_forks) {
+            const size_t need = prompts[next].size() - prefix.size() + max_tokens_per_fork;
+            if (!group.empty() && budget + need > static_cast<size_t>(n_ctx)) {
+                break;
+            }
+            budget += need;
+            group.push_back(next++);
+        }
+        if (group.size() == 1 && budget > static_cast<size_t>(n_ctx)) {
+            // Too long to fork. completeOnce() may trim or shift sequence 0, which the
+            // remaining groups fork the prefix from, so it runs after all of them.
+            oversized.push_back(group[0]);
+            metrics.prompt_tokens -= static_cast<int>(prompts[group[0]].size());
+            continue;
+        }
+
+        struct Fork {
+            size_t index;          // Into user_messages
+            llama_seq_id seq;
+            llama_pos n_past;
+            llama_sampler* sampler; // Its own chain: penalties and RNG state never mix across forks
+            llama_token next_token = 0; // Sampled, not yet decoded
+            size_t n_generated = 0;
+            bool done = false;
+        };
+        std::vector<Fork> forks;
+        const uint32_t seed = getSeed();
+        for (size_t k = 0; k < group.size(); k++) {
+            const llama_seq_id seq = static_cast<llama_seq_id>(k + 1);
+            // Forking shares the prefix cells with sequence 0; nothing is copied or recomputed
+            llama_kv_self_seq_rm(ctx_, seq, -1, -1);
+            llama_kv_self_seq_cp(ctx_, 0, seq, 0, static_cast<llama_pos>(prefix.size()));
+            // Seeded per message, so a message gets the same completion in any batch
+            llama_sampler* sampler = buildSamplerChain(sampler_config_.reply, seed + static_cast<uint32_t>(group[k]));
+            forks.push_back(Fork{group[k], seq, static_cast<llama_pos>(prefix.size()), sampler});
+        }
+
+        // Prefill every fork's own tokens together, n_batch tokens per decode. Each fork's
+        // first token is sampled right after the chunk containing its last prompt token.
+        const auto t_suffix = PerfClock::now();
+        std::vector<std::pair<size_t, size_t>> pending; // (fork, token index) in submission order
+        for (size_t f = 0; f < forks.size(); f++) {
+            for (size_t t = prefix.size(); t < prompts[forks[f].index].size(); t++) {
+                pending.emplace_back(f, t);
+            }
+        }
+        bool failed = yieldRequested();
+        for (size_t p = 0; p < pending.size() && !failed; ) {
+            const int n_chunk = static_cast<int>(std::min<size_t>(n_batch, pending.size() - p));
+            batch.n_tokens = n_chunk;
+            for (int j = 0; j < n_chunk; j++) {
+                const auto [f, t] = pending[p + j];
+                const std::vector<llama_token>& tokens = prompts[forks[f].index];
+                batch.token[j]     = tokens[t];
+                batch.pos[j]       = static_cast<llama_pos>(t);
+                batch.n_seq_id[j]  = 1;
+                batch.seq_id[j][0] = forks[f].seq;
+                batch.logits[j]    = (t == tokens.size() - 1);
+                if (batch.logits[j]) {
+                    forks[f].n_past = static_cast<llama_pos>(tokens.size());
+                }
+            }
+            if (yieldRequested() || llama_decode(ctx_, batch) != 0) {
+                if (!yieldRequested()) {
+                    LOG_ERROR("LlamaEngine::completeBatch", "llama_decode failed while prefilling forks.");
+                }
+                failed = true;
+                break;
+            }
+            metrics.prefill_tokens += n_chunk;
+            // Sample the first token of forks whose prompt ended in this chunk
+            for (int j = 0; j < n_chunk; j++) {
+                Fork& fork = forks[pending[p + j].first];
+                if (!batch.logits[j]) continue;
+                const llama_token token = llama_sampler_sample(fork.sampler, ctx_, j);
+                if (metrics.ttft_ms == 0.0) {
+                    metrics.ttft_ms = elapsedMs(t_start);
+                }
+                if (llama_vocab_is_eog(vocab_, token)) {
+                    fork.done = true;
+                    continue;
+                }
+                TokenStreamer::appendPiece(vocab_, token, outputs[fork.index]);
+                metrics.generated_tokens++;
+                fork.n_generated++;
+                fork.next_token = token;
+            }
+            p += n_chunk;
+        }
+        metrics.prefill_ms += elapsedMs(t_suffix);
+
+        // Generate: one token per live fork per decode
+        while (!failed) {
+            if (yieldRequested()) {
+                failed = true; // Preempted: the remaining groups are not started either
+                break;
+            }
+            batch.n_tokens = 0;
+            std::vector<size_t> in_batch;
+            for (size_t f = 0; f < forks.size(); f++) {
+                Fork& fork = forks[f];
+                if (fork.done) continue;
+                if (outputs[fork.index].size() >= max_chars_per_fork || fork.n_generated >= max_tokens_per_fork ||
+                    fork.n_past >= n_ctx) {
+                    fork.done = true;
+                    continue;
+                }
+                const int j = batch.n_tokens++;
+                batch.token[j]     = fork.next_token;
+                batch.pos[j]       = fork.n_past++;
+                batch.n_seq_id[j]  = 1;
+                batch.seq_id[j][0] = fork.seq;
+                batch.logits[j]    = true;
+                in_batch.push_back(f);
+            }
+            if (batch.n_tokens == 0) {
+                break;
+            }
+            const auto t_decode = PerfClock::now();
+            if (llama_decode(ctx_, batch) != 0) {
+                if (yieldRequested()) {
+                    failed = true;
+                } else {
+                    LOG_ERROR("LlamaEngine::completeBatch", "llama_decode failed during generation.");
+                }
+                break;
+            }
+            const double step_ms = elapsedMs(t_decode);
+            metrics.decode_ms += step_ms;
+            EngineMetrics::instance().decode_latency_seconds.observe(step_ms / 1000.0);
+            for (int j = 0; j < batch.n_tokens; j++) {
+                Fork& fork = forks[in_batch[j]];
+                const llama_token token = llama_sampler_sample(fork.sampler, ctx_, j);
+                if (llama_vocab_is_eog(vocab_, token)) {
+                    fork.done = true;
+                    continue;
+                }
+                TokenStreamer::appendPiece(vocab_, token, outputs[fork.index]);
+                metrics.generated_tokens++;
+                fork.n_generated++;
+                fork.next_token = token;
+            }
+        }
+
+        // Drop the forks; the prefix cells stay owned by sequence 0
+        for (const Fork& fork : forks) {
+            llama_kv_self_seq_rm(ctx_, fork.seq, -1, -1);
+            fork_sample_ms += llama_perf_sampler(fork.sampler).t_sample_ms;
+            llama_sampler_free(fork.sampler);
+        }
+        if (failed) {
+            break;
+        }
+    }
+    llama_batch_free(batch);
+    // Every prompt token that was not decoded was served from the shared prefix
+    metrics.reused_tokens = std::max(0, metrics.prompt_tokens - metrics.prefill_tokens);
+
+    // finishGeneration() measures sampling time on sampler_; the forks sampled with their own chains
+    llama_perf_sampler_data fork_sampler_before = sampler_before;
+    fork_sampler_before.t_sample_ms -= fork_sample_ms;
+    finishGeneration(metrics, perf_before, fork_sampler_before, t_start);
+    LOG_DEBUG("LlamaEngine::completeBatch", "%zu prompts, shared prefix %zu tokens (%zu cached), %d tokens prefilled, %d generated in %.1f ms",
+              user_messages.size(), prefix.size(), n_reuse, metrics.prefill_tokens, metrics.generated_tokens, metrics.total_ms);
+
+    // completeOnce() trims oversized prompts and reports its own metrics
+    for (size_t i = 0; i < oversized.size() && !yieldRequested(); i++) {
+        outputs[oversized[i]] = completeOnce(system_prompt, user_messages[oversized[i]], max_chars);
+    }
+    return outputs;
+}
+
+int LlamaEngine::countTokens(const std::string& text) const {
+    // Called without the call lock: the vocabulary is read-only once published
+    const llama_vocab* vocab = published_vocab_.load(std::memory_order_acquire);
+    if (!vocab) {
+        return 0;
+    }
+    return static_cast<int>(tokenizeWith(vocab, text, false).size());
+}
+
+std::vector<double> LlamaEngine::classify(const std::string& system_prompt,
+                                             const std::string& user_message,
+                                             const std::vector<std::string>& labels,
+                                             const std::string& answer_prefix) {
+    if (labels.empty()) {
+        return {};
+    }
+    if (!model_ || !ctx_ || !sampler_) {
+        LOG_ERROR("LlamaEngine::classify", "Called with uninitialized Llama resources!");
+        return {};
+    }
+
+    GenerationMetrics metrics;
+    const auto t_start = PerfClock::now();
+    const llama_perf_context_data perf_before = llama_perf_context(ctx_);
+    const llama_perf_sampler_data sampler_before = samplerPerf();
+
+    std::vector<llama_token> prompt_tokens = tokenize(formatOneShot(system_prompt, user_message) + answer_prefix, false);
+    std::vector<std::vector<llama_token>> label_tokens(labels.size());
+    size_t longest_label = 0;
+    for (size_t i = 0; i < labels.size(); i++) {
+        label_tokens[i] = tokenize(labels[i], false);
+        longest_label = std::max(longest_label, label_tokens[i].size());
+    }
+    metrics.tokenize_ms = elapsedMs(t_start);
+    if (prompt_tokens.empty()) {
+        LOG_ERROR("LlamaEngine::classify", "Prompt tokenized to nothing.");
+        return {};
+    }
+    metrics.prompt_tokens = static_cast<int>(prompt_tokens.size());
+
+    // The prompt plus the longest label must fit the context. An oversized prompt loses
+    // the middle of the user message; the tail keeps the end of the turn and the answer prefix.
+    const int n_ctx = static_cast<int>(llama_n_ctx(ctx_));
+    const size_t max_prompt_tokens = static_cast<size_t>(std::max(2, n_ctx - static_cast<int>(longest_label)));
+    if (prompt_tokens.size() > max_prompt_tokens) {
+        const size_t n_tail = std::min<size_t>(64, max_prompt_tokens / 2);
+        const size_t n_discard = prompt_tokens.size() - max_prompt_tokens;
+        const auto tail_begin = prompt_tokens.end() - n_tail;
+        prompt_tokens.erase(tail_begin - n_discard, tail_begin);
+        metrics.context_shifts++;
+        LOG_DEBUG("LlamaEngine::classify", "Prompt exceeds context budget. Dropped %zu tokens before the last %zu.", n_discard, n_tail);
+    }
+
+    const size_t n_reuse = reuseCachedPrefix(prompt_tokens, true);
+    metrics.reused_tokens = static_cast<int>(n_reuse);
+    metrics.prefill_tokens = static_cast<int>(prompt_tokens.size() - n_reuse);
+    const auto t_prefill = PerfClock::now();
+    if (!prefillTokens(prompt_tokens, n_reuse)) {
+        return {};
+    }
+    metrics.prefill_ms = elapsedMs(t_prefill);
+
+    // log-softmax normalizer of the logits at batch index `i` (nullptr logits on failure)
+    const int n_vocab = llama_vocab_n_tokens(vocab_);
+    auto logitsAt = [&](int32_t i, double& log_norm) -> const float* {
+        const float* logits = llama_get_logits_ith(ctx_, i);
+        if (!logits) {
+            return nullptr;
+        }
+        const float max_logit = *std::max_element(logits, logits + n_vocab);
+        double sum = 0.0;
+        for (int v = 0; v < n_vocab; v++) {
+            sum += std::exp(static_cast<double>(logits[v] - max_logit));
+        }
+        log_norm = max_logit + std::log(sum);
+        return logits;
+    };
+
+    // A label's score is the log-probability of its whole token sequence. The first token
+    // comes from the prompt's logits; later ones need the label's own tokens decoded after
+    // the prompt, which are removed from the KV cache again right away.
+    std::vector<double> scores(labels.size(), -std::numeric_limits<double>::infinity());
+    double prompt_norm = 0.0;
+    const float* prompt_logits = logitsAt(-1, prompt_norm);
+    if (!prompt_logits) {
+        LOG_ERROR("LlamaEngine::classify", "No logits after prefill.");
+        return {};
+    }
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (!label_tokens[i].empty()) {
+            scores[i] = prompt_logits[label_tokens[i][0]] - prompt_norm;
+        }
+    }
+
+    const llama_pos n_prompt = static_cast<llama_pos>(prompt_tokens.size());
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(std::max<size_t>(longest_label, 1)), 0, 1);
+    for (size_t i = 0; i < labels.size() && !yieldRequested(); i++) {
+        const std::vector<llama_token>& tokens = label_tokens[i];
+        if (tokens.size() < 2) {
+            continue;
+        }
+        const auto t_decode = PerfClock::now();
+        batch.n_tokens = static_cast<int32_t>(tokens.size() - 1);
+        for (int32_t j = 0; j < batch.n_tokens; j++) {
+            batch.token[j]     = tokens[j];
+            batch.pos[j]       = n_prompt + j;
+            batch.n_seq_id[j]  = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j]    = true;
+        }
+        if (llama_decode(ctx_, batch) != 0) {
+            if (!yieldRequested()) {
+                LOG_ERROR("LlamaEngine::classify", "llama_decode failed on label '%s'.", labels[i].c_str());
+            }
+            scores[i] = -std::numeric_limits<double>::infinity();
+        } else {
+            for (int32_t j = 0; j < batch.n_tokens; j++) {
+                double norm = 0.0;
+                const float* logits = logitsAt(j, norm);
+                scores[i] += logits ? logits[tokens[j + 1]] - norm : -std::numeric_limits<double>::infinity();
+            }
+        }
+        llama_kv_self_seq_rm(ctx_, 0, n_prompt, -1);
+        metrics.decode_ms += elapsedMs(t_decode);
+    }
+    llama_batch_free(batch);
+    if (yieldRequested()) {
+        return {}; // Preempted: some labels were never scored
+    }
+    metrics.ttft_ms = elapsedMs(t_start);
+
+    // Normalize over the candidates (softmax of the sequence log-probabilities)
+    const double best = *std::max_element(scores.begin(), scores.end());
+    std::vector<double> probs(labels.size(), 0.0);
+    if (std::isfinite(best)) {
+        double total = 0.0;
+        for (size_t i = 0; i < scores.size(); i++) {
+            probs[i] = std::exp(scores[i] - best);
+            total += probs[i];
+        }
+        for (double& p : probs) p /= total;
+    }
+
+    finishGeneration(metrics, perf_before, sampler_before, t_start);
+    LOG_DEBUG("LlamaEngine::classify", "%zu labels, %d prompt tokens (%d reused) in %.1f ms, top p=%.3f",
+              labels.size(), metrics.prompt_tokens, metrics.reused_tokens, metrics.total_ms,
+              *std::max_element(probs.begin(), probs.end()));
+    return probs;
+}
+
+std::vector<llama_token> LlamaEngine::tokenize(const std::string& text, bool add_special) const {
+    return tokenizeWith(vocab_, text, add_special);
+}
+
+std::vector<llama_token> LlamaEngine::tokenizeWith(const llama_vocab* vocab, const std::string& text, bool add_special) {
+    std::vector<llama_token> tokens(text.length() + 16); // Provide some buffer
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), add_special, true /* parse_special */);
+    if (n_tokens < 0) {
+        // Buffer too small: llama_tokenize returns the negated required size
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), add_special, true);
+        if (n_tokens < 0) {
+            LOG_ERROR("LlamaEngine::tokenize", "llama_tokenize failed. Code: %d", n_tokens);
+            return {};
+        }
+    }
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+size_t LlamaEngine::reuseCachedPrefix(const std::vector<llama_token>& tokens, bool need_logits) {
+    size_t n_reuse = 0;
+    while (n_reuse < kv_tokens_.size() && n_reuse < tokens.size() && kv_tokens_[n_reuse] == tokens[n_reuse]) {
+        n_reuse++;
+    }
+    if (need_logits && n_reuse > 0 && n_reuse == tokens.size()) {
+        n_reuse--;
+    }
+    if (n_reuse < kv_tokens_.size()) {
+        llama_kv_self_seq_rm(ctx_, 0, n_reuse, -1);
+        kv_tokens_.resize(n_reuse);
+    }
+    n_past_ = static_cast<int>(n_reuse);
+    return n_reuse;
+}
+
+bool LlamaEngine::prefillTokens(const std::vector<llama_token>& tokens, size_t start) {
+    const int n_batch = static_cast<int>(llama_n_batch(ctx_));
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    for (size_t i = start; i < tokens.size(); ) {
+        const int n_chunk = static_cast<int>(std::min<size_t>(n_batch, tokens.size() - i));
+        batch.n_tokens = n_chunk;
+        for (int j = 0; j < n_chunk; ++j) {
+            batch.token[j]     = tokens[i + j];
+            batch.pos[j]       = n_past_ + j;
+            batch.n_seq_id[j]  = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j]    = (i + j == tokens.size() - 1); // Logits for the last prompt token only
+        }
+        if (yieldRequested() || llama_decode(ctx_, batch) != 0) {
+            if (yieldRequested()) {
+                LOG_DEBUG("LlamaEngine::prefillTokens", "Prefill preempted at position %d.", n_past_);
+            } else {
+                LOG_ERROR("LlamaEngine::prefillTokens", "llama_decode failed on prompt chunk at position %d (%d tokens).", n_past_, n_chunk);
+            }
+            // Cells of a partly decoded chunk are not in kv_tokens_; the decoded prefix stays usable
+            llama_kv_self_seq_rm(ctx_, 0, n_past_, -1);
+            llama_batch_free(batch);
+            return false;
+        }
+        kv_tokens_.insert(kv_tokens_.end(), tokens.begin() + i, tokens.begin() + i + n_chunk);
+        n_past_ += n_chunk;
+        i += n_chunk;
+    }
+
+    llama_batch_free(batch);
+    return true;
+}
+
+bool LlamaEngine::shiftContext(int n_discard) {
+    const int n_keep = std::min(n_keep_, n_past_);
+    n_discard = std::min(n_discard, n_past_ - n_keep);
+    if (n_discard <= 0) {
+        return false;
+    }
+    if (!llama_kv_self_can_shift(ctx_)) {
+        LOG_WARN("LlamaEngine::shiftContext", "KV cache does not support shifting; cannot make room.");
+        return false;
+    }
+    // Drop [n_keep, n_keep + n_discard) and slide everything after it down so positions stay contiguous
+    llama_kv_self_seq_rm(ctx_, 0, n_keep, n_keep + n_discard);
+    llama_kv_self_seq_add(ctx_, 0, n_keep + n_discard, n_past_, -n_discard);
+    kv_tokens_.erase(kv_tokens_.begin() + n_keep, kv_tokens_.begin() + n_keep + n_discard);
+    n_past_ -= n_discard;
+    LOG_DEBUG("LlamaEngine::shiftContext", "Discarded %d tokens after the first %d. n_past_ is now %d", n_discard, n_keep, n_past_);
+    return true;
+}
+
+std::string LlamaEngine::generateWithCallback(
+    const std::string& prompt,
+    FunctionRef<void(std::string_view)> token_callback
+) {
+    LOG_DEBUG("LlamaEngine::generateWithCallback", "Method entered. Prompt length: %zu", prompt.length());
+    LOG_TRACE("LlamaEngine::generateWithCallback", "Received prompt (first 200 chars): %.200s", prompt.c_str());
+
+    if (prompt.empty()) {
+        LOG_ERROR("LlamaEngine::generateWithCallback", "Received an empty prompt!");
+        return ""; // Early exit if prompt is empty
+    }
+    if (!model_ || !ctx_ || !sampler_ || !vocab_) {
+        LOG_ERROR("LlamaEngine::generateWithCallback", "Called with uninitialized Llama resources!");
+        return "[Error: Llama resources not initialized in generateWithCallback]";
+    }
+
+    GenerationMetrics metrics;
+    const auto t_start = PerfClock::now();
+    const llama_perf_context_data perf_before = llama_perf_context(ctx_);
+    const llama_perf_sampler_data sampler_before = samplerPerf();
+
+    // Sized for the whole reply up front, so appending pieces does not reallocate
+    std::string response;
+    response.reserve(max_response_chars_ + 64);
+    TokenStreamer streamer(vocab_);
+
+    // Sampled tokens and their arrival times, kept only while a session is being recorded
+    std::vector<int32_t> recorded_tokens;
+    std::vector<double> recorded_token_ms;
+    if (recorder_) {
+        recorder_->recordPrompt(prompt);
+    }
+
+    // The prompt is the whole formatted conversation. add_bos is false: the template handles it.
+    std::vector<llama_token> prompt_tokens = tokenize(prompt, false);
+    metrics.tokenize_ms = elapsedMs(t_start);
+    if (prompt_tokens.empty()) {
+        LOG_ERROR("LlamaEngine::generateWithCallback", "llama_tokenize resulted in empty token list for non-empty prompt.");
+        return "";
+    }
+    metrics.prompt_tokens = static_cast<int>(prompt_tokens.size());
+
+    // Prompt overflow management: keep the system prompt and the most recent tokens,
+    // leaving a quarter of the context free for generation.
+    const int n_ctx = llama_n_ctx(ctx_);
+    const int max_prompt_tokens = n_ctx - n_ctx / 4;
+    if (static_cast<int>(prompt_tokens.size()) > max_prompt_tokens) {
+        const int n_keep = std::min(n_keep_, max_prompt_tokens / 2);
+        const int n_discard = static_cast<int>(prompt_tokens.size()) - max_prompt_tokens;
+        prompt_tokens.erase(prompt_tokens.begin() + n_keep, prompt_tokens.begin() + n_keep + n_discard);
+        metrics.context_shifts++;
+        LOG_DEBUG("LlamaEngine::generateWithCallback", "Prompt exceeds context budget. Dropped %d tokens after the first %d.", n_discard, n_keep);
+    }
+
+    // Reuse the longest common prefix already in the KV cache. The last prompt token is
+    // always decoded again so fresh logits are available for sampling.
+    const size_t n_reuse = reuseCachedPrefix(prompt_tokens, true);
+    metrics.reused_tokens = static_cast<int>(n_reuse);
+    metrics.prefill_tokens = static_cast<int>(prompt_tokens.size() - n_reuse);
+
+    const auto t_prefill = PerfClock::now();
+    if (!prefillTokens(prompt_tokens, n_reuse)) {
+        return response;
+    }
+    metrics.prefill_ms = elapsedMs(t_prefill);
+    LOG_DEBUG("LlamaEngine::generateWithCallback", "Prefill: %d prompt tokens, %d reused from cache, %d decoded in %.1f ms",
+              metrics.prompt_tokens, metrics.reused_tokens, metrics.prefill_tokens, metrics.prefill_ms);
+
+    // Single-token batch reused for every generated token
+    llama_batch batch = llama_batch_init(1, 0, 1);
+
+    bool eog_detected = false; // Flag to track if EOG was the reason for stopping
+
+    // The reply profile samples until the reply turns out to be a tool call
+    llama_sampler* active_sampler = sampler_;
+    int reply_kind = -1;
+
+    while (response.length() < max_response_chars_) { // Added a safety break for max response length
+        llama_token new_token_id = llama_sampler_sample(active_sampler, ctx_, -1);
+        if (metrics.generated_tokens == 0) {
+            metrics.ttft_ms = elapsedMs(t_start);
+        }
+        if (recorder_) {
+            recorded_tokens.push_back(new_token_id);
+            recorded_token_ms.push_back(elapsedMs(t_start));
+        }
+
+        if (llama_vocab_is_eog(vocab_, new_token_id)) {
+            LOG_DEBUG("LlamaEngine::generateWithCallback", "EOG token detected. Stopping generation.");
+            eog_detected = true;
+            break;
+        }
+        metrics.generated_tokens++;
+
+        // Only complete UTF-8 reaches the callback; a partial character waits for the next token
+        const std::string_view piece = streamer.push(new_token_id);
+        if (!piece.empty()) {
+            token_callback(piece);
+            response += piece;
+            if (reply_kind < 0) {
+                reply_kind = ToolDispatcher::replyKind(response);
+                if (reply_kind == 1) {
+                    active_sampler = tool_sampler_;
+                    LOG_DEBUG("LlamaEngine::generateWithCallback", "Tool call detected; switching to the tool-call sampler.");
+                }
+            }
+        }
+
+        if (n_past_ >= n_ctx) { // If n_past_ (which will be pos of next token) hits context limit
+            if (!shiftContext(n_ctx / 4)) { // Discard 1/4th of the context
+                LOG_WARN("LlamaEngine::generateWithCallback", "Context full and cannot be shifted. Stopping generation.");
+                break;
+            }
+            metrics.context_shifts++;
+        }
+
+        if (yieldRequested()) {
+            LOG_DEBUG("LlamaEngine::generateWithCallback", "Preempted after %d tokens.", metrics.generated_tokens);
+            break;
+        }
+
+        // Prepare batch for the next token (generation phase)
+        batch.n_tokens = 1;
+        batch.token[0]    = new_token_id;
+        batch.pos[0]      = n_past_; // Position of the new token is current n_past_
+        batch.n_seq_id[0] = 1;
+        batch.seq_id[0][0]= 0;
+        batch.logits[0]   = true;
+
+        const auto t_decode = PerfClock::now();
+        if (llama_decode(ctx_, batch) != 0) {
+            if (yieldRequested()) {
+                LOG_DEBUG("LlamaEngine::generateWithCallback", "Preempted after %d tokens.", metrics.generated_tokens);
+            } else {
+                LOG_ERROR("LlamaEngine::generateWithCallback", "llama_decode failed during generation.");
+            }
+            llama_kv_self_seq_rm(ctx_, 0, n_past_, -1);
+            break; // Return whatever we have accumulated
+        }
+        const double token_decode_ms = elapsedMs(t_decode);
+        metrics.decode_ms += token_decode_ms;
+        EngineMetrics::instance().decode_latency_seconds.observe(token_decode_ms / 1000.0);
+        kv_tokens_.push_back(new_token_id);
+        n_past_++;
+    }
+
+    llama_batch_free(batch);
+
+    // Bytes of a character the generation stopped in the middle of
+    const std::string_view rest = streamer.flush();
+    if (!rest.empty()) {
+        token_callback(rest);
+        response += rest;
+    }
+
+    if (recorder_) {
+        recorder_->recordGeneration(recorded_tokens, recorded_token_ms, response);
+    }
+
+    finishGeneration(metrics, perf_before, sampler_before, t_start);
+
+    if (eog_detected) {
+        LOG_DEBUG("LlamaEngine::generateWithCallback", "Generation loop finished: EOG token. Response length: %zu", response.length());
+    } else if (response.length() >= max_response_chars_) {
+        LOG_DEBUG("LlamaEngine::generateWithCallback", "Generation loop finished: max_response_chars_ limit (%d). Response length: %zu", max_response_chars_, response.length());
+    } else {
+        LOG_DEBUG("LlamaEngine::generateWithCallback", "Generation loop finished for other reasons (response length %zu < max_response_chars_ %d).", response.length(), max_response_chars_);
+    }
+    LOG_DEBUG("LlamaEngine::generateWithCallback", "%d tokens in %.1f ms decode (%.2f tok/s), TTFT %.1f ms, sampling %.1f ms",
+              metrics.generated_tokens, metrics.decode_ms, metrics.decodeTokensPerSecond(), metrics.ttft_ms, metrics.sample_ms);
+    LOG_TRACE("LlamaEngine::generateWithCallback", "Final response content (first 300 chars): %.300s", response.c_str());
+    return response;
+}
+
+void LlamaEngine::finishGeneration(GenerationMetrics& metrics, const llama_perf_context_data& perf_before,
+                                      const llama_perf_sampler_data& sampler_before, PerfClock::time_point t_start,
+                                      bool global) {
+    const llama_perf_context_data perf_after = llama_perf_context(ctx_);
+    const llama_perf_sampler_data sampler_after = samplerPerf();
+    metrics.perf_prompt_eval_ms = perf_after.t_p_eval_ms - perf_before.t_p_eval_ms;
+    metrics.perf_eval_ms = perf_after.t_eval_ms - perf_before.t_eval_ms;
+    metrics.perf_prompt_eval_tokens = perf_after.n_p_eval - perf_before.n_p_eval;
+    metrics.perf_eval_tokens = perf_after.n_eval - perf_before.n_eval;
+    metrics.sample_ms = sampler_after.t_sample_ms - sampler_before.t_sample_ms;
+    metrics.total_ms = elapsedMs(t_start);
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex_);
+        last_generation_ = metrics;
+    }
+    if (!global) {
+        return;
+    }
+
+    // Process-wide counters for the Prometheus endpoint (aggregated only when scraped)
+    EngineMetrics& engine_metrics = EngineMetrics::instance();
+    engine_metrics.prompt_tokens_total.inc(metrics.prompt_tokens);
+    engine_metrics.prompt_tokens_reused_total.inc(metrics.reused_tokens);
+    engine_metrics.prefill_tokens_total.inc(metrics.prefill_tokens);
+    engine_metrics.prefill_seconds_total.add(metrics.prefill_ms / 1000.0);
+    if (metrics.prefill_tokens > 1) {
+        engine_metrics.prefill_tokens_per_second.observe(metrics.prefillTokensPerSecond());
+    }
+    engine_metrics.generated_tokens_total.inc(metrics.generated_tokens);
+    engine_metrics.decode_seconds_total.add(metrics.decode_ms / 1000.0);
+    engine_metrics.ttft_seconds.observe(metrics.ttft_ms / 1000.0);
+    engine_metrics.context_shifts_total.inc(metrics.context_shifts);
+    engine_metrics.kv_cache_tokens.set(n_past_);
+    engine_metrics.kv_cache_capacity.set(llama_n_ctx(ctx_));
+}
+
+bool LlamaEngine::initRouter() {
+    const auto t_start = PerfClock::now();
+    const int n_ctx = cascade_.context_size > 0 ? cascade_.context_size : context_size_;
+    auto router = std::make_shared<LlamaEngine>(*this, cascade_.model_path, n_ctx, cascade_.n_gpu_layers);
+    // Only route() runs on it: no conversation of its own to compact, remember or record
+    router->cascade_ = CascadeConfig();
+    router->router_.reset();
+    router->memory_ = nullptr;
+    router->mailbox_ = nullptr;
+    router->recorder_ = nullptr;
+    router->compaction_.enabled = false;
+    router->n_parallel_ = 0;
+    if (!router->initialize()) {
+        return false;
+    }
+    router_ = std::move(router);
+    owns_router_ = true;
+    LOG_INFO("LlamaEngine::initRouter", "Cascade: %s decides tool calls (n_ctx %d, min confidence %.2f), loaded in %.0f ms",
+             cascade_.model_path.c_str(), n_ctx, cascade_.min_confidence, elapsedMs(t_start));
+    return true;
+}
+
+bool LlamaEngine::route(const std::vector<llama_chat_message>& messages, int max_tokens, Route& result) {
+    if (!model_ || !ctx_ || !vocab_) {
+        return false;
+    }
+    if (!route_grammar_) {
+        route_grammar_ = llama_sampler_init_grammar(vocab_, routeGrammar().c_str(), "root");
+        if (!route_grammar_) {
+            LOG_ERROR("LlamaEngine::route", "Could not build the route grammar.");
+            return false;
+        }
+    }
+    llama_sampler_reset(route_grammar_);
+
+    GenerationMetrics& metrics = result.metrics;
+    const auto t_start = PerfClock::now();
+    const llama_perf_context_data perf_before = llama_perf_context(ctx_);
+    const llama_perf_sampler_data sampler_before = samplerPerf();
+
+    // The conversation as this model's template renders it, then the question about it
+    std::vector<llama_chat_message> prompt_messages = messages;
+    prompt_messages.push_back({"system", kRoutePrompt});
+    const char* tmpl = llama_model_chat_template(model_, nullptr);
+    const int len = llama_chat_apply_template(tmpl, prompt_messages.data(), prompt_messages.size(), true, nullptr, 0);
+    if (len < 0) {
+        LOG_ERROR("LlamaEngine::route", "llama_chat_apply_template failed. Error code: %d", len);
+        return false;
+    }
+    std::vector<char> buf(len + 1);
+    llama_chat_apply_template(tmpl, prompt_messages.data(), prompt_messages.size(), true, buf.data(), buf.size());
+    result.prompt.assign(buf.data(), len);
+
+    const std::vector<llama_token> prompt_tokens = tokenize(result.prompt, false);
+    metrics.tokenize_ms = elapsedMs(t_start);
+    metrics.prompt_tokens = static_cast<int>(prompt_tokens.size());
+    if (prompt_tokens.empty() || metrics.prompt_tokens + max_tokens > static_cast<int>(llama_n_ctx(ctx_))) {
+        LOG_DEBUG("LlamaEngine::route", "%d prompt tokens do not fit n_ctx %u.", metrics.prompt_tokens, llama_n_ctx(ctx_));
+        return false;
+    }
+    const size_t n_reuse = reuseCachedPrefix(prompt_tokens, true);
+    metrics.reused_tokens = static_cast<int>(n_reuse);
+    metrics.prefill_tokens = static_cast<int>(prompt_tokens.size() - n_reuse);
+    const auto t_prefill = PerfClock::now();
+    if (!prefillTokens(prompt_tokens, n_reuse)) {
+        return false;
+    }
+    metrics.prefill_ms = elapsedMs(t_prefill);
+
+    // Greedy under the grammar. A step where the grammar left more than one token scores
+    // the chosen token by its probability among the allowed ones; steps the grammar forced
+    // (JSON scaffolding, the rest of a tool name) say nothing about the decision and are skipped.
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab_);
+    const auto higher_logit = [](const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; };
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    double choice_logp = 0.0; // Tokens up to the end of the tool name, or the answer marker
+    double params_logp = 0.0;
+    int n_params = 0;
+    bool chosen = false;
+    bool complete = false;
+    std::string text;
+    for (int n = 0; n < max_tokens; n++) {
+        const float* logits = llama_get_logits_ith(ctx_, -1);
+        candidates_.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; id++) {
+            candidates_[id] = {id, logits[id], 0.0f};
+        }
+        const size_t n_top = std::min(kRouteTopCandidates, candidates_.size());
+        std::partial_sort(candidates_.begin(), candidates_.begin() + n_top, candidates_.end(), higher_logit);
+        llama_token_data_array checked = {candidates_.data(), n_top, -1, false};
+        llama_sampler_apply(route_grammar_, &checked);
+        const auto allowed = [](const llama_token_data& c) { return std::isfinite(c.logit); };
+        if (std::none_of(candidates_.begin(), candidates_.begin() + n_top, allowed)) {
+            llama_token_data_array rest = {candidates_.data() + n_top, candidates_.size() - n_top, -1, false};
+            llama_sampler_apply(route_grammar_, &rest);
+            checked.size = candidates_.size();
+        }
+        const llama_token_data* best = nullptr;
+        int n_allowed = 0;
+        for (size_t i = 0; i < checked.size; i++) {
+            if (allowed(candidates_[i])) {
+                n_allowed++;
+                if (!best || candidates_[i].logit > best->logit) {
+                    best = &candidates_[i];
+                }
+            }
+        }
+        if (!best) {
+            LOG_WARN("LlamaEngine::route", "The grammar allows no token after: %s", text.c_str());
+            break;
+        }
+        const llama_token token = best->id;
+        double logp = 0.0;
+        if (n_allowed > 1) {
+            double sum = 0.0;
+            for (size_t i = 0; i < checked.size; i++) {
+                if (allowed(candidates_[i])) {
+                    sum += std::exp(static_cast<double>(candidates_[i].logit - best->logit));
+                }
+            }
+            logp = -std::log(sum);
+        }
+        if (metrics.generated_tokens == 0) {
+            metrics.ttft_ms = elapsedMs(t_start);
+        }
+        result.tokens.push_back(token);
+        result.token_ms.push_back(elapsedMs(t_start));
+        if (llama_vocab_is_eog(vocab_, token)) {
+            complete = true; // Only allowed once the grammar is satisfied
+            break;
+        }
+        if (n_allowed > 1 && chosen) {
+            params_logp += logp;
+            n_params++;
+        } else if (n_allowed > 1) {
+            choice_logp += logp;
+        }
+        llama_sampler_accept(route_grammar_, token);
+        TokenStreamer::appendPiece(vocab_, token, text);
+        metrics.generated_tokens++;
+        chosen = chosen || text.find("\"parameters\"") != std::string::npos;
+
+        if (yieldRequested()) {
+            break;
+        }
+        batch.n_tokens = 1;
+        batch.token[0] = token;
+        batch.pos[0] = n_past_;
+        batch.n_seq_id[0] = 1;
+        batch.seq_id[0][0] = 0;
+        batch.logits[0] = true;
+        const auto t_decode = PerfClock::now();
+        if (llama_decode(ctx_, batch) != 0) {
+            if (!yieldRequested()) {
+                LOG_ERROR("LlamaEngine::route", "llama_decode failed during generation.");
+            }
+            llama_kv_self_seq_rm(ctx_, 0, n_past_, -1);
+            break;
+        }
+        metrics.decode_ms += elapsedMs(t_decode);
+        kv_tokens_.push_back(token);
+        n_past_++;
+    }
+    llama_batch_free(batch);
+    finishGeneration(metrics, perf_before, sampler_before, t_start, false); // Reported as RouteMetrics instead
+    if (!complete) {
+        LOG_DEBUG("LlamaEngine::route", "No complete decision within %d tokens: %s", max_tokens, text.c_str());
+        return false;
+    }
+
+    result.call = stripReasoning(text);
+    result.answer = result.call == kRouteAnswer;
+    result.confidence = std::exp(choice_logp);
+    if (n_params > 0) {
+        result.confidence = std::min(result.confidence, std::exp(params_logp / n_params));
+    }
+    if (result.answer) {
+        result.call.clear();
+    }
+    LOG_TRACE("LlamaEngine::route", "Decided (confidence %.3f): %s", result.confidence, text.c_str());
+    return true;
+}
+
+std::string LlamaEngine::chat(const std::string& user_message,
+    bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui) {
+
+    LOG_DEBUG("LlamaEngine::chat", "Method entered. stream_output: %d, user input length: %zu", stream_output, user_message.length());
+    LOG_TRACE("LlamaEngine::chat", "User input (first 100 chars): %.100s", user_message.c_str());
+
+    if (!model_ || !ctx_ || !sampler_) {
+        LOG_ERROR("LlamaEngine::chat", "Model/context/sampler not initialized! model=%p, ctx=%p, sampler=%p",
+                  static_cast<void*>(model_), static_cast<void*>(ctx_), static_cast<void*>(sampler_));
+        return "[Error: Model not initialized]";
+    }
+
+    // Add user message to history
+    // Note: llama_chat_message content must be managed (strdup/free) if LlamaEngine owns it.
+    // Assuming LlamaEngine's messages_ vector handles this.
+    // If messages_ stores {role, content} pairs where content is char*, ensure it's correctly managed.
+    // For simplicity, let's assume a helper function to add messages or direct manipulation of messages_
+
+    // Current implementation of LlamaEngine::chat uses `llama_chat_apply_template`
+    // which formats messages_ into `formatted_`. Then `generateWithCallback` is called
+    // with this `formatted_` buffer.
+    // We need to inject the tool call loop here.
+
+    // Maximum number of tool calls in a single user turn to prevent loops
+    const int MAX_TOOL_CALLS = 5;
+    int tool_calls_remaining = MAX_TOOL_CALLS;
+
+    // We need a way to manage the conversation history that includes tool calls and their responses.
+    // The existing `messages_` (std::vector<llama_chat_message>) stores {role, content}.
+    // We'll add tool requests and tool responses to this history.
+    // A "tool" role could represent the tool's output.
+    // The LLM's request to call a tool is just an "assistant" message that happens to be JSON.
+
+    // Add current user message to the main history
+    // Assuming messages_ are {role, content} pairs.
+    // The LlamaEngine class seems to manage 'messages_' internally already.
+    // The `llama_chat_apply_template` in the original chat likely uses this.
+    // We need to make sure user_message is added before the loop starts.
+
+    // This part is tricky with the existing `llama_chat_apply_template` and `messages_`.
+    // Let's assume `messages_` is the primary store.
+    // The original `chat` function structure:
+    // 1. Adds user_message to `messages_`.
+    // 2. Calls `llama_chat_apply_template` using `model_`, `messages_`, `formatted_.data()`, `formatted_.size()`.
+    // 3. Calls `generateWithCallback(std::string(formatted_.data(), len), ...)`
+    // We need to replicate this but in a loop.
+
+    // Clear previous output string for streaming
+    output_string.clear();
+
+    // Per-turn telemetry, recorded on every exit path
+    TurnMetrics turn;
+    const auto turn_start = PerfClock::now();
+    turn.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    struct TurnGuard {
+        LlamaEngine* self; TurnMetrics& turn; PerfClock::time_point start;
+        ~TurnGuard() { self->finishTurn(turn, start); }
+    } turn_guard{this, turn, turn_start};
+
+    // Usually done while the user was idle already; otherwise this turn pays for it, which
+    // is still cheaper than prefilling a truncated history on every turn from now on
+    if (compaction_.enabled) {
+        compactHistory(false);
+    }
+
+    // Recalled entries go in front of the user message they were looked up for
+    if (memory_) {
+        recallMemory(user_message, turn);
+    }
+
+    char* user_msg_content = strdup(user_message.c_str());
+    if (!user_msg_content) {
+        LOG_ERROR("LlamaEngine::chat", "strdup failed for user_message!");
+        return "[Error: Memory allocation failed]";
+    }
+    messages_.push_back({"user", user_msg_content});
+    if (recorder_) {
+        recorder_->recordUserMessage(user_message);
+    }
+    LOG_DEBUG("LlamaEngine::chat", "User message added to history. Message count: %zu", messages_.size());
+
+
+    std::string current_llm_response_text;
+
+    for (int i = 0; i < MAX_TOOL_CALLS; ++i) {
+        LOG_DEBUG("LlamaEngine::chat", "Loop iteration %d", i);
+        current_llm_response_text.clear();
+
+        const char* chat_template_str = llama_model_chat_template(model_, nullptr);
+
+        if (!chat_template_str) {
+            LOG_WARN("LlamaEngine::chat", "[Loop %d] Model has no chat template. Using fallback.", i);
+            chat_template_str = "{{#each messages}}{{@root.bos_token}}{{role}}\n{{content}}{{@root.eos_token}}{{/each}}";
+        }
+
+        if (formatted_.size() < static_cast<size_t>(context_size_)) { // Ensure context_size_ is treated as size_t for comparison
+             try {
+                formatted_.resize(context_size_);
+                LOG_DEBUG("LlamaEngine::chat", "[Loop %d] formatted_ resized to: %zu", i, formatted_.size());
+             } catch (const std::bad_alloc& e) {
+                LOG_ERROR("LlamaEngine::chat", "[Loop %d] std::bad_alloc while resizing formatted_ to %d. what(): %s", i, context_size_, e.what());
+                return "[Error: Memory allocation failed for prompt buffer]";
+             }
+        }
+
+        LOG_DEBUG("LlamaEngine::chat", "[Loop %d] Applying chat template. messages_.size(): %zu", i, messages_.size());
+        for (size_t j = 0; j < messages_.size(); ++j) {
+            LOG_TRACE("LlamaEngine::chat", "  Msg[%zu] Role: %s, Content (first 50): %.50s", j, messages_[j].role, messages_[j].content);
+        }
+        int formatted_len = llama_chat_apply_template(
+            chat_template_str,
+            messages_.data(),
+            messages_.size(),
+            true, /* add_generation_prompt - true for assistant's turn */
+            formatted_.data(),
+            formatted_.size()
+        );
+
+        if (formatted_len < 0) {
+            LOG_ERROR("LlamaEngine::chat", "[Loop %d] Failed to apply chat template (returned %d). Message count: %zu", i, formatted_len, messages_.size());
+            for (const auto& msg : messages_) {
+                LOG_TRACE("LlamaEngine::chat", "  Role: %s, Content: %s", msg.role, msg.content);
+            }
+            // Attempt to recover by removing the last message if it caused the issue.
+            if (!messages_.empty()) {
+                free(const_cast<char*>(messages_.back().content));
+                messages_.pop_back();
+            }
+            return "[Error: Failed to format prompt for LLM]";
+        }
+        if (static_cast<size_t>(formatted_len) > formatted_.size()) {
+            LOG_ERROR("LlamaEngine::chat", "[Loop %d] Formatted prompt length (%d) exceeds buffer size (%zu). Returning early with error message.",
+                      i, formatted_len, formatted_.size());
+            // Try to recover or error out
+            if (!messages_.empty()) { // Remove last message, might be too long
+                free(const_cast<char*>(messages_.back().content));
+                messages_.pop_back();
+            }
+            return "[Error: Prompt too long for buffer]";
+        }
+
+        std::string prompt_for_llm(formatted_.data(), formatted_len);
+        LOG_DEBUG("LlamaEngine::chat", "[Loop %d] Formatted prompt length: %d, prev_len_: %d", i, formatted_len, prev_len_);
+        prev_len_ = formatted_len;
+
+        // 2. Get response from LLM
+        // Everything generated is streamed to the UI, tool calls included; the return value
+        // is this iteration's own output, which is what gets parsed for a tool call.
+        // The prefetcher watches the same pieces, to start the Gmail request of a tool call
+        // while the rest of the call is still being generated.
+        auto stream_to_ui = [this, &output_string, &redraw_ui](std::string_view piece) {
+            prefetcher_.observe(piece);
+            output_string += piece;
+            redraw_ui();
+        };
+
+        // The full prompt is only worth dumping when tracing; it is large and re-sent every iteration.
+        LOG_TRACE("LlamaEngine::chat", "Prompt for LLM (length %zu): %s", prompt_for_llm.length(), prompt_for_llm.c_str());
+
+        IterationMetrics iteration;
+        iteration.index = i;
+
+        // Cascade: the small model decides the step first. Its tool call is taken as it is
+        // when it is confident; the main model writes the replies and the steps it is unsure of.
+        bool routed_call = false;
+        if (router_) {
+            Route route;
+            const bool routed = router_->route(messages_, cascade_.max_tokens, route);
+            iteration.routed = true;
+            iteration.route.confidence = route.confidence;
+            iteration.route.generation = route.metrics;
+            EngineMetrics& engine_metrics = EngineMetrics::instance();
+            if (!routed || route.confidence < cascade_.min_confidence) {
+                iteration.route.decision = "escalated";
+                engine_metrics.cascade_escalations_total.inc();
+            } else if (route.answer) {
+                iteration.route.decision = "answer";
+                engine_metrics.cascade_answers_total.inc();
+            } else {
+                iteration.route.decision = "tool";
+                engine_metrics.cascade_tool_calls_total.inc();
+                routed_call = true;
+            }
+            LOG_DEBUG("LlamaEngine::chat", "[Loop %d] Cascade: %s (confidence %.2f, %.1f ms)",
+                      i, iteration.route.decision.c_str(), route.confidence, route.metrics.total_ms);
+            if (routed_call) {
+                if (recorder_) {
+                    recorder_->recordPrompt(route.prompt);
+                    recorder_->recordGeneration(route.tokens, route.token_ms, route.call);
+                }
+                prefetcher_.beginReply();
+                stream_to_ui(route.call);
+                current_llm_response_text = std::move(route.call);
+                iteration.generation = route.metrics;
+            }
+        }
+        if (!routed_call) {
+            // This call is for the LLM to decide on a tool or give a final answer
+            prefetcher_.beginReply();
+            current_llm_response_text = generateWithCallback(prompt_for_llm, stream_to_ui);
+            iteration.generation = getLastGenerationMetrics();
+        }
+        turn.iterations.push_back(iteration);
+
+
+        if (current_llm_response_text.empty() && prompt_for_llm.length() > 0) {
+             // This could be an error or a sign the model has nothing more to say.
+             LOG_WARN("LlamaEngine::chat", "LLM generated an empty response for a non-empty prompt.");
+        }
+        LOG_TRACE("LlamaEngine::chat", "LLM Raw Response: %s", current_llm_response_text.c_str());
+
+
+        // Add LLM's response to history (as 'assistant')
+        // This is important so the next turn sees the LLM's thought process / tool request.
+        char* assistant_msg_content = strdup(current_llm_response_text.c_str());
+        if (!assistant_msg_content) {
+            LOG_ERROR("LlamaEngine::chat", "strdup failed for assistant_msg_content!");
+            /* error handling */ return "[Error: Memory alloc for assistant msg]";
+        }
+        messages_.push_back({"assistant", assistant_msg_content});
+        LOG_DEBUG("LlamaEngine::chat", "Assistant message added to history. Message count: %zu", messages_.size());
+
+
+        // 3. Check if it's a tool call
+        std::string tool_name;
+        json tool_params;
+        const auto t_parse = PerfClock::now();
+        uint64_t allocations_before = threadAllocationCount();
+        const bool is_tool_call = ToolDispatcher::parseToolCall(current_llm_response_text, tool_name, tool_params);
+        double parse_us = elapsedMs(t_parse) * 1000.0;
+        uint64_t parse_allocations = threadAllocationCount() - allocations_before;
+        if (is_tool_call) {
+            LOG_INFO("LlamaEngine::chat", "Detected tool call. Tool Name: %s", tool_name.c_str());
+            LOG_DEBUG("LlamaEngine::chat", "Tool Params: %s", tool_params.dump().c_str());
+            tool_calls_remaining--;
+            if (tool_calls_remaining < 0) {
+                LOG_ERROR("LlamaEngine::chat", "Maximum tool call limit reached.");
+                // Add a message to history indicating this error
+                const char* err_msg = "[Error: Max tool calls reached]";
+                char* err_msg_content = strdup(err_msg);
+                if(err_msg_content) messages_.push_back({"assistant", err_msg_content}); // Or a "system" error role
+                return err_msg; // Stop further processing
+            }
+
+            // Map the tool onto its microservice endpoint. Unknown tools and missing
+            // parameters are reported back so the model can correct itself.
+            ToolRequest request;
+            std::string tool_error;
+            if (!ToolDispatcher::resolve(tool_name, tool_params, request, tool_error)) {
+                LOG_ERROR("LlamaEngine::chat", "%s", tool_error.c_str());
+                char* tool_error_content = strdup(tool_error.c_str());
+                if (tool_error_content) messages_.push_back({"system", tool_error_content});
+                continue;
+            }
+            const std::string& http_method = request.http_method;
+
+            const auto t_tool = PerfClock::now();
+            bool prefetched = false;
+            std::string tool_response_str = prefetcher_.fetch(request, prefetched);
+            const double http_ms = elapsedMs(t_tool);
+            std::string context_response; // Replaces the response in the conversation if set
+
+            // Listings are read once, by a SAX projection that keeps the summary fields of
+            // each message: their IDs feed the prefetcher, and with project_tool_results_ the
+            // summaries replace the response in the conversation
+            if (request.tool_name == "list_messages" || request.tool_name == "list_new_messages") {
+                const auto t_project = PerfClock::now();
+                allocations_before = threadAllocationCount();
+                std::vector<MessageSummary> listing;
+                const bool projected = projectMessages(tool_response_str, kMessageSummaryFields, listing);
+                if (projected && project_tool_results_) {
+                    context_response = messagesToJson(listing);
+                }
+                parse_us += elapsedMs(t_project) * 1000.0;
+                parse_allocations += threadAllocationCount() - allocations_before;
+                if (projected) {
+                    prefetcher_.afterListing(listing);
+                }
+            }
+
+            ToolCallMetrics& tool_metrics = turn.iterations.back().tool;
+            turn.iterations.back().has_tool_call = true;
+            tool_metrics.prefetched = prefetched;
+            tool_metrics.tool_name = tool_name;
+            tool_metrics.http_method = http_method;
+            tool_metrics.http_ms = http_ms;
+            tool_metrics.parse_us = parse_us;
+            tool_metrics.parse_allocations = parse_allocations;
+            tool_metrics.response_bytes = context_response.empty() ? tool_response_str.size() : context_response.size();
+            tool_metrics.error = tool_response_str.rfind("{\"error\"", 0) == 0; // GmailClient's error envelope
+            EngineMetrics::instance().recordToolCall(tool_name, tool_metrics.http_ms / 1000.0, tool_metrics.error);
+            if (recorder_) {
+                recorder_->recordToolCall(tool_name, http_method, request.endpoint, request.params, tool_response_str, tool_metrics.http_ms);
+            }
+
+            // Tool responses can be tens of kilobytes; log the size always, the body only when tracing.
+            LOG_DEBUG("LlamaEngine::chat", "Tool '%s' returned %zu bytes in %.1f ms.", tool_name.c_str(), tool_response_str.size(), tool_metrics.http_ms);
+            LOG_TRACE("LlamaEngine::chat", "Tool Response from microservice: %s", tool_response_str.c_str());
+
+            // Add tool response to history.
+            // Need a role for tool responses. llama.cpp examples sometimes use "tool" or just feed it as "assistant" or "user".
+            // Let's use "tool" role for now, assuming the chat template can handle it.
+            // If not, we might need to format it as a user or assistant message saying "Tool X returned: ..."
+            // The recording above keeps the service's response; the model gets the projection.
+            char* tool_resp_content = strdup(context_response.empty() ? tool_response_str.c_str() : context_response.c_str());
+            if (!tool_resp_content) { /* error handling */ return "[Error: Memory alloc for tool response]"; }
+            messages_.push_back({"tool", tool_resp_content}); // Using "tool" role
+            if (memory_ && !tool_metrics.error) {
+                rememberToolResult(tool_name, tool_params, tool_resp_content);
+            }
+
+            // Loop back to let LLM process tool response.
+        } else {
+            // Not a tool call, so this is the final response.
+            LOG_DEBUG("LlamaEngine::chat", "LLM response was NOT parsed as a tool call. Treating as final response.");
+            // It has already been streamed to the UI via `stream_to_ui`.
+            if (memory_) {
+                rememberTurn(user_message, current_llm_response_text);
+            }
+            return output_string; // Final response, exit loop.
+        }
+    }
+
+    // If loop finishes due to MAX_TOOL_CALLS, return the last LLM response or an error.
+    // The last LLM response is already in `messages_` as 'assistant'.
+    // We should also return an error message indicating loop termination.
+    const char* max_calls_msg = "[Error: Exceeded maximum tool iterations. Last response was a tool call.]";
+    // Add this error to messages_ so the state reflects it.
+    char* max_calls_content = strdup(max_calls_msg);
+    if(max_calls_content) messages_.push_back({"system", max_calls_content});
+
+    // The output_string already contains everything streamed, including the last (tool) response.
+    // Append the error message to it.
+    LOG_WARN("LlamaEngine::chat", "Chat ended after exhausting tool iterations.");
+    output_string += "\n" + std::string(max_calls_msg);
+    redraw_ui(); // Ensure the final error message is displayed
+
+    return output_string;
+}
+
+void LlamaEngine::resetChat() {
+    LOG_DEBUG("LlamaEngine::resetChat", "Method entered.");
+    // Clear KV cache and reset past token count for the new session
+    if (ctx_) {
+        llama_kv_self_clear(ctx_);
+    }
+    n_past_ = 0;
+    kv_tokens_.clear();
+    prefetcher_.clear(); // A new conversation may follow a reset of the mailbox
+    if (recorder_) {
+        recorder_->recordReset();
+    }
+
+    // Free message contents
+    for (auto& msg : messages_) {
+        free(const_cast<char*>(msg.content));
+    }
+
+    messages_.clear();
+    prev_len_ = 0;
+
+    // Reinitialize with system prompt if set
+    if (!system_prompt_.empty()) {
+        initializeChat();
+    }
+}
+
+std::vector<ChatMessage> LlamaEngine::exportHistory() const {
+    std::vector<ChatMessage> history;
+    for (const auto& msg : messages_) {
+        if (&msg == &messages_.front() && !system_prompt_.empty() && strcmp(msg.role, "system") == 0) {
+            continue; // The system prompt belongs to the engine, not the conversation
+        }
+        history.push_back({msg.role, msg.content});
+    }
+    return history;
+}
+
+void LlamaEngine::importHistory(const std::vector<ChatMessage>& history) {
+    LOG_DEBUG("LlamaEngine::importHistory", "%zu messages", history.size());
+    for (auto& msg : messages_) {
+        free(const_cast<char*>(msg.content));
+    }
+    messages_.clear();
+    prev_len_ = 0;
+    if (!system_prompt_.empty()) {
+        initializeChat();
+    }
+    // llama_chat_message::role is not owned, so roles map onto string literals
+    for (const auto& msg : history) {
+        const char* role = "user";
+        for (const char* known : {"system", "user", "assistant", "tool"}) {
+            if (msg.role == known) role = known;
+        }
+        messages_.push_back({role, strdup(msg.content.c_str())});
+    }
+    // The KV cache is left alone: the next prompt reuses whatever prefix still matches
+}
+
+void LlamaEngine::setCompactionConfig(const CompactionConfig& config) {
+    compaction_ = config;
+    publishConfig();
+}
+
+bool LlamaEngine::compactHistory(bool force) {
+    if (!model_ || !ctx_ || (!compaction_.enabled && !force)) {
+        return false;
+    }
+    const size_t first = (!system_prompt_.empty() && !messages_.empty() && strcmp(messages_[0].role, "system") == 0) ? 1 : 0;
+    const bool has_summary = first < messages_.size() && strcmp(messages_[first].role, "system") == 0 &&
+                             strncmp(messages_[first].content, kSummaryPrefix, strlen(kSummaryPrefix)) == 0;
+
+    // The kept turns start at a user message, so a tool loop is never split
+    const int keep_turns = std::max(1, compaction_.keep_recent_turns);
+    size_t keep_from = messages_.size();
+    int user_messages = 0;
+    for (size_t i = messages_.size(); i > first; i--) {
+        if (strcmp(messages_[i - 1].role, "user") == 0 && ++user_messages == keep_turns) {
+            keep_from = i - 1;
+            break;
+        }
+    }
+    if (user_messages < keep_turns || keep_from <= first + (has_summary ? 1 : 0)) {
+        return false; // Nothing but the kept turns (and a summary) to compact
+    }
+
+    const int n_ctx = llama_n_ctx(ctx_);
+    const int history_tokens = static_cast<int>(tokenize(formatHistory(false), false).size());
+    if (!force && history_tokens < compaction_.trigger_ratio * (n_ctx - n_ctx / 4)) {
+        return false;
+    }
+
+    const auto t_start = PerfClock::now();
+    std::string transcript;
+    for (size_t i = first; i < keep_from; i++) {
+        const llama_chat_message& msg = messages_[i];
+        if (i == first && has_summary) {
+            transcript += "Summary of even earlier turns:\n";
+            transcript += msg.content + strlen(kSummaryPrefix);
+        } else if (strcmp(msg.role, "tool") == 0) {
+            transcript += "Tool result: ";
+            appendClipped(transcript, msg.content, kCompactToolChars);
+        } else {
+            transcript += strcmp(msg.role, "user") == 0      ? "User: "
+                        : strcmp(msg.role, "assistant") == 0 ? "Assistant: "
+                                                             : "Note: ";
+            appendClipped(transcript, msg.content, kCompactMessageChars);
+        }
+        transcript += "\n\n";
+    }
+
+    // Not recorded as part of a turn; the recording gets the resulting summary instead
+    // (SessionReplay applies it)
+    std::string summary = completeGreedy(compactionPrompt(compaction_.summary_max_chars), {transcript},
+                                         compaction_.summary_max_chars)[0];
+    if (yieldRequested()) {
+        LOG_DEBUG("LlamaEngine::compactHistory", "Preempted while summarizing; history left as it is.");
+        return false;
+    }
+
+    // A reasoning block is not part of the summary
+    summary = stripReasoning(std::move(summary));
+    if (summary.empty()) {
+        LOG_WARN("LlamaEngine::compactHistory", "The model wrote an empty summary; history left as it is.");
+        return false;
+    }
+
+    const std::string content = kSummaryPrefix + summary;
+    for (size_t i = first; i < keep_from; i++) {
+        free(const_cast<char*>(messages_[i].content));
+    }
+    messages_.erase(messages_.begin() + first, messages_.begin() + keep_from);
+    messages_.insert(messages_.begin() + first, {"system", strdup(content.c_str())});
+    if (recorder_) {
+        recorder_->recordCompaction(keep_from - first, content);
+    }
+    EngineMetrics::instance().history_compactions_total.inc();
+
+    // The summary invalidated the cache after the system prompt; prefill the compacted
+    // conversation now rather than at the start of the next turn
+    const double summarize_ms = elapsedMs(t_start);
+    prefillConversation();
+    LOG_INFO("LlamaEngine::compactHistory", "Replaced %zu messages (%d history tokens) with a %zu-char summary: %.0f ms to summarize, %.0f ms in total",
+             keep_from - first, history_tokens, summary.size(), summarize_ms, elapsedMs(t_start));
+    return true;
+}
+
+std::vector<std::string> LlamaEngine::completeGreedy(const std::string& system_prompt,
+                                                     const std::vector<std::string>& user_messages, int max_chars) {
+    llama_sampler* chat_sampler = sampler_;
+    llama_sampler* greedy = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(greedy, llama_sampler_init_greedy());
+    SessionRecorder* recorder = recorder_;
+    sampler_ = greedy;
+    recorder_ = nullptr;
+    std::vector<std::string> outputs = completeBatch(system_prompt, user_messages, max_chars);
+    sampler_ = chat_sampler;
+    recorder_ = recorder;
+    llama_sampler_free(greedy);
+    return outputs;
+}
+
+int LlamaEngine::summarizeNewMail(int max_messages) {
+    if (!mailbox_ || !model_ || !ctx_ || max_messages <= 0) {
+        return 0;
+    }
+    const auto pending = mailbox_->pendingSummaries(static_cast<size_t>(max_messages));
+    if (pending.empty()) {
+        return 0;
+    }
+    const auto t_start = PerfClock::now();
+    std::vector<std::string> texts;
+    texts.reserve(pending.size());
+    for (const auto& message : pending) {
+        texts.push_back(message.second + "\n/no_think"); // Thinking models skip the reasoning block
+    }
+    // Forks of the shared system prompt, as in batch triage
+    const std::vector<std::string> outputs = completeGreedy(mailSummaryPrompt(kMailSummaryChars), texts, kMailSummaryChars);
+    if (yieldRequested()) {
+        return 0; // Preempted: partial summaries are dropped and the messages stay pending
+    }
+
+    std::vector<std::pair<std::string, std::string>> summaries;
+    for (size_t i = 0; i < pending.size(); i++) {
+        std::string summary = stripReasoning(outputs[i]);
+        summary = summary.substr(0, summary.find('\n'));
+        if (!summary.empty() && summary.compare(0, 7, "<think>") != 0) {
+            summaries.emplace_back(pending[i].first, std::move(summary));
+        }
+    }
+    mailbox_->setSummaries(summaries);
+    LOG_DEBUG("LlamaEngine::summarizeNewMail", "Summarized %zu of %zu new messages in %.0f ms",
+              summaries.size(), pending.size(), elapsedMs(t_start));
+    return static_cast<int>(summaries.size());
+}
+
+std::vector<std::vector<float>> LlamaEngine::embed(const std::vector<std::string>& texts) {
+    std::vector<std::vector<float>> out(texts.size());
+    if (!model_) {
+        LOG_ERROR("LlamaEngine::embed", "Called before initialize()!");
+        return out;
+    }
+    if (!embd_ctx_) {
+        // Whole texts are decoded in one ubatch, which pooling requires
+        llama_context_params params = llama_context_default_params();
+        params.n_ctx = static_cast<uint32_t>(std::min(context_size_, 2048));
+        params.n_batch = params.n_ctx;
+        params.n_ubatch = params.n_ctx;
+        params.n_seq_max = 1;
+        params.embeddings = true;
+        params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        params.n_threads = num_threads_generate_ > 0 ? num_threads_generate_ : 0;
+        params.n_threads_batch = num_threads_batch_ > 0 ? num_threads_batch_ : 0;
+        params.abort_callback = abort_callback_;
+        params.abort_callback_data = abort_callback_data_;
+        embd_ctx_ = llama_init_from_model(model_, params);
+        if (!embd_ctx_) {
+            LOG_ERROR("LlamaEngine::embed", "Failed to create the embedding context.");
+            return out;
+        }
+    }
+
+    const int n_ctx = static_cast<int>(llama_n_ctx(embd_ctx_));
+    const int n_embd = llama_model_n_embd(model_);
+    llama_batch batch = llama_batch_init(n_ctx, 0, 1);
+    for (size_t i = 0; i < texts.size() && !yieldRequested(); i++) {
+        std::vector<llama_token> tokens = tokenize(texts[i], true);
+        if (tokens.empty()) {
+            continue;
+        }
+        if (static_cast<int>(tokens.size()) > n_ctx) {
+            tokens.resize(n_ctx); // Embeds the beginning of oversized texts
+        }
+        llama_kv_self_clear(embd_ctx_);
+        batch.n_tokens = static_cast<int32_t>(tokens.size());
+        for (int32_t j = 0; j < batch.n_tokens; j++) {
+            batch.token[j]     = tokens[j];
+            batch.pos[j]       = j;
+            batch.n_seq_id[j]  = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j]    = true; // Every token contributes to the pooled embedding
+        }
+        if (llama_decode(embd_ctx_, batch) != 0) {
+            if (!yieldRequested()) {
+                LOG_ERROR("LlamaEngine::embed", "llama_decode failed for text %zu (%zu tokens).", i, tokens.size());
+            }
+            continue;
+        }
+        const float* pooled = llama_get_embeddings_seq(embd_ctx_, 0);
+        if (!pooled) {
+            LOG_ERROR("LlamaEngine::embed", "No pooled embedding for text %zu.", i);
+            continue;
+        }
+        double norm = 0.0;
+        for (int k = 0; k < n_embd; k++) {
+            norm += static_cast<double>(pooled[k]) * pooled[k];
+        }
+        norm = norm > 0.0 ? std::sqrt(norm) : 1.0;
+        out[i].resize(n_embd);
+        for (int k = 0; k < n_embd; k++) {
+            out[i][k] = static_cast<float>(pooled[k] / norm);
+        }
+    }
+    llama_batch_free(batch);
+    return out;
+}
+
+void LlamaEngine::setMemoryStore(MemoryStore* store, const MemoryConfig& config) {
+    memory_ = store;
+    memory_config_ = config;
+    if (memory_ && model_) {
+        memory_->setEmbeddingModel(embeddingModelId());
+    }
+    publishConfig();
+}
+
+std::string LlamaEngine::embeddingModelId() const {
+    return model_path_ + ":" + std::to_string(model_ ? llama_model_n_embd(model_) : 0);
+}
+
+int LlamaEngine::indexMemory(int max_entries) {
+    if (!memory_ || !model_ || max_entries <= 0) {
+        return 0;
+    }
+    const auto pending = memory_->pendingEmbeddings(static_cast<size_t>(max_entries));
+    if (pending.empty()) {
+        return 0;
+    }
+    const auto t_start = PerfClock::now();
+    std::vector<std::string> texts;
+    texts.reserve(pending.size());
+    for (const auto& entry : pending) {
+        texts.push_back(entry.second);
+    }
+    const std::vector<std::vector<float>> embeddings = embed(texts);
+    const std::string model_id = embeddingModelId();
+    int embedded = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (!embeddings[i].empty()) {
+            memory_->setEmbedding(pending[i].first, embeddings[i], model_id);
+            embedded++;
+        }
+    }
+    LOG_DEBUG("LlamaEngine::indexMemory", "Embedded %d memory entries in %.0f ms", embedded, elapsedMs(t_start));
+    return embedded;
+}
+
+void LlamaEngine::recallMemory(const std::string& user_message, TurnMetrics& turn) {
+    const auto t_start = PerfClock::now();
+    indexMemory(kMemoryIndexPerTurn);
+
+    MemoryQuery query;
+    query.text = user_message;
+    query.k = static_cast<size_t>(std::max(0, memory_config_.top_k));
+    query.min_similarity = memory_config_.min_similarity;
+    std::vector<std::vector<float>> query_embedding = embed({user_message});
+    query.embedding = std::move(query_embedding[0]);
+
+    // Nothing the conversation still holds is recalled: neither the messages entries were
+    // taken from nor entries recalled by an earlier turn
+    const size_t prefix_len = strlen(kMemoryPrefix);
+    for (const auto& msg : messages_) {
+        query.exclude_sources.insert(memoryHash(msg.content));
+        if (strcmp(msg.role, "system") == 0 && strncmp(msg.content, kMemoryPrefix, prefix_len) == 0) {
+            for (const char* p = strstr(msg.content, "\n[#"); p; p = strstr(p + 1, "\n[#")) {
+                query.exclude_ids.insert(std::strtoull(p + 3, nullptr, 10));
+            }
+        }
+    }
+
+    const auto t_lookup = PerfClock::now();
+    const std::vector<MemoryHit> hits = memory_->search(query);
+    turn.memory_lookup_ms = elapsedMs(t_lookup);
+    EngineMetrics::instance().memory_lookup_seconds.observe(turn.memory_lookup_ms / 1000.0);
+
+    // Best entries first, as long as they fit the budget; a better entry that is too long
+    // on its own is cut rather than skipped
+    std::string text = kMemoryPrefix;
+    int tokens = countTokens(text);
+    for (const MemoryHit& hit : hits) {
+        std::string line = "\n[#" + std::to_string(hit.entry.id) + ", " + formatLocalTime(hit.entry.time_ms) + ", " +
+                           hit.entry.kind + "] " + hit.entry.text;
+        int line_tokens = countTokens(line);
+        const int room = memory_config_.token_budget - tokens;
+        if (line_tokens > room && turn.memory_entries == 0 && room >= 32) {
+            std::string clipped;
+            appendClipped(clipped, line.c_str(), line.size() * room / line_tokens * 9 / 10);
+            line = std::move(clipped);
+            line_tokens = countTokens(line);
+        }
+        if (line_tokens > room) {
+            continue;
+        }
+        text += line;
+        tokens += line_tokens;
+        turn.memory_entries++;
+    }
+    turn.memory_ms = elapsedMs(t_start);
+    if (turn.memory_entries == 0) {
+        LOG_DEBUG("LlamaEngine::recallMemory", "Nothing recalled (%zu candidates) in %.1f ms", hits.size(), turn.memory_ms);
+        return;
+    }
+    turn.memory_tokens = tokens;
+    EngineMetrics::instance().memory_recalled_entries_total.inc(turn.memory_entries);
+    messages_.push_back({"system", strdup(text.c_str())});
+    if (recorder_) {
+        recorder_->recordMemory(text);
+    }
+    LOG_DEBUG("LlamaEngine::recallMemory", "Recalled %d entries (%d tokens) in %.1f ms, lookup %.3f ms",
+              turn.memory_entries, tokens, turn.memory_ms, turn.memory_lookup_ms);
+}
+
+void LlamaEngine::rememberTurn(const std::string& user_message, const std::string& reply) {
+    const std::string answer = stripReasoning(reply);
+    if (answer.empty() || answer.rfind("[Error", 0) == 0) {
+        return;
+    }
+    std::string text = "User: ";
+    appendClipped(text, user_message.c_str(), kMemoryUserChars);
+    text += "\nAssistant: ";
+    appendClipped(text, answer.c_str(), kMemoryReplyChars);
+    memory_->add("turn", "", text, memoryHash(reply));
+}
+
+void LlamaEngine::rememberToolResult(const std::string& tool_name, const json& params, const std::string& content) {
+    // The same request made again replaces the older result
+    const std::string request = tool_name + " " + params.dump(-1, ' ', false, json::error_handler_t::replace);
+    std::string text = request + "\n";
+    appendClipped(text, content.c_str(), kMemoryToolChars);
+    memory_->add("tool", request, text, memoryHash(content));
+}
+
+void LlamaEngine::setContextSize(int n_ctx) {
+    LOG_DEBUG("LlamaEngine::setContextSize", "%d", n_ctx);
+    context_size_ = n_ctx;
+    // Applied by initialize(); a live engine is rebuilt by LlamaInference::reconfigure()
+    publishConfig();
+}
+
+void LlamaEngine::setGpuLayers(int ngl) {
+    LOG_DEBUG("LlamaEngine::setGpuLayers", "%d", ngl);
+    n_gpu_layers_ = ngl;
+    // Applied by initialize(); a live engine is rebuilt by LlamaInference::reconfigure()
+    publishConfig();
+}
+
+void LlamaEngine::prefillHistory(const std::vector<ChatMessage>& history) {
+    importHistory(history);
+    prefillConversation();
+}
+
+std::string LlamaEngine::formatHistory(bool add_generation_prompt) const {
+    const char* tmpl = llama_model_chat_template(model_, nullptr);
+    const int len = llama_chat_apply_template(tmpl, messages_.data(), messages_.size(), add_generation_prompt, nullptr, 0);
+    if (len <= 0) {
+        return "";
+    }
+    std::vector<char> buf(len + 1);
+    llama_chat_apply_template(tmpl, messages_.data(), messages_.size(), add_generation_prompt, buf.data(), buf.size());
+    return std::string(buf.data(), len);
+}
+
+void LlamaEngine::prefillConversation() {
+    if (!ctx_ || messages_.empty()) {
+        return;
+    }
+    const std::vector<llama_token> tokens = tokenize(formatHistory(false), false);
+
+    // A conversation beyond the prompt budget is shifted by the next turn anyway
+    const int n_ctx = llama_n_ctx(ctx_);
+    if (tokens.empty() || static_cast<int>(tokens.size()) > n_ctx - n_ctx / 4) {
+        LOG_DEBUG("LlamaEngine::prefillConversation", "Skipped: %zu tokens do not fit the prompt budget.", tokens.size());
+        return;
+    }
+    const auto t_start = PerfClock::now();
+    const size_t n_reuse = reuseCachedPrefix(tokens, false);
+    if (prefillTokens(tokens, n_reuse)) {
+        LOG_INFO("LlamaEngine::prefillConversation", "Prefilled %zu of %zu conversation tokens in %.0f ms",
+                 tokens.size() - n_reuse, tokens.size(), elapsedMs(t_start));
+    }
+}
+
+void LlamaEngine::migrateFrom(LlamaEngine& old) {
+    // Same weights: the KV cells of sequence 0 are valid as they are, so copy them instead
+    // of decoding the conversation again. Fails (and falls back to the next turn's prefix
+    // reuse) if they do not fit the new context.
+    if (ctx_ && old.ctx_ && model_ == old.model_ && !old.kv_tokens_.empty()) {
+        const auto t_start = PerfClock::now();
+        std::vector<uint8_t> state(llama_state_seq_get_size(old.ctx_, 0));
+        const size_t n_read = llama_state_seq_get_data(old.ctx_, state.data(), state.size(), 0);
+        llama_kv_self_seq_rm(ctx_, 0, -1, -1);
+        kv_tokens_.clear();
+        n_past_ = 0;
+        if (n_read > 0 && llama_state_seq_set_data(ctx_, state.data(), n_read, 0) > 0) {
+            kv_tokens_ = old.kv_tokens_;
+            n_past_ = old.n_past_;
+            LOG_INFO("LlamaEngine::migrateFrom", "Copied %d KV cache tokens (%zu bytes) in %.1f ms",
+                     n_past_, n_read, elapsedMs(t_start));
+        } else {
+            LOG_WARN("LlamaEngine::migrateFrom", "KV cache of %zu tokens does not fit n_ctx %d; it will be prefilled again.",
+                     old.kv_tokens_.size(), context_size_);
+        }
+    }
+    system_prompt_ = old.system_prompt_;
+    importHistory(old.exportHistory());
+    tools_ = old.tools_;
+    prefetcher_.setOptions(old.prefetcher_.options());
+    recorder_ = old.recorder_;
+    replacing_ = false;
+    if (memory_ && model_) {
+        memory_->setEmbeddingModel(embeddingModelId());
+    }
+
+    std::scoped_lock lock(metrics_mutex_, old.metrics_mutex_);
+    metrics_file_ = std::move(old.metrics_file_);
+    metrics_path_ = old.metrics_path_;
+    turn_counter_ = old.turn_counter_;
+    last_turn_ = old.last_turn_;
+    last_generation_ = old.last_generation_;
+}
+
+void LlamaEngine::setMaxResponseChars(int max_chars) {
+    LOG_DEBUG("LlamaEngine::setMaxResponseChars", "%d", max_chars);
+    max_response_chars_ = max_chars > 0 ? max_chars : context_size_; // Ensure it's positive, fallback to context_size if not
+    publishConfig();
+}
+
+TurnMetrics LlamaEngine::getLastTurnMetrics() const {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    return last_turn_;
+}
+
+GenerationMetrics LlamaEngine::getLastGenerationMetrics() const {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    return last_generation_;
+}
+
+bool LlamaEngine::setMetricsFile(const std::string& path) {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    if (metrics_file_.is_open()) {
+        metrics_file_.close();
+    }
+    metrics_path_ = path;
+    if (path.empty()) {
+        return true;
+    }
+    metrics_file_.open(path, std::ios::app);
+    if (!metrics_file_.is_open()) {
+        LOG_ERROR("LlamaEngine::setMetricsFile", "Could not open metrics file: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void LlamaEngine::finishTurn(TurnMetrics& turn, PerfClock::time_point turn_start) {
+    turn.total_ms = elapsedMs(turn_start);
+    turn.n_ctx = ctx_ ? static_cast<int>(llama_n_ctx(ctx_)) : 0;
+    turn.kv_tokens_after = n_past_;
+    publishConfig(); // The turn may have added memory entries
+
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    turn.turn = ++turn_counter_;
+    last_turn_ = turn;
+    EngineMetrics::instance().turns_total.inc();
+    if (metrics_file_.is_open()) {
+        // One line per turn, written after the answer is complete so it never delays streaming
+        metrics_file_ << turn.toJson().dump() << '\n';
+        metrics_file_.flush();
+    }
+    LOG_INFO("LlamaEngine::chat", "Turn %llu: %s", static_cast<unsigned long long>(turn.turn), turn.statusLine().c_str());
+    if (recorder_) {
+        recorder_->recordTurnEnd(turn);
+    }
+}
+
+void LlamaEngine::setBatchSize(int n_batch) {
+    LOG_DEBUG("LlamaEngine::setBatchSize", "%d", n_batch);
+    n_batch_ = n_batch;
+    // Note: This requires re-initialization
+    publishConfig();
+}
+
+void LlamaEngine::setParallelSequences(int n_parallel) {
+    LOG_DEBUG("LlamaEngine::setParallelSequences", "%d", n_parallel);
+    n_parallel_ = n_parallel;
+    // Note: This requires re-initialization
+    publishConfig();
+}
+
+void LlamaEngine::setSamplerConfig(const SamplerConfig& config) {
+    LOG_DEBUG("LlamaEngine::setSamplerConfig", "%s", config.toJson().dump().c_str());
+    sampler_config_ = config;
+    if (sampler_) {
+        initSampler();
+    }
+    publishConfig();
+}
+
+SamplerConfig LlamaEngine::getSamplerConfig() const {
+    return sampler_config_;
+}
+
+void LlamaEngine::setSeed(uint32_t seed) {
+    LOG_DEBUG("LlamaEngine::setSeed", "%u", seed);
+    seed_ = seed;
+    if (sampler_) {
+        initSampler(); // Takes effect immediately, including a fresh RNG state
+    }
+    publishConfig();
+}
+
+uint32_t LlamaEngine::getSeed() const {
+    return sampler_ ? resolved_seed_ : seed_;
+}
+
+void LlamaEngine::setToolTransport(ToolTransport transport) {
+    tools_.setTransport(std::move(transport));
+}
+
+void LlamaEngine::setToolPrefetch(bool enabled, int follow_up_ids) {
+    ToolPrefetcher::Options options = prefetcher_.options();
+    options.enabled = enabled;
+    options.follow_up_ids = follow_up_ids;
+    prefetcher_.setOptions(options);
+    publishConfig();
+}
+
+void LlamaEngine::setNativeMime(bool enabled) {
+    tools_.setNativeMime(enabled);
+    publishConfig();
+}
+
+void LlamaEngine::setProjectToolResults(bool enabled) {
+    project_tool_results_ = enabled;
+    publishConfig();
+}
+
+void LlamaEngine::setMailboxSync(MailboxSync* mailbox) {
+    mailbox_ = mailbox;
+    tools_.setMailboxSync(mailbox);
+}
+
+void LlamaEngine::setAbortCallback(ggml_abort_callback callback, void* data) {
+    abort_callback_ = callback;
+    abort_callback_data_ = data;
+    if (ctx_) {
+        llama_set_abort_callback(ctx_, callback, data);
+    }
+    if (embd_ctx_) {
+        llama_set_abort_callback(embd_ctx_, callback, data);
+    }
+    // An inherited router still serves the engine being replaced: reconfigure() clears this
+    // engine's callback while loading, outside the call lock, and must not touch that router
+    if (router_ && owns_router_) {
+        router_->setAbortCallback(callback, data);
+    }
+}
+
+void LlamaEngine::setSessionRecorder(SessionRecorder* recorder) {
+    recorder_ = recorder;
+}
+
+void LlamaEngine::setUseMmap(bool use_mmap) {
+    use_mmap_ = use_mmap;
+    publishConfig();
+}
+
+void LlamaEngine::setUseMlock(bool use_mlock) {
+    use_mlock_ = use_mlock;
+    publishConfig();
+}
+
+void LlamaEngine::setCascadeConfig(const CascadeConfig& config) {
+    cascade_ = config;
+    // Note: the small model is loaded by initialize()
+    publishConfig();
+}
+
+void LlamaEngine::setKvCacheConfig(const KvCacheConfig& config) {
+    kv_cache_ = config;
+    publishConfig();
+}
+
+void LlamaEngine::setNumaStrategy(NumaStrategy strategy) {
+    numa_ = strategy;
+    publishConfig();
+}
+
+void LlamaEngine::setWarmup(bool warmup) {
+    warmup_ = warmup;
+    publishConfig();
+}
+
+void LlamaEngine::setLoadProgressCallback(LoadProgressCallback callback) {
+    load_progress_ = std::move(callback);
+}
+
+void LlamaEngine::setThreadConfig(const ThreadConfig& generate, const ThreadConfig& batch) {
+    LOG_DEBUG("LlamaEngine::setThreadConfig", "generate %d threads (%zu pinned), batch %d threads (%zu pinned)",
+              generate.n_threads, generate.cpus.size(), batch.n_threads, batch.cpus.size());
+    num_threads_generate_ = generate.n_threads > 0 ? generate.n_threads : static_cast<int>(generate.cpus.size());
+    num_threads_batch_ = batch.n_threads > 0 ? batch.n_threads : static_cast<int>(batch.cpus.size());
+    cpus_generate_ = generate.cpus;
+    cpus_batch_ = batch.cpus;
+    applyThreads();
+    if (router_) {
+        router_->setThreadConfig(generate, batch); // The two models never decode at the same time
+    }
+    publishConfig();
+}
+
+void LlamaEngine::applyThreads() {
+    if (!ctx_) {
+        return; // initialize() applies them
+    }
+    llama_detach_threadpool(ctx_);
+    freeThreadpools();
+    if (!cpus_generate_.empty() || !cpus_batch_.empty()) {
+        // Pools are attached as a pair; a side without pinning gets an unpinned pool
+        threadpool_ = newThreadpool(num_threads_generate_, cpus_generate_);
+        threadpool_batch_ = newThreadpool(num_threads_batch_, cpus_batch_);
+        if (threadpool_ && threadpool_batch_) {
+            llama_attach_threadpool(ctx_, threadpool_, threadpool_batch_);
+        } else {
+            LOG_ERROR("LlamaEngine::applyThreads", "Could not create pinned thread pools; using unpinned threads.");
+            freeThreadpools();
+        }
+    }
+    if (num_threads_generate_ > 0 && num_threads_batch_ > 0) {
+        llama_set_n_threads(ctx_, num_threads_generate_, num_threads_batch_);
+    }
+}
+
+void LlamaEngine::freeThreadpools() {
+    if (threadpool_) {
+        ggml_threadpool_free(threadpool_);
+        threadpool_ = nullptr;
+    }
+    if (threadpool_batch_) {
+        ggml_threadpool_free(threadpool_batch_);
+        threadpool_batch_ = nullptr;
+    }
+}
+
+bool LlamaEngine::measureThroughput(int n_prefill, int n_decode, double& prefill_tps, double& decode_tps) {
+    prefill_tps = 0.0;
+    decode_tps = 0.0;
+    if (!ctx_ || !vocab_) {
+        return false;
+    }
+    n_prefill = std::max(1, std::min({n_prefill, static_cast<int>(llama_n_batch(ctx_)),
+                                      static_cast<int>(llama_n_ctx(ctx_)) - n_decode - 1}));
+
+    // Ordinary text rather than one repeated token, so the timing resembles real prompts
+    const std::vector<llama_token> text = tokenize("The quick brown fox jumps over the lazy dog. ", false);
+    if (text.empty()) {
+        return false;
+    }
+    std::vector<llama_token> tokens(n_prefill);
+    for (int i = 0; i < n_prefill; ++i) {
+        tokens[i] = text[i % text.size()];
+    }
+
+    llama_kv_self_seq_rm(ctx_, 0, -1, -1);
+    kv_tokens_.clear();
+    n_past_ = 0;
+
+    const auto t_prefill = PerfClock::now();
+    bool ok = llama_decode(ctx_, llama_batch_get_one(tokens.data(), n_prefill)) == 0;
+    llama_synchronize(ctx_);
+    const double prefill_ms = elapsedMs(t_prefill);
+
+    const auto t_decode = PerfClock::now();
+    for (int i = 0; ok && i < n_decode; ++i) {
+        llama_token token = text[i % text.size()];
+        ok = llama_decode(ctx_, llama_batch_get_one(&token, 1)) == 0;
+    }
+    llama_synchronize(ctx_);
+    const double decode_ms = elapsedMs(t_decode);
+
+    llama_kv_self_seq_rm(ctx_, 0, -1, -1);
+    if (!ok) {
+        LOG_ERROR("LlamaEngine::measureThroughput", "llama_decode failed while measuring.");
+        return false;
+    }
+    prefill_tps = prefill_ms > 0.0 ? n_prefill * 1000.0 / prefill_ms : 0.0;
+    decode_tps = decode_ms > 0.0 ? n_decode * 1000.0 / decode_ms : 0.0;
+    return true;
+}
+
+void LlamaEngine::warmup() {
+    const auto t_start = PerfClock::now();
+
+    std::vector<llama_token> tokens;
+    const llama_token bos = llama_vocab_bos(vocab_);
+    const llama_token eos = llama_vocab_eos(vocab_);
+    if (bos != LLAMA_TOKEN_NULL) tokens.push_back(bos);
+    if (eos != LLAMA_TOKEN_NULL) tokens.push_back(eos);
+    if (tokens.empty()) tokens.push_back(0);
+
+    // A multi-token batch runs on the n_threads_batch pool; the single token after it on n_threads
+    if (llama_decode(ctx_, llama_batch_get_one(tokens.data(), static_cast<int32_t>(tokens.size()))) != 0 ||
+        llama_decode(ctx_, llama_batch_get_one(tokens.data(), 1)) != 0) {
+        LOG_WARN("LlamaEngine::warmup", "Warm-up decode failed; continuing without it.");
+    }
+    llama_kv_self_clear(ctx_);
+    llama_synchronize(ctx_);
+    llama_perf_context_reset(ctx_);
+    kv_tokens_.clear();
+    n_past_ = 0;
+
+    warmup_ms_ = elapsedMs(t_start);
+    LOG_INFO("LlamaEngine::warmup", "Warm-up decode took %.0f ms", warmup_ms_);
+}
+
+void LlamaEngine::publishConfig() {
+    json config{
+        {"model", model_path_},
+        {"seed", getSeed()},
+        {"n_ctx", ctx_ ? static_cast<int>(llama_n_ctx(ctx_)) : context_size_},
+        {"n_batch", ctx_ ? static_cast<int>(llama_n_batch(ctx_)) : n_batch_},
+        {"n_seq_max", ctx_ ? static_cast<int>(llama_n_seq_max(ctx_)) : 1 + n_parallel_},
+        {"n_gpu_layers", n_gpu_layers_},
+        {"kv_cache", {
+            {"type_k", kvCacheTypeName(kv_cache_.type_k)},
+            {"type_v", kvCacheTypeName(kv_cache_.type_v)},
+            {"flash_attn", kv_cache_.flash_attn},
+            {"offload_kqv", kv_cache_.offload_kqv},
+            {"bytes", kv_cache_bytes_},
+        }},
+        {"threads", num_threads_generate_},
+        {"threads_batch", num_threads_batch_},
+        {"sampler", sampler_config_.toJson()},
+        {"cpus", cpus_generate_},
+        {"cpus_batch", cpus_batch_},
+        {"max_response_chars", max_response_chars_},
+        {"native_mime", tools_.nativeMime()},
+        {"project_tool_results", project_tool_results_},
+        {"compaction", {
+            {"enabled", compaction_.enabled},
+            {"trigger_ratio", compaction_.trigger_ratio},
+            {"keep_recent_turns", compaction_.keep_recent_turns},
+            {"summary_max_chars", compaction_.summary_max_chars},
+        }},
+        {"memory", {
+            {"enabled", memory_ != nullptr},
+            {"top_k", memory_config_.top_k},
+            {"token_budget", memory_config_.token_budget},
+            {"min_similarity", memory_config_.min_similarity},
+            {"entries", memory_ ? memory_->size() : 0},
+        }},
+        {"cascade", {
+            {"enabled", router_ != nullptr},
+            {"model", cascade_.model_path},
+            {"n_ctx", router_ ? router_->contextSize() : cascade_.context_size},
+            {"n_gpu_layers", cascade_.n_gpu_layers},
+            {"min_confidence", cascade_.min_confidence},
+            {"max_tokens", cascade_.max_tokens},
+            {"load_ms", router_ ? router_->load_ms_ : 0.0},
+        }},
+        {"tool_prefetch", {
+            {"enabled", prefetcher_.options().enabled},
+            {"follow_up_ids", prefetcher_.options().follow_up_ids},
+        }},
+        {"use_mmap", use_mmap_},
+        {"use_mlock", use_mlock_},
+        {"numa", numaName(numa_)},
+        {"warmup", warmup_},
+        {"load_ms", load_ms_},
+        {"warmup_ms", warmup_ms_},
+        {"system_prompt", system_prompt_},
+        {"system_info", llama_print_system_info()},
+    };
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    config_ = std::move(config);
+}
+
+json LlamaEngine::describeConfig() const {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    return config_;
+}
+
+void LlamaEngine::cleanup() {
+    // Free resources
+    for (auto& msg : messages_) {
+        free(const_cast<char*>(msg.content));
+    }
+    messages_.clear();
+
+    if (sampler_) {
+        llama_sampler_free(sampler_);
+        sampler_ = nullptr;
+    }
+    if (tool_sampler_) {
+        llama_sampler_free(tool_sampler_);
+        tool_sampler_ = nullptr;
+    }
+    if (route_grammar_) {
+        llama_sampler_free(route_grammar_);
+        route_grammar_ = nullptr;
+    }
+    router_.reset(); // Freed with the last engine using it
+
+    if (embd_ctx_) {
+        llama_free(embd_ctx_);
+        embd_ctx_ = nullptr;
+    }
+
+    if (ctx_) {
+        llama_free(ctx_);
+        ctx_ = nullptr;
+    }
+    freeThreadpools(); // After the context that used them
+
+    // The weights are freed with the last engine using them
+    published_vocab_.store(nullptr, std::memory_order_release);
+    model_owner_.reset();
+    model_ = nullptr;
+}
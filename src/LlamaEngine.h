@@ -0,0 +1,284 @@
+#ifndef LLAMA_ENGINE_H
+#define LLAMA_ENGINE_H
+
+#include "llama.h"
+#include "LlamaInference.h"
+#include "PerfMetrics.h"
+#include "ToolDispatcher.h"
+#include "ToolPrefetcher.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+#include "nlohmann/json.hpp"
+
+class MemoryStore;
+class SessionRecorder;
+
+// The inference engine behind the LlamaInference facade. Private to maimail_core:
+// this header pulls in llama.h and nlohmann/json, which the public API keeps out of
+// its includers. Method contracts are documented on LlamaInference.
+class LlamaEngine {
+public:
+    using ToolTransport = LlamaInference::ToolTransport;
+    using LoadProgressCallback = LlamaInference::LoadProgressCallback;
+
+    LlamaEngine(const std::string& model_path,
+                int n_gpu_layers,
+                int context_size,
+                const std::string& gmail_service_addr,
+                int num_threads_generate = 4,
+                int num_threads_batch = 4);
+    // For LlamaInference::reconfigure(): every setting of `base` (prompt, sampler, threads,
+    // tool transport, recorder, ...) except these three. Shares base's weights when the
+    // model path and GPU layers are unchanged, so initialize() only builds a new context.
+    LlamaEngine(const LlamaEngine& base, const std::string& model_path, int context_size, int n_gpu_layers);
+    ~LlamaEngine();
+
+    bool initialize();
+    void setSystemPrompt(const std::string& system_prompt);
+
+    std::string generate(const std::string& prompt, bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui);
+    std::string generateWithCallback(const std::string& prompt, FunctionRef<void(std::string_view)> token_callback);
+    std::string completeOnce(const std::string& system_prompt, const std::string& user_message, int max_chars);
+    std::vector<std::string> completeBatch(const std::string& system_prompt,
+                                           const std::vector<std::string>& user_messages,
+                                           int max_chars);
+    std::vector<double> classify(const std::string& system_prompt, const std::string& user_message,
+                                 const std::vector<std::string>& labels, const std::string& answer_prefix);
+    int countTokens(const std::string& text) const;
+    std::vector<std::vector<float>> embed(const std::vector<std::string>& texts);
+    void setMemoryStore(MemoryStore* store, const MemoryConfig& config);
+    int indexMemory(int max_entries);
+    int summarizeNewMail(int max_messages);
+
+    std::string chat(const std::string& user_message, bool stream_output, std::string& output_string, FunctionRef<void()> redraw_ui);
+    void resetChat();
+    std::vector<ChatMessage> exportHistory() const;
+    void importHistory(const std::vector<ChatMessage>& history);
+    void setCompactionConfig(const CompactionConfig& config);
+    bool compactHistory(bool force);
+
+    void setContextSize(int n_ctx);
+    void setGpuLayers(int ngl);
+    void setMaxResponseChars(int max_chars);
+    void setBatchSize(int n_batch);
+    void setParallelSequences(int n_parallel);
+    void setCascadeConfig(const CascadeConfig& config);
+    void setKvCacheConfig(const KvCacheConfig& config);
+    void setUseMmap(bool use_mmap);
+    void setUseMlock(bool use_mlock);
+    void setNumaStrategy(NumaStrategy strategy);
+    void setWarmup(bool warmup);
+    void setLoadProgressCallback(LoadProgressCallback callback);
+    void setThreadConfig(const ThreadConfig& generate, const ThreadConfig& batch);
+    bool measureThroughput(int n_prefill, int n_decode, double& prefill_tps, double& decode_tps);
+    void setSamplerConfig(const SamplerConfig& config);
+    SamplerConfig getSamplerConfig() const;
+    void setSeed(uint32_t seed);
+    uint32_t getSeed() const;
+    void setToolTransport(ToolTransport transport);
+    void setToolPrefetch(bool enabled, int follow_up_ids);
+    void setNativeMime(bool enabled);
+    void setProjectToolResults(bool enabled);
+    void setMailboxSync(MailboxSync* mailbox);
+    void setSessionRecorder(SessionRecorder* recorder);
+    nlohmann::json describeConfig() const;
+
+    const std::string& modelPath() const { return model_path_; }
+    int contextSize() const { return context_size_; }
+    int gpuLayers() const { return n_gpu_layers_; }
+    // importHistory(), then decode the formatted conversation so the next turn only
+    // prefills its own message. Used to warm a replacement engine before the swap.
+    void prefillHistory(const std::vector<ChatMessage>& history);
+    // Decode the formatted conversation into sequence 0 (reusing the cached prefix), so the
+    // next turn only prefills its own message. Skipped beyond the prompt budget.
+    void prefillConversation();
+    // Polled inside llama_decode (CPU backends stop the graph) and between decode steps,
+    // where generation, prefill and embedding loops stop early. Lets an idle job give the
+    // context up to a foreground call; kept across reconfigure().
+    void setAbortCallback(ggml_abort_callback callback, void* data);
+    // Take over the conversation, turn counter and metrics file of `old` (both idle). When
+    // both share the weights, sequence 0 of the KV cache is copied as well, if it fits.
+    void migrateFrom(LlamaEngine& old);
+
+    TurnMetrics getLastTurnMetrics() const;
+    GenerationMetrics getLastGenerationMetrics() const;
+    bool setMetricsFile(const std::string& path);
+
+private:
+    // Configuration
+    std::string model_path_;
+    int n_gpu_layers_;
+    int context_size_;
+    int max_response_chars_ = 2048; // Default max response length
+    int num_threads_generate_;
+    int num_threads_batch_;
+    std::vector<int> cpus_generate_; // Pinning for the decode / batch thread pools (empty = none)
+    std::vector<int> cpus_batch_;
+    int n_batch_ = 0; // 0 = use context_size_
+    int n_parallel_ = 0; // Forked sequences besides sequence 0
+    uint32_t seed_ = LLAMA_DEFAULT_SEED;
+    uint32_t resolved_seed_ = LLAMA_DEFAULT_SEED; // seed_, or the value drawn for it, once the samplers exist
+    SamplerConfig sampler_config_;
+    KvCacheConfig kv_cache_;
+    size_t kv_cache_bytes_ = 0; // K and V of all layers at the context size, once initialized
+    bool use_mmap_ = true;
+    bool use_mlock_ = false;
+    NumaStrategy numa_ = NumaStrategy::Disabled;
+    bool warmup_ = true;
+    LoadProgressCallback load_progress_;
+    double load_ms_ = 0.0;   // llama_model_load_from_file of the last initialize()
+    double warmup_ms_ = 0.0;
+    std::string system_prompt_;
+    ToolDispatcher tools_; // Tool-call mapping and the Gmail microservice client
+    ToolPrefetcher prefetcher_{tools_}; // Starts likely tool requests during generation
+    bool project_tool_results_ = false;  // Listings enter the conversation as summaries only
+    CompactionConfig compaction_;
+    MemoryStore* memory_ = nullptr; // Not owned
+    MemoryConfig memory_config_;
+    MailboxSync* mailbox_ = nullptr; // Not owned; also held by tools_ for list_new_messages
+    ggml_abort_callback abort_callback_ = nullptr;
+    void* abort_callback_data_ = nullptr;
+    CascadeConfig cascade_;
+    std::shared_ptr<LlamaEngine> router_; // The cascade's small model; shared with engines built from this one
+    bool owns_router_ = false;
+    bool replacing_ = false; // Built by reconfigure() and not yet swapped in by migrateFrom()             // Built by initRouter(), not inherited from the engine this one replaces
+    
+    // LLAMA resources
+    std::shared_ptr<llama_model> model_owner_; // Shared with engines built from this one by reconfigure()
+    llama_model* model_ = nullptr;
+    llama_context* ctx_ = nullptr;
+    llama_context* embd_ctx_ = nullptr; // embed() only; shares model_
+    llama_sampler* sampler_ = nullptr;      // SamplerConfig::reply
+    llama_sampler* tool_sampler_ = nullptr; // SamplerConfig::tool_call
+    ggml_threadpool* threadpool_ = nullptr;       // Only while threads are pinned
+    ggml_threadpool* threadpool_batch_ = nullptr;
+    const llama_vocab* vocab_ = nullptr;
+    std::atomic<const llama_vocab*> published_vocab_{nullptr}; // vocab_ for countTokens(), which runs without the call lock
+    llama_sampler* route_grammar_ = nullptr;   // route() only: a tool call or the answer marker
+    std::vector<llama_token_data> candidates_; // route() only: the vocabulary, highest logits first
+    int n_past_ = 0;
+    // Tokens currently held in the KV cache for sequence 0 (kv_tokens_.size() == n_past_).
+    // Used to skip re-decoding the common prefix of consecutive prompts.
+    std::vector<llama_token> kv_tokens_;
+    // Leading tokens (the formatted system prompt) that are never evicted on context shift
+    int n_keep_ = 0;
+
+    // Telemetry
+    mutable std::mutex metrics_mutex_;
+    nlohmann::json config_; // describeConfig(), published by publishConfig()
+    GenerationMetrics last_generation_;
+    TurnMetrics last_turn_;
+    uint64_t turn_counter_ = 0;
+    std::ofstream metrics_file_;
+    std::string metrics_path_;
+
+    // Session recording
+    SessionRecorder* recorder_ = nullptr;
+    
+    // Chat history
+    std::vector<llama_chat_message> messages_;
+    std::vector<char> formatted_;
+    int prev_len_ = 0;
+    
+    // Initialize chat with system prompt
+    void initializeChat();
+
+    // (Re)build both sampler chains from sampler_config_ and seed_
+    void initSampler();
+    // Sampling time and count of both chains together, for the telemetry deltas
+    llama_perf_sampler_data samplerPerf() const;
+
+    // Push the thread counts (and pinned pools, if any) to ctx_
+    void applyThreads();
+    void freeThreadpools();
+
+    // Throwaway decode of BOS/EOS (as llama.cpp's common_init_from_params does), then
+    // cleared from the KV cache: faults in mmap-ed weights, uploads to the GPU backend and
+    // starts both thread pools, so the first real prompt is not charged for it.
+    void warmup();
+
+    // {system, user} rendered with the chat template, generation prompt appended
+    std::string formatOneShot(const std::string& system_prompt, const std::string& user_message) const;
+
+    // messages_ rendered with the chat template; empty on failure
+    std::string formatHistory(bool add_generation_prompt) const;
+
+    // Look up memory entries relevant to `user_message` that are not in messages_ and add
+    // them as one system message, within memory_config_.token_budget
+    void recallMemory(const std::string& user_message, TurnMetrics& turn);
+    // Store a finished turn / a tool result in memory_
+    void rememberTurn(const std::string& user_message, const std::string& reply);
+    void rememberToolResult(const std::string& tool_name, const nlohmann::json& params, const std::string& content);
+    // completeBatch() with greedy sampling and without recording, for summaries the engine
+    // writes for itself: the most likely reading, and the chat samplers' random state is left as it was
+    std::vector<std::string> completeGreedy(const std::string& system_prompt,
+                                            const std::vector<std::string>& user_messages, int max_chars);
+    // What the cascade's small model made of one step of the tool loop
+    struct Route {
+        bool answer = false;         // It left the step to the main model's reply
+        std::string call;            // Otherwise its tool call
+        double confidence = 0.0;     // See LlamaInference::setCascadeConfig
+        std::string prompt;          // For the session recorder
+        std::vector<int32_t> tokens;
+        std::vector<double> token_ms;
+        GenerationMetrics metrics;
+    };
+    // Build router_ from cascade_: a copy of this engine's settings on the small model
+    bool initRouter();
+    // Called on router_: decide the next step of the conversation `messages` (the main
+    // engine's, system prompt included) under the route grammar, greedily. Sequence 0 keeps
+    // the prefix for the next step. Returns false when the model did not finish within
+    // max_tokens, the conversation does not fit, or the decode failed.
+    bool route(const std::vector<llama_chat_message>& messages, int max_tokens, Route& result);
+
+    // Model path and embedding size, so a store knows when its embeddings are stale
+    std::string embeddingModelId() const;
+
+    // Whether the abort callback asks for the context back. A decode that failed while this
+    // holds was aborted, not broken.
+    bool yieldRequested() const { return abort_callback_ && abort_callback_(abort_callback_data_); }
+
+    // Tokenize text with the model vocabulary. Returns an empty vector on failure.
+    std::vector<llama_token> tokenize(const std::string& text, bool add_special) const;
+    static std::vector<llama_token> tokenizeWith(const llama_vocab* vocab, const std::string& text, bool add_special);
+
+    // Drop the cached tokens of sequence 0 that `tokens` does not start with and set n_past_
+    // accordingly. Returns the number of tokens that need no decoding; with need_logits the
+    // last token is always left to decode so its logits are fresh.
+    size_t reuseCachedPrefix(const std::vector<llama_token>& tokens, bool need_logits);
+
+    // Decode tokens[start..] into sequence 0 in n_batch-sized chunks, requesting logits
+    // for the last token only. Updates kv_tokens_/n_past_.
+    bool prefillTokens(const std::vector<llama_token>& tokens, size_t start);
+
+    // Evict n_discard tokens after the first n_keep_ and shift the remainder down.
+    // Returns false if the KV cache cannot be shifted.
+    bool shiftContext(int n_discard);
+
+    // Fill in the perf-counter deltas and total time of a generation, keep it for
+    // getLastGenerationMetrics() and, unless `global` is false, add it to the process-wide
+    // EngineMetrics (the cascade's small model keeps out of the main model's numbers)
+    void finishGeneration(GenerationMetrics& metrics, const llama_perf_context_data& perf_before,
+                          const llama_perf_sampler_data& sampler_before, PerfClock::time_point t_start,
+                          bool global = true);
+
+    // Rebuild the describeConfig() snapshot. Called by every setter it reflects (under the
+    // facade's call lock), so other threads never read the settings while they change.
+    void publishConfig();
+
+    // Record a finished chat() turn: keep it for getLastTurnMetrics() and append it to the metrics file
+    void finishTurn(TurnMetrics& turn, PerfClock::time_point turn_start);
+
+    // Clean up resources
+    void cleanup();
+};
+
+#endif // LLAMA_ENGINE_H
@@ -0,0 +1,252 @@
+#include "Logger.h"
+#include "Utf8.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+
+namespace { // Anonymous namespace for helpers
+
+int64_t nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Small, stable per-thread id (std::thread::id is not printable as a number portably)
+uint32_t currentThreadId() {
+    static std::atomic<uint32_t> next_id{1};
+    thread_local uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Trace: return "trace";
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info:  return "info";
+        case LogLevel::Warn:  return "warn";
+        case LogLevel::Error: return "error";
+    }
+    return "unknown";
+}
+
+void appendJsonEscaped(std::string& out, const char* text, size_t length) {
+    static const char* hex = "0123456789abcdef";
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xF];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+}
+
+} // end anonymous namespace
+
+bool parseLogLevel(const std::string& name, LogLevel& level) {
+    if (name == "trace") level = LogLevel::Trace;
+    else if (name == "debug") level = LogLevel::Debug;
+    else if (name == "info") level = LogLevel::Info;
+    else if (name == "warn") level = LogLevel::Warn;
+    else if (name == "error") level = LogLevel::Error;
+    else return false;
+    return true;
+}
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::~Logger() {
+    close();
+}
+
+bool Logger::open(const std::string& path) {
+    close();
+
+    file_ = std::fopen(path.c_str(), "a");
+    if (!file_) {
+        return false;
+    }
+    // Large stdio buffer so the writer thread issues few write() syscalls
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 16);
+
+    // The ring is allocated once and kept for the lifetime of the process, so a
+    // producer racing with close() can never write into freed memory.
+    if (!ring_) {
+        ring_.reset(new Slot[kRingSize]);
+    }
+    for (size_t i = 0; i < kRingSize; ++i) {
+        ring_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+
+    stop_requested_.store(false, std::memory_order_relaxed);
+    running_.store(true, std::memory_order_release);
+    writer_ = std::thread(&Logger::writerLoop, this);
+    return true;
+}
+
+void Logger::close() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    stop_requested_.store(true, std::memory_order_release);
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    if (file_) {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+void Logger::log(LogLevel level, const char* component, const char* fmt, ...) {
+    const size_t mask = kRingSize - 1;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    for (;;) {
+        slot = &ring_[pos & mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed); // Ring full, never block the caller
+            return;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->timestamp_us = nowMicros();
+    slot->thread_id = currentThreadId();
+    slot->level = level;
+    slot->component = component;
+
+    va_list args;
+    va_start(args, fmt);
+    int written = std::vsnprintf(slot->message, kMaxMessage, fmt, args);
+    va_end(args);
+    if (written < 0) {
+        written = 0;
+    }
+    slot->truncated = static_cast<size_t>(written) >= kMaxMessage;
+    // A cut message ends at a character boundary, so the JSON line stays valid UTF-8
+    size_t length = static_cast<size_t>(written);
+    if (slot->truncated) {
+        length = completeUtf8Length(std::string_view(slot->message, kMaxMessage - 1));
+    }
+    slot->length = static_cast<uint16_t>(length);
+
+    if (level >= LogLevel::Warn) {
+        urgent_flush_.store(true, std::memory_order_relaxed);
+    }
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool Logger::drainOnce() {
+    const size_t mask = kRingSize - 1;
+    bool wrote_any = false;
+    for (;;) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Slot& slot = ring_[pos & mask];
+        size_t seq = slot.sequence.load(std::memory_order_acquire);
+        if (seq != pos + 1) {
+            break; // Empty, or the producer of this slot has not finished yet
+        }
+        writeRecord(slot);
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        slot.sequence.store(pos + kRingSize, std::memory_order_release);
+        wrote_any = true;
+    }
+    return wrote_any;
+}
+
+void Logger::writeRecord(const Slot& slot) {
+    std::time_t seconds = static_cast<std::time_t>(slot.timestamp_us / 1000000);
+    std::tm tm_utc{};
+    gmtime_r(&seconds, &tm_utc);
+    char ts[40];
+    size_t ts_len = std::strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm_utc);
+    std::snprintf(ts + ts_len, sizeof(ts) - ts_len, ".%06dZ", static_cast<int>(slot.timestamp_us % 1000000));
+
+    line_.clear();
+    line_ += "{\"ts\":\"";
+    line_ += ts;
+    line_ += "\",\"level\":\"";
+    line_ += levelName(slot.level);
+    line_ += "\",\"thread\":";
+    line_ += std::to_string(slot.thread_id);
+    line_ += ",\"component\":\"";
+    appendJsonEscaped(line_, slot.component, std::strlen(slot.component));
+    line_ += "\",\"msg\":\"";
+    appendJsonEscaped(line_, slot.message, slot.length);
+    line_ += "\"";
+    if (slot.truncated) {
+        line_ += ",\"truncated\":true";
+    }
+    line_ += "}\n";
+    std::fwrite(line_.data(), 1, line_.size(), file_);
+}
+
+bool Logger::reportDrops(uint64_t& reported_drops) {
+    uint64_t drops = dropped_.load(std::memory_order_relaxed);
+    if (drops == reported_drops) {
+        return false;
+    }
+    // Written as a regular record so it carries a timestamp and thread like any other line
+    Slot notice;
+    notice.timestamp_us = nowMicros();
+    notice.thread_id = currentThreadId();
+    notice.level = LogLevel::Warn;
+    notice.truncated = false;
+    notice.component = "Logger";
+    int written = std::snprintf(notice.message, kMaxMessage, "dropped %llu records (ring full)",
+                                static_cast<unsigned long long>(drops - reported_drops));
+    notice.length = static_cast<uint16_t>(written > 0 ? written : 0);
+    writeRecord(notice);
+    reported_drops = drops;
+    return true;
+}
+
+void Logger::writerLoop() {
+    uint64_t reported_drops = dropped_.load(std::memory_order_relaxed);
+    bool dirty = false;
+    while (!stop_requested_.load(std::memory_order_acquire)) {
+        if (drainOnce()) {
+            dirty = true;
+            if (urgent_flush_.exchange(false, std::memory_order_relaxed)) {
+                std::fflush(file_);
+                dirty = false;
+            }
+            continue;
+        }
+        // Ring is empty: this is the only place routine records hit the disk
+        dirty |= reportDrops(reported_drops);
+        if (dirty) {
+            std::fflush(file_);
+            dirty = false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    drainOnce();
+    reportDrops(reported_drops);
+    std::fflush(file_);
+}
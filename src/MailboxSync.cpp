@@ -0,0 +1,599 @@
+#include "MailboxSync.h"
+#include "Logger.h"
+#include "Utf8.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unordered_set>
+
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::json;
+
+namespace {
+
+// Metadata kept per message; bodies are never fetched by the sync
+const json kEntryFields = {"id", "threadId", "from", "subject", "date", "snippet", "labelIds", "internalDate"};
+
+// Messages per POST /messages/batch; the service splits them into Gmail batches itself
+const size_t kFetchChunk = 100;
+
+// Idle priority for the calling thread: it only runs when a CPU would otherwise be idle,
+// so polling and tokenizing never take time from the decode threads
+void lowerThreadPriority() {
+#if defined(__linux__)
+    sched_param param{};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        // Not permitted in some containers; the lowest nice value still yields to decode
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+    }
+#elif defined(__APPLE__)
+    setpriority(PRIO_DARWIN_THREAD, 0, PRIO_DARWIN_BG);
+#endif
+}
+
+// GmailClient response as JSON. A failed request comes back as GmailClient's error envelope;
+// then null is returned, with the message in `error` and the HTTP status in `status` (0
+// for transport errors).
+json requestJson(const GmailClient& client, const std::string& method, const std::string& endpoint,
+                 const json& params, std::string& error, int* status = nullptr) {
+    json body = json::parse(client.request(method, endpoint, params), nullptr, /*allow_exceptions=*/false);
+    if (body.is_discarded()) {
+        error = method + " " + endpoint + ": invalid JSON in response";
+        return nullptr;
+    }
+    if (body.is_object() && body.contains("error")) {
+        if (status) {
+            *status = body.value("status_code", 0);
+        }
+        error = method + " " + endpoint + ": " + body.dump().substr(0, 200);
+        return nullptr;
+    }
+    return body;
+}
+
+bool hasLabel(const std::vector<std::string>& label_ids, const char* label) {
+    return std::find(label_ids.begin(), label_ids.end(), label) != label_ids.end();
+}
+
+std::vector<std::string> labelsOf(const json& message) {
+    std::vector<std::string> labels;
+    for (const auto& label : message.value("labelIds", json::array())) {
+        if (label.is_string()) {
+            labels.push_back(label.get<std::string>());
+        }
+    }
+    return labels;
+}
+
+} // namespace
+
+MailboxSync::MailboxSync(const std::string& gmail_service_addr, MailboxSyncOptions options)
+    : client_(gmail_service_addr), options_(std::move(options)) {}
+
+MailboxSync::~MailboxSync() {
+    stop();
+}
+
+void MailboxSync::setTokenCounter(TokenCounter counter) {
+    count_tokens_ = std::move(counter);
+}
+
+void MailboxSync::setChangeCallback(ChangeCallback callback) {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    on_change_ = std::move(callback);
+}
+
+void MailboxSync::start() {
+    if (worker_.joinable()) {
+        return;
+    }
+    loadSnapshot();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = false;
+    }
+    worker_ = std::thread(&MailboxSync::run, this);
+}
+
+void MailboxSync::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+void MailboxSync::syncNow() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_requested_ = true;
+    }
+    wake_.notify_all();
+}
+
+bool MailboxSync::ready() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ready_;
+}
+
+void MailboxSync::run() {
+    lowerThreadPriority();
+    LOG_INFO("MailboxSync::run", "Mailbox sync started (poll every %d-%d s)",
+             options_.min_interval_ms / 1000, options_.max_interval_ms / 1000);
+
+    int interval_ms = options_.min_interval_ms;
+    while (true) {
+        std::string history_id;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            history_id = history_id_;
+        }
+
+        bool ok = false;
+        bool changed = false;
+        std::string error;
+        const auto t_start = Clock::now();
+        if (history_id.empty()) {
+            ok = seed(error);
+            changed = ok;
+        } else {
+            bool expired = false;
+            ok = poll(changed, expired, error);
+            if (!ok && expired) {
+                LOG_WARN("MailboxSync::run", "History ID %s has expired; listing the inbox again.", history_id.c_str());
+                ok = seed(error);
+                changed = ok;
+            }
+        }
+        recountMissing();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            polls_++;
+            if (ok) {
+                ready_ = true;
+                last_sync_ = Clock::now();
+            } else {
+                poll_errors_++;
+            }
+        }
+        if (!ok) {
+            LOG_WARN("MailboxSync::run", "Sync failed: %s", error.c_str());
+        } else if (changed) {
+            saveSnapshot();
+            LOG_DEBUG("MailboxSync::run", "Mailbox synced in %.0f ms",
+                      std::chrono::duration<double, std::milli>(Clock::now() - t_start).count());
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            if (on_change_) {
+                on_change_();
+            }
+        }
+        // Back off while the mailbox is quiet (or the service is down), poll fast after a change
+        interval_ms = ok && changed ? options_.min_interval_ms : std::min(interval_ms * 2, options_.max_interval_ms);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return stop_ || wake_requested_; });
+        if (stop_) {
+            break;
+        }
+        if (wake_requested_) {
+            wake_requested_ = false;
+            interval_ms = options_.min_interval_ms;
+        }
+    }
+    LOG_INFO("MailboxSync::run", "Mailbox sync stopped");
+}
+
+bool MailboxSync::seed(std::string& error) {
+    // The history ID is read before listing, so changes made during the listing are replayed
+    // by the next poll rather than lost
+    const json profile = requestJson(client_, "GET", "/profile", json::object(), error);
+    if (profile.is_null() || !profile.contains("historyId")) {
+        if (error.empty()) error = "GET /profile: no historyId";
+        return false;
+    }
+    const std::string history_id = profile["historyId"].is_string()
+        ? profile["historyId"].get<std::string>()
+        : profile["historyId"].dump();
+
+    const json listing = requestJson(client_, "GET", "/messages", json{
+        {"query", "in:inbox"},
+        {"max_results", options_.seed_messages},
+        {"ids_only", true},
+    }, error);
+    if (listing.is_null()) {
+        return false;
+    }
+    std::vector<std::string> ids;
+    for (const auto& message : listing.value("messages", json::array())) {
+        const std::string id = message.value("id", "");
+        if (!id.empty()) {
+            ids.push_back(id);
+        }
+    }
+    std::vector<Entry> entries;
+    if (!fetchEntries(ids, entries, error)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    for (auto& entry : entries) {
+        entries_[entry.id] = std::move(entry);
+    }
+    history_id_ = history_id;
+    trimLocked();
+    LOG_INFO("MailboxSync::seed", "Listed %zu inbox messages at history ID %s", entries_.size(), history_id_.c_str());
+    return true;
+}
+
+bool MailboxSync::poll(bool& changed, bool& expired, std::string& error) {
+    std::string start_history_id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        start_history_id = history_id_;
+    }
+
+    // Walk every page first; records are applied in order, after the new messages are fetched
+    json records = json::array();
+    std::string latest_history_id = start_history_id;
+    std::string page_token;
+    do {
+        json params = {{"start_history_id", start_history_id}, {"max_results", 500}};
+        if (!page_token.empty()) {
+            params["page_token"] = page_token;
+        }
+        int status = 0;
+        const json page = requestJson(client_, "GET", "/history", params, error, &status);
+        if (page.is_null()) {
+            expired = status == 404;
+            return false;
+        }
+        for (const auto& record : page.value("history_records", json::array())) {
+            records.push_back(record);
+        }
+        if (page.contains("latest_history_id") && !page["latest_history_id"].is_null()) {
+            latest_history_id = page["latest_history_id"].is_string()
+                ? page["latest_history_id"].get<std::string>()
+                : page["latest_history_id"].dump();
+        }
+        page_token = page.value("next_page_token", json()).is_string() ? page["next_page_token"].get<std::string>() : "";
+    } while (!page_token.empty());
+
+    // Messages that enter the inbox (new, or moved back from the archive) need their metadata
+    std::vector<std::string> to_fetch;
+    std::unordered_set<std::string> queued;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& record : records) {
+            for (const char* kind : {"messagesAdded", "labelsAdded"}) {
+                for (const auto& change : record.value(kind, json::array())) {
+                    const json message = change.value("message", json::object());
+                    const std::string id = message.value("id", "");
+                    if (!id.empty() && !entries_.count(id) && hasLabel(labelsOf(message), "INBOX") &&
+                        queued.insert(id).second) {
+                        to_fetch.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+    std::vector<Entry> fetched;
+    if (!fetchEntries(to_fetch, fetched, error)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (history_id_ != start_history_id) {
+        return true; // Re-seeded meanwhile (cannot happen with one worker, but stay consistent)
+    }
+    std::map<std::string, Entry> arrived;
+    for (auto& entry : fetched) {
+        arrived[entry.id] = std::move(entry);
+    }
+    for (const auto& record : records) {
+        for (const auto& change : record.value("messagesDeleted", json::array())) {
+            changed |= entries_.erase(change.value("message", json::object()).value("id", "")) > 0;
+        }
+        for (const char* kind : {"messagesAdded", "labelsAdded", "labelsRemoved"}) {
+            for (const auto& change : record.value(kind, json::array())) {
+                const json message = change.value("message", json::object());
+                const std::string id = message.value("id", "");
+                const std::vector<std::string> labels = labelsOf(message);
+                if (!hasLabel(labels, "INBOX")) {
+                    changed |= entries_.erase(id) > 0; // Archived, or never in the inbox
+                    continue;
+                }
+                auto it = entries_.find(id);
+                if (it == entries_.end()) {
+                    auto fresh = arrived.find(id);
+                    if (fresh == arrived.end()) {
+                        continue; // Deleted before it could be fetched
+                    }
+                    it = entries_.emplace(id, std::move(fresh->second)).first;
+                    arrived.erase(fresh);
+                }
+                // The record carries the labels the message had after this change
+                it->second.label_ids = labels;
+                changed = true;
+            }
+        }
+    }
+    history_id_ = latest_history_id;
+    trimLocked();
+    if (!records.empty()) {
+        LOG_DEBUG("MailboxSync::poll", "Applied %zu history records (%zu new messages); now at history ID %s",
+                  records.size(), fetched.size(), history_id_.c_str());
+    }
+    changed |= latest_history_id != start_history_id; // Save the new position
+    return true;
+}
+
+bool MailboxSync::fetchEntries(const std::vector<std::string>& ids, std::vector<Entry>& entries, std::string& error) {
+    for (size_t start = 0; start < ids.size(); start += kFetchChunk) {
+        const size_t end = std::min(ids.size(), start + kFetchChunk);
+        const json batch = requestJson(client_, "POST", "/messages/batch", json{
+            {"message_ids", std::vector<std::string>(ids.begin() + start, ids.begin() + end)},
+            {"fields", kEntryFields},
+        }, error);
+        if (batch.is_null()) {
+            return false;
+        }
+        for (const auto& message : batch.value("messages", json::array())) {
+            if (!message.is_object() || message.contains("error")) {
+                continue; // Deleted since it was listed
+            }
+            Entry entry = fromJson(message);
+            truncateUtf8(entry.snippet, static_cast<size_t>(options_.snippet_chars));
+            countTokens(entry);
+            entries.push_back(std::move(entry));
+        }
+    }
+    return true;
+}
+
+void MailboxSync::countTokens(Entry& entry) const {
+    if (!count_tokens_) {
+        return;
+    }
+    const int tokens = count_tokens_(entry.from + "\n" + entry.subject + "\n" + entry.snippet);
+    entry.tokens = tokens > 0 ? tokens : -1;
+}
+
+void MailboxSync::recountMissing() {
+    if (!count_tokens_) {
+        return;
+    }
+    // Counted outside the lock: the counter may wait for the chat model
+    std::vector<Entry> missing;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [id, entry] : entries_) {
+            if (entry.tokens < 0) {
+                missing.push_back(entry);
+            }
+        }
+    }
+    if (missing.empty()) {
+        return;
+    }
+    for (auto& entry : missing) {
+        countTokens(entry);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : missing) {
+        auto it = entries_.find(entry.id);
+        if (it != entries_.end()) {
+            it->second.tokens = entry.tokens;
+        }
+    }
+}
+
+void MailboxSync::trimLocked() {
+    if (static_cast<int>(entries_.size()) <= options_.max_messages) {
+        return;
+    }
+    std::vector<std::pair<int64_t, std::string>> by_date;
+    by_date.reserve(entries_.size());
+    for (const auto& [id, entry] : entries_) {
+        by_date.emplace_back(entry.internal_date, id);
+    }
+    const size_t excess = entries_.size() - static_cast<size_t>(options_.max_messages);
+    std::nth_element(by_date.begin(), by_date.begin() + excess, by_date.end());
+    for (size_t i = 0; i < excess; i++) {
+        entries_.erase(by_date[i].second);
+    }
+}
+
+json MailboxSync::newest(int max_results, bool unread_only) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<const Entry*> order;
+    order.reserve(entries_.size());
+    for (const auto& [id, entry] : entries_) {
+        if (!unread_only || hasLabel(entry.label_ids, "UNREAD")) {
+            order.push_back(&entry);
+        }
+    }
+    std::sort(order.begin(), order.end(), [](const Entry* a, const Entry* b) { return a->internal_date > b->internal_date; });
+
+    json messages = json::array();
+    int tokens = 0;
+    for (const Entry* entry : order) {
+        if (static_cast<int>(messages.size()) >= max_results) {
+            break;
+        }
+        // Uncounted messages (and summaries) are estimated at 4 bytes per token
+        const int cost = static_cast<int>(entry->summary.size() / 4) + (entry->tokens >= 0
+            ? entry->tokens
+            : static_cast<int>((entry->from.size() + entry->subject.size() + entry->snippet.size()) / 4));
+        if (!messages.empty() && tokens + cost > options_.answer_token_budget) {
+            break;
+        }
+        tokens += cost;
+        json message = toJson(*entry);
+        message.erase("internalDate");
+        message.erase("tokens");
+        if (entry->summary.empty()) {
+            message.erase("summary");
+        }
+        messages.push_back(std::move(message));
+    }
+    const auto age = std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - last_sync_).count();
+    return json{
+        {"messages", std::move(messages)},
+        {"matching", order.size()},
+        {"synced_seconds_ago", age},
+    };
+}
+
+std::vector<std::pair<std::string, std::string>> MailboxSync::pendingSummaries(size_t max) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<const Entry*> pending;
+    for (const auto& [id, entry] : entries_) {
+        if (entry.summary.empty()) {
+            pending.push_back(&entry);
+        }
+    }
+    const size_t n = std::min(max, pending.size());
+    std::partial_sort(pending.begin(), pending.begin() + n, pending.end(),
+                      [](const Entry* a, const Entry* b) { return a->internal_date > b->internal_date; });
+    std::vector<std::pair<std::string, std::string>> out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        const Entry& entry = *pending[i];
+        out.emplace_back(entry.id, "From: " + entry.from + "\nSubject: " + entry.subject + "\n\n" + entry.snippet);
+    }
+    return out;
+}
+
+void MailboxSync::setSummaries(const std::vector<std::pair<std::string, std::string>>& summaries) {
+    bool changed = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [id, summary] : summaries) {
+            auto it = entries_.find(id);
+            if (it != entries_.end() && !summary.empty()) {
+                it->second.summary = summary;
+                changed = true;
+            }
+        }
+    }
+    if (changed) {
+        saveSnapshot();
+    }
+}
+
+json MailboxSync::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return json{
+        {"ready", ready_},
+        {"messages", entries_.size()},
+        {"history_id", history_id_},
+        {"synced_seconds_ago", ready_ ? std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - last_sync_).count() : -1},
+        {"polls", polls_},
+        {"poll_errors", poll_errors_},
+    };
+}
+
+json MailboxSync::toJson(const Entry& entry) {
+    return json{
+        {"id", entry.id},
+        {"threadId", entry.thread_id},
+        {"from", entry.from},
+        {"subject", entry.subject},
+        {"date", entry.date},
+        {"snippet", entry.snippet},
+        {"labelIds", entry.label_ids},
+        {"internalDate", entry.internal_date},
+        {"tokens", entry.tokens},
+        {"summary", entry.summary},
+    };
+}
+
+MailboxSync::Entry MailboxSync::fromJson(const json& j) {
+    Entry entry;
+    entry.id = j.value("id", "");
+    entry.thread_id = j.value("threadId", "");
+    entry.from = j.value("from", "");
+    entry.subject = j.value("subject", "");
+    entry.date = j.value("date", "");
+    entry.snippet = j.value("snippet", "");
+    entry.label_ids = labelsOf(j);
+    // Gmail sends internalDate as a string of milliseconds; the snapshot stores a number
+    const json internal_date = j.value("internalDate", json());
+    if (internal_date.is_number_integer()) {
+        entry.internal_date = internal_date.get<int64_t>();
+    } else if (internal_date.is_string()) {
+        entry.internal_date = std::strtoll(internal_date.get<std::string>().c_str(), nullptr, 10);
+    }
+    entry.tokens = j.value("tokens", -1);
+    entry.summary = j.value("summary", "");
+    return entry;
+}
+
+void MailboxSync::loadSnapshot() {
+    if (options_.snapshot_path.empty()) {
+        return;
+    }
+    std::ifstream in(options_.snapshot_path);
+    if (!in) {
+        return;
+    }
+    const json snapshot = json::parse(in, nullptr, /*allow_exceptions=*/false);
+    if (!snapshot.is_object() || !snapshot.value("history_id", json()).is_string()) {
+        LOG_WARN("MailboxSync::loadSnapshot", "Ignoring unreadable snapshot %s", options_.snapshot_path.c_str());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    for (const auto& message : snapshot.value("messages", json::array())) {
+        Entry entry = fromJson(message);
+        if (!entry.id.empty()) {
+            entries_[entry.id] = std::move(entry);
+        }
+    }
+    history_id_ = snapshot["history_id"].get<std::string>();
+    LOG_INFO("MailboxSync::loadSnapshot", "Loaded %zu messages at history ID %s from %s",
+             entries_.size(), history_id_.c_str(), options_.snapshot_path.c_str());
+}
+
+void MailboxSync::saveSnapshot() const {
+    if (options_.snapshot_path.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
+    json snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        json messages = json::array();
+        for (const auto& [id, entry] : entries_) {
+            messages.push_back(toJson(entry));
+        }
+        snapshot = json{{"history_id", history_id_}, {"messages", std::move(messages)}};
+    }
+    // Written aside and renamed, so a crash never leaves a truncated snapshot
+    const std::string tmp_path = options_.snapshot_path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        if (!out) {
+            LOG_WARN("MailboxSync::saveSnapshot", "Cannot write %s", tmp_path.c_str());
+            return;
+        }
+        out << snapshot.dump();
+    }
+    if (std::rename(tmp_path.c_str(), options_.snapshot_path.c_str()) != 0) {
+        LOG_WARN("MailboxSync::saveSnapshot", "Cannot replace %s", options_.snapshot_path.c_str());
+    }
+}
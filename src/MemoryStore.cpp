@@ -0,0 +1,481 @@
+#include "MemoryStore.h"
+#include "Logger.h"
+#include "MimeParser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+
+// BM25 parameters, the usual ones
+constexpr double kBm25K1 = 1.2;
+constexpr double kBm25B = 0.75;
+// Reciprocal-rank fusion constant: damps the difference between the first few ranks
+constexpr double kRrfK = 60.0;
+
+// Words too common to say anything about relevance
+const std::unordered_set<std::string>& stopWords() {
+    static const std::unordered_set<std::string> words = {
+        "an", "and", "are", "as", "at", "be", "by", "for", "from", "has", "have", "in", "is", "it",
+        "its", "me", "my", "of", "on", "or", "that", "the", "this", "to", "was", "were", "what",
+        "when", "which", "who", "will", "with", "you", "your",
+    };
+    return words;
+}
+
+const char kBase64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Embeddings are stored as base64 of the float32 array in host byte order (little-endian
+// on every platform llama.cpp runs on): a third of the size of a JSON number array
+std::string encodeVector(const std::vector<float>& v) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(v.data());
+    const size_t n = v.size() * sizeof(float);
+    std::string out;
+    out.reserve((n + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < n; i += 3) {
+        const uint32_t chunk = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+        out += kBase64Chars[(chunk >> 18) & 63];
+        out += kBase64Chars[(chunk >> 12) & 63];
+        out += kBase64Chars[(chunk >> 6) & 63];
+        out += kBase64Chars[chunk & 63];
+    }
+    if (i < n) {
+        const uint32_t chunk = (bytes[i] << 16) | (i + 1 < n ? bytes[i + 1] << 8 : 0);
+        out += kBase64Chars[(chunk >> 18) & 63];
+        out += kBase64Chars[(chunk >> 12) & 63];
+        out += i + 1 < n ? kBase64Chars[(chunk >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+bool decodeVector(const std::string& text, std::vector<float>& v) {
+    std::string bytes;
+    if (!base64UrlDecode(text, bytes) || bytes.size() % sizeof(float) != 0) {
+        return false;
+    }
+    v.resize(bytes.size() / sizeof(float));
+    std::memcpy(v.data(), bytes.data(), bytes.size());
+    return true;
+}
+
+json entryRecord(const MemoryEntry& e) {
+    return json{
+        {"type", "entry"},
+        {"id", e.id},
+        {"t", e.time_ms},
+        {"kind", e.kind},
+        {"key", e.key},
+        {"text", e.text},
+        {"source", e.source_hash},
+    };
+}
+
+json embeddingRecord(uint64_t id, const std::string& model, const std::vector<float>& embedding) {
+    return json{{"type", "embedding"}, {"id", id}, {"model", model}, {"vector", encodeVector(embedding)}};
+}
+
+// Eight independent partial sums, so the compiler can keep them in one vector register
+// (a single float accumulator may not be reordered without -ffast-math)
+float dotProduct(const float* a, const float* b, size_t n) {
+    float sums[8] = {};
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        for (int j = 0; j < 8; j++) {
+            sums[j] += a[k + j] * b[k + j];
+        }
+    }
+    float dot = 0.0f;
+    for (; k < n; k++) {
+        dot += a[k] * b[k];
+    }
+    for (float s : sums) {
+        dot += s;
+    }
+    return dot;
+}
+
+int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+uint64_t memoryHash(const std::string& text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+MemoryStore::MemoryStore(MemoryStoreOptions options) : options_(std::move(options)) {}
+
+MemoryStore::~MemoryStore() {
+    close();
+}
+
+bool MemoryStore::open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (options_.path.empty()) {
+        return true;
+    }
+
+    std::ifstream in(options_.path);
+    std::string line;
+    size_t line_no = 0;
+    size_t skipped = 0;
+    while (in.is_open() && std::getline(in, line)) {
+        line_no++;
+        if (line.empty()) continue;
+        try {
+            const json record = json::parse(line, nullptr, /*allow_exceptions=*/false);
+            const std::string type = record.is_object() ? record.value("type", "") : "";
+            if (type == "entry") {
+                MemoryEntry entry;
+                entry.id = record.value("id", uint64_t{0});
+                entry.time_ms = record.value("t", int64_t{0});
+                entry.kind = record.value("kind", "");
+                entry.key = record.value("key", "");
+                entry.text = record.value("text", "");
+                entry.source_hash = record.value("source", uint64_t{0});
+                if (entry.id == 0) {
+                    skipped++;
+                    continue;
+                }
+                next_id_ = std::max(next_id_, entry.id + 1);
+                insertLocked(std::move(entry));
+            } else if (type == "embedding") {
+                // Every field is read before the slot changes
+                auto it = by_id_.find(record.value("id", uint64_t{0}));
+                const std::string vector = record.value("vector", "");
+                const std::string model = record.value("model", "");
+                Slot* slot = it != by_id_.end() ? &slots_[it->second] : nullptr;
+                if (slot && decodeVector(vector, slot->entry.embedding)) {
+                    slot->embedding_model = model;
+                } else {
+                    skipped++; // Replaced entry, or a line cut short by a crash
+                }
+            } else {
+                skipped++;
+            }
+        } catch (const json::exception&) {
+            skipped++; // Right keys, wrong types
+            continue;
+        }
+        log_records_++;
+    }
+    if (skipped > 0) {
+        LOG_DEBUG("MemoryStore::open", "%zu of %zu lines of %s skipped", skipped, line_no, options_.path.c_str());
+    }
+    in.close();
+
+    // Replaced and forgotten entries are only dropped from the log here
+    if (log_records_ > 2 * live_ + 64) {
+        rewriteLog();
+    }
+    log_.open(options_.path, std::ios::app);
+    if (!log_.is_open()) {
+        LOG_ERROR("MemoryStore::open", "Cannot write %s; memory is kept for this process only", options_.path.c_str());
+        return false;
+    }
+    LOG_INFO("MemoryStore::open", "%zu entries from %s", live_, options_.path.c_str());
+    return true;
+}
+
+void MemoryStore::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (log_.is_open()) {
+        log_.close();
+    }
+}
+
+void MemoryStore::setEmbeddingModel(const std::string& model) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    embedding_model_ = model;
+}
+
+uint64_t MemoryStore::add(const std::string& kind, const std::string& key, const std::string& text, uint64_t source_hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    MemoryEntry entry;
+    entry.id = next_id_++;
+    entry.time_ms = nowMs();
+    entry.kind = kind;
+    entry.key = key;
+    entry.text = text;
+    entry.source_hash = source_hash;
+    appendRecord(entryRecord(entry).dump(-1, ' ', false, json::error_handler_t::replace));
+    const uint64_t id = entry.id;
+    insertLocked(std::move(entry));
+
+    // Dead slots keep their postings; drop them once they clearly outnumber the live ones
+    if (slots_.size() > 2 * live_ + 256) {
+        rebuildLocked();
+    }
+    return id;
+}
+
+std::vector<std::pair<uint64_t, std::string>> MemoryStore::pendingEmbeddings(size_t max) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<uint64_t, std::string>> pending;
+    for (size_t i = slots_.size(); i > 0 && pending.size() < max; i--) {
+        const Slot& slot = slots_[i - 1];
+        if (slot.live && (slot.entry.embedding.empty() || slot.embedding_model != embedding_model_)) {
+            pending.emplace_back(slot.entry.id, slot.entry.text);
+        }
+    }
+    return pending;
+}
+
+void MemoryStore::setEmbedding(uint64_t id, const std::vector<float>& embedding, const std::string& model) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_id_.find(id);
+    if (it == by_id_.end() || embedding.empty()) {
+        return;
+    }
+    Slot& slot = slots_[it->second];
+    slot.entry.embedding = embedding;
+    slot.embedding_model = model;
+    appendRecord(embeddingRecord(id, model, embedding).dump());
+}
+
+std::vector<MemoryHit> MemoryStore::search(const MemoryQuery& query) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<MemoryHit> hits;
+    if (live_ == 0 || query.k == 0) {
+        return hits;
+    }
+
+    // BM25 over the query's distinct terms
+    std::vector<double> keyword(slots_.size(), 0.0);
+    std::vector<std::string> query_terms = terms(query.text);
+    std::sort(query_terms.begin(), query_terms.end());
+    query_terms.erase(std::unique(query_terms.begin(), query_terms.end()), query_terms.end());
+    const double n_docs = static_cast<double>(live_);
+    const double avg_terms = std::max(1.0, static_cast<double>(live_terms_) / n_docs);
+    for (const std::string& term : query_terms) {
+        auto it = index_.find(term);
+        if (it == index_.end()) continue;
+        size_t df = 0;
+        for (const Posting& p : it->second) {
+            df += slots_[p.slot].live ? 1 : 0;
+        }
+        if (df == 0) continue;
+        const double idf = std::log(1.0 + (n_docs - df + 0.5) / (df + 0.5));
+        for (const Posting& p : it->second) {
+            const Slot& slot = slots_[p.slot];
+            if (!slot.live) continue;
+            const double tf = p.count;
+            keyword[p.slot] += idf * tf * (kBm25K1 + 1.0) /
+                               (tf + kBm25K1 * (1.0 - kBm25B + kBm25B * slot.n_terms / avg_terms));
+        }
+    }
+
+    // Dot products with the query embedding; both sides are normalized
+    std::vector<double> similarity(slots_.size(), -2.0); // -2: not comparable
+    const size_t dim = query.embedding.size();
+    for (size_t i = 0; dim > 0 && i < slots_.size(); i++) {
+        const Slot& slot = slots_[i];
+        if (!slot.live || slot.entry.embedding.size() != dim || slot.embedding_model != embedding_model_) continue;
+        similarity[i] = dotProduct(slot.entry.embedding.data(), query.embedding.data(), dim);
+    }
+
+    // Rank each list, then fuse the ranks of the eligible entries
+    std::vector<uint32_t> by_keyword;
+    std::vector<uint32_t> by_similarity;
+    for (uint32_t i = 0; i < slots_.size(); i++) {
+        const Slot& slot = slots_[i];
+        if (!slot.live || query.exclude_ids.count(slot.entry.id) || query.exclude_sources.count(slot.entry.source_hash)) {
+            continue;
+        }
+        if (keyword[i] > 0.0) by_keyword.push_back(i);
+        if (similarity[i] > -2.0) by_similarity.push_back(i);
+    }
+    std::sort(by_keyword.begin(), by_keyword.end(), [&](uint32_t a, uint32_t b) { return keyword[a] > keyword[b]; });
+    std::sort(by_similarity.begin(), by_similarity.end(), [&](uint32_t a, uint32_t b) { return similarity[a] > similarity[b]; });
+    std::unordered_map<uint32_t, double> fused;
+    for (size_t r = 0; r < by_keyword.size(); r++) {
+        fused[by_keyword[r]] += 1.0 / (kRrfK + r + 1);
+    }
+    for (size_t r = 0; r < by_similarity.size(); r++) {
+        const uint32_t i = by_similarity[r];
+        if (keyword[i] > 0.0 || similarity[i] >= query.min_similarity) {
+            fused[i] += 1.0 / (kRrfK + r + 1);
+        }
+    }
+
+    std::vector<std::pair<double, uint32_t>> ranked;
+    ranked.reserve(fused.size());
+    for (const auto& [slot, score] : fused) {
+        ranked.emplace_back(score, slot);
+    }
+    const size_t n = std::min(query.k, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+                      [](const auto& a, const auto& b) { return a.first > b.first || (a.first == b.first && a.second > b.second); });
+    for (size_t r = 0; r < n; r++) {
+        const Slot& slot = slots_[ranked[r].second];
+        MemoryHit hit;
+        hit.entry.id = slot.entry.id;
+        hit.entry.time_ms = slot.entry.time_ms;
+        hit.entry.kind = slot.entry.kind;
+        hit.entry.key = slot.entry.key;
+        hit.entry.text = slot.entry.text;
+        hit.entry.source_hash = slot.entry.source_hash;
+        hit.score = ranked[r].first;
+        hit.similarity = std::max(0.0, similarity[ranked[r].second]);
+        hit.keyword_score = keyword[ranked[r].second];
+        hits.push_back(std::move(hit));
+    }
+    return hits;
+}
+
+size_t MemoryStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return live_;
+}
+
+void MemoryStore::insertLocked(MemoryEntry entry) {
+    if (!entry.key.empty()) {
+        auto it = by_key_.find(entry.key);
+        if (it != by_key_.end()) {
+            forgetLocked(it->second);
+        }
+    }
+
+    const uint32_t slot_index = static_cast<uint32_t>(slots_.size());
+    std::unordered_map<std::string, uint32_t> counts;
+    const std::vector<std::string> entry_terms = terms(entry.text);
+    for (const std::string& term : entry_terms) {
+        counts[term]++;
+    }
+    for (const auto& [term, count] : counts) {
+        index_[term].push_back({slot_index, count});
+    }
+
+    Slot slot;
+    slot.live = true;
+    slot.n_terms = static_cast<uint32_t>(entry_terms.size());
+    by_id_[entry.id] = slot_index;
+    if (!entry.key.empty()) {
+        by_key_[entry.key] = slot_index;
+    }
+    slot.entry = std::move(entry);
+    slots_.push_back(std::move(slot));
+    live_++;
+    live_terms_ += slots_.back().n_terms;
+
+    // Oldest first: slots are in insertion order
+    for (uint32_t i = 0; live_ > options_.max_entries && i < slots_.size(); i++) {
+        if (slots_[i].live) {
+            forgetLocked(i);
+        }
+    }
+}
+
+void MemoryStore::forgetLocked(uint32_t slot_index) {
+    Slot& slot = slots_[slot_index];
+    if (!slot.live) {
+        return;
+    }
+    slot.live = false;
+    live_--;
+    live_terms_ -= slot.n_terms;
+    by_id_.erase(slot.entry.id);
+    auto it = by_key_.find(slot.entry.key);
+    if (it != by_key_.end() && it->second == slot_index) {
+        by_key_.erase(it);
+    }
+    // The postings stay until the next rebuild; search skips dead slots
+    slot.entry.text.clear();
+    slot.entry.text.shrink_to_fit();
+    slot.entry.embedding.clear();
+    slot.entry.embedding.shrink_to_fit();
+}
+
+void MemoryStore::rebuildLocked() {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    by_id_.clear();
+    by_key_.clear();
+    index_.clear();
+    live_ = 0;
+    live_terms_ = 0;
+    for (Slot& slot : old) {
+        if (!slot.live) continue;
+        std::string model = std::move(slot.embedding_model);
+        std::vector<float> embedding = std::move(slot.entry.embedding);
+        insertLocked(std::move(slot.entry));
+        slots_.back().entry.embedding = std::move(embedding);
+        slots_.back().embedding_model = std::move(model);
+    }
+    LOG_DEBUG("MemoryStore::rebuildLocked", "%zu live of %zu slots kept", live_, old.size());
+}
+
+void MemoryStore::appendRecord(const std::string& line) {
+    if (!log_.is_open()) {
+        return;
+    }
+    log_ << line << '\n';
+    // Flushed per record so a crash loses at most the line being written
+    log_.flush();
+    log_records_++;
+}
+
+void MemoryStore::rewriteLog() {
+    // Written aside and renamed, so a crash never leaves a truncated memory
+    const std::string tmp_path = options_.path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        if (!out.is_open()) {
+            LOG_WARN("MemoryStore::rewriteLog", "Cannot write %s", tmp_path.c_str());
+            return;
+        }
+        log_records_ = 0;
+        for (const Slot& slot : slots_) {
+            if (!slot.live) continue;
+            out << entryRecord(slot.entry).dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+            log_records_++;
+            if (!slot.entry.embedding.empty()) {
+                out << embeddingRecord(slot.entry.id, slot.embedding_model, slot.entry.embedding).dump() << '\n';
+                log_records_++;
+            }
+        }
+    }
+    if (std::rename(tmp_path.c_str(), options_.path.c_str()) != 0) {
+        LOG_WARN("MemoryStore::rewriteLog", "Cannot replace %s", options_.path.c_str());
+    }
+}
+
+std::vector<std::string> MemoryStore::terms(const std::string& text) {
+    // Lowercase ASCII letters and digits; bytes of multi-byte UTF-8 characters count as
+    // letters, so words in other scripts are kept whole (if not case-folded)
+    std::vector<std::string> out;
+    std::string word;
+    auto flush = [&]() {
+        if (word.size() >= 2 && word.size() <= 40 && !stopWords().count(word)) {
+            out.push_back(word);
+        }
+        word.clear();
+    };
+    for (unsigned char c : text) {
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            word += static_cast<char>(c);
+        } else if (c >= 'A' && c <= 'Z') {
+            word += static_cast<char>(c - 'A' + 'a');
+        } else {
+            flush();
+        }
+    }
+    flush();
+    return out;
+}
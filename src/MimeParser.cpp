@@ -0,0 +1,600 @@
+#include "MimeParser.h"
+#include "Logger.h"
+
+#include "nlohmann/json.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MIME_SSSE3_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+using json = nlohmann::json;
+
+namespace {
+
+// Nested multiparts deeper than this are treated as opaque leaves
+constexpr int kMaxDepth = 16;
+
+constexpr int8_t kInvalid = -1;
+constexpr int8_t kSkip = -2; // Whitespace inside wrapped base64
+constexpr int8_t kPad = -3;
+
+// Both base64 alphabets at once: '+' and '-' are 62, '/' and '_' are 63
+constexpr std::array<int8_t, 256> makeDecodeTable() {
+    std::array<int8_t, 256> table{};
+    for (auto& v : table) v = kInvalid;
+    for (int i = 0; i < 26; i++) {
+        table['A' + i] = static_cast<int8_t>(i);
+        table['a' + i] = static_cast<int8_t>(26 + i);
+    }
+    for (int i = 0; i < 10; i++) {
+        table['0' + i] = static_cast<int8_t>(52 + i);
+    }
+    table['+'] = 62;
+    table['-'] = 62;
+    table['/'] = 63;
+    table['_'] = 63;
+    table['='] = kPad;
+    table[' '] = kSkip;
+    table['\t'] = kSkip;
+    table['\r'] = kSkip;
+    table['\n'] = kSkip;
+    return table;
+}
+
+constexpr std::array<int8_t, 256> kDecode = makeDecodeTable();
+
+std::atomic<bool> base64_simd{true}; // setBase64Simd()
+
+#ifdef MIME_SSSE3_DISPATCH
+// Decodes whole blocks of 16 characters into 12 bytes each, stopping at the first block
+// that contains anything but base64 letters (whitespace, padding, garbage), which the
+// caller decodes with the table. Writes 16 bytes per block, so `out` needs 4 bytes of
+// slack. Returns the number of characters consumed, a multiple of 16.
+__attribute__((target("ssse3")))
+size_t decodeBlocksSsse3(const char* in, size_t len, uint8_t* out) {
+    const auto inRange = [](__m128i c, char lo, char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                             _mm_cmplt_epi8(c, _mm_set1_epi8(static_cast<char>(hi + 1))));
+    };
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        // Bytes >= 0x80 are negative as signed chars and fall outside every range
+        const __m128i upper = inRange(c, 'A', 'Z');
+        const __m128i lower = inRange(c, 'a', 'z');
+        const __m128i digit = inRange(c, '0', '9');
+        const __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+        const __m128i minus = _mm_cmpeq_epi8(c, _mm_set1_epi8('-'));
+        const __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+        const __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+        const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+                                           _mm_or_si128(_mm_or_si128(minus, slash), under));
+        if (_mm_movemask_epi8(valid) != 0xFFFF) {
+            break;
+        }
+        // Character to 6-bit value: one offset per class
+        __m128i offset = _mm_and_si128(upper, _mm_set1_epi8(-65));
+        offset = _mm_or_si128(offset, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+        offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(4)));
+        offset = _mm_or_si128(offset, _mm_and_si128(plus, _mm_set1_epi8(19)));
+        offset = _mm_or_si128(offset, _mm_and_si128(minus, _mm_set1_epi8(17)));
+        offset = _mm_or_si128(offset, _mm_and_si128(slash, _mm_set1_epi8(16)));
+        offset = _mm_or_si128(offset, _mm_and_si128(under, _mm_set1_epi8(-32)));
+        const __m128i values = _mm_add_epi8(c, offset);
+        // Pack four 6-bit values per 32-bit lane into 24 bits, then gather the 12 bytes
+        const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        const __m128i lanes = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        const __m128i bytes = _mm_shuffle_epi8(lanes, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i / 16 * 12), bytes);
+    }
+    return i;
+}
+
+bool cpuHasSsse3() {
+    static const bool has = __builtin_cpu_supports("ssse3");
+    return has;
+}
+#endif
+
+size_t decodeBlocks(const char* in, size_t len, uint8_t* out) {
+#ifdef MIME_SSSE3_DISPATCH
+    if (base64_simd.load(std::memory_order_relaxed) && cpuHasSsse3()) {
+        return decodeBlocksSsse3(in, len, out);
+    }
+#endif
+    (void)in;
+    (void)len;
+    (void)out;
+    return 0;
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+std::string toLower(std::string_view s) {
+    std::string out(s);
+    for (char& c : out) c = lowerAscii(c);
+    return out;
+}
+
+bool equalsInsensitive(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (lowerAscii(a[i]) != lowerAscii(b[i])) return false;
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view s) {
+    const size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == std::string_view::npos) return {};
+    const size_t last = s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last - first + 1);
+}
+
+// Windows-1252 code points of the bytes 0x80-0x9F, which ISO-8859-1 leaves to C1 controls.
+// The five bytes cp1252 does not assign map to themselves.
+constexpr uint16_t kCp1252High[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+// Appends Latin-1 bytes as UTF-8, or Windows-1252 bytes with `cp1252`
+void latin1ToUtf8(std::string_view in, std::string& out, bool cp1252) {
+    out.reserve(out.size() + in.size() + in.size() / 8);
+    for (const char ch : in) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        const uint32_t cp = cp1252 && c >= 0x80 && c < 0xA0 ? kCp1252High[c - 0x80] : c;
+        if (cp < 0x80) {
+            out.push_back(ch);
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+}
+
+bool isCp1252(const std::string& charset) {
+    return charset == "windows-1252" || charset == "cp1252";
+}
+
+bool isLatin1(const std::string& charset) {
+    return charset == "iso-8859-1" || charset == "latin1" || isCp1252(charset);
+}
+
+// Splits an entity at the first empty line into its header block and body
+void splitEntity(std::string_view entity, std::string_view& headers, std::string_view& body) {
+    size_t pos = 0;
+    while (pos < entity.size()) {
+        const size_t eol = entity.find('\n', pos);
+        if (eol == std::string_view::npos) {
+            break;
+        }
+        const size_t line_end = eol > pos && entity[eol - 1] == '\r' ? eol - 1 : eol;
+        if (line_end == pos) {
+            headers = entity.substr(0, pos);
+            body = entity.substr(eol + 1);
+            return;
+        }
+        pos = eol + 1;
+    }
+    headers = entity;
+    body = {};
+}
+
+// Unfolded value of the first header `name` in a header block; empty if absent
+std::string findHeader(std::string_view headers, std::string_view name) {
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t eol = headers.find('\n', pos);
+        if (eol == std::string_view::npos) eol = headers.size();
+        const std::string_view line = headers.substr(pos, eol - pos);
+        pos = eol + 1;
+        if (line.size() <= name.size() || line[name.size()] != ':' || !equalsInsensitive(line.substr(0, name.size()), name)) {
+            continue;
+        }
+        std::string value(trim(line.substr(name.size() + 1)));
+        // Continuation lines start with whitespace; the line break itself is dropped
+        while (pos < headers.size() && (headers[pos] == ' ' || headers[pos] == '\t')) {
+            eol = headers.find('\n', pos);
+            if (eol == std::string_view::npos) eol = headers.size();
+            value += ' ';
+            value += trim(headers.substr(pos, eol - pos));
+            pos = eol + 1;
+        }
+        return value;
+    }
+    return {};
+}
+
+// "text/plain; charset=utf-8" -> "text/plain"
+std::string mainValue(std::string_view value) {
+    return toLower(trim(value.substr(0, value.find(';'))));
+}
+
+// Parameter `name` of a structured header value, unquoted. RFC 2231 extended values
+// (name*=utf-8''caf%C3%A9) are percent-decoded; their charset is assumed to be UTF-8.
+std::string headerParam(std::string_view value, std::string_view name) {
+    size_t pos = value.find(';');
+    while (pos != std::string_view::npos) {
+        const size_t start = pos + 1;
+        const size_t eq = value.find('=', start);
+        if (eq == std::string_view::npos) {
+            break;
+        }
+        const std::string_view key = trim(value.substr(start, eq - start));
+        size_t vstart = eq + 1;
+        while (vstart < value.size() && (value[vstart] == ' ' || value[vstart] == '\t')) vstart++;
+        std::string param;
+        size_t next;
+        if (vstart < value.size() && value[vstart] == '"') {
+            size_t i = vstart + 1;
+            for (; i < value.size() && value[i] != '"'; i++) {
+                if (value[i] == '\\' && i + 1 < value.size()) i++;
+                param += value[i];
+            }
+            next = value.find(';', i);
+        } else {
+            next = value.find(';', vstart);
+            param = std::string(trim(value.substr(vstart, next == std::string_view::npos ? std::string_view::npos : next - vstart)));
+        }
+        if (equalsInsensitive(key, name)) {
+            return param;
+        }
+        if (key.size() == name.size() + 1 && key.back() == '*' && equalsInsensitive(key.substr(0, name.size()), name)) {
+            const size_t quote = param.find("''");
+            const std::string_view encoded = quote == std::string::npos ? std::string_view(param) : std::string_view(param).substr(quote + 2);
+            std::string decoded;
+            for (size_t i = 0; i < encoded.size(); i++) {
+                if (encoded[i] == '%' && i + 2 < encoded.size() && hexValue(encoded[i + 1]) >= 0 && hexValue(encoded[i + 2]) >= 0) {
+                    decoded += static_cast<char>(hexValue(encoded[i + 1]) * 16 + hexValue(encoded[i + 2]));
+                    i += 2;
+                } else {
+                    decoded += encoded[i];
+                }
+            }
+            return decoded;
+        }
+        pos = next;
+    }
+    return {};
+}
+
+// RFC 2047 encoded words (=?charset?B?...?= and =?charset?Q?...?=) in a header value.
+// UTF-8, ASCII and Latin-1 are converted; words in other charsets are left as they are.
+std::string decodeEncodedWords(const std::string& value) {
+    if (value.find("=?") == std::string::npos) {
+        return value;
+    }
+    std::string out;
+    size_t pos = 0;
+    bool previous_was_word = false;
+    while (pos < value.size()) {
+        const size_t start = value.find("=?", pos);
+        if (start == std::string::npos) {
+            out.append(value, pos, std::string::npos);
+            break;
+        }
+        const size_t q1 = value.find('?', start + 2);
+        const size_t q2 = q1 == std::string::npos ? q1 : value.find('?', q1 + 1);
+        const size_t end = q2 == std::string::npos ? q2 : value.find("?=", q2 + 1);
+        if (end == std::string::npos || q2 != q1 + 2) {
+            out.append(value, pos, std::string::npos);
+            break;
+        }
+        // Whitespace between two adjacent encoded words is not part of the text
+        const std::string_view between(value.data() + pos, start - pos);
+        if (!(previous_was_word && trim(between).empty())) {
+            out.append(between);
+        }
+        const std::string charset = toLower(std::string_view(value).substr(start + 2, q1 - start - 2));
+        const char encoding = lowerAscii(value[q1 + 1]);
+        const std::string_view text(value.data() + q2 + 1, end - q2 - 1);
+        std::string decoded;
+        bool ok = true;
+        if (encoding == 'b') {
+            ok = base64UrlDecode(text, decoded);
+        } else if (encoding == 'q') {
+            for (size_t i = 0; i < text.size(); i++) {
+                if (text[i] == '_') {
+                    decoded += ' ';
+                } else if (text[i] == '=' && i + 2 < text.size() && hexValue(text[i + 1]) >= 0 && hexValue(text[i + 2]) >= 0) {
+                    decoded += static_cast<char>(hexValue(text[i + 1]) * 16 + hexValue(text[i + 2]));
+                    i += 2;
+                } else {
+                    decoded += text[i];
+                }
+            }
+        } else {
+            ok = false;
+        }
+        if (ok && isLatin1(charset)) {
+            std::string utf8;
+            latin1ToUtf8(decoded, utf8, isCp1252(charset));
+            out += utf8;
+        } else if (ok && (charset == "utf-8" || charset == "us-ascii")) {
+            out += decoded;
+        } else {
+            out.append(value, start, end + 2 - start);
+        }
+        previous_was_word = true;
+        pos = end + 2;
+    }
+    return out;
+}
+
+// Start of the next boundary delimiter line at or after `from`
+size_t findDelimiter(std::string_view body, std::string_view delimiter, size_t from) {
+    for (size_t p = body.find(delimiter, from); p != std::string_view::npos; p = body.find(delimiter, p + 1)) {
+        if (p == 0 || body[p - 1] == '\n') {
+            return p;
+        }
+    }
+    return std::string_view::npos;
+}
+
+} // namespace
+
+void setBase64Simd(bool enabled) {
+    base64_simd.store(enabled, std::memory_order_relaxed);
+}
+
+bool base64UrlDecode(std::string_view in, std::string& out) {
+    const size_t start = out.size();
+    // Upper bound plus 16 bytes, so the block decoder may store past the last full block
+    out.resize(start + in.size() / 4 * 3 + 3 + 16);
+    uint8_t* dst = reinterpret_cast<uint8_t*>(&out[start]);
+    size_t o = 0;
+    size_t i = 0;
+    uint32_t acc = 0;
+    int n = 0;
+    while (i < in.size()) {
+        if (n == 0 && in.size() - i >= 16) {
+            const size_t used = decodeBlocks(in.data() + i, in.size() - i, dst + o);
+            i += used;
+            o += used / 4 * 3;
+            if (i == in.size()) {
+                break;
+            }
+        }
+        const int8_t v = kDecode[static_cast<unsigned char>(in[i++])];
+        if (v >= 0) {
+            acc = (acc << 6) | static_cast<uint32_t>(v);
+            if (++n == 4) {
+                dst[o++] = static_cast<uint8_t>(acc >> 16);
+                dst[o++] = static_cast<uint8_t>(acc >> 8);
+                dst[o++] = static_cast<uint8_t>(acc);
+                acc = 0;
+                n = 0;
+            }
+        } else if (v == kPad) {
+            break; // The data ends at the padding
+        } else if (v != kSkip) {
+            out.resize(start);
+            return false;
+        }
+    }
+    // A final partial quantum: 2 characters carry 1 byte, 3 carry 2
+    if (n == 2) {
+        dst[o++] = static_cast<uint8_t>(acc >> 4);
+    } else if (n == 3) {
+        dst[o++] = static_cast<uint8_t>(acc >> 10);
+        dst[o++] = static_cast<uint8_t>(acc >> 2);
+    }
+    out.resize(start + o);
+    return true;
+}
+
+void quotedPrintableDecode(std::string_view in, std::string& out) {
+    out.reserve(out.size() + in.size());
+    size_t i = 0;
+    while (i < in.size()) {
+        // Copy the run up to the next escape in one go
+        const void* eq_ptr = std::memchr(in.data() + i, '=', in.size() - i);
+        const size_t eq = eq_ptr ? static_cast<size_t>(static_cast<const char*>(eq_ptr) - in.data()) : in.size();
+        out.append(in.data() + i, eq - i);
+        if (eq == in.size()) {
+            break;
+        }
+        i = eq + 1;
+        if (i < in.size() && in[i] == '\n') {
+            i++; // Soft line break
+        } else if (i + 1 < in.size() && in[i] == '\r' && in[i + 1] == '\n') {
+            i += 2;
+        } else if (i + 1 < in.size() && hexValue(in[i]) >= 0 && hexValue(in[i + 1]) >= 0) {
+            out.push_back(static_cast<char>(hexValue(in[i]) * 16 + hexValue(in[i + 1])));
+            i += 2;
+        } else {
+            out.push_back('=');
+        }
+    }
+}
+
+MimeMessage::MimeMessage(std::string_view message) {
+    std::string_view body;
+    splitEntity(message, headers_, body);
+    walk(headers_, body, 0);
+}
+
+std::string MimeMessage::header(std::string_view name) const {
+    return decodeEncodedWords(findHeader(headers_, name));
+}
+
+void MimeMessage::walk(std::string_view headers, std::string_view body, int depth) {
+    const std::string content_type = findHeader(headers, "Content-Type");
+    std::string type = mainValue(content_type);
+    if (type.empty()) {
+        type = "text/plain";
+    }
+
+    if (type.compare(0, 10, "multipart/") == 0 && depth < kMaxDepth) {
+        const std::string boundary = headerParam(content_type, "boundary");
+        if (!boundary.empty()) {
+            const std::string delimiter = "--" + boundary;
+            size_t pos = findDelimiter(body, delimiter, 0);
+            while (pos != std::string_view::npos) {
+                const size_t after = pos + delimiter.size();
+                if (body.compare(after, 2, "--") == 0) {
+                    break; // Close delimiter
+                }
+                const size_t eol = body.find('\n', after);
+                if (eol == std::string_view::npos) {
+                    break;
+                }
+                const size_t start = eol + 1;
+                const size_t next = findDelimiter(body, delimiter, start);
+                size_t end = next == std::string_view::npos ? body.size() : next;
+                // The line break before a delimiter belongs to the delimiter
+                if (next != std::string_view::npos && end > start && body[end - 1] == '\n') end--;
+                if (next != std::string_view::npos && end > start && body[end - 1] == '\r') end--;
+                std::string_view part_headers;
+                std::string_view part_body;
+                splitEntity(body.substr(start, end - start), part_headers, part_body);
+                walk(part_headers, part_body, depth + 1);
+                pos = next;
+            }
+            return;
+        }
+    }
+
+    MimePart part;
+    part.headers = headers;
+    part.body = body;
+    part.content_type = std::move(type);
+    part.charset = toLower(headerParam(content_type, "charset"));
+    part.transfer_encoding = mainValue(findHeader(headers, "Content-Transfer-Encoding"));
+    const std::string disposition = findHeader(headers, "Content-Disposition");
+    part.filename = decodeEncodedWords(headerParam(disposition, "filename"));
+    if (part.filename.empty()) {
+        part.filename = decodeEncodedWords(headerParam(content_type, "name"));
+    }
+    part.attachment = mainValue(disposition) == "attachment" || !part.filename.empty();
+    parts_.push_back(std::move(part));
+}
+
+std::string MimeMessage::bodyText() const {
+    const MimePart* html = nullptr;
+    for (const auto& part : parts_) {
+        if (part.attachment) continue;
+        if (part.content_type == "text/plain") {
+            return decodeBody(part);
+        }
+        if (part.content_type == "text/html" && !html) {
+            html = &part;
+        }
+    }
+    return html ? decodeBody(*html) : std::string();
+}
+
+std::string MimeMessage::decodeBody(const MimePart& part) {
+    std::string decoded;
+    if (part.transfer_encoding == "base64") {
+        decoded.reserve(part.body.size() / 4 * 3 + 3 + 16);
+        if (!base64UrlDecode(part.body, decoded)) {
+            decoded = "[Error decoding body: invalid base64]";
+            return decoded;
+        }
+    } else if (part.transfer_encoding == "quoted-printable") {
+        quotedPrintableDecode(part.body, decoded);
+    } else {
+        decoded.assign(part.body);
+    }
+    if (isLatin1(part.charset)) {
+        std::string utf8;
+        latin1ToUtf8(decoded, utf8, isCp1252(part.charset));
+        return utf8;
+    }
+    return decoded;
+}
+
+bool rawMessageToContent(const std::string& response, std::string& content) {
+    // Find the "raw" member; base64url needs no JSON escapes, so its value is the bytes
+    // between the quotes
+    size_t key = response.find("\"raw\"");
+    while (key != std::string::npos && key > 0 && response[key - 1] == '\\') {
+        key = response.find("\"raw\"", key + 1);
+    }
+    if (key == std::string::npos) {
+        return false;
+    }
+    size_t pos = response.find_first_not_of(" \t\r\n", key + 5);
+    if (pos == std::string::npos || response[pos] != ':') {
+        return false;
+    }
+    pos = response.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string::npos || response[pos] != '"') {
+        return false;
+    }
+    const size_t value_start = pos + 1;
+    const size_t value_end = response.find('"', value_start);
+    if (value_end == std::string::npos) {
+        return false;
+    }
+    const std::string_view raw(response.data() + value_start, value_end - value_start);
+    if (raw.find('\\') != std::string_view::npos) {
+        return false;
+    }
+
+    // The metadata around it is small; parse it without the raw value
+    std::string metadata_text;
+    metadata_text.reserve(response.size() - raw.size() + 8);
+    metadata_text.append(response, 0, value_start - 1);
+    metadata_text += "null";
+    metadata_text.append(response, value_end + 1, std::string::npos);
+    const json metadata = json::parse(metadata_text, nullptr, /*allow_exceptions=*/false);
+    if (!metadata.is_object()) {
+        return false;
+    }
+
+    std::string message;
+    if (!base64UrlDecode(raw, message)) {
+        LOG_WARN("rawMessageToContent", "Message %s: raw payload is not valid base64url", metadata.value("id", "").c_str());
+        return false;
+    }
+    const MimeMessage mime(message);
+
+    json attachments = json::array();
+    for (const auto& part : mime.parts()) {
+        if (!part.attachment) continue;
+        // Encoded size, scaled for base64; attachments are never decoded
+        const size_t size = part.transfer_encoding == "base64" ? part.body.size() / 4 * 3 : part.body.size();
+        attachments.push_back(json{{"filename", part.filename}, {"mimeType", part.content_type}, {"size", size}});
+    }
+    std::string from = mime.header("From");
+    std::string subject = mime.header("Subject");
+    std::string body = mime.bodyText();
+    json out = {
+        {"id", metadata.value("id", json())},
+        {"threadId", metadata.value("threadId", json())},
+        {"from", from.empty() ? "[No Sender]" : std::move(from)},
+        {"subject", subject.empty() ? "[No Subject]" : std::move(subject)},
+        {"snippet", metadata.value("snippet", json())},
+        {"body", body.empty() ? "[No readable body content found]" : std::move(body)},
+    };
+    if (!attachments.empty()) {
+        out["attachments"] = std::move(attachments);
+    }
+    // Mail in undeclared charsets can hold invalid UTF-8; replace it rather than fail
+    content = out.dump(-1, ' ', false, json::error_handler_t::replace);
+    return true;
+}
@@ -0,0 +1,195 @@
+#include "PerfMetrics.h"
+
+#include <cstdio>
+
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+thread_local uint64_t thread_allocations = 0;
+} // namespace
+
+uint64_t threadAllocationCount() {
+    return thread_allocations;
+}
+
+void countThreadAllocation() {
+    thread_allocations++;
+}
+
+double GenerationMetrics::prefillTokensPerSecond() const {
+    return prefill_ms > 0.0 ? prefill_tokens * 1000.0 / prefill_ms : 0.0;
+}
+
+double GenerationMetrics::decodeTokensPerSecond() const {
+    return decode_ms > 0.0 ? generated_tokens * 1000.0 / decode_ms : 0.0;
+}
+
+json GenerationMetrics::toJson() const {
+    return json{
+        {"prompt_tokens", prompt_tokens},
+        {"reused_tokens", reused_tokens},
+        {"prefill_tokens", prefill_tokens},
+        {"generated_tokens", generated_tokens},
+        {"context_shifts", context_shifts},
+        {"tokenize_ms", tokenize_ms},
+        {"prefill_ms", prefill_ms},
+        {"decode_ms", decode_ms},
+        {"sample_ms", sample_ms},
+        {"ttft_ms", ttft_ms},
+        {"total_ms", total_ms},
+        {"prefill_tokens_per_s", prefillTokensPerSecond()},
+        {"decode_tokens_per_s", decodeTokensPerSecond()},
+        {"llama_perf", {
+            {"prompt_eval_ms", perf_prompt_eval_ms},
+            {"eval_ms", perf_eval_ms},
+            {"prompt_eval_tokens", perf_prompt_eval_tokens},
+            {"eval_tokens", perf_eval_tokens},
+        }},
+    };
+}
+
+json IterationMetrics::toJson() const {
+    json j = {
+        {"index", index},
+        {"generation", generation.toJson()},
+    };
+    if (has_tool_call) {
+        j["tool"] = {
+            {"name", tool.tool_name},
+            {"method", tool.http_method},
+            {"http_ms", tool.http_ms},
+            {"response_bytes", tool.response_bytes},
+            {"error", tool.error},
+            {"prefetched", tool.prefetched},
+            {"parse_us", tool.parse_us},
+            {"parse_allocations", tool.parse_allocations},
+        };
+    }
+    if (routed) {
+        j["route"] = {
+            {"decision", route.decision},
+            {"confidence", route.confidence},
+            {"generation", route.generation.toJson()},
+        };
+    }
+    return j;
+}
+
+double TurnMetrics::ttftMs() const {
+    return iterations.empty() ? 0.0 : iterations.front().generation.ttft_ms;
+}
+
+int TurnMetrics::promptTokens() const {
+    int total = 0;
+    for (const auto& it : iterations) total += it.generation.prompt_tokens;
+    return total;
+}
+
+int TurnMetrics::reusedTokens() const {
+    int total = 0;
+    for (const auto& it : iterations) total += it.generation.reused_tokens;
+    return total;
+}
+
+int TurnMetrics::prefillTokens() const {
+    int total = 0;
+    for (const auto& it : iterations) total += it.generation.prefill_tokens;
+    return total;
+}
+
+int TurnMetrics::generatedTokens() const {
+    int total = 0;
+    for (const auto& it : iterations) total += it.generation.generated_tokens;
+    return total;
+}
+
+double TurnMetrics::prefillMs() const {
+    double total = 0.0;
+    for (const auto& it : iterations) total += it.generation.prefill_ms;
+    return total;
+}
+
+double TurnMetrics::decodeMs() const {
+    double total = 0.0;
+    for (const auto& it : iterations) total += it.generation.decode_ms;
+    return total;
+}
+
+double TurnMetrics::sampleMs() const {
+    double total = 0.0;
+    for (const auto& it : iterations) total += it.generation.sample_ms;
+    return total;
+}
+
+double TurnMetrics::toolMs() const {
+    double total = 0.0;
+    for (const auto& it : iterations) total += it.has_tool_call ? it.tool.http_ms : 0.0;
+    return total;
+}
+
+size_t TurnMetrics::toolBytes() const {
+    size_t total = 0;
+    for (const auto& it : iterations) total += it.has_tool_call ? it.tool.response_bytes : 0;
+    return total;
+}
+
+int TurnMetrics::toolCalls() const {
+    int total = 0;
+    for (const auto& it : iterations) total += it.has_tool_call ? 1 : 0;
+    return total;
+}
+
+json TurnMetrics::toJson() const {
+    json its = json::array();
+    for (const auto& it : iterations) {
+        its.push_back(it.toJson());
+    }
+    const double prefill_ms = prefillMs();
+    const double decode_ms = decodeMs();
+    return json{
+        {"turn", turn},
+        {"timestamp_ms", timestamp_ms},
+        {"total_ms", total_ms},
+        {"n_ctx", n_ctx},
+        {"kv_tokens_after", kv_tokens_after},
+        {"memory_entries", memory_entries},
+        {"memory_tokens", memory_tokens},
+        {"memory_ms", memory_ms},
+        {"memory_lookup_ms", memory_lookup_ms},
+        {"ttft_ms", ttftMs()},
+        {"prompt_tokens", promptTokens()},
+        {"reused_tokens", reusedTokens()},
+        {"prefill_tokens", prefillTokens()},
+        {"generated_tokens", generatedTokens()},
+        {"prefill_ms", prefill_ms},
+        {"decode_ms", decode_ms},
+        {"sample_ms", sampleMs()},
+        {"prefill_tokens_per_s", prefill_ms > 0.0 ? prefillTokens() * 1000.0 / prefill_ms : 0.0},
+        {"decode_tokens_per_s", decode_ms > 0.0 ? generatedTokens() * 1000.0 / decode_ms : 0.0},
+        {"tool_calls", toolCalls()},
+        {"tool_ms", toolMs()},
+        {"tool_bytes", toolBytes()},
+        {"iterations", its},
+    };
+}
+
+std::string TurnMetrics::statusLine() const {
+    if (iterations.empty()) {
+        return "no turns yet";
+    }
+    const double prefill_ms = prefillMs();
+    const double decode_ms = decodeMs();
+    char buf[256];
+    std::snprintf(buf, sizeof(buf),
+                  "TTFT %.0f ms | prefill %d tok (%d cached) %.0f tok/s | decode %d tok %.1f tok/s | tools %d %.0f ms %zu B | ctx %d/%d",
+                  ttftMs(),
+                  prefillTokens(), reusedTokens(),
+                  prefill_ms > 0.0 ? prefillTokens() * 1000.0 / prefill_ms : 0.0,
+                  generatedTokens(),
+                  decode_ms > 0.0 ? generatedTokens() * 1000.0 / decode_ms : 0.0,
+                  toolCalls(), toolMs(), toolBytes(),
+                  kv_tokens_after, n_ctx);
+    return buf;
+}
@@ -0,0 +1,115 @@
+#include "SessionRecorder.h"
+#include "Logger.h"
+
+using json = nlohmann::json;
+
+SessionRecorder::~SessionRecorder() {
+    close();
+}
+
+bool SessionRecorder::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.is_open()) {
+        file_.close();
+    }
+    in_memory_ = false;
+    // A recording is one session; never append to an older one
+    file_.open(path, std::ios::trunc);
+    if (!file_.is_open()) {
+        LOG_ERROR("SessionRecorder::open", "Could not open session recording: %s", path.c_str());
+        return false;
+    }
+    start_ = PerfClock::now();
+    LOG_INFO("SessionRecorder::open", "Recording session to %s", path.c_str());
+    return true;
+}
+
+void SessionRecorder::captureInMemory() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.is_open()) {
+        file_.close();
+    }
+    in_memory_ = true;
+    events_.clear();
+    start_ = PerfClock::now();
+}
+
+void SessionRecorder::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.is_open()) {
+        file_.close();
+    }
+    in_memory_ = false;
+}
+
+bool SessionRecorder::isOpen() const {
+    return in_memory_ || file_.is_open();
+}
+
+std::vector<json> SessionRecorder::takeEvents() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<json> events;
+    events.swap(events_);
+    return events;
+}
+
+void SessionRecorder::write(const char* type, json event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    event["type"] = type;
+    event["t_ms"] = elapsedMs(start_);
+    if (in_memory_) {
+        events_.push_back(std::move(event));
+        return;
+    }
+    if (!file_.is_open()) {
+        return;
+    }
+    // Model output and tool bodies may contain invalid UTF-8; keep the recording loadable
+    file_ << event.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+    // Flushed per event so a crash still leaves a replayable prefix
+    file_.flush();
+}
+
+void SessionRecorder::recordSessionStart(const json& config) {
+    write("session_start", json{{"config", config}});
+}
+
+void SessionRecorder::recordReset() {
+    write("reset", json::object());
+}
+
+void SessionRecorder::recordUserMessage(const std::string& text) {
+    write("user", json{{"text", text}});
+}
+
+void SessionRecorder::recordPrompt(const std::string& prompt) {
+    write("prompt", json{{"text", prompt}});
+}
+
+void SessionRecorder::recordGeneration(const std::vector<int32_t>& tokens, const std::vector<double>& token_ms, const std::string& text) {
+    write("generation", json{{"tokens", tokens}, {"token_ms", token_ms}, {"text", text}});
+}
+
+void SessionRecorder::recordToolCall(const std::string& tool_name, const std::string& http_method, const std::string& endpoint,
+                                     const json& params, const std::string& response, double ms) {
+    write("tool", json{
+        {"name", tool_name},
+        {"method", http_method},
+        {"endpoint", endpoint},
+        {"params", params},
+        {"response", response},
+        {"ms", ms},
+    });
+}
+
+void SessionRecorder::recordTurnEnd(const TurnMetrics& metrics) {
+    write("turn_end", json{{"metrics", metrics.toJson()}});
+}
+
+void SessionRecorder::recordMemory(const std::string& text) {
+    write("memory", json{{"text", text}});
+}
+
+void SessionRecorder::recordCompaction(size_t replaced_messages, const std::string& summary) {
+    write("compaction", json{{"messages", replaced_messages}, {"summary", summary}});
+}
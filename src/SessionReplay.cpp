@@ -0,0 +1,300 @@
+#include "SessionReplay.h"
+#include "LlamaInference.h"
+#include "SessionRecorder.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <fstream>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Metrics compared between the recording and the replay. Tool time is excluded from
+// the wall-clock figure because replayed tool calls are answered from memory.
+const char* const kComparedMetrics[] = {
+    "ttft_ms", "prefill_tokens_per_s", "decode_tokens_per_s", "prefill_tokens", "generated_tokens", "compute_ms",
+};
+
+json comparableMetrics(const json& turn_metrics) {
+    if (!turn_metrics.is_object()) {
+        return json::object();
+    }
+    json out = json::object();
+    for (const char* key : kComparedMetrics) {
+        if (turn_metrics.contains(key)) {
+            out[key] = turn_metrics[key];
+        }
+    }
+    out["compute_ms"] = turn_metrics.value("total_ms", 0.0) - turn_metrics.value("tool_ms", 0.0);
+    return out;
+}
+
+// Percentage change from `recorded` to `replayed` for every metric present in both
+json metricDeltas(const json& recorded, const json& replayed) {
+    json deltas = json::object();
+    for (const char* key : kComparedMetrics) {
+        if (!recorded.contains(key) || !replayed.contains(key)) continue;
+        const double before = recorded[key].get<double>();
+        const double after = replayed[key].get<double>();
+        deltas[key] = before != 0.0 ? (after - before) * 100.0 / before : 0.0;
+    }
+    return deltas;
+}
+
+json toolCallsJson(const std::vector<RecordedToolCall>& calls) {
+    json out = json::array();
+    for (const auto& call : calls) out.push_back(call.toJson());
+    return out;
+}
+
+} // namespace
+
+bool RecordedToolCall::sameRequest(const RecordedToolCall& other) const {
+    return method == other.method && endpoint == other.endpoint && params == other.params;
+}
+
+json RecordedToolCall::toJson() const {
+    return json{{"name", name}, {"method", method}, {"endpoint", endpoint}, {"params", params}};
+}
+
+bool RecordedSession::load(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::vector<json> events;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(file, line)) {
+        line_no++;
+        if (line.empty()) continue;
+        json event = json::parse(line, nullptr, /*allow_exceptions=*/false);
+        if (event.is_discarded() || !event.is_object() || !event.contains("type")) {
+            error = path + ":" + std::to_string(line_no) + ": not a session event";
+            return false;
+        }
+        events.push_back(std::move(event));
+    }
+    appendEvents(events);
+    if (turns.empty()) {
+        error = path + " contains no turns";
+        return false;
+    }
+    return true;
+}
+
+void RecordedSession::appendEvents(const std::vector<json>& events) {
+    bool pending_reset = false;
+    json pending_compaction;
+    std::string pending_memory;
+    RecordedTurn* current = nullptr;
+    for (const auto& event : events) {
+        const std::string type = event.value("type", "");
+        if (type == "session_start") {
+            config = event.value("config", json::object());
+        } else if (type == "reset") {
+            pending_reset = true;
+            pending_compaction = nullptr;
+            pending_memory.clear();
+            current = nullptr;
+        } else if (type == "compaction") {
+            // Compactions happen between turns (idle time) or at the start of chat(), before
+            // its user event; either way they apply to the next turn
+            pending_compaction = json{{"messages", event.value("messages", 0)}, {"summary", event.value("summary", "")}};
+        } else if (type == "memory") {
+            // Recorded by chat() just before its user event
+            pending_memory = event.value("text", "");
+        } else if (type == "user") {
+            turns.emplace_back();
+            current = &turns.back();
+            current->reset_before = pending_reset;
+            current->compaction_before = std::move(pending_compaction);
+            pending_compaction = nullptr;
+            current->memory_before = std::move(pending_memory);
+            pending_memory.clear();
+            current->user_message = event.value("text", "");
+            pending_reset = false;
+        } else if (!current) {
+            // Generation or tool events outside chat() (e.g. generate()) are not replayed
+            continue;
+        } else if (type == "prompt") {
+            current->prompts.push_back(event.value("text", ""));
+        } else if (type == "generation") {
+            current->generations.push_back(event.value("tokens", std::vector<int32_t>{}));
+        } else if (type == "tool") {
+            RecordedToolCall call;
+            call.name = event.value("name", "");
+            call.method = event.value("method", "");
+            call.endpoint = event.value("endpoint", "");
+            call.params = event.value("params", json::object());
+            call.response = event.value("response", "");
+            call.ms = event.value("ms", 0.0);
+            current->tool_calls.push_back(std::move(call));
+        } else if (type == "turn_end") {
+            current->metrics = event.value("metrics", json());
+            current = nullptr;
+        }
+    }
+}
+
+SessionReplayer::SessionReplayer(LlamaInference& engine, const RecordedSession& session)
+    : engine_(engine), session_(session) {}
+
+json SessionReplayer::run(bool& identical) {
+    identical = true;
+
+    // Same sampler profiles, seed and system prompt as the recorded session (recordings
+    // made before sampler profiles existed used the built-in defaults)
+    if (session_.config.contains("sampler")) {
+        engine_.setSamplerConfig(SamplerConfig::fromJson(session_.config["sampler"]));
+    }
+    if (session_.config.contains("seed") && session_.config["seed"].is_number_unsigned()) {
+        engine_.setSeed(session_.config["seed"].get<uint32_t>());
+    }
+    if (session_.config.contains("system_prompt") && session_.config["system_prompt"].is_string()) {
+        engine_.setSystemPrompt(session_.config["system_prompt"].get<std::string>());
+    }
+    engine_.resetChat();
+    // The recorded compactions are applied as they were; the engine must not add its own
+    engine_.setCompactionConfig(CompactionConfig());
+    // Likewise the recalled memory: the recording has what was recalled, the store may not
+    engine_.setMemoryStore(nullptr);
+
+    // Tool requests are matched, in order, against the recorded calls of the current turn
+    const RecordedTurn* expected_turn = nullptr;
+    size_t next_tool = 0;
+    bool tool_mismatch = false;
+    engine_.setToolTransport([&](const std::string& method, const std::string& endpoint, const json& params) -> std::string {
+        RecordedToolCall request;
+        request.method = method;
+        request.endpoint = endpoint;
+        request.params = params;
+        if (expected_turn && next_tool < expected_turn->tool_calls.size() &&
+            expected_turn->tool_calls[next_tool].sameRequest(request)) {
+            return expected_turn->tool_calls[next_tool++].response;
+        }
+        tool_mismatch = true;
+        next_tool++;
+        return json{{"error", "Replay: tool call not in the recording"}, {"method", method}, {"endpoint", endpoint}}.dump();
+    });
+
+    SessionRecorder capture;
+    capture.captureInMemory();
+    engine_.setSessionRecorder(&capture);
+
+    json turns = json::array();
+    json recorded_totals = json::object();
+    json replayed_totals = json::object();
+    int diverged_turns = 0;
+    int token_diverged_turns = 0;
+
+    for (size_t t = 0; t < session_.turns.size(); t++) {
+        const RecordedTurn& recorded = session_.turns[t];
+        if (recorded.reset_before && t > 0) {
+            engine_.resetChat();
+        }
+        if (recorded.compaction_before.is_object()) {
+            // Same history as the recorded turn saw: the summary replaces the first messages
+            std::vector<ChatMessage> history = engine_.exportHistory();
+            const size_t n = std::min<size_t>(history.size(), recorded.compaction_before.value("messages", 0));
+            history.erase(history.begin(), history.begin() + n);
+            history.insert(history.begin(), ChatMessage{"system", recorded.compaction_before.value("summary", "")});
+            engine_.importHistory(history);
+        }
+        if (!recorded.memory_before.empty()) {
+            std::vector<ChatMessage> history = engine_.exportHistory();
+            history.push_back(ChatMessage{"system", recorded.memory_before});
+            engine_.importHistory(history);
+        }
+        expected_turn = &recorded;
+        next_tool = 0;
+        tool_mismatch = false;
+
+        std::string output;
+        engine_.chat(recorded.user_message, false, output, []() {});
+
+        RecordedSession replayed;
+        replayed.appendEvents(capture.takeEvents());
+        const RecordedTurn empty_turn;
+        const RecordedTurn& replay_turn = replayed.turns.empty() ? empty_turn : replayed.turns.back();
+
+        // Identical tool calls: same count and same requests in the same order
+        bool tools_match = !tool_mismatch && replay_turn.tool_calls.size() == recorded.tool_calls.size();
+        for (size_t i = 0; tools_match && i < recorded.tool_calls.size(); i++) {
+            tools_match = recorded.tool_calls[i].sameRequest(replay_turn.tool_calls[i]);
+        }
+
+        // First sampled token that differs, if any
+        json token_divergence = nullptr;
+        const size_t n_iterations = std::max(recorded.generations.size(), replay_turn.generations.size());
+        for (size_t it = 0; it < n_iterations && token_divergence.is_null(); it++) {
+            if (it >= recorded.generations.size() || it >= replay_turn.generations.size()) {
+                token_divergence = json{{"iteration", it}, {"index", 0}};
+                break;
+            }
+            const auto& a = recorded.generations[it];
+            const auto& b = replay_turn.generations[it];
+            const size_t n = std::min(a.size(), b.size());
+            size_t k = 0;
+            while (k < n && a[k] == b[k]) k++;
+            if (k < n || a.size() != b.size()) {
+                token_divergence = json{{"iteration", it}, {"index", k}};
+            }
+        }
+
+        if (!tools_match) {
+            identical = false;
+            diverged_turns++;
+            LOG_WARN("SessionReplayer::run", "Turn %zu: tool calls differ from the recording", t + 1);
+        }
+        if (!token_divergence.is_null()) {
+            token_diverged_turns++;
+        }
+
+        const json recorded_metrics = comparableMetrics(recorded.metrics);
+        const json replayed_metrics = comparableMetrics(replay_turn.metrics);
+        for (auto& [key, value] : recorded_metrics.items()) {
+            recorded_totals[key] = recorded_totals.value(key, 0.0) + value.get<double>();
+        }
+        for (auto& [key, value] : replayed_metrics.items()) {
+            replayed_totals[key] = replayed_totals.value(key, 0.0) + value.get<double>();
+        }
+
+        turns.push_back(json{
+            {"turn", t + 1},
+            {"user", recorded.user_message},
+            {"tool_calls_match", tools_match},
+            {"recorded_tool_calls", toolCallsJson(recorded.tool_calls)},
+            {"replayed_tool_calls", toolCallsJson(replay_turn.tool_calls)},
+            {"tokens_match", token_divergence.is_null()},
+            {"token_divergence", token_divergence},
+            {"recorded", recorded_metrics},
+            {"replayed", replayed_metrics},
+            {"delta_pct", metricDeltas(recorded_metrics, replayed_metrics)},
+        });
+    }
+
+    engine_.setSessionRecorder(nullptr);
+    engine_.setToolTransport(nullptr);
+
+    // Session-level deltas are computed on per-turn means
+    const double n_turns = session_.turns.empty() ? 1.0 : static_cast<double>(session_.turns.size());
+    for (auto& [key, value] : recorded_totals.items()) value = value.get<double>() / n_turns;
+    for (auto& [key, value] : replayed_totals.items()) value = value.get<double>() / n_turns;
+
+    return json{
+        {"recorded_config", session_.config},
+        {"summary", {
+            {"turns", session_.turns.size()},
+            {"identical_tool_calls", identical},
+            {"turns_with_different_tool_calls", diverged_turns},
+            {"turns_with_different_tokens", token_diverged_turns},
+            {"recorded_mean", recorded_totals},
+            {"replayed_mean", replayed_totals},
+            {"delta_pct", metricDeltas(recorded_totals, replayed_totals)},
+        }},
+        {"turns", turns},
+    };
+}
@@ -0,0 +1,271 @@
+#include "ThreadTuner.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Tokens per measurement: a prefill batch like a short prompt, and enough decode steps
+// to average out scheduling noise
+constexpr int kPrefillTokens = 256;
+constexpr int kDecodeTokens = 32;
+
+std::string readFirstLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// sysfs CPU list, e.g. "0-7,16,18-19"
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        try {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception&) {
+            // Empty or malformed entry
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> intersect(const std::vector<int>& a, const std::vector<int>& b) {
+    std::vector<int> out;
+    for (int cpu : a) {
+        if (std::find(b.begin(), b.end(), cpu) != b.end()) {
+            out.push_back(cpu);
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+CpuTopology CpuTopology::detect() {
+    CpuTopology topology;
+    const std::string sys = "/sys/devices/system/cpu/";
+
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuinfo, line);) {
+        if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos) {
+            topology.cpu_model = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+
+    topology.logical = parseCpuList(readFirstLine(sys + "online"));
+    if (topology.logical.empty()) {
+        const int n = std::max(1u, std::thread::hardware_concurrency());
+        for (int cpu = 0; cpu < n; ++cpu) {
+            topology.logical.push_back(cpu);
+        }
+        topology.physical = topology.performance = topology.performance_physical = topology.logical;
+        return topology;
+    }
+
+    // SMT siblings share package and core id; keep the lowest-numbered one
+    std::set<std::string> seen_cores;
+    std::map<int, int> capacity; // ARM big.LITTLE: relative core performance
+    for (int cpu : topology.logical) {
+        const std::string dir = sys + "cpu" + std::to_string(cpu) + "/";
+        const std::string core = readFirstLine(dir + "topology/physical_package_id") + ":" +
+                                 readFirstLine(dir + "topology/core_id");
+        if (core == ":" || seen_cores.insert(core).second) {
+            topology.physical.push_back(cpu);
+        }
+        const std::string cap = readFirstLine(dir + "cpu_capacity");
+        if (!cap.empty()) {
+            try {
+                capacity[cpu] = std::stoi(cap);
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    // Intel hybrid parts expose the P-cores as the "cpu_core" PMU, the E-cores as "cpu_atom"
+    const std::vector<int> p_cores = parseCpuList(readFirstLine("/sys/devices/cpu_core/cpus"));
+    if (!p_cores.empty() && !parseCpuList(readFirstLine("/sys/devices/cpu_atom/cpus")).empty()) {
+        topology.performance = intersect(topology.logical, p_cores);
+    } else if (!capacity.empty()) {
+        int max_capacity = 0;
+        for (const auto& [cpu, cap] : capacity) max_capacity = std::max(max_capacity, cap);
+        for (const auto& [cpu, cap] : capacity) {
+            if (cap == max_capacity) topology.performance.push_back(cpu);
+        }
+    }
+    topology.hybrid = !topology.performance.empty() && topology.performance.size() < topology.logical.size();
+    if (!topology.hybrid) {
+        topology.performance = topology.logical;
+    }
+    topology.performance_physical = intersect(topology.physical, topology.performance);
+    return topology;
+}
+
+ThreadTuner::ThreadTuner(LlamaInference& engine, const std::string& model_path, int n_gpu_layers, bool pin)
+    : engine_(engine),
+      model_path_(model_path),
+      n_gpu_layers_(n_gpu_layers),
+      pin_(pin),
+      topology_(CpuTopology::detect()) {
+    LOG_INFO("ThreadTuner", "%s: %zu logical CPUs, %zu cores, %zu performance cores%s",
+             topology_.cpu_model.c_str(), topology_.logical.size(), topology_.physical.size(),
+             topology_.performance_physical.size(), topology_.hybrid ? " (hybrid)" : "");
+}
+
+std::vector<ThreadTuner::Candidate> ThreadTuner::candidates() const {
+    std::vector<Candidate> out;
+    auto add = [&](const std::string& name, const std::vector<int>& cpus) {
+        if (cpus.empty()) return;
+        for (const auto& c : out) {
+            // Without pinning only the thread count distinguishes two candidates
+            if (pin_ ? c.cpus == cpus : c.cpus.size() == cpus.size()) return;
+        }
+        out.push_back({name, cpus});
+    };
+    const auto& p_phys = topology_.performance_physical;
+    add("performance-cores", p_phys);
+    if (p_phys.size() >= 4) {
+        add("half-performance-cores", std::vector<int>(p_phys.begin(), p_phys.begin() + p_phys.size() / 2));
+    }
+    add("performance-threads", topology_.performance);
+    add("all-cores", topology_.physical);
+    add("all-threads", topology_.logical);
+    return out;
+}
+
+std::string ThreadTuner::cacheKey() const {
+    std::error_code ec;
+    const auto model_size = std::filesystem::file_size(model_path_, ec);
+    return topology_.cpu_model + "|" + std::to_string(topology_.logical.size()) + " cpus|" +
+           std::filesystem::path(model_path_).filename().string() + "|" + std::to_string(ec ? 0 : model_size) +
+           "|ngl " + std::to_string(n_gpu_layers_) + (pin_ ? "|pinned" : "|unpinned");
+}
+
+void ThreadTuner::apply(const json& result) {
+    auto config = [&](const json& j) {
+        ThreadConfig c;
+        c.n_threads = j.value("threads", 0);
+        if (pin_) {
+            c.cpus = j.value("cpus", std::vector<int>());
+        }
+        return c;
+    };
+    engine_.setThreadConfig(config(result.at("decode")), config(result.at("prefill")));
+}
+
+bool ThreadTuner::tune(const std::string& cache_path, bool force) {
+    benchmarked_ = false;
+    json cache = json::object();
+    {
+        std::ifstream file(cache_path);
+        if (file.is_open()) {
+            cache = json::parse(file, nullptr, /*allow_exceptions=*/false);
+            if (!cache.is_object()) {
+                LOG_WARN("ThreadTuner::tune", "Ignoring unreadable cache %s", cache_path.c_str());
+                cache = json::object();
+            }
+        }
+    }
+
+    const std::string key = cacheKey();
+    if (!force && cache.contains(key)) {
+        try {
+            result_ = cache[key];
+            apply(result_);
+            LOG_INFO("ThreadTuner::tune", "Cached: decode %d threads, prefill %d threads",
+                     result_["decode"].value("threads", 0), result_["prefill"].value("threads", 0));
+            return true;
+        } catch (const json::exception& e) {
+            LOG_WARN("ThreadTuner::tune", "Bad cache entry for %s (%s); measuring again", key.c_str(), e.what());
+        }
+    }
+
+    // Restored if no candidate can be measured
+    const json before = engine_.describeConfig();
+    ThreadConfig before_decode;
+    before_decode.n_threads = before.value("threads", 0);
+    before_decode.cpus = before.value("cpus", std::vector<int>());
+    ThreadConfig before_prefill;
+    before_prefill.n_threads = before.value("threads_batch", 0);
+    before_prefill.cpus = before.value("cpus_batch", std::vector<int>());
+
+    json measured = json::array();
+    int best_decode = -1;
+    int best_prefill = -1;
+    double best_decode_tps = 0.0;
+    double best_prefill_tps = 0.0;
+    const std::vector<Candidate> list = candidates();
+    for (size_t i = 0; i < list.size(); ++i) {
+        const Candidate& c = list[i];
+        ThreadConfig config;
+        config.n_threads = static_cast<int>(c.cpus.size());
+        if (pin_) {
+            config.cpus = c.cpus;
+        }
+        engine_.setThreadConfig(config, config);
+
+        double prefill_tps = 0.0;
+        double decode_tps = 0.0;
+        engine_.measureThroughput(32, 4, prefill_tps, decode_tps); // Untimed: starts the new pool
+        if (!engine_.measureThroughput(kPrefillTokens, kDecodeTokens, prefill_tps, decode_tps)) {
+            continue;
+        }
+        LOG_INFO("ThreadTuner::tune", "%-22s %2d threads: prefill %.1f tok/s, decode %.1f tok/s",
+                 c.name.c_str(), config.n_threads, prefill_tps, decode_tps);
+        measured.push_back({{"name", c.name}, {"threads", config.n_threads},
+                            {"prefill_tps", prefill_tps}, {"decode_tps", decode_tps}});
+        if (decode_tps > best_decode_tps) {
+            best_decode_tps = decode_tps;
+            best_decode = static_cast<int>(i);
+        }
+        if (prefill_tps > best_prefill_tps) {
+            best_prefill_tps = prefill_tps;
+            best_prefill = static_cast<int>(i);
+        }
+    }
+    if (best_decode < 0 || best_prefill < 0) {
+        LOG_ERROR("ThreadTuner::tune", "No thread configuration could be measured.");
+        engine_.setThreadConfig(before_decode, before_prefill);
+        return false;
+    }
+
+    auto entry = [&](const Candidate& c) {
+        return json{{"name", c.name}, {"threads", static_cast<int>(c.cpus.size())}, {"cpus", c.cpus}};
+    };
+    result_ = {
+        {"decode", entry(list[best_decode])},
+        {"prefill", entry(list[best_prefill])},
+        {"decode_tps", best_decode_tps},
+        {"prefill_tps", best_prefill_tps},
+        {"candidates", measured},
+    };
+    apply(result_);
+    benchmarked_ = true;
+
+    cache[key] = result_;
+    std::ofstream out(cache_path);
+    if (out.is_open()) {
+        out << cache.dump(2) << '\n';
+    } else {
+        LOG_WARN("ThreadTuner::tune", "Could not write %s", cache_path.c_str());
+    }
+    LOG_INFO("ThreadTuner::tune", "Selected decode: %s, prefill: %s",
+             list[best_decode].name.c_str(), list[best_prefill].name.c_str());
+    return true;
+}
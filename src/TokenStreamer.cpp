@@ -0,0 +1,49 @@
+#include "TokenStreamer.h"
+#include "Logger.h"
+
+namespace {
+
+// Room made at the end of the buffer before converting a token. Pieces are rarely longer
+// than a few bytes; a longer one costs a second llama_token_to_piece() call.
+constexpr size_t kPieceReserve = 32;
+
+} // namespace
+
+TokenStreamer::TokenStreamer(const llama_vocab* vocab) : vocab_(vocab) {
+    buf_.reserve(64);
+}
+
+std::string_view TokenStreamer::push(llama_token token) {
+    // Drop what was handed out last time; at most 3 held-back bytes move to the front
+    buf_.erase(0, emitted_);
+    emitted_ = 0;
+    if (!appendPiece(vocab_, token, buf_)) {
+        return {};
+    }
+    emitted_ = completeUtf8Length(buf_);
+    return std::string_view(buf_.data(), emitted_);
+}
+
+std::string_view TokenStreamer::flush() {
+    const std::string_view rest(buf_.data() + emitted_, buf_.size() - emitted_);
+    emitted_ = buf_.size();
+    return rest;
+}
+
+bool TokenStreamer::appendPiece(const llama_vocab* vocab, llama_token token, std::string& out) {
+    const size_t start = out.size();
+    out.resize(start + kPieceReserve);
+    int n = llama_token_to_piece(vocab, token, &out[start], static_cast<int32_t>(kPieceReserve), 0, true);
+    if (n < 0) {
+        // Too small: the negated return value is the length needed
+        out.resize(start + static_cast<size_t>(-n));
+        n = llama_token_to_piece(vocab, token, &out[start], -n, 0, true);
+    }
+    if (n < 0) {
+        LOG_ERROR("TokenStreamer::appendPiece", "Failed to convert token %d to a piece (%d)", token, n);
+        out.resize(start);
+        return false;
+    }
+    out.resize(start + static_cast<size_t>(n));
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef TOKEN_STREAMER_H
+#define TOKEN_STREAMER_H
+
+#include "llama.h"
+#include "Utf8.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Detokenizes a generation one token at a time into one reused buffer, so the per-token
+// path does not allocate once the buffer has grown to the longest piece. A token can end
+// in the middle of a multi-byte character (byte-fallback tokens, emoji split across
+// tokens); those bytes are held back until the character is complete, so every view
+// handed out is valid UTF-8 on its own. Private to maimail_core, like LlamaEngine.
+class TokenStreamer {
+public:
+    explicit TokenStreamer(const llama_vocab* vocab);
+
+    // The text that became complete with `token`; empty while a character is still open
+    // or if the token has no text. Valid until the next push() or flush().
+    std::string_view push(llama_token token);
+
+    // Whatever is still held back, at the end of a generation
+    std::string_view flush();
+
+    // Append the text of `token` to `out` in place (special tokens rendered), without a
+    // temporary. Returns false if llama.cpp could not convert the token.
+    static bool appendPiece(const llama_vocab* vocab, llama_token token, std::string& out);
+
+private:
+    const llama_vocab* vocab_;
+    std::string buf_;     // Held-back bytes of an open character, followed by the newest piece
+    size_t emitted_ = 0;  // Bytes at the front of buf_ already handed out
+};
+
+#endif // TOKEN_STREAMER_H
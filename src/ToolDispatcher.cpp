@@ -0,0 +1,219 @@
+#include "ToolDispatcher.h"
+#include "JsonProjection.h"
+#include "Logger.h"
+#include "MailboxSync.h"
+#include "MimeParser.h"
+
+#include <algorithm>
+#include <cstring>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Moves a required string path parameter out of the body into `value`
+bool takePathParam(json& params, const char* key, std::string& value) {
+    if (!params.contains(key) || !params[key].is_string()) {
+        return false;
+    }
+    value = params[key].get<std::string>();
+    params.erase(key);
+    return true;
+}
+
+std::string missingParam(const std::string& tool_name, const char* key) {
+    return "[Error: " + tool_name + " tool call missing '" + key + "' string parameter]";
+}
+
+} // namespace
+
+ToolDispatcher::ToolDispatcher(const std::string& gmail_service_addr) : client_(gmail_service_addr) {}
+
+bool ToolDispatcher::parseToolCall(const std::string& model_output, std::string& tool_name, json& params) {
+    // Skip any reasoning block, then take everything from the first '{' to the last '}'
+    size_t search_start_pos = 0;
+    const size_t think_end_pos = model_output.rfind("</think>");
+    if (think_end_pos != std::string::npos) {
+        search_start_pos = think_end_pos + strlen("</think>");
+    }
+    const size_t json_start_pos = model_output.find('{', search_start_pos);
+    if (json_start_pos == std::string::npos) {
+        LOG_DEBUG("ToolDispatcher::parseToolCall", "No '{' found after think block (or at all if no think block).");
+        return false;
+    }
+    const size_t json_end_pos = model_output.rfind('}');
+    if (json_end_pos == std::string::npos || json_end_pos <= json_start_pos) {
+        LOG_DEBUG("ToolDispatcher::parseToolCall", "No matching '}' found after '{', or '}' is before '{'.");
+        return false;
+    }
+    const std::string_view candidate(model_output.data() + json_start_pos, json_end_pos - json_start_pos + 1);
+    LOG_DEBUG("ToolDispatcher::parseToolCall", "Extracted potential JSON: %.*s",
+              static_cast<int>(std::min<size_t>(candidate.size(), 200)), candidate.data());
+
+    // Not being JSON is the common case (a plain answer). The SAX projection fails without
+    // exceptions and only builds "parameters", not a DOM of the whole call.
+    return projectToolCall(candidate, tool_name, params);
+}
+
+int ToolDispatcher::replyKind(const std::string& text, size_t* json_start) {
+    static const std::string kThinkOpen = "<think>";
+    static const std::string kThinkClose = "</think>";
+    size_t pos = text.find_first_not_of(" \t\r\n");
+    if (pos == std::string::npos) {
+        return -1;
+    }
+    if (text.compare(pos, kThinkOpen.size(), kThinkOpen) == 0) {
+        const size_t close = text.find(kThinkClose, pos);
+        if (close == std::string::npos) {
+            return -1;
+        }
+        pos = text.find_first_not_of(" \t\r\n", close + kThinkClose.size());
+        if (pos == std::string::npos) {
+            return -1;
+        }
+    } else if (kThinkOpen.compare(0, text.size() - pos, text, pos) == 0) {
+        return -1; // A prefix of "<think>"
+    }
+    if (text[pos] != '{') {
+        return 0;
+    }
+    if (json_start) {
+        *json_start = pos;
+    }
+    return 1;
+}
+
+const std::vector<std::string>& ToolDispatcher::toolNames() {
+    static const std::vector<std::string> names = {
+        "send_email", "list_messages", "list_new_messages", "get_message_content", "get_messages",
+        "trash_message", "list_labels", "get_label", "create_label", "update_label", "delete_label",
+        "get_profile", "get_history",
+    };
+    return names;
+}
+
+bool ToolDispatcher::isReadOnly(const std::string& tool_name) {
+    return tool_name == "list_messages" || tool_name == "list_new_messages" ||
+           tool_name == "get_message_content" || tool_name == "get_messages" ||
+           tool_name == "list_labels" || tool_name == "get_label" || tool_name == "get_profile" ||
+           tool_name == "get_history";
+}
+
+bool ToolDispatcher::resolve(const std::string& tool_name, json params, ToolRequest& request, std::string& error) {
+    request.tool_name = tool_name;
+    std::string id;
+
+    // Routes of gmail-microservice/gmail_service.py
+    if (tool_name == "send_email") {                       // POST /messages
+        request.http_method = "POST";
+        request.endpoint = "/messages";
+    } else if (tool_name == "list_messages") {             // GET /messages?query=&max_results=
+        request.http_method = "GET";
+        request.endpoint = "/messages";
+    } else if (tool_name == "list_new_messages") {         // GET /messages?query=in:inbox (or MailboxSync)
+        // The newest inbox messages. With a mailbox sync attached, execute() answers from the
+        // synced copy; the query is what the HTTP fallback sends.
+        const bool unread_only = params.value("unread_only", false);
+        int max_results = 20;
+        if (params.contains("max_results") && params["max_results"].is_number_integer()) {
+            max_results = std::max(1, params["max_results"].get<int>());
+        }
+        params = json{
+            {"query", unread_only ? "in:inbox is:unread" : "in:inbox"},
+            {"max_results", max_results},
+        };
+        request.http_method = "GET";
+        request.endpoint = "/messages";
+    } else if (tool_name == "get_message_content") {       // GET /messages/{message_id}
+        if (!takePathParam(params, "message_id", id)) {
+            error = missingParam(tool_name, "message_id");
+            return false;
+        }
+        request.http_method = "GET";
+        request.endpoint = "/messages/" + id;
+    } else if (tool_name == "get_messages") {              // POST /messages/batch
+        // Many messages in one call, instead of one get_message_content round trip each
+        if (!params.contains("message_ids") || !params["message_ids"].is_array() || params["message_ids"].empty()) {
+            error = "[Error: get_messages tool call missing 'message_ids' list parameter]";
+            return false;
+        }
+        request.http_method = "POST";
+        request.endpoint = "/messages/batch";
+    } else if (tool_name == "trash_message") {             // DELETE /messages/{message_id}
+        if (!takePathParam(params, "message_id", id)) {
+            error = missingParam(tool_name, "message_id");
+            return false;
+        }
+        request.http_method = "DELETE";
+        request.endpoint = "/messages/" + id;
+    } else if (tool_name == "list_labels") {               // GET /labels
+        request.http_method = "GET";
+        request.endpoint = "/labels";
+    } else if (tool_name == "get_label") {                 // GET /labels/{label_id}
+        if (!takePathParam(params, "label_id", id)) {
+            error = missingParam(tool_name, "label_id");
+            return false;
+        }
+        request.http_method = "GET";
+        request.endpoint = "/labels/" + id;
+    } else if (tool_name == "create_label") {              // POST /labels
+        request.http_method = "POST";
+        request.endpoint = "/labels";
+    } else if (tool_name == "update_label") {              // PUT /labels/{label_id}
+        // label_id stays in the body as well; the service takes the one in the path
+        if (!params.contains("label_id") || !params["label_id"].is_string()) {
+            error = missingParam(tool_name, "label_id");
+            return false;
+        }
+        request.http_method = "PUT";
+        request.endpoint = "/labels/" + params["label_id"].get<std::string>();
+    } else if (tool_name == "delete_label") {              // DELETE /labels/{label_id}
+        if (!takePathParam(params, "label_id", id)) {
+            error = missingParam(tool_name, "label_id");
+            return false;
+        }
+        request.http_method = "DELETE";
+        request.endpoint = "/labels/" + id;
+    } else if (tool_name == "get_profile") {               // GET /profile
+        request.http_method = "GET";
+        request.endpoint = "/profile";
+    } else if (tool_name == "get_history") {               // GET /history?start_history_id=&max_results=
+        request.http_method = "GET";
+        request.endpoint = "/history";
+    } else {
+        error = "[Error: Unknown tool name: " + tool_name + "]";
+        return false;
+    }
+    request.params = std::move(params);
+    return true;
+}
+
+std::string ToolDispatcher::execute(const ToolRequest& request) const {
+    if (transport_) {
+        return transport_(request.http_method, request.endpoint, request.params);
+    }
+    if (mailbox_ && request.tool_name == "list_new_messages" && mailbox_->ready()) {
+        const bool unread_only = request.params.value("query", "").find("is:unread") != std::string::npos;
+        return mailbox_->newest(request.params.value("max_results", 20), unread_only).dump();
+    }
+    if (native_mime_ && request.tool_name == "get_message_content") {
+        json params = request.params;
+        params["format"] = "raw";
+        std::string response = client_.request(request.http_method, request.endpoint, params);
+        std::string content;
+        if (rawMessageToContent(response, content)) {
+            return content;
+        }
+        // An error envelope, or a service without format=raw that sent the decoded message
+        if (response.find("\"raw\"") == std::string::npos) {
+            return response;
+        }
+        LOG_WARN("ToolDispatcher::execute", "Could not decode the raw message at %s; asking the service to decode it.",
+                 request.endpoint.c_str());
+    }
+    std::string response = client_.request(request.http_method, request.endpoint, request.params);
+    if (mailbox_ && !isReadOnly(request.tool_name)) {
+        mailbox_->syncNow(); // Pick up the change now rather than at the end of the interval
+    }
+    return response;
+}
@@ -0,0 +1,171 @@
+#include "ToolPrefetcher.h"
+#include "EngineMetrics.h"
+#include "Logger.h"
+
+#include <thread>
+
+using json = nlohmann::json;
+
+namespace {
+
+std::string cacheKey(const ToolRequest& request) {
+    return request.http_method + " " + request.endpoint + " " + request.params.dump();
+}
+
+bool isErrorEnvelope(const std::string& response) {
+    return response.rfind("{\"error\"", 0) == 0; // GmailClient's error envelope
+}
+
+// The string value of "key" in partial JSON, once its closing quote has been generated.
+// Values with escapes are not needed for tool names and IDs, and are left alone.
+bool completedString(std::string_view text, std::string_view key, std::string& value) {
+    const std::string quoted = "\"" + std::string(key) + "\"";
+    size_t pos = text.find(quoted);
+    if (pos == std::string_view::npos) return false;
+    pos = text.find_first_not_of(" \t\r\n", pos + quoted.size());
+    if (pos == std::string_view::npos || text[pos] != ':') return false;
+    pos = text.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string_view::npos || text[pos] != '"') return false;
+    const size_t end = text.find_first_of("\"\\", pos + 1);
+    if (end == std::string_view::npos || text[end] != '"') return false;
+    value.assign(text.substr(pos + 1, end - pos - 1));
+    return !value.empty();
+}
+
+} // namespace
+
+ToolPrefetcher::ToolPrefetcher(const ToolDispatcher& tools) : tools_(tools) {}
+
+ToolPrefetcher::ToolPrefetcher(const ToolDispatcher& tools, const Options& options)
+    : tools_(tools), options_(options) {}
+
+void ToolPrefetcher::setOptions(const Options& options) {
+    options_ = options;
+    if (!options_.enabled) {
+        clear();
+    }
+}
+
+void ToolPrefetcher::beginReply() {
+    reply_.clear();
+    reply_kind_ = -1;
+    call_start_ = 0;
+    // Replayed sessions answer tool calls from the recording, strictly in order
+    watching_ = options_.enabled && !tools_.hasTransport();
+}
+
+void ToolPrefetcher::observe(std::string_view piece) {
+    if (!watching_) {
+        return;
+    }
+    reply_.append(piece);
+    if (reply_kind_ < 0) {
+        reply_kind_ = ToolDispatcher::replyKind(reply_, &call_start_);
+        if (reply_kind_ == 0) {
+            watching_ = false; // A plain answer
+            return;
+        }
+        if (reply_kind_ < 0) {
+            return;
+        }
+    }
+    if (startFromPartialCall(std::string_view(reply_).substr(call_start_))) {
+        watching_ = false;
+    }
+}
+
+bool ToolPrefetcher::startFromPartialCall(std::string_view call) {
+    std::string tool_name;
+    if (!completedString(call, "tool_name", tool_name)) {
+        return false;
+    }
+    if (tool_name == "list_labels" || tool_name == "get_profile") {
+        start(tool_name, json::object());
+        return true;
+    }
+    const char* id_key = tool_name == "get_message_content" ? "message_id"
+                       : tool_name == "get_label"           ? "label_id"
+                                                            : nullptr;
+    if (!id_key) {
+        return true; // The request depends on parameters that are only known at the end
+    }
+    std::string id;
+    if (!completedString(call, id_key, id)) {
+        return false;
+    }
+    start(tool_name, json{{id_key, id}});
+    return true;
+}
+
+void ToolPrefetcher::start(const std::string& tool_name, const json& params) {
+    if (!options_.enabled || tools_.hasTransport() || !ToolDispatcher::isReadOnly(tool_name)) {
+        return;
+    }
+    ToolRequest request;
+    std::string error;
+    if (!ToolDispatcher::resolve(tool_name, params, request, error)) {
+        return;
+    }
+    evictExpired();
+    const std::string key = cacheKey(request);
+    if (parked_.count(key) || in_flight_->load() >= options_.max_in_flight) {
+        return;
+    }
+
+    auto promise = std::make_shared<std::promise<std::string>>();
+    parked_[key] = Parked{promise->get_future().share(), Clock::now()};
+    in_flight_->fetch_add(1);
+    // The thread owns a copy of the dispatcher, so it may outlive this prefetcher
+    std::thread([tools = tools_, request, promise, in_flight = in_flight_]() {
+        promise->set_value(tools.execute(request));
+        in_flight->fetch_sub(1);
+    }).detach();
+    EngineMetrics::instance().tool_prefetches_total.inc();
+    LOG_DEBUG("ToolPrefetcher::start", "Prefetching %s %s", request.http_method.c_str(), request.endpoint.c_str());
+}
+
+std::string ToolPrefetcher::fetch(const ToolRequest& request, bool& prefetched) {
+    prefetched = false;
+    if (!ToolDispatcher::isReadOnly(request.tool_name)) {
+        clear(); // The mailbox is about to change
+        return tools_.execute(request);
+    }
+    evictExpired();
+    const auto it = parked_.find(cacheKey(request));
+    if (it != parked_.end()) {
+        std::string response = it->second.response.get();
+        if (!isErrorEnvelope(response)) {
+            prefetched = true;
+            EngineMetrics::instance().tool_prefetch_hits_total.inc();
+            LOG_DEBUG("ToolPrefetcher::fetch", "Served %s %s from a prefetch", request.http_method.c_str(), request.endpoint.c_str());
+            return response;
+        }
+        parked_.erase(it); // A failed prefetch is retried for real
+    }
+    return tools_.execute(request);
+}
+
+void ToolPrefetcher::afterListing(const std::vector<MessageSummary>& messages) {
+    int started = 0;
+    for (const auto& message : messages) {
+        if (started >= options_.follow_up_ids) break;
+        if (!(message.present & kMessageId)) continue;
+        start("get_message_content", json{{"message_id", message.id}});
+        started++;
+    }
+}
+
+void ToolPrefetcher::clear() {
+    parked_.clear();
+}
+
+void ToolPrefetcher::evictExpired() {
+    const auto now = Clock::now();
+    for (auto it = parked_.begin(); it != parked_.end();) {
+        if (now - it->second.started > std::chrono::milliseconds(options_.ttl_ms)) {
+            it = parked_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
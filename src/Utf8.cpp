@@ -0,0 +1,26 @@
+#include "Utf8.h"
+
+size_t completeUtf8Length(std::string_view text) {
+    const size_t end = text.size();
+    size_t i = end;
+    // Walk back over at most 3 continuation bytes to the lead byte
+    while (i > 0 && end - i < 4 && (static_cast<unsigned char>(text[i - 1]) & 0xC0) == 0x80) {
+        i--;
+    }
+    if (i == 0) {
+        return end;
+    }
+    const unsigned char lead = static_cast<unsigned char>(text[i - 1]);
+    size_t need = 1;
+    if ((lead & 0xE0) == 0xC0) need = 2;
+    else if ((lead & 0xF0) == 0xE0) need = 3;
+    else if ((lead & 0xF8) == 0xF0) need = 4;
+    return end - (i - 1) >= need ? end : i - 1;
+}
+
+void truncateUtf8(std::string& s, size_t max_bytes) {
+    if (s.size() <= max_bytes) {
+        return;
+    }
+    s.resize(completeUtf8Length(std::string_view(s).substr(0, max_bytes)));
+}
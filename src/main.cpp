@@ -1,5 +1,14 @@
 // llama.cpp
 #include "LlamaInference.h"
+#include "Logger.h"
+#include "EngineMetrics.h"
+#include "SystemPrompt.h"
+#include "SessionRecorder.h"
+#include "BatchTriage.h"
+#include "ThreadTuner.h"
+#include "MailboxSync.h"
+#include "MemoryStore.h"
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 // FTXUI
@@ -16,9 +25,6 @@
 
 using namespace ftxui;
 
-// Open a global log file stream for main.cpp diagnostics
-std::ofstream main_debug_log;
-
 const std::string APP_VERSION = "v0.0.1";
 
 void print_detailed_help(const char* app_name) {
@@ -35,11 +41,99 @@ void print_detailed_help(const char* app_name) {
               << "  -mrc, --max-response-chars <int> Maximum characters for LLM response. (Default: context size)\n"
               << "  -ga, --gmail-addr <addr>   Address of the Gmail microservice. (Default: http://localhost:8000)\n"
               << "  -spf, --system-prompt-file <path> Path to a file containing the system prompt. (Default: uses internal system prompt)\n"
+              << "  -lf, --log-file <path>     File receiving JSON-lines diagnostics. (Default: llama_debug.log)\n"
+              << "  -mf, --metrics-file <path> File receiving one JSON line of performance metrics per chat turn.\n"
+              << "                             Pass an empty string to disable. (Default: llama_metrics.jsonl)\n"
+              << "  -mp, --metrics-port <int>  Serve Prometheus metrics at http://<metrics-host>:<port>/metrics. (Default: off)\n"
+              << "  --metrics-host <addr>      Address the metrics endpoint binds to. (Default: 127.0.0.1)\n"
+              << "  --temp <float>             Reply sampling temperature; 0 = greedy. (Default: 0.8)\n"
+              << "  --top-k <int>              Top-k pre-filter; 0 = off. (Default: 40)\n"
+              << "  --top-p <float>            Top-p; 1 = off. (Default: 0.95)\n"
+              << "  --min-p <float>            Min-p; 0 = off. (Default: 0.05)\n"
+              << "  --repeat-penalty <float>   Repetition penalty; 1 = off. (Default: 1.0)\n"
+              << "  --repeat-last-n <int>      Tokens the repetition penalty looks back over. (Default: 64)\n"
+              << "  --tool-temp <float>        Temperature once a reply turns out to be a tool call; 0 = greedy. (Default: 0)\n"
+              << "  --seed <int>               Sampler seed, for reproducible sessions. (Default: random)\n"
+              << "  --auto-threads             Pick decode and prefill threads by benchmarking thread counts on the\n"
+              << "                             first run for this model and machine (cached). Overrides -t/-tb.\n"
+              << "  --retune-threads           Like --auto-threads, but ignore the cache and measure again.\n"
+              << "  --pin-threads              With --auto-threads: pin threads to the selected CPUs.\n"
+              << "  --thread-cache <path>      Cache of tuned thread configurations. (Default: maimail_threads.json)\n"
+              << "  -ctk, --cache-type-k <type> KV cache type for K: f16, q8_0, q4_0, ... (Default: f16)\n"
+              << "  -ctv, --cache-type-v <type> KV cache type for V; quantized types enable flash attention.\n"
+              << "                             (Default: f16)\n"
+              << "  -fa, --flash-attn          Use flash attention.\n"
+              << "  -nkvo, --no-kv-offload     Keep the KV cache in system memory when layers are offloaded to the GPU.\n"
+              << "  --no-tool-prefetch         Do not start Gmail requests before the model has finished a tool call.\n"
+              << "  --native-mime              Fetch messages in raw format and decode MIME parts here instead of in\n"
+              << "                             the Gmail service.\n"
+              << "  --project-tool-results     Give the model only id, from, subject, date and snippet of listed\n"
+              << "                             messages.\n"
+              << "  --compact                  Summarize older turns once the history fills 60% of the prompt budget,\n"
+              << "                             instead of dropping tokens when the context overflows.\n"
+              << "  --compact-at <float>       Share of the prompt budget that triggers a summary (Default: 0.6).\n"
+              << "  --compact-keep <int>       Latest user turns kept verbatim when summarizing (Default: 2).\n"
+              << "  --memory                   Remember tool results and answers across sessions and recall the ones\n"
+              << "                             relevant to each message. (Default: off)\n"
+              << "  --memory-file <path>       Where the memory is kept. (Default: maimail_memory.jsonl)\n"
+              << "  --memory-top-k <int>       Entries recalled per message at most. (Default: 3)\n"
+              << "  --memory-tokens <int>      Tokens the recalled entries may take. (Default: 384)\n"
+              << "  --no-mmap                  Read the model into memory instead of mapping it.\n"
+              << "  --mlock                    Lock the model in RAM so it is never swapped out.\n"
+              << "  --numa <strategy>          NUMA placement: disabled, distribute, isolate, numactl or mirror. (Default: disabled)\n"
+              << "  --no-warmup                Skip the warm-up decode that pages in weights before the first prompt.\n"
+              << "  --cascade-model <path>     Small model that decides the tool calls; the main model writes the\n"
+              << "                             replies and the calls the small one is unsure of. (Default: off)\n"
+              << "  --cascade-ngl <int>        Layers of the small model to offload to the GPU. (Default: 0)\n"
+              << "  --cascade-confidence <float> Confidence below which the main model decides a step. (Default: 0.6)\n"
+              << "  -rs, --record-session <path> Record user messages, prompts, sampled tokens and tool traffic\n"
+              << "                             as JSON lines for later replay with `bench --replay`. (Default: off)\n"
+              << "  --sync                     Keep a local copy of the inbox up to date in the background, so\n"
+              << "                             \"what's new\" is answered without asking Gmail. (Default: off)\n"
+              << "  --sync-interval <int>      Seconds between polls after a change; doubles while nothing\n"
+              << "                             changes, up to 5 minutes. (Default: 15)\n"
+              << "  --sync-snapshot <path>     Where the synced inbox is kept between runs. (Default: maimail_mailbox.json)\n"
+              << "  --no-idle-jobs             Do not use the time between prompts for background work (compaction,\n"
+              << "                             memory indexing, prefilling the conversation, summarizing new mail).\n"
+              << "  --idle-delay <int>         Milliseconds without a request before background work starts. (Default: 1000)\n"
+              << "  -ll, --log-level <level>   trace, debug, info, warn or error. Levels below the build's\n"
+              << "                             MAIMAIL_LOG_LEVEL are compiled out. (Default: debug)\n"
+              << "\nChat commands:\n"
+              << "  /model <path>              Load another model in the background and switch to it, keeping the conversation.\n"
+              << "  /ctx <int>                 Rebuild the context at a new size on the same weights.\n"
+              << "\nBatch triage (non-interactive, no UI):\n"
+              << "  --batch                    Classify messages and label them <prefix><category>, then exit.\n"
+              << "  --batch-query <query>      Gmail search selecting the messages. (Default: in:inbox)\n"
+              << "  --batch-since-history <id> Only messages added since this history ID (overrides --batch-query).\n"
+              << "  --batch-max <int>          Maximum number of messages. (Default: 1000)\n"
+              << "  --batch-categories <list>  Comma-separated categories.\n"
+              << "                             (Default: Work,Personal,Finance,Travel,Newsletters,Notifications,Spam)\n"
+              << "  --batch-label-prefix <str> Prefix of the applied labels. (Default: Triage/)\n"
+              << "  --batch-fetch-threads <int> Concurrent message fetches overlapping inference. (Default: 4)\n"
+              << "  --batch-generate           Generate the category name instead of scoring categories from logits.\n"
+              << "  --batch-parallel <int>     With --batch-generate: messages classified together as forks of the\n"
+              << "                             shared prompt. (Default: 8)\n"
+              << "  --batch-report <path>      One JSON line per message. (Default: triage_report.jsonl)\n"
+              << "  --batch-dry-run            Classify only; do not create or apply labels.\n"
               << std::endl;
 }
 
 std::mutex response_mutex;
 std::atomic<bool> is_streaming = false;
+
+// Background model load. The UI is up (and accepts a prompt) while weights load.
+enum class LoadState { Loading, Ready, Failed };
+std::atomic<LoadState> load_state = LoadState::Loading;
+std::atomic<int> load_percent = 0;
+std::atomic<bool> abort_load = false; // Set when the UI exits mid-load
+std::atomic<bool> tuning_threads = false; // ThreadTuner is measuring after the load
+std::mutex queued_prompt_mutex;
+std::string queued_prompt; // Submitted before the model was ready
+
+// "/model" and "/ctx" switch engines in the background (LlamaInference::reconfigure)
+std::atomic<bool> reconfiguring = false;
+std::mutex reconfigure_status_mutex;
+std::string reconfigure_status; // KV cache size after loading, then the outcome of the last switch; shown in the status line
 std::string response = "";
 std::string current_streaming_text = ""; // Track the currently streaming text separately
 
@@ -89,6 +183,14 @@ bool shouldAutoScroll(int scroll_offset, int max_scroll, bool was_at_bottom) {
     return is_streaming && (was_at_bottom || scroll_offset == 0);
 }
 
+// "KV cache 288 MiB (q8_0/q8_0, flash attention)" from describeConfig()
+std::string kvCacheSummary(const nlohmann::json& config) {
+    const nlohmann::json kv = config.value("kv_cache", nlohmann::json::object());
+    const uint64_t mib = kv.value("bytes", static_cast<uint64_t>(0)) / (1024 * 1024);
+    return "KV cache " + std::to_string(mib) + " MiB (" + kv.value("type_k", std::string("f16")) + "/" +
+           kv.value("type_v", std::string("f16")) + (kv.value("flash_attn", false) ? ", flash attention)" : ")");
+}
+
 // Extract the last few tokens from a string
 std::string getLastPartOfString(const std::string& text, int numChars) {
     if (text.length() <= numChars) {
@@ -98,8 +200,7 @@ std::string getLastPartOfString(const std::string& text, int numChars) {
 }
 
 void StreamChat(LlamaInference& llama, bool user_scrolled, std::string prompt, std::function<void()> redraw) {
-    if (main_debug_log.is_open()) main_debug_log << "DEBUG main: StreamChat entered with prompt: " << prompt.substr(0, 50) << "..." << std::endl;
-    else std::cout << "DEBUG main: StreamChat entered with prompt: " << prompt.substr(0,50) << "..." << std::endl; // Fallback
+    LOG_DEBUG("main::StreamChat", "StreamChat entered with prompt: %.50s...", prompt.c_str());
 
     is_streaming = true;
     current_streaming_text = ""; // Reset streaming display
@@ -116,16 +217,18 @@ void StreamChat(LlamaInference& llama, bool user_scrolled, std::string prompt, s
     current_streaming_text = ""; // Clear streaming display when done
     redraw();
 
-    if (main_debug_log.is_open()) main_debug_log << "DEBUG main: StreamChat finished for prompt: " << prompt.substr(0,50) << "..." << std::endl;
-    else std::cout << "DEBUG main: StreamChat finished for prompt: " << prompt.substr(0,50) << "..." << std::endl; // Fallback
+    // The user is reading the reply: summarize older turns now (if --compact and the history
+    // crossed the trigger) instead of at the start of the next turn, and embed what this turn
+    // added to the memory (if --memory). The idle worker does both, preemptibly, when it runs.
+    if (!llama.idleWorkRunning()) {
+        llama.compactHistory();
+        llama.indexMemory();
+    }
+
+    LOG_DEBUG("main::StreamChat", "StreamChat finished for prompt: %.50s...", prompt.c_str());
 }
 
 int main(int argc, char** argv) {
-    // Open the log file at the beginning of main
-    main_debug_log.open("llama_debug.log", std::ios::app); 
-    if (main_debug_log.is_open()) main_debug_log << "\n--- Main Application Started ---" << std::endl;
-    else std::cerr << "CRITICAL ERROR: Failed to open llama_debug.log in main!" << std::endl;
-
     // Check for help argument first
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -135,8 +238,6 @@ int main(int argc, char** argv) {
     }
 
     if (argc < 2) { // Basic check, model path is the minimum required that isn't help
-        if (main_debug_log.is_open()) main_debug_log << "ERROR main: Not enough arguments or model path missing." << std::endl;
-        else std::cerr << "ERROR main: Not enough arguments or model path missing (log not open)." << std::endl;
         std::cout << "Usage: " << argv[0] << " -m <model_path> [options]\n"
                   << "Use " << argv[0] << " --help for more detailed information." << std::endl;
         return 1;
@@ -151,6 +252,37 @@ int main(int argc, char** argv) {
     int user_max_response_chars = -1; // User specified max response chars
     std::string gmail_address = "http://localhost:8000"; // Default Gmail service address
     std::string system_prompt_file_path;
+    std::string log_file_path = "llama_debug.log";
+    std::string log_level_name;
+    std::string metrics_file_path = "llama_metrics.jsonl";
+    int metrics_port = 0; // 0 = metrics endpoint disabled
+    std::string metrics_host = "127.0.0.1";
+    long long seed = -1; // -1 = random (LlamaInference::kRandomSeed)
+    SamplerConfig sampler_config;
+    bool batch_mode = false;
+    BatchTriageOptions batch_options;
+    std::string record_session_path;
+    KvCacheConfig kv_cache;
+    bool tool_prefetch = true;
+    bool native_mime = false;
+    bool project_tool_results = false;
+    CompactionConfig compaction;
+    bool memory_enabled = false;
+    MemoryStoreOptions memory_options;
+    MemoryConfig memory_config;
+    bool mailbox_sync_enabled = false;
+    MailboxSyncOptions sync_options;
+    bool idle_jobs = true;
+    IdleConfig idle_config;
+    CascadeConfig cascade;
+    bool use_mmap = true;
+    bool use_mlock = false;
+    NumaStrategy numa = NumaStrategy::Disabled;
+    bool warmup = true;
+    bool auto_threads = false;
+    bool retune_threads = false;
+    bool pin_threads = false;
+    std::string thread_cache_path = "maimail_threads.json";
     
     for (int i = 1; i < argc; i++) {
         try {
@@ -170,19 +302,160 @@ int main(int argc, char** argv) {
                 gmail_address = argv[++i];
             } else if ((strcmp(argv[i], "--system-prompt-file") == 0 || strcmp(argv[i], "-spf") == 0) && i + 1 < argc) {
                 system_prompt_file_path = argv[++i];
+            } else if ((strcmp(argv[i], "--log-file") == 0 || strcmp(argv[i], "-lf") == 0) && i + 1 < argc) {
+                log_file_path = argv[++i];
+            } else if ((strcmp(argv[i], "--log-level") == 0 || strcmp(argv[i], "-ll") == 0) && i + 1 < argc) {
+                log_level_name = argv[++i];
+            } else if ((strcmp(argv[i], "--metrics-file") == 0 || strcmp(argv[i], "-mf") == 0) && i + 1 < argc) {
+                metrics_file_path = argv[++i];
+            } else if ((strcmp(argv[i], "--metrics-port") == 0 || strcmp(argv[i], "-mp") == 0) && i + 1 < argc) {
+                metrics_port = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--metrics-host") == 0 && i + 1 < argc) {
+                metrics_host = argv[++i];
+            } else if (strcmp(argv[i], "--temp") == 0 && i + 1 < argc) {
+                sampler_config.reply.temperature = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) {
+                sampler_config.reply.top_k = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--top-p") == 0 && i + 1 < argc) {
+                sampler_config.reply.top_p = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--min-p") == 0 && i + 1 < argc) {
+                sampler_config.reply.min_p = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat-penalty") == 0 && i + 1 < argc) {
+                sampler_config.reply.repeat_penalty = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat-last-n") == 0 && i + 1 < argc) {
+                sampler_config.reply.repeat_last_n = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--tool-temp") == 0 && i + 1 < argc) {
+                sampler_config.tool_call.temperature = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                seed = std::stoll(argv[++i]);
+            } else if ((strcmp(argv[i], "--record-session") == 0 || strcmp(argv[i], "-rs") == 0) && i + 1 < argc) {
+                record_session_path = argv[++i];
+            } else if (strcmp(argv[i], "--sync") == 0) {
+                mailbox_sync_enabled = true;
+            } else if (strcmp(argv[i], "--sync-interval") == 0 && i + 1 < argc) {
+                sync_options.min_interval_ms = std::max(1, std::stoi(argv[++i])) * 1000;
+                sync_options.max_interval_ms = std::max(sync_options.max_interval_ms, sync_options.min_interval_ms);
+            } else if (strcmp(argv[i], "--sync-snapshot") == 0 && i + 1 < argc) {
+                sync_options.snapshot_path = argv[++i];
+            } else if (strcmp(argv[i], "--no-idle-jobs") == 0) {
+                idle_jobs = false;
+            } else if (strcmp(argv[i], "--idle-delay") == 0 && i + 1 < argc) {
+                idle_config.delay_ms = std::max(0, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--auto-threads") == 0) {
+                auto_threads = true;
+            } else if (strcmp(argv[i], "--retune-threads") == 0) {
+                auto_threads = true;
+                retune_threads = true;
+            } else if (strcmp(argv[i], "--pin-threads") == 0) {
+                pin_threads = true;
+            } else if (strcmp(argv[i], "--thread-cache") == 0 && i + 1 < argc) {
+                thread_cache_path = argv[++i];
+            } else if ((strcmp(argv[i], "-ctk") == 0 || strcmp(argv[i], "--cache-type-k") == 0) && i + 1 < argc) {
+                if (!parseKvCacheType(argv[++i], kv_cache.type_k)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if ((strcmp(argv[i], "-ctv") == 0 || strcmp(argv[i], "--cache-type-v") == 0) && i + 1 < argc) {
+                if (!parseKvCacheType(argv[++i], kv_cache.type_v)) {
+                    std::cerr << "Unknown KV cache type: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-fa") == 0 || strcmp(argv[i], "--flash-attn") == 0) {
+                kv_cache.flash_attn = true;
+            } else if (strcmp(argv[i], "-nkvo") == 0 || strcmp(argv[i], "--no-kv-offload") == 0) {
+                kv_cache.offload_kqv = false;
+            } else if (strcmp(argv[i], "--no-tool-prefetch") == 0) {
+                tool_prefetch = false;
+            } else if (strcmp(argv[i], "--native-mime") == 0) {
+                native_mime = true;
+            } else if (strcmp(argv[i], "--project-tool-results") == 0) {
+                project_tool_results = true;
+            } else if (strcmp(argv[i], "--compact") == 0) {
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-at") == 0 && i + 1 < argc) {
+                compaction.trigger_ratio = std::stof(argv[++i]);
+                compaction.enabled = true;
+            } else if (strcmp(argv[i], "--compact-keep") == 0 && i + 1 < argc) {
+                compaction.keep_recent_turns = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory") == 0) {
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-file") == 0 && i + 1 < argc) {
+                memory_options.path = argv[++i];
+                memory_enabled = true;
+            } else if (strcmp(argv[i], "--memory-top-k") == 0 && i + 1 < argc) {
+                memory_config.top_k = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--memory-tokens") == 0 && i + 1 < argc) {
+                memory_config.token_budget = std::max(64, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--no-mmap") == 0) {
+                use_mmap = false;
+            } else if (strcmp(argv[i], "--mlock") == 0) {
+                use_mlock = true;
+            } else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+                if (!parseNumaStrategy(argv[++i], numa)) {
+                    std::cerr << "Unknown NUMA strategy: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--cascade-model") == 0 && i + 1 < argc) {
+                cascade.model_path = argv[++i];
+            } else if (strcmp(argv[i], "--cascade-ngl") == 0 && i + 1 < argc) {
+                cascade.n_gpu_layers = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cascade-confidence") == 0 && i + 1 < argc) {
+                cascade.min_confidence = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--no-warmup") == 0) {
+                warmup = false;
+            } else if (strcmp(argv[i], "--batch") == 0) {
+                batch_mode = true;
+            } else if (strcmp(argv[i], "--batch-query") == 0 && i + 1 < argc) {
+                batch_options.query = argv[++i];
+            } else if (strcmp(argv[i], "--batch-since-history") == 0 && i + 1 < argc) {
+                batch_options.since_history_id = argv[++i];
+            } else if (strcmp(argv[i], "--batch-max") == 0 && i + 1 < argc) {
+                batch_options.max_messages = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--batch-categories") == 0 && i + 1 < argc) {
+                batch_options.categories.clear();
+                std::istringstream list(argv[++i]);
+                std::string category;
+                while (std::getline(list, category, ',')) {
+                    if (!category.empty()) batch_options.categories.push_back(category);
+                }
+            } else if (strcmp(argv[i], "--batch-label-prefix") == 0 && i + 1 < argc) {
+                batch_options.label_prefix = argv[++i];
+            } else if (strcmp(argv[i], "--batch-fetch-threads") == 0 && i + 1 < argc) {
+                batch_options.fetch_threads = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--batch-generate") == 0) {
+                batch_options.generate = true;
+            } else if (strcmp(argv[i], "--batch-parallel") == 0 && i + 1 < argc) {
+                batch_options.parallel = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--batch-report") == 0 && i + 1 < argc) {
+                batch_options.report_path = argv[++i];
+            } else if (strcmp(argv[i], "--batch-dry-run") == 0) {
+                batch_options.dry_run = true;
             }
             // Note: -h/--help is handled before this loop if present as the only arg, or will be caught if it needs a value it doesn't get
         } catch (std::exception& e) {
-            if (main_debug_log.is_open()) main_debug_log << "ERROR main: Error parsing arguments: " << e.what() << std::endl;
-            else std::cerr << "Error parsing arguments: " << e.what() << std::endl; 
+            std::cerr << "Error parsing arguments: " << e.what() << std::endl; 
             std::cout << "Use " << argv[0] << " --help for more detailed information." << std::endl;
             return 1;
         }
     }
     
+    // Open the log file once arguments are known. Everything (including LlamaInference)
+    // logs through this single asynchronous logger.
+    if (!log_level_name.empty()) {
+        LogLevel level;
+        if (!parseLogLevel(log_level_name, level)) {
+            std::cerr << "Unknown log level: " << log_level_name << std::endl;
+            return 1;
+        }
+        Logger::instance().setLevel(level);
+    }
+    if (!Logger::instance().open(log_file_path)) {
+        std::cerr << "CRITICAL ERROR: Failed to open " << log_file_path << " in main!" << std::endl;
+    }
+    LOG_INFO("main", "--- Main Application Started ---");
+
     if (model_path.empty()) {
-        if (main_debug_log.is_open()) main_debug_log << "ERROR main: Model path (-m) is required." << std::endl;
-        else std::cerr << "ERROR main: Model path (-m) is required (log not open)." << std::endl; 
+        LOG_ERROR("main", "Model path (-m) is required.");
         std::cout << "Model path (-m) is required.\n"
                   << "Use " << argv[0] << " --help for more detailed information." << std::endl; 
         return 1;
@@ -220,46 +493,18 @@ int main(int argc, char** argv) {
             std::stringstream buffer;
             buffer << sp_file.rdbuf();
             system_prompt = buffer.str();
-            if (main_debug_log.is_open()) main_debug_log << "INFO main: Loaded system prompt from file: " << system_prompt_file_path << std::endl;
-            // else std::cout << "INFO main: Loaded system prompt from file: " << system_prompt_file_path << std::endl; // Replaced by log
+            LOG_INFO("main", "Loaded system prompt from file: %s", system_prompt_file_path.c_str());
         } else {
-            if (main_debug_log.is_open()) main_debug_log << "ERROR main: Could not open system prompt file: " << system_prompt_file_path << ". Using default prompt." << std::endl;
-            else std::cerr << "ERROR main: Could not open system prompt file: " << system_prompt_file_path << ". Using default prompt. (log not open)" << std::endl; // Keep cerr
+            LOG_ERROR("main", "Could not open system prompt file: %s. Using default prompt.", system_prompt_file_path.c_str());
+            std::cerr << "ERROR main: Could not open system prompt file: " << system_prompt_file_path << ". Using default prompt." << std::endl; // Keep cerr
             // Fall through to use hardcoded default
         }
     }
     
     if (system_prompt.empty()) {
         // Default system prompt if not loaded from file or file was empty
-        system_prompt = R"EOF(You are an AI assistant. Tools are available.
-When calling a tool, respond ONLY with a single JSON object: {"tool_name": "...", "parameters": {...}}.
-No other text, explanations, or markdown.
-
-To fulfill requests like "show me my last 3 unread emails", you should use the "list_messages" tool with appropriate query (e.g., "is:unread") and max_results (e.g., 3). This tool will return a list of messages, each including sender (from), subject, and a snippet of the content. Present this information directly to the user. Do not show raw message IDs unless the user asks for them or for an operation that requires an ID.
-If the user asks for the full content of a specific email after seeing the list, or needs to perform an action on a specific email (like trashing it), then you can use the "get_message_content" tool (for full content) or other relevant tools, using the message ID from the initial list.
-
-Available tools:
-- {"name": "send_email", "description": "Sends an email.", "parameters": {"to": "string (email_address)", "subject": "string", "body": "string"}}
-- {"name": "list_labels", "description": "Lists all Gmail labels.", "parameters": {}}
-- {"name": "get_profile", "description": "Gets the user's Gmail profile.", "parameters": {}}
-- {"name": "trash_message", "description": "Moves a specific message to trash using its ID.", "parameters": {"message_id": "string"}}
-- {"name": "list_messages", "description": "Lists messages matching a query. Returns a list of messages, each including sender (from), subject, snippet, and message ID.", "parameters": {"query": "string (Gmail search query, e.g., 'is:unread')", "max_results": "integer (optional, specifies maximum number of messages to return)"}}
-- {"name": "get_message_content", "description": "Gets the full raw content (headers, body, payload, etc.) of a specific message using its ID. Use this if the snippet from list_messages is insufficient and the user wants more details.", "parameters": {"message_id": "string"}}
-- {"name": "get_label", "description": "Gets details for a specific label by ID.", "parameters": {"label_id": "string"}}
-- {"name": "create_label", "description": "Creates a new label.", "parameters": {"name": "string", "label_list_visibility": "string (optional: labelShow, labelHide, labelShowIfUnread)", "message_list_visibility": "string (optional: show, hide)"}}
-- {"name": "update_label", "description": "Updates an existing label by ID.", "parameters": {"label_id": "string", "name": "string (optional)", "label_list_visibility": "string (optional)", "message_list_visibility": "string (optional)"}}
-- {"name": "delete_label", "description": "Deletes a label by ID.", "parameters": {"label_id": "string"}}
-- {"name": "get_history", "description": "Gets mailbox history.", "parameters": {"start_history_id": "string (optional)", "max_results": "integer (optional)"}}
-
-Tool results will be provided via role "tool".
-Based on the result:
-- Respond to the user in plain text.
-- Call another tool (as JSON).
-- Ask for clarification.
-If no tool is needed, respond directly. If a tool call errors, inform the user or try an alternative.
-)EOF";
-        if (main_debug_log.is_open()) main_debug_log << "INFO main: Using default system prompt." << std::endl;
-        // else std::cout << "INFO main: Using default system prompt." << std::endl; // Replaced by log
+        system_prompt = defaultSystemPrompt();
+        LOG_INFO("main", "Using default system prompt.");
     }
 
     // initialize LlamaInference object
@@ -272,38 +517,99 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
         n_threads_batch = hardware_concurrency_val > 0 ? hardware_concurrency_val : 4; // Fallback if detection fails, can also default to n_threads
     }
 
-    if (main_debug_log.is_open()) {
-        main_debug_log << "INFO main: Using " << n_threads << " threads for generation." << std::endl;
-        main_debug_log << "INFO main: Using " << n_threads_batch << " threads for batch processing." << std::endl;
-    } else {
-        // std::cout << "INFO main: Using " << n_threads << " threads for generation." << std::endl; // Replaced by log (if open)
-        // std::cout << "INFO main: Using " << n_threads_batch << " threads for batch processing." << std::endl; // Replaced by log (if open)
-        // If log isn't open here, it's a critical failure already noted.
-    }
+    LOG_INFO("main", "Using %d threads for generation.", n_threads);
+    LOG_INFO("main", "Using %d threads for batch processing.", n_threads_batch);
 
     LlamaInference llama(model_path, ngl, n_ctx, gmail_address, n_threads, n_threads_batch);
 
     // Set system prompt
     llama.setSystemPrompt(system_prompt);
+    llama.setMetricsFile(metrics_file_path);
+    llama.setSamplerConfig(sampler_config);
+    if (seed >= 0) {
+        llama.setSeed(static_cast<uint32_t>(seed));
+    }
+    llama.setKvCacheConfig(kv_cache);
+    llama.setToolPrefetch(tool_prefetch);
+    llama.setNativeMime(native_mime);
+    llama.setProjectToolResults(project_tool_results);
+    llama.setCompactionConfig(compaction);
+    llama.setUseMmap(use_mmap);
+    llama.setUseMlock(use_mlock);
+    llama.setNumaStrategy(numa);
+    llama.setWarmup(warmup);
+    if (!batch_mode) {
+        llama.setCascadeConfig(cascade); // Triage never runs the tool loop
+    }
+    if (batch_mode && batch_options.generate) {
+        llama.setParallelSequences(batch_options.parallel); // Forks for BatchTriage's completeBatch()
+    }
 
     // If user specified max_response_chars, apply it. Otherwise, it defaults to context_size in LlamaInference constructor.
     if (user_max_response_chars > 0) {
         llama.setMaxResponseChars(user_max_response_chars);
-        if (main_debug_log.is_open()) main_debug_log << "INFO main: User override: Set max_response_chars to " << user_max_response_chars << std::endl;
-        // else std::cout << "INFO main: User override: Set max_response_chars to " << user_max_response_chars << std::endl; // Replaced by log
+        LOG_INFO("main", "User override: Set max_response_chars to %d", user_max_response_chars);
     } else {
         // Log the default value being used (which is n_ctx, set in LlamaInference constructor)
         // To get this value accurately for logging, we might need a getter in LlamaInference or pass n_ctx to this log.
         // For simplicity, we'll just state it defaults to context size here.
-        if (main_debug_log.is_open()) main_debug_log << "INFO main: max_response_chars defaulted to context_size (" << n_ctx << ")." << std::endl;
-        // else std::cout << "INFO main: max_response_chars defaulted to context_size (" << n_ctx << ")." << std::endl; // Replaced by log
+        LOG_INFO("main", "max_response_chars defaulted to context_size (%d).", n_ctx);
     }
 
-    if (!llama.initialize()) {
-        if (main_debug_log.is_open()) main_debug_log << "ERROR main: Failed to initialize LlamaInference." << std::endl;
-        else std::cerr << "ERROR main: Failed to initialize LlamaInference (log not open)." << std::endl; // Keep cerr
-        // std::cerr << "Failed to initialize LlamaInference." << std::endl; // Already logged
-        return 1;
+    if (batch_mode) {
+        if (!llama.initialize()) {
+            LOG_ERROR("main", "Failed to initialize LlamaInference.");
+            std::cerr << "ERROR main: Failed to initialize LlamaInference." << std::endl; // Keep cerr
+            Logger::instance().close();
+            return 1;
+        }
+        if (auto_threads) {
+            std::cerr << "Selecting thread configuration..." << std::endl;
+            ThreadTuner(llama, model_path, ngl, pin_threads).tune(thread_cache_path, retune_threads);
+        }
+
+        if (batch_options.categories.empty()) {
+            std::cerr << "--batch-categories must name at least one category." << std::endl;
+            Logger::instance().close();
+            return 1;
+        }
+        BatchTriage triage(llama, gmail_address, batch_options);
+        const nlohmann::json summary = triage.run();
+        std::cout << summary.dump(2) << std::endl;
+        Logger::instance().close();
+        return summary.contains("error") ? 1 : 0;
+    }
+
+    // Optional session recording; the session_start record is written once the model is loaded
+    SessionRecorder session_recorder;
+    if (!record_session_path.empty() && !session_recorder.open(record_session_path)) {
+        std::cerr << "WARNING: Could not open session recording " << record_session_path << std::endl;
+    }
+
+    // Optional Prometheus endpoint; stopped when it goes out of scope at the end of main
+    MetricsServer metrics_server;
+    if (metrics_port > 0 && !metrics_server.start(metrics_host, metrics_port)) {
+        std::cerr << "WARNING: Could not start metrics endpoint on " << metrics_host << ":" << metrics_port << std::endl;
+    }
+
+    // Optional background mailbox sync. It starts now, while the model loads; messages that
+    // arrive before the model is ready get their token counts on a later poll.
+    MailboxSync mailbox_sync(gmail_address, sync_options);
+    if (mailbox_sync_enabled) {
+        mailbox_sync.setTokenCounter([&llama](const std::string& text) {
+            return load_state == LoadState::Ready ? llama.countTokens(text) : 0;
+        });
+        llama.setMailboxSync(&mailbox_sync);
+        mailbox_sync.start();
+    }
+
+    // Optional long-term memory; entries are embedded once the model is loaded
+    MemoryStore memory_store(memory_options);
+    if (memory_enabled) {
+        if (!memory_store.open()) {
+            std::cerr << "WARNING: Could not open " << memory_options.path << "; memory is kept for this session only" << std::endl;
+        }
+        llama.setMemoryStore(&memory_store, memory_config);
     }
 
     // UI Setup
@@ -315,6 +621,62 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
     bool user_scrolled = false; // Track if user has manually scrolled
 
     std::string prompt;
+
+    // Load the model in the background. Progress callbacks arrive once per tensor, so only
+    // whole-percent changes trigger a redraw.
+    llama.setLoadProgressCallback([&screen](float progress) {
+        const int percent = static_cast<int>(progress * 100.0f);
+        if (load_percent.exchange(percent) != percent) {
+            screen.PostEvent(Event::Custom);
+        }
+        return !abort_load.load();
+    });
+    std::thread load_thread([&]() {
+        if (!llama.initialize()) {
+            LOG_ERROR("main", "Failed to initialize LlamaInference.");
+            load_state = LoadState::Failed;
+            if (!abort_load) {
+                screen.Exit();
+            }
+            return;
+        }
+        if (auto_threads && !abort_load) {
+            tuning_threads = true;
+            screen.PostEvent(Event::Custom);
+            ThreadTuner(llama, model_path, ngl, pin_threads).tune(thread_cache_path, retune_threads);
+            tuning_threads = false;
+        }
+        // The config (including the effective seed) is known only after initialize()
+        if (session_recorder.isOpen()) {
+            session_recorder.recordSessionStart(llama.describeConfig());
+            llama.setSessionRecorder(&session_recorder);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(reconfigure_status_mutex);
+            reconfigure_status = kvCacheSummary(llama.describeConfig());
+        }
+
+        if (idle_jobs && !abort_load) {
+            llama.startIdleWork(idle_config);
+        }
+
+        std::string first_prompt;
+        {
+            std::lock_guard<std::mutex> lock(queued_prompt_mutex);
+            load_state = LoadState::Ready;
+            first_prompt.swap(queued_prompt);
+        }
+        screen.PostEvent(Event::Custom);
+        if (!first_prompt.empty()) {
+            std::thread([&llama, first_prompt, &screen]() {
+                StreamChat(llama, false, first_prompt, [&] {
+                    screen.PostEvent(Event::Custom);
+                });
+            }).detach();
+        }
+    });
+    std::thread reconfigure_thread; // The latest "/model" or "/ctx" switch; joined before exit
     
     // Text input component for user input
     Component user_prompt_box = Input(&prompt, "Type prompt here") | border;
@@ -358,16 +720,60 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
             }
         }
         
+        // A prompt submitted while the model loads is sent as soon as it is ready
+        if (event == Event::Return && !prompt.empty() && prompt[0] != '/' && load_state != LoadState::Ready) {
+            std::lock_guard<std::mutex> lock(queued_prompt_mutex);
+            if (load_state == LoadState::Loading && queued_prompt.empty()) {
+                queued_prompt = prompt;
+                prompt.clear();
+                return true;
+            }
+            if (load_state != LoadState::Ready) {
+                return true; // Keep typing; one queued prompt at a time
+            }
+        }
+
+        // "/model <path.gguf>" or "/ctx <n>": the new engine loads while chatting continues
+        if (event == Event::Return && (prompt.rfind("/model ", 0) == 0 || prompt.rfind("/ctx ", 0) == 0)) {
+            if (reconfiguring) {
+                return true;
+            }
+            std::string model_arg;
+            int ctx_arg = 0;
+            try {
+                if (prompt.rfind("/model ", 0) == 0) {
+                    model_arg = prompt.substr(7);
+                } else {
+                    ctx_arg = std::stoi(prompt.substr(5));
+                }
+            } catch (const std::exception&) {
+                return true; // Leave the command in the box for correction
+            }
+            prompt.clear();
+            if (reconfigure_thread.joinable()) {
+                reconfigure_thread.join(); // Already finished: "reconfiguring" was false
+            }
+            reconfiguring = true;
+            reconfigure_thread = std::thread([&llama, &screen, model_arg, ctx_arg]() {
+                const bool ok = llama.reconfigure(model_arg, ctx_arg);
+                {
+                    std::lock_guard<std::mutex> lock(reconfigure_status_mutex);
+                    const nlohmann::json config = llama.describeConfig();
+                    reconfigure_status = ok ? "Now using " + config.value("model", std::string()) +
+                                                  " (n_ctx " + std::to_string(config.value("n_ctx", 0)) + ", " +
+                                                  kvCacheSummary(config) + ")"
+                                            : "Switch failed; see the log";
+                }
+                reconfiguring = false;
+                screen.PostEvent(Event::Custom);
+            });
+            return true;
+        }
+
         // Handle input submission
         if (event == Event::Return && !prompt.empty() && !is_streaming) {
-            if (main_debug_log.is_open()) {
-                main_debug_log << "DEBUG main: Event::Return triggered." << std::endl;
-                main_debug_log << "DEBUG main: Prompt from UI: '" << prompt << "'" << std::endl;
-                main_debug_log << "DEBUG main: is_streaming is false." << std::endl;
-            } else { // Fallback if log isn't open
-                // std::cout << "DEBUG main: Event::Return triggered with prompt: '" << prompt << "'" << std::endl; // Replaced
-                // Avoid cout from here if log isn't open
-            }
+            LOG_DEBUG("main", "Event::Return triggered. Prompt length from UI: %zu", prompt.size());
+            LOG_TRACE("main", "Prompt from UI: '%s'", prompt.c_str());
 
             response = "";
             scroll_offset = 0; // Reset scroll position
@@ -393,7 +799,7 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
         int width = size.dimx - 6; // Account for borders and some padding
         
         // For history area, use all but 5 lines (2 for streaming, 1 for separator, 2 for padding)
-        int history_height = size.dimy - 13; // Adjusted to make room for streaming area
+        int history_height = size.dimy - 14; // Adjusted to make room for streaming area and status line
         
         // Create wrapped lines for scrolling from the full response
         std::vector<std::string> history_lines = wrapText(response, width);
@@ -467,7 +873,40 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
             streaming_area = filler();
         }
         
-        // Basic layout with history, streaming indicator, and input
+        // Load progress until the model is ready, then performance of the last completed turn
+        Element status_line;
+        if (load_state == LoadState::Ready) {
+            std::string status = " " + llama.getLastTurnMetrics().statusLine();
+            if (reconfiguring) {
+                status = " Switching engine in the background..." + status;
+            } else {
+                std::lock_guard<std::mutex> lock(reconfigure_status_mutex);
+                if (!reconfigure_status.empty()) {
+                    status = " " + reconfigure_status + " |" + status;
+                }
+            }
+            status_line = text(status) | dim;
+        } else if (load_state == LoadState::Failed) {
+            status_line = text(" Failed to load " + model_path + " (see " + log_file_path + "). Ctrl-C to quit.") | color(Color::Red);
+        } else {
+            const int percent = load_percent;
+            std::string load_text = percent < 100 ? " Loading model... " + std::to_string(percent) + "%"
+                                  : tuning_threads ? " Selecting thread configuration..."
+                                                   : " Warming up...";
+            {
+                std::lock_guard<std::mutex> lock(queued_prompt_mutex);
+                if (!queued_prompt.empty()) {
+                    load_text += "  (prompt queued)";
+                }
+            }
+            status_line = hbox({
+                text(load_text) | color(Color::Yellow),
+                text(" "),
+                gauge(percent / 100.0f) | flex,
+            });
+        }
+
+        // Basic layout with history, streaming indicator, status line, and input
         return vbox({
             text("MaiMail " + APP_VERSION) | center,
             separator(),
@@ -475,14 +914,27 @@ If no tool is needed, respond directly. If a tool call errors, inform the user o
             scroll_info.empty() ? filler() : text(scroll_info) | center,
             streaming_area,
             separator(),
+            status_line,
             user_prompt_box->Render()
         });
     });
 
     screen.Loop(renderer);
-    if (main_debug_log.is_open()) {
-        main_debug_log << "--- Main Application Exiting ---" << std::endl;
-        main_debug_log.close();
+
+    // Quitting mid-load aborts it at the next progress callback
+    const bool quit_while_loading = load_state == LoadState::Loading;
+    abort_load = true;
+    load_thread.join();
+    if (reconfigure_thread.joinable()) {
+        reconfigure_thread.join(); // A model switch in flight finishes loading first
+    }
+    llama.stopIdleWork(); // Its jobs use the mailbox sync and memory store, which go first
+    if (load_state == LoadState::Failed && !quit_while_loading) {
+        std::cerr << "ERROR main: Failed to initialize LlamaInference." << std::endl; // Keep cerr
+        Logger::instance().close();
+        return 1;
     }
+    LOG_INFO("main", "--- Main Application Exiting ---");
+    Logger::instance().close();
     return 0;
 }
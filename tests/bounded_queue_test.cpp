@@ -0,0 +1,141 @@
+// Checks BoundedQueue: FIFO order, back-pressure at capacity, close() waking blocked
+// producers and consumers while consumers still drain what was queued, and no item lost
+// or duplicated with several producers and consumers. Exits non-zero if any check fails.
+#include "BoundedQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using std::chrono::milliseconds;
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+template <typename Predicate>
+bool waitFor(Predicate done, int timeout_ms = 2000) {
+    const auto until = std::chrono::steady_clock::now() + milliseconds(timeout_ms);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > until) {
+            return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return true;
+}
+
+void orderAndBackPressure() {
+    BoundedQueue<std::unique_ptr<int>> queue(2); // Move-only items
+    std::atomic<int> pushed{0};
+    std::thread producer([&]() {
+        for (int i = 0; i < 3; i++) {
+            queue.push(std::make_unique<int>(i));
+            pushed++;
+        }
+    });
+    check(waitFor([&]() { return pushed == 2; }), "pushes up to capacity");
+    std::this_thread::sleep_for(milliseconds(20));
+    check(pushed == 2 && queue.size() == 2, "producer blocked at capacity");
+
+    std::unique_ptr<int> item;
+    check(queue.pop(item) && *item == 0, "first in, first out");
+    producer.join();
+    check(pushed == 3, "a pop unblocks the producer");
+    check(queue.tryPop(item) && *item == 1 && queue.tryPop(item) && *item == 2, "tryPop in order");
+    check(!queue.tryPop(item), "tryPop on an empty queue returns at once");
+
+    BoundedQueue<int> unbuffered(0);
+    check(unbuffered.push(7) && unbuffered.size() == 1, "capacity 0 holds one item");
+}
+
+void closeDrains() {
+    BoundedQueue<int> queue(2);
+    queue.push(1);
+    queue.push(2);
+    std::atomic<int> result{-1};
+    std::thread producer([&]() { result = queue.push(3) ? 1 : 0; });
+    std::this_thread::sleep_for(milliseconds(20));
+    check(result == -1, "producer waiting on a full queue");
+    queue.close();
+    producer.join();
+    check(result == 0, "close() fails a blocked push");
+    check(!queue.push(4), "push after close fails");
+
+    int item = 0;
+    check(queue.pop(item) && item == 1 && queue.pop(item) && item == 2, "consumers drain after close");
+    check(!queue.pop(item), "pop on a closed, empty queue returns false");
+
+    BoundedQueue<int> empty(2);
+    std::atomic<int> popped{-1};
+    std::thread consumer([&]() {
+        int value = 0;
+        popped = empty.pop(value) ? 1 : 0;
+    });
+    std::this_thread::sleep_for(milliseconds(20));
+    check(popped == -1, "consumer waiting on an empty queue");
+    empty.close();
+    consumer.join();
+    check(popped == 0, "close() wakes a blocked consumer");
+}
+
+void manyProducersAndConsumers() {
+    constexpr int kProducers = 4;
+    constexpr int kConsumers = 3;
+    constexpr int kPerProducer = 5000;
+    BoundedQueue<int> queue(8);
+    std::vector<std::atomic<int>> seen(kProducers * kPerProducer);
+    std::atomic<int> consumed{0};
+
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < kConsumers; c++) {
+        consumers.emplace_back([&]() {
+            int item = 0;
+            while (queue.pop(item)) {
+                seen[item]++;
+                consumed++;
+            }
+        });
+    }
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < kPerProducer; i++) {
+                queue.push(p * kPerProducer + i);
+            }
+        });
+    }
+    for (auto& t : producers) t.join();
+    queue.close();
+    for (auto& t : consumers) t.join();
+
+    bool each_once = true;
+    for (const auto& count : seen) {
+        each_once = each_once && count == 1;
+    }
+    check(consumed == kProducers * kPerProducer && each_once, "every item consumed exactly once");
+}
+
+} // namespace
+
+int main() {
+    orderAndBackPressure();
+    closeDrains();
+    manyProducersAndConsumers();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("bounded queue checks passed\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+// Checks IdleScheduler's preemption and requeue rules with stand-ins for LlamaInference's
+// call lock and for a decode loop polling shouldYield(). Exits non-zero if any check fails.
+#include "IdleScheduler.h"
+#include "Logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "nlohmann/json.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+constexpr int kIdleDelayMs = 50;
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+// The worker side of LlamaInference::CallLock
+class WorkerLock {
+public:
+    WorkerLock(IdleScheduler& idle, std::mutex& call_mutex) : idle_(idle) {
+        for (;;) {
+            lock_ = std::unique_lock<std::mutex>(call_mutex);
+            if (idle_.workerEnter()) {
+                return;
+            }
+            lock_.unlock();
+            idle_.waitForIdle();
+        }
+    }
+    ~WorkerLock() {
+        idle_.workerLeave();
+    }
+
+private:
+    IdleScheduler& idle_;
+    std::unique_lock<std::mutex> lock_;
+};
+
+// A job step of `steps` decodes of 1 ms, stopping early when told to yield
+bool decode(IdleScheduler& idle, int steps) {
+    for (int i = 0; i < steps; i++) {
+        if (idle.shouldYield()) {
+            return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return true;
+}
+
+template <typename Predicate>
+bool waitFor(Predicate done, int timeout_ms = 2000) {
+    const auto until = Clock::now() + milliseconds(timeout_ms);
+    while (!done()) {
+        if (Clock::now() > until) {
+            return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return true;
+}
+
+// A foreground call that takes the engine while the job waits for it, after the job was
+// dequeued: the job must wait for the next idle period, then run once and complete
+void foregroundBetweenDequeueAndLock() {
+    IdleScheduler idle(kIdleDelayMs);
+    std::mutex call_mutex;
+    std::atomic<bool> dequeued{false};
+    std::atomic<bool> go{false};
+    std::atomic<int> runs{0};
+    std::atomic<bool> finished{false};
+    Clock::time_point entered;
+    Clock::time_point foreground_end;
+
+    idle.start();
+    idle.submit("job", 0, [&](const std::atomic<bool>& preempted) {
+        runs++;
+        dequeued = true;
+        waitFor([&] { return go.load(); });
+        WorkerLock lock(idle, call_mutex);
+        entered = Clock::now();
+        decode(idle, 20);
+        finished = true;
+        return !preempted;
+    });
+    check(waitFor([&] { return dequeued.load(); }), "job dequeued");
+
+    idle.foregroundBegin();
+    {
+        std::lock_guard<std::mutex> lock(call_mutex);
+        go = true;
+        std::this_thread::sleep_for(milliseconds(20));
+        foreground_end = Clock::now();
+    }
+    idle.foregroundEnd();
+
+    check(waitFor([&] { return finished.load(); }), "job finished");
+    check(entered - foreground_end >= milliseconds(kIdleDelayMs - 5), "job waited for the idle delay after the foreground call");
+    std::this_thread::sleep_for(milliseconds(3 * kIdleDelayMs));
+    const nlohmann::json stats = idle.stats();
+    check(runs == 1, "job ran once");
+    check(stats.value("completed", 0) == 1, "job completed");
+    check(stats.value("preempted", 0) == 0, "job not counted as preempted");
+    idle.stop();
+}
+
+// A foreground call while the job decodes: the job yields, is requeued and finishes in
+// the next idle period
+void preemptedWhileDecoding() {
+    IdleScheduler idle(kIdleDelayMs);
+    std::mutex call_mutex;
+    std::atomic<int> runs{0};
+    std::atomic<bool> in_engine{false};
+    std::atomic<bool> yielded{false};
+
+    idle.start();
+    idle.submit("job", 0, [&](const std::atomic<bool>& preempted) {
+        const int run = ++runs;
+        WorkerLock lock(idle, call_mutex);
+        in_engine = true;
+        const bool done = decode(idle, run == 1 ? 1000 : 5);
+        in_engine = false;
+        if (!done) {
+            yielded = true;
+        }
+        return !preempted;
+    });
+    check(waitFor([&] { return in_engine.load(); }), "job entered the engine");
+
+    idle.foregroundBegin();
+    {
+        std::lock_guard<std::mutex> lock(call_mutex); // Granted once the job has yielded
+        check(yielded.load(), "job yielded before the foreground call got the engine");
+    }
+    idle.foregroundEnd();
+
+    check(waitFor([&] { return idle.stats().value("completed", 0) == 1; }), "requeued job completed");
+    const nlohmann::json stats = idle.stats();
+    check(runs == 2, "job ran twice");
+    check(stats.value("preempted", 0) == 1, "one preemption counted");
+    check(stats["queued"].empty(), "queue empty");
+    idle.stop();
+}
+
+// Higher priorities first, equal ones in submission order; a resubmitted name replaces
+// the queued job
+void ordering() {
+    IdleScheduler idle(0);
+    std::mutex order_mutex;
+    std::string order;
+    auto job = [&](char name) {
+        return [&, name](const std::atomic<bool>&) {
+            std::lock_guard<std::mutex> lock(order_mutex);
+            order += name;
+            return true;
+        };
+    };
+    idle.foregroundBegin(); // Hold jobs back while queueing
+    idle.start();
+    idle.submit("a", 1, job('a'));
+    idle.submit("b", 2, job('b'));
+    idle.submit("c", 1, job('c'));
+    idle.submit("a", 1, job('A'));
+    idle.foregroundEnd();
+    check(waitFor([&] { return idle.stats().value("completed", 0) == 3; }), "three jobs ran");
+    std::lock_guard<std::mutex> lock(order_mutex);
+    check(order == "bcA", "priority and submission order");
+    idle.stop();
+}
+
+} // namespace
+
+int main() {
+    foregroundBetweenDequeueAndLock();
+    preemptedWhileDecoding();
+    ordering();
+    Logger::instance().close();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("idle scheduler checks passed\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Checks the SAX projections against what json::parse makes of the same documents: tool
+// calls with the keys in any order, nested and malformed parameters, and message listings
+// with bodies, nested payloads and field masks. Exits non-zero if any check fails.
+#include "JsonProjection.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+void toolCalls() {
+    std::string name;
+    json params;
+
+    const std::string nested = R"({"q": "from:ana", "max": 5, "unread": true, "ratio": 0.5, "labels": ["A", "B"],
+                                   "range": {"after": "2024/01/01", "ids": [1, {"x": null}]}})";
+    check(projectToolCall(R"({"tool_name": "search", "parameters": )" + nested + "}", name, params) &&
+              name == "search" && params == json::parse(nested),
+          "tool call with nested parameters");
+
+    check(projectToolCall(R"({"parameters": {"id": "m1"}, "note": {"tool_name": "x"}, "tool_name": "get_message"})",
+                          name, params) &&
+              name == "get_message" && params == json{{"id", "m1"}},
+          "parameters before tool_name, nested tool_name ignored");
+
+    check(projectToolCall(R"({"tool_name": "list_labels"})", name, params) && name == "list_labels" &&
+              params == json::object(),
+          "missing parameters");
+    check(projectToolCall(R"({"tool_name": "list_labels", "parameters": ["a"]})", name, params) &&
+              params == json::object(),
+          "parameters that are not an object");
+    check(projectToolCall(R"({"tool_name": "t", "parameters": {"a": 1}, "parameters": {"b": 2}})", name, params) &&
+              params == json{{"b", 2}},
+          "repeated parameters: the last one wins");
+
+    name = "kept";
+    params = json{{"kept", true}};
+    const char* rejected[] = {
+        R"({"tool_name": 3, "parameters": {}})",
+        R"({"parameters": {}})",
+        R"(["tool_name", "search"])",
+        R"({"tool_name": "search", "parameters": {"q": )",
+        R"({"tool_name": "search"} trailing)",
+        "",
+    };
+    for (const char* text : rejected) {
+        check(!projectToolCall(text, name, params), text);
+    }
+    check(name == "kept" && params == json{{"kept", true}}, "a rejected call leaves the outputs alone");
+}
+
+void messages() {
+    const std::string listing = R"({
+        "resultSizeEstimate": 2,
+        "messages": [
+            {"id": "m1", "threadId": "t1", "from": "Ana <ana@example.com>", "subject": "Lunch",
+             "snippet": "See you at noon", "date": "Mon, 1 Jan 2024", "labelIds": ["INBOX", "UNREAD"],
+             "body": "a long body é", "payload": {"id": "nested", "headers": [{"subject": "no"}],
+                                                     "messages": [{"id": "deeper"}]}},
+            {"id": "m2", "error": "not found"}
+        ],
+        "nextPageToken": "p2"
+    })";
+    std::vector<MessageSummary> out;
+    check(projectMessages(listing, kMessageSummaryFields, out) && out.size() == 2, "listing read");
+    if (out.size() == 2) {
+        const MessageSummary& a = out[0];
+        check(a.id == "m1" && a.from == "Ana <ana@example.com>" && a.subject == "Lunch" &&
+                  a.snippet == "See you at noon" && a.date == "Mon, 1 Jan 2024",
+              "summary fields kept");
+        check(a.thread_id.empty() && a.label_ids.empty() &&
+                  a.present == (kMessageId | kMessageFrom | kMessageSubject | kMessageSnippet | kMessageDate),
+              "fields outside the mask skipped");
+        check(out[1].id == "m2" && out[1].error == "not found" && out[1].present == (kMessageId | kMessageError),
+              "per-message error kept");
+    }
+
+    check(projectMessages(listing, kMessageId | kMessageLabelIds | kMessageThreadId, out) && out.size() == 2 &&
+              out[0].label_ids == std::vector<std::string>{"INBOX", "UNREAD"} && out[0].thread_id == "t1" &&
+              out[0].subject.empty(),
+          "label ids and thread id on request");
+
+    check(projectMessages(R"([{"id": "a"}, {"id": "b", "subject": "Hi"}])", kMessageSummaryFields, out) &&
+              out.size() == 2 && out[1].subject == "Hi",
+          "bare array");
+    check(projectMessages(R"({"messages": []})", kMessageSummaryFields, out) && out.empty(), "empty listing");
+
+    check(projectMessages(R"({"messages": [{"id": "x"}], "id": "root"})", kMessageSummaryFields, out) &&
+              messagesToJson(out) == json{{"messages", {{{"id", "x"}}}}}.dump(),
+          "only the fields a message had are serialized");
+    check(projectMessages(listing, kMessageSummaryFields, out) &&
+              json::parse(messagesToJson(out))["messages"][0] ==
+                  json{{"id", "m1"}, {"from", "Ana <ana@example.com>"}, {"subject", "Lunch"},
+                       {"snippet", "See you at noon"}, {"date", "Mon, 1 Jan 2024"}},
+          "serialized summary");
+
+    out.assign(1, MessageSummary{});
+    check(!projectMessages(R"({"detail": "Gmail API error"})", kMessageSummaryFields, out) && out.empty(),
+          "an error envelope is not a listing");
+    check(!projectMessages(R"({"messages": [{"id": "a"})", kMessageSummaryFields, out) && out.empty(),
+          "truncated listing rejected and cleared");
+    check(!projectMessages(R"({"messages": [], "messages": []})", kMessageSummaryFields, out),
+          "second messages array rejected");
+}
+
+} // namespace
+
+int main() {
+    toolCalls();
+    messages();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("json projection checks passed\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+// Checks MemoryStore's ranking (BM25, embedding similarity and their reciprocal-rank
+// fusion), replacement by key, the entry limit, and the log: replayed on open(), lines
+// it cannot use skipped, rewritten once most of it is dead. Exits non-zero if any check fails.
+#include "MemoryStore.h"
+#include "Logger.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+std::vector<uint64_t> ids(const std::vector<MemoryHit>& hits) {
+    std::vector<uint64_t> out;
+    for (const MemoryHit& hit : hits) {
+        out.push_back(hit.entry.id);
+    }
+    return out;
+}
+
+MemoryQuery query(const std::string& text, std::vector<float> embedding = {}, size_t k = 3) {
+    MemoryQuery q;
+    q.text = text;
+    q.embedding = std::move(embedding);
+    q.k = k;
+    return q;
+}
+
+size_t lineCount(const std::string& path) {
+    std::ifstream in(path);
+    size_t n = 0;
+    for (std::string line; std::getline(in, line);) {
+        n += line.empty() ? 0 : 1;
+    }
+    return n;
+}
+
+void keywordRanking() {
+    MemoryStore store(MemoryStoreOptions{"", 100});
+    const uint64_t both = store.add("tool", "", "Invoice 1042 from ACME, due Friday", 1);
+    const uint64_t one = store.add("tool", "", "ACME newsletter: spring sale", 2);
+    const uint64_t repeated = store.add("turn", "", "invoice invoice invoice reminders and more reminders", 3);
+    store.add("turn", "", "Lunch with Ana on Monday", 4);
+
+    const std::vector<MemoryHit> hits = store.search(query("the ACME invoice"));
+    check(ids(hits) == std::vector<uint64_t>{both, repeated, one}, "BM25 order");
+    check(!hits.empty() && hits[0].keyword_score > hits[1].keyword_score && hits[0].similarity == 0.0,
+          "keyword scores without embeddings");
+    check(store.search(query("the of and")).empty(), "stop words alone match nothing");
+
+    MemoryQuery excluded = query("ACME invoice");
+    excluded.exclude_ids = {both};
+    excluded.exclude_sources = {3};
+    check(ids(store.search(excluded)) == std::vector<uint64_t>{one}, "excluded ids and sources");
+}
+
+void fusedRanking() {
+    MemoryStore store(MemoryStoreOptions{"", 100});
+    store.setEmbeddingModel("model-a");
+    const uint64_t keyword_only = store.add("tool", "", "flight booking confirmation", 1);
+    const uint64_t both = store.add("tool", "", "flight to Lisbon on the 3rd", 2);
+    const uint64_t near = store.add("turn", "", "trip itinerary for Portugal", 3);
+    const uint64_t far = store.add("turn", "", "quarterly tax forms", 4);
+    const uint64_t stale = store.add("turn", "", "travel plans for Porto", 5);
+    check(store.pendingEmbeddings(10).size() == 5, "all entries pending");
+
+    store.setEmbedding(both, {1.0f, 0.0f, 0.0f}, "model-a");
+    store.setEmbedding(near, {0.8f, 0.6f, 0.0f}, "model-a");
+    store.setEmbedding(far, {0.0f, 0.0f, 1.0f}, "model-a");
+    store.setEmbedding(stale, {1.0f, 0.0f, 0.0f}, "model-b"); // Another model: not comparable
+    store.setEmbedding(keyword_only, {}, "model-a");           // Empty: ignored
+    const auto pending = store.pendingEmbeddings(10);
+    check(pending.size() == 2 && pending[0].first == stale && pending[1].first == keyword_only,
+          "pending: other model and unembedded, newest first");
+
+    MemoryQuery q = query("flight", {1.0f, 0.0f, 0.0f}, 5);
+    q.min_similarity = 0.75f;
+    const std::vector<MemoryHit> hits = store.search(q);
+    check(ids(hits) == std::vector<uint64_t>{both, keyword_only, near}, "fused order");
+    check(hits.size() == 3 && hits[0].similarity > 0.99 && hits[2].similarity > 0.79 && hits[2].keyword_score == 0.0,
+          "similarity reported");
+
+    q.min_similarity = 0.9f;
+    check(ids(store.search(q)) == std::vector<uint64_t>{both, keyword_only},
+          "an embedding match below min_similarity needs a keyword match");
+}
+
+void replacementAndLimit() {
+    MemoryStore store(MemoryStoreOptions{"", 3});
+    const uint64_t first = store.add("tool", "inbox", "inbox listing: old mail", 1);
+    const uint64_t second = store.add("tool", "inbox", "inbox listing: new mail", 2);
+    check(second != first && store.size() == 1, "same key replaces");
+    check(ids(store.search(query("inbox mail"))) == std::vector<uint64_t>{second}, "only the replacement is found");
+
+    store.add("turn", "", "alpha", 3);
+    store.add("turn", "", "beta", 4);
+    store.add("turn", "", "gamma", 5);
+    check(store.size() == 3, "entry limit");
+    check(store.search(query("inbox")).empty() && store.search(query("gamma")).size() == 1, "oldest forgotten");
+}
+
+void logReplay(const std::string& path) {
+    uint64_t keep = 0;
+    uint64_t last = 0;
+    {
+        MemoryStore store(MemoryStoreOptions{path, 100});
+        check(store.open(), "open a new log");
+        store.setEmbeddingModel("model-a");
+        keep = store.add("tool", "", "parcel tracking number 1Z999", 7);
+        store.setEmbedding(keep, {0.0f, 1.0f, 0.0f}, "model-a");
+        store.add("tool", "labels", "labels: work", 8);
+        last = store.add("tool", "labels", "labels: work, family", 9);
+    }
+    {
+        // A cut-off line and a record with the right keys but wrong types
+        std::ofstream out(path, std::ios::app);
+        out << "{\"type\":\"entry\",\"id\":99,\"te\n";
+        out << "{\"type\":\"entry\",\"id\":\"100\",\"text\":\"typed wrong\"}\n";
+        out << "{\"type\":\"embedding\",\"id\":" << keep << ",\"vector\":5}\n";
+    }
+
+    MemoryStore store(MemoryStoreOptions{path, 100});
+    check(store.open(), "reopen");
+    store.setEmbeddingModel("model-a");
+    check(store.size() == 2, "replayed entries, replacement applied, bad lines skipped");
+    const std::vector<MemoryHit> hits = store.search(query("", {0.0f, 1.0f, 0.0f}));
+    check(ids(hits) == std::vector<uint64_t>{keep} && hits[0].entry.source_hash == 7, "embedding replayed");
+    check(ids(store.search(query("family"))) == std::vector<uint64_t>{last}, "replacement replayed");
+    check(store.pendingEmbeddings(10).size() == 1, "only the unembedded entry is pending");
+    check(store.add("turn", "", "after replay", 10) > last, "IDs continue after the replayed ones");
+}
+
+void logRewrite(const std::string& path) {
+    {
+        MemoryStore store(MemoryStoreOptions{path, 100});
+        store.open();
+        for (int i = 0; i < 100; i++) {
+            store.add("tool", "inbox", "inbox version " + std::to_string(i), i);
+        }
+        store.add("turn", "", "kept as is", 1000);
+    }
+    check(lineCount(path) == 101, "appended one record per add");
+
+    {
+        MemoryStore store(MemoryStoreOptions{path, 100});
+        store.open();
+        check(store.size() == 2, "live entries after replay");
+    }
+    check(lineCount(path) == 2, "mostly dead log rewritten");
+    check(!std::filesystem::exists(path + ".tmp"), "no temporary file left");
+
+    MemoryStore store(MemoryStoreOptions{path, 100});
+    store.open();
+    check(store.size() == 2 && store.search(query("version 99")).size() == 1, "rewritten log reads back");
+}
+
+} // namespace
+
+int main() {
+    const std::string path =
+        (std::filesystem::temp_directory_path() / ("memory_store_test_" + std::to_string(getpid()) + ".jsonl")).string();
+
+    keywordRanking();
+    fusedRanking();
+    replacementAndLimit();
+    std::filesystem::remove(path);
+    logReplay(path);
+    std::filesystem::remove(path);
+    logRewrite(path);
+    std::filesystem::remove(path);
+
+    Logger::instance().close();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("memory store checks passed\n");
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Checks base64UrlDecode() against a reference encoder, with the SSSE3 block decoder on
+// and off: random buffers of every length up to 64 bytes, in both alphabets, padded and
+// unpadded, unwrapped and CRLF-wrapped at widths that put the line breaks at every offset
+// of a 16-character block. Exits non-zero if any case fails.
+#include "MimeParser.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+
+namespace {
+
+std::string encode(const std::string& bytes, bool url_safe, bool pad) {
+    const char* alphabet = url_safe ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+                                    : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= bytes.size(); i += 3) {
+        const uint32_t v = static_cast<uint8_t>(bytes[i]) << 16 | static_cast<uint8_t>(bytes[i + 1]) << 8 |
+                           static_cast<uint8_t>(bytes[i + 2]);
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 63];
+        out += alphabet[(v >> 6) & 63];
+        out += alphabet[v & 63];
+    }
+    const size_t rest = bytes.size() - i;
+    if (rest > 0) {
+        uint32_t v = static_cast<uint8_t>(bytes[i]) << 16;
+        if (rest == 2) {
+            v |= static_cast<uint8_t>(bytes[i + 1]) << 8;
+        }
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 63];
+        if (rest == 2) {
+            out += alphabet[(v >> 6) & 63];
+        }
+        if (pad) {
+            out.append(3 - rest, '=');
+        }
+    }
+    return out;
+}
+
+// CRLF after every `width` characters (0: one line)
+std::string wrap(const std::string& text, size_t width) {
+    if (width == 0) {
+        return text;
+    }
+    std::string out;
+    for (size_t i = 0; i < text.size(); i += width) {
+        out += text.substr(i, width);
+        out += "\r\n";
+    }
+    return out;
+}
+
+int failures = 0;
+
+void check(bool ok, const char* what, size_t length, bool simd, const std::string& encoded) {
+    if (!ok && ++failures <= 20) {
+        std::fprintf(stderr, "FAIL %s: %zu bytes, simd %d, input \"%s\"\n", what, length, simd ? 1 : 0, encoded.c_str());
+    }
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(20240601);
+    std::uniform_int_distribution<int> byte(0, 255);
+    const size_t widths[] = {0, 1, 3, 4, 7, 15, 16, 17, 31, 64, 76};
+    size_t cases = 0;
+
+    for (size_t length = 0; length <= 64; length++) {
+        for (int round = 0; round < 8; round++) {
+            std::string bytes(length, '\0');
+            for (char& c : bytes) {
+                c = static_cast<char>(byte(rng));
+            }
+            for (const bool url_safe : {false, true}) {
+                for (const bool pad : {false, true}) {
+                    for (const size_t width : widths) {
+                        const std::string encoded = wrap(encode(bytes, url_safe, pad), width);
+                        std::string decoded[2];
+                        for (const bool simd : {false, true}) {
+                            setBase64Simd(simd);
+                            // Appends: the prefix must survive
+                            std::string out = "prefix";
+                            const bool ok = base64UrlDecode(encoded, out);
+                            check(ok && out == "prefix" + bytes, "decode", length, simd, encoded);
+                            decoded[simd] = out;
+                            cases++;
+                        }
+                        check(decoded[0] == decoded[1], "simd and table decoders differ", length, true, encoded);
+                    }
+                }
+            }
+
+            // A character outside both alphabets, anywhere, fails and leaves `out` alone
+            if (length > 0) {
+                std::string encoded = encode(bytes, round % 2 == 1, true);
+                const size_t letters = encode(bytes, round % 2 == 1, false).size(); // Not after the padding
+                encoded[static_cast<size_t>(rng()) % letters] = '*';
+                for (const bool simd : {false, true}) {
+                    setBase64Simd(simd);
+                    std::string out = "prefix";
+                    const bool ok = base64UrlDecode(encoded, out);
+                    check(!ok && out == "prefix", "invalid character accepted", length, simd, encoded);
+                    cases++;
+                }
+            }
+        }
+    }
+    setBase64Simd(true);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d of %zu cases failed\n", failures, cases);
+        return 1;
+    }
+    std::printf("%zu cases passed\n", cases);
+    return 0;
+}
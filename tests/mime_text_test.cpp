@@ -0,0 +1,114 @@
+// Checks the text side of MimeParser: quoted-printable bodies (escapes, soft line breaks,
+// malformed escapes kept), RFC 2047 encoded words in headers (B and Q, adjacent and folded
+// words, Latin-1 and Windows-1252, unknown charsets left alone), RFC 2231 filenames and
+// which part bodyText() picks. Exits non-zero if any check fails.
+#include "MimeParser.h"
+
+#include <cstdio>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+std::string qp(const std::string& in) {
+    std::string out = "prefix:"; // Appends: the prefix must survive
+    quotedPrintableDecode(in, out);
+    return out;
+}
+
+std::string subject(const std::string& value) {
+    const std::string message = "From: a@example.com\r\nSubject: " + value + "\r\n\r\nbody\r\n";
+    return MimeMessage(message).header("subject");
+}
+
+void quotedPrintable() {
+    check(qp("caf=C3=A9 cr=c3=a8me") == "prefix:caf\xC3\xA9 cr\xC3\xA8me", "escapes in either case");
+    check(qp("=3D=3D") == "prefix:==", "escaped equals signs");
+    check(qp("a long=\r\n line=\nbreak") == "prefix:a long linebreak", "soft line breaks, CRLF and LF");
+    check(qp("line\r\nnext") == "prefix:line\r\nnext", "hard line breaks kept");
+    check(qp("=ZZ x=4") == "prefix:=ZZ x=4", "malformed escapes kept literally");
+    check(qp("ends with =") == "prefix:ends with =", "trailing equals sign kept");
+    check(qp("") == "prefix:", "empty input");
+}
+
+void encodedWords() {
+    check(subject("=?UTF-8?B?Y2Fmw6k=?=") == "caf\xC3\xA9", "B word");
+    check(subject("=?utf-8?q?caf=C3=A9_au_lait?=") == "caf\xC3\xA9 au lait", "Q word with underscores");
+    check(subject("Re: =?UTF-8?Q?na=C3=AFve?= idea") == "Re: na\xC3\xAFve idea", "word between plain text");
+    check(subject("=?UTF-8?Q?one?= =?UTF-8?Q?two?=") == "onetwo", "whitespace between adjacent words dropped");
+    check(subject("=?UTF-8?Q?one?=\r\n =?UTF-8?Q?_two?=") == "one two", "folded words");
+    check(subject("=?ISO-8859-1?Q?Andr=E9?=") == "Andr\xC3\xA9", "ISO-8859-1");
+    check(subject("=?windows-1252?Q?=93quoted=94_=80?=") == "\xE2\x80\x9Cquoted\xE2\x80\x9D \xE2\x82\xAC",
+          "Windows-1252 0x80-0x9F");
+    check(subject("=?iso-8859-1?Q?=93?=") == "\xC2\x93", "ISO-8859-1 keeps C1 controls");
+    check(subject("=?koi8-r?B?0MXS?=") == "=?koi8-r?B?0MXS?=", "unknown charset left alone");
+    check(subject("=?UTF-8?X?abc?=") == "=?UTF-8?X?abc?=", "unknown encoding left alone");
+    check(subject("50% off =? not a word") == "50% off =? not a word", "unterminated word left alone");
+    check(MimeMessage("Subject: x\r\n\r\n").header("From").empty(), "absent header");
+}
+
+void parts() {
+    const std::string message =
+        "From: =?UTF-8?Q?Jos=C3=A9?= <jose@example.com>\r\n"
+        "Content-Type: multipart/mixed; boundary=\"outer\"\r\n"
+        "\r\n"
+        "preamble\r\n"
+        "--outer\r\n"
+        "Content-Type: multipart/alternative; boundary=inner\r\n"
+        "\r\n"
+        "--inner\r\n"
+        "Content-Type: text/html; charset=utf-8\r\n"
+        "\r\n"
+        "<p>html</p>\r\n"
+        "--inner\r\n"
+        "Content-Type: text/plain; charset=\"Windows-1252\"\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n"
+        "Price: 5 =80, =\r\n"
+        "tax incl.\r\n"
+        "--inner--\r\n"
+        "--outer\r\n"
+        "Content-Type: application/pdf\r\n"
+        "Content-Disposition: attachment; filename*=utf-8''caf%C3%A9.pdf\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "\r\n"
+        "JVBERi0=\r\n"
+        "--outer--\r\n";
+    const MimeMessage mime(message);
+    check(mime.header("From") == "Jos\xC3\xA9 <jose@example.com>", "encoded sender");
+    check(mime.parts().size() == 3, "nested multiparts walked");
+    check(mime.bodyText() == "Price: 5 \xE2\x82\xAC, tax incl.", "text/plain preferred, decoded and converted");
+    if (mime.parts().size() == 3) {
+        const MimePart& pdf = mime.parts()[2];
+        check(pdf.attachment && pdf.filename == "caf\xC3\xA9.pdf" && pdf.content_type == "application/pdf",
+              "RFC 2231 attachment filename");
+        check(MimeMessage::decodeBody(pdf) == "%PDF-", "base64 attachment decodes on request");
+        check(mime.parts()[1].charset == "windows-1252", "charset lowercased and unquoted");
+    }
+
+    const MimeMessage html_only("Content-Type: text/html; charset=iso-8859-1\r\n\r\nd\xE9j\xE0 vu");
+    check(html_only.bodyText() == "d\xC3\xA9j\xC3\xA0 vu", "HTML fallback, Latin-1 converted");
+    check(MimeMessage("Subject: none\r\n\r\n").bodyText().empty(), "empty body");
+}
+
+} // namespace
+
+int main() {
+    quotedPrintable();
+    encodedWords();
+    parts();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("mime text checks passed\n");
+    return 0;
+}
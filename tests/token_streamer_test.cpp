@@ -0,0 +1,122 @@
+// Checks TokenStreamer's UTF-8 hold-back with a fake vocabulary standing in for llama.cpp's
+// (this file defines llama_token_to_piece; the test does not link llama): characters split
+// across byte tokens, pieces that finish one character and open the next, pieces longer
+// than the reserve, failed conversions and the final flush. Exits non-zero if any check fails.
+#include "TokenStreamer.h"
+#include "Logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct llama_vocab {
+    std::vector<std::string> pieces;
+};
+
+// Same contract as llama.cpp's: the negated length needed when `length` is too small
+extern "C" int32_t llama_token_to_piece(const llama_vocab* vocab, llama_token token, char* buf, int32_t length,
+                             int32_t /*lstrip*/, bool /*special*/) {
+    if (token < 0 || static_cast<size_t>(token) >= vocab->pieces.size()) {
+        return -1; // Never fits: an unconvertible token
+    }
+    const std::string& piece = vocab->pieces[token];
+    if (static_cast<int32_t>(piece.size()) > length) {
+        return -static_cast<int32_t>(piece.size());
+    }
+    std::memcpy(buf, piece.data(), piece.size());
+    return static_cast<int32_t>(piece.size());
+}
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+enum : llama_token {
+    kHello,      // "Hello"
+    kC3,         // First byte of "é"
+    kA9,         // Second byte of "é"
+    kF0,         // First byte of U+1F600
+    k9F,
+    k98,
+    k80Tail,     // Last byte of U+1F600, then " ok"
+    kDoneE2,     // "!" and the first byte of "€"
+    k82Ac,       // The rest of "€"
+    kLong,       // 40 bytes with a 3-byte character across the 32-byte reserve
+    kEmpty,      // No text (a control token)
+    kCount,
+};
+
+const std::string kLongPiece = std::string(30, 'x') + "\xE2\x82\xAC" + "yyyyyyy";
+
+llama_vocab vocabulary() {
+    llama_vocab vocab;
+    vocab.pieces.resize(kCount);
+    vocab.pieces[kHello] = "Hello";
+    vocab.pieces[kC3] = "\xC3";
+    vocab.pieces[kA9] = "\xA9";
+    vocab.pieces[kF0] = "\xF0";
+    vocab.pieces[k9F] = "\x9F";
+    vocab.pieces[k98] = "\x98";
+    vocab.pieces[k80Tail] = "\x80 ok";
+    vocab.pieces[kDoneE2] = "!\xE2";
+    vocab.pieces[k82Ac] = "\x82\xAC";
+    vocab.pieces[kLong] = kLongPiece;
+    vocab.pieces[kEmpty] = "";
+    return vocab;
+}
+
+} // namespace
+
+int main() {
+    const llama_vocab vocab = vocabulary();
+    TokenStreamer streamer(&vocab);
+    std::string all;
+    auto push = [&](llama_token token) {
+        const std::string_view piece = streamer.push(token);
+        all.append(piece);
+        return std::string(piece);
+    };
+
+    check(push(kHello) == "Hello", "ASCII passes through");
+    check(push(kC3).empty(), "first byte of a 2-byte character held back");
+    check(push(kEmpty).empty(), "a token without text keeps what is held");
+    check(push(kA9) == "\xC3\xA9", "2-byte character released whole");
+
+    check(push(kF0).empty() && push(k9F).empty() && push(k98).empty(), "4-byte character held byte by byte");
+    check(push(k80Tail) == "\xF0\x9F\x98\x80 ok", "4-byte character released with the text after it");
+
+    check(push(kDoneE2) == "!", "complete text released, the opened character held");
+    check(push(-1).empty(), "unconvertible token yields nothing");
+    check(push(k82Ac) == "\xE2\x82\xAC", "held bytes survive a failed conversion");
+
+    check(push(kLong) == kLongPiece, "piece longer than the reserve");
+    check(push(kC3).empty(), "held before the end");
+    const std::string_view rest = streamer.flush();
+    check(rest == "\xC3", "flush hands out the open character");
+    check(streamer.flush().empty(), "flush only once");
+    all.append(rest);
+
+    check(all == "Hello\xC3\xA9\xF0\x9F\x98\x80 ok!\xE2\x82\xAC" + kLongPiece + "\xC3", "views add up to the text");
+    check(completeUtf8Length(all) == all.size() - 1, "every released view was whole characters");
+
+    std::string out = "prefix ";
+    check(TokenStreamer::appendPiece(&vocab, kLong, out) && out == "prefix " + kLongPiece, "appendPiece appends in place");
+    check(!TokenStreamer::appendPiece(&vocab, kCount, out) && out == "prefix " + kLongPiece,
+          "failed appendPiece leaves the string alone");
+
+    Logger::instance().close();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("token streamer checks passed\n");
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Checks when ToolPrefetcher starts a request while a tool call is still being generated:
+// the tool name and ID split across pieces, a reasoning block first, escaped or empty IDs,
+// tools whose request depends on later parameters, plain replies. What is started is seen
+// through the prefetch counter and the parked responses it dedupes against; the Gmail
+// address is a closed port, so every request fails fast. Exits non-zero if any check fails.
+#include "ToolPrefetcher.h"
+#include "EngineMetrics.h"
+#include "Logger.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+uint64_t prefetches() {
+    return EngineMetrics::instance().tool_prefetches_total.value();
+}
+
+// Feeds `pieces` as one reply. Returns the 1-based piece after which a request was
+// started, or 0 if none was.
+size_t startedAfter(ToolPrefetcher& prefetcher, const std::vector<std::string>& pieces) {
+    prefetcher.clear();
+    prefetcher.beginReply();
+    size_t started = 0;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        const uint64_t before = prefetches();
+        prefetcher.observe(pieces[i]);
+        if (prefetches() > before && started == 0) {
+            started = i + 1;
+        }
+    }
+    return started;
+}
+
+std::vector<MessageSummary> listing(const std::vector<std::string>& ids) {
+    std::vector<MessageSummary> messages;
+    for (const std::string& id : ids) {
+        MessageSummary m;
+        m.id = id;
+        m.present = kMessageId;
+        messages.push_back(m);
+    }
+    return messages;
+}
+
+void partialCalls(ToolPrefetcher& prefetcher) {
+    check(startedAfter(prefetcher, {"{\"tool_", "name\": \"list_la", "bels\"", ", \"parameters\": {}}"}) == 3,
+          "parameterless tool started once its name is complete");
+    check(startedAfter(prefetcher, {"<think>\n</think>\n\n", "{\"tool_name\": \"get_message_content\", ",
+                                    "\"parameters\": {\"message_id\": \"18c", "2f\"", "}}"}) == 4,
+          "get_message_content started once its ID is complete, after a reasoning block");
+    check(startedAfter(prefetcher, {"{\"parameters\": {\"label_id\" : \"Label_7\"}, ", "\"tool_name\":\"get_label\"}"}) == 2,
+          "get_label with the ID before the name and a space before the colon");
+
+    check(startedAfter(prefetcher, {"{\"tool_name\": \"get_message_content\", \"parameters\": {\"message_id\": \"a\\\"b\"}}"}) == 0,
+          "escaped ID left alone");
+    check(startedAfter(prefetcher, {"{\"tool_name\": \"get_message_content\", \"parameters\": {\"message_id\": \"\"}}"}) == 0,
+          "empty ID left alone");
+    check(startedAfter(prefetcher, {"{\"tool_name\": \"list_messages\", ", "\"parameters\": {\"query\": \"is:unread\"}}"}) == 0,
+          "list_messages waits for its parameters");
+    check(startedAfter(prefetcher, {"{\"tool_name\": \"trash_message\", \"parameters\": {\"message_id\": \"m1\"}}"}) == 0,
+          "a tool that changes the mailbox is never prefetched");
+    check(startedAfter(prefetcher, {"Sure, ", "{\"tool_name\": \"list_labels\"}"}) == 0, "plain reply");
+}
+
+void parkedResponses(ToolPrefetcher& prefetcher) {
+    // The partial call parked GET /messages/18c2f, so the listing only adds the other ID
+    startedAfter(prefetcher, {"{\"tool_name\": \"get_message_content\", \"parameters\": {\"message_id\": \"18c2f\"}}"});
+    uint64_t before = prefetches();
+    prefetcher.afterListing(listing({"18c2f", "18c30"}));
+    check(prefetches() - before == 1, "the partial call's request was GET /messages/18c2f");
+
+    // A tool that changes the mailbox drops what was parked
+    ToolRequest trash;
+    std::string error;
+    check(ToolDispatcher::resolve("trash_message", json{{"message_id", "m1"}}, trash, error), "resolve trash_message");
+    bool prefetched = true;
+    prefetcher.fetch(trash, prefetched);
+    check(!prefetched, "trash_message not served from a prefetch");
+    before = prefetches();
+    std::vector<MessageSummary> messages = listing({"18c2f", "18c30", "x1", "x2", "x3"});
+    messages[1].present = 0; // No ID
+    prefetcher.afterListing(messages);
+    check(prefetches() - before == 3, "after a change, follow_up_ids prefetches of listed IDs");
+
+    // A failed prefetch is performed again rather than served
+    ToolRequest get;
+    check(ToolDispatcher::resolve("get_message_content", json{{"message_id", "x1"}}, get, error), "resolve get_message_content");
+    prefetcher.fetch(get, prefetched);
+    check(!prefetched, "an error response is not served from a prefetch");
+}
+
+void disabled(const ToolDispatcher& tools) {
+    ToolPrefetcher::Options options;
+    options.enabled = false;
+    ToolPrefetcher prefetcher(tools, options);
+    check(startedAfter(prefetcher, {"{\"tool_name\": \"list_labels\"}"}) == 0, "disabled");
+    const uint64_t before = prefetches();
+    prefetcher.afterListing(listing({"a"}));
+    check(prefetches() == before, "disabled: no follow-ups");
+
+    ToolDispatcher replayed("http://127.0.0.1:1");
+    replayed.setTransport([](const std::string&, const std::string&, const json&) { return std::string("{}"); });
+    ToolPrefetcher with_transport(replayed);
+    check(startedAfter(with_transport, {"{\"tool_name\": \"list_labels\"}"}) == 0, "never with a transport");
+}
+
+} // namespace
+
+int main() {
+    ToolDispatcher tools("http://127.0.0.1:1");
+    ToolPrefetcher::Options options;
+    options.max_in_flight = 100; // Failed requests may not have finished yet
+    ToolPrefetcher prefetcher(tools, options);
+
+    partialCalls(prefetcher);
+    parkedResponses(prefetcher);
+    disabled(tools);
+
+    Logger::instance().close();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("tool prefetcher checks passed\n");
+    return 0;
+}